@@ -0,0 +1,86 @@
+#include "body_compression.h"
+
+#include "source/common/http/headers.h"
+#include "absl/strings/ascii.h"
+#include "absl/strings/match.h"
+#include "absl/strings/numbers.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/str_split.h"
+#include <algorithm>
+
+namespace Envoy::Http {
+
+namespace {
+
+constexpr absl::string_view DEFAULT_CONTENT_TYPES[] = {
+    "text/", "application/json", "application/javascript", "application/xml", "application/xhtml+xml", "image/svg+xml"};
+
+bool hasCompressibleContentType(const ResponseHeaderMap& headers, const CompressionOptions& options) {
+    const std::vector<absl::string_view> parameters = absl::StrSplit(headers.getContentTypeValue(), ';');
+    const std::string mediaType = absl::AsciiStrToLower(absl::StripAsciiWhitespace(parameters[0]));
+    if (mediaType.empty()) {
+        return false;
+    }
+    const auto matches = [&mediaType](absl::string_view prefix) { return absl::StartsWith(mediaType, prefix); };
+    if (options.content_types_.empty()) {
+        return std::any_of(std::begin(DEFAULT_CONTENT_TYPES), std::end(DEFAULT_CONTENT_TYPES), matches);
+    }
+    return std::any_of(options.content_types_.begin(), options.content_types_.end(), matches);
+}
+
+bool hasNoTransform(const ResponseHeaderMap& headers) {
+    const auto values = headers.get(Http::CustomHeaders::get().CacheControl);
+    for (size_t i = 0; i < values.size(); ++i) {
+        for (absl::string_view directive: absl::StrSplit(values[i]->value().getStringView(), ',')) {
+            if (absl::EqualsIgnoreCase(absl::StripAsciiWhitespace(directive), "no-transform")) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+} // namespace
+
+bool isCompressibleResponse(const ResponseHeaderMap& headers, const CompressionOptions& options) {
+    const auto contentEncoding = headers.get(Http::CustomHeaders::get().ContentEncoding);
+    if (!contentEncoding.empty() &&
+        !absl::EqualsIgnoreCase(absl::StripAsciiWhitespace(contentEncoding[0]->value().getStringView()), "identity")) {
+        return false;
+    }
+    if (!headers.get(LowerCaseString("content-range")).empty() || hasNoTransform(headers) ||
+        !hasCompressibleContentType(headers, options)) {
+        return false;
+    }
+    uint64_t contentLength = 0;
+    return !absl::SimpleAtoi(headers.getContentLengthValue(), &contentLength) || contentLength >= options.min_bytes_;
+}
+
+void applyCompressedHeaders(ResponseHeaderMap& headers) {
+    headers.setReferenceKey(Http::CustomHeaders::get().ContentEncoding,
+                            Http::CustomHeaders::get().ContentEncodingValues.Gzip);
+    headers.removeContentLength();
+    const auto etag = headers.get(Http::CustomHeaders::get().Etag);
+    if (!etag.empty() && !absl::StartsWith(etag[0]->value().getStringView(), "W/")) {
+        headers.setCopy(Http::CustomHeaders::get().Etag, absl::StrCat("W/", etag[0]->value().getStringView()));
+    }
+}
+
+void addVaryAcceptEncoding(ResponseHeaderMap& headers) {
+    const auto values = headers.get(Http::CustomHeaders::get().Vary);
+    for (size_t i = 0; i < values.size(); ++i) {
+        for (absl::string_view name: absl::StrSplit(values[i]->value().getStringView(), ',')) {
+            if (absl::EqualsIgnoreCase(absl::StripAsciiWhitespace(name), "accept-encoding")) {
+                return;
+            }
+        }
+    }
+    headers.appendCopy(Http::CustomHeaders::get().Vary, "accept-encoding");
+}
+
+void applyDecompressedHeaders(ResponseHeaderMap& headers) {
+    headers.remove(Http::CustomHeaders::get().ContentEncoding);
+    headers.removeContentLength();
+}
+
+} // namespace Envoy::Http
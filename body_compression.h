@@ -0,0 +1,36 @@
+/***********************************************************************************************************************
+ * Bodies compressed at rest: which responses are stored gzip-compressed and how their headers are served
+ ***********************************************************************************************************************/
+
+#pragma once
+
+#include "envoy/http/header_map.h"
+#include <string>
+#include <vector>
+
+namespace Envoy::Http {
+
+// Smaller bodies gain too little to pay for the compressor and the gzip framing
+constexpr uint64_t DEFAULT_COMPRESSION_MIN_BYTES = 1024;
+
+struct CompressionOptions {
+    // Responses with a smaller Content-Length are stored as is (responses without Content-Length are compressed)
+    uint64_t min_bytes_ {DEFAULT_COMPRESSION_MIN_BYTES};
+    // Lower-case prefixes of the compressed media types (empty == text, JSON, JavaScript, XML and SVG)
+    std::vector<std::string> content_types_ {};
+};
+
+/**
+ * @brief Response body may be stored compressed: it has no Content-Encoding (other than identity), no
+ * Content-Range, no "Cache-Control: no-transform", a compressible media type and at least min_bytes_.
+ */
+bool isCompressibleResponse(const ResponseHeaderMap& headers, const CompressionOptions& options);
+
+// Headers stored with the compressed body: Content-Encoding gzip, no Content-Length, weak ETag (RFC 9110 Section 8.8.1)
+void applyCompressedHeaders(ResponseHeaderMap& headers);
+// Every response served from a compressed body depends on the Accept-Encoding of the request
+void addVaryAcceptEncoding(ResponseHeaderMap& headers);
+// Headers of a compressed body served decompressed (its length is known only once it is decompressed)
+void applyDecompressedHeaders(ResponseHeaderMap& headers);
+
+} // namespace Envoy::Http
@@ -0,0 +1,121 @@
+#include "byte_range.h"
+
+#include "envoy/http/codes.h"
+#include "source/common/common/enum_to_int.h"
+#include "source/common/common/macros.h"
+#include "source/common/http/headers.h"
+#include "absl/strings/ascii.h"
+#include "absl/strings/match.h"
+#include "absl/strings/numbers.h"
+#include "absl/strings/str_cat.h"
+
+namespace Envoy::Http {
+
+const LowerCaseString& rangeHeader() {
+    CONSTRUCT_ON_FIRST_USE(LowerCaseString, "range");
+}
+
+const LowerCaseString& ifRangeHeader() {
+    CONSTRUCT_ON_FIRST_USE(LowerCaseString, "if-range");
+}
+
+std::optional<ByteRangeRequest> parseByteRangeRequest(const RequestHeaderMap& headers) {
+    if (headers.getMethodValue() != Http::Headers::get().MethodValues.Get) {
+        return std::nullopt;
+    }
+    const auto rangeValues = headers.get(rangeHeader());
+    if (rangeValues.size() != 1) {
+        return std::nullopt;
+    }
+    absl::string_view value = absl::StripAsciiWhitespace(rangeValues[0]->value().getStringView());
+    if (!absl::ConsumePrefix(&value, "bytes=") || absl::StrContains(value, ',')) {
+        return std::nullopt;
+    }
+    const size_t dash = value.find('-');
+    if (dash == absl::string_view::npos) {
+        return std::nullopt;
+    }
+    ByteRangeRequest request;
+    absl::string_view first = absl::StripAsciiWhitespace(value.substr(0, dash));
+    absl::string_view last = absl::StripAsciiWhitespace(value.substr(dash + 1));
+    uint64_t number = 0;
+    if (!first.empty()) {
+        if (!absl::SimpleAtoi(first, &number)) {
+            return std::nullopt;
+        }
+        request.first_ = number;
+    }
+    if (!last.empty()) {
+        if (!absl::SimpleAtoi(last, &number)) {
+            return std::nullopt;
+        }
+        request.last_ = number;
+    }
+    if ((!request.first_.has_value() && !request.last_.has_value()) ||
+        (request.first_.has_value() && request.last_.has_value() && *request.last_ < *request.first_)) {
+        return std::nullopt;
+    }
+    const auto ifRangeValues = headers.get(ifRangeHeader());
+    if (!ifRangeValues.empty()) {
+        request.if_range_ = std::string(ifRangeValues[0]->value().getStringView());
+    }
+    return request;
+}
+
+std::optional<ByteRange> resolveByteRange(const ByteRangeRequest& request, uint64_t bodyLength) {
+    if (bodyLength == 0) {
+        return std::nullopt;
+    }
+    ByteRange range;
+    if (!request.first_.has_value()) {
+        // Suffix range: last N bytes
+        if (*request.last_ == 0) {
+            return std::nullopt;
+        }
+        range.first_ = bodyLength - std::min(*request.last_, bodyLength);
+        range.last_ = bodyLength - 1;
+        return range;
+    }
+    if (*request.first_ >= bodyLength) {
+        return std::nullopt;
+    }
+    range.first_ = *request.first_;
+    range.last_ = std::min(request.last_.value_or(bodyLength - 1), bodyLength - 1);
+    return range;
+}
+
+bool ifRangeMatches(const ByteRangeRequest& request, const ResponseHeaderMap& storedHeaders) {
+    if (request.if_range_.empty()) {
+        return true;
+    }
+    // Weak validators never match If-Range
+    if (absl::StartsWith(request.if_range_, "\"")) {
+        const auto etag = storedHeaders.get(Http::CustomHeaders::get().Etag);
+        return !etag.empty() && etag[0]->value().getStringView() == request.if_range_;
+    }
+    const auto lastModified = storedHeaders.get(Http::CustomHeaders::get().LastModified);
+    return !lastModified.empty() && lastModified[0]->value().getStringView() == request.if_range_;
+}
+
+RangeOutcome applyByteRange(const ByteRangeRequest& request, ResponseHeaderMap& headers, ByteRange& range) {
+    static const LowerCaseString contentRangeHeader {"content-range"};
+    uint64_t bodyLength = 0;
+    if (headers.getStatusValue() != "200" || !absl::SimpleAtoi(headers.getContentLengthValue(), &bodyLength) ||
+        !ifRangeMatches(request, headers)) {
+        return RangeOutcome::FULL;
+    }
+    std::optional<ByteRange> resolved = resolveByteRange(request, bodyLength);
+    if (!resolved.has_value()) {
+        headers.setStatus(enumToInt(Code::RangeNotSatisfiable));
+        headers.setCopy(contentRangeHeader, absl::StrCat("bytes */", bodyLength));
+        headers.setContentLength(0);
+        return RangeOutcome::UNSATISFIABLE;
+    }
+    range = *resolved;
+    headers.setStatus(enumToInt(Code::PartialContent));
+    headers.setCopy(contentRangeHeader, absl::StrCat("bytes ", range.first_, "-", range.last_, "/", bodyLength));
+    headers.setContentLength(range.length());
+    return RangeOutcome::PARTIAL;
+}
+
+} // namespace Envoy::Http
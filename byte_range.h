@@ -0,0 +1,50 @@
+/***********************************************************************************************************************
+ * Single byte range requests (RFC 9110 Section 14)
+ ***********************************************************************************************************************/
+
+#pragma once
+
+#include "envoy/http/header_map.h"
+#include <optional>
+#include <string>
+
+namespace Envoy::Http {
+
+/**
+ * @brief Parsed "Range: bytes=first-last" header, either bound may be missing ("first-" or "-suffix_length").
+ */
+struct ByteRangeRequest {
+    std::optional<uint64_t> first_ {};
+    std::optional<uint64_t> last_ {};
+    // Value of If-Range (empty == unconditional)
+    std::string if_range_ {};
+};
+
+/**
+ * @brief Range resolved against the length of the body, both bounds inclusive.
+ */
+struct ByteRange {
+    uint64_t first_ {0};
+    uint64_t last_ {0};
+
+    uint64_t length() const { return last_ - first_ + 1; }
+};
+
+/**
+ * @brief How a range request is answered from a complete stored response.
+ */
+enum class RangeOutcome { FULL, PARTIAL, UNSATISFIABLE };
+
+const LowerCaseString& rangeHeader();
+const LowerCaseString& ifRangeHeader();
+// Returns nullopt for requests without Range, non-GET requests and ranges this cache does not serve (multiple ranges)
+std::optional<ByteRangeRequest> parseByteRangeRequest(const RequestHeaderMap& headers);
+// Returns nullopt if the range is not satisfiable for the body length
+std::optional<ByteRange> resolveByteRange(const ByteRangeRequest& request, uint64_t bodyLength);
+// If-Range matches the strong ETag or the exact Last-Modified of the stored response
+bool ifRangeMatches(const ByteRangeRequest& request, const ResponseHeaderMap& storedHeaders);
+// Turns the headers of a 200 response with Content-Length into 206 (range stored in `range`) or 416 headers,
+// any other response is served in full and its headers stay untouched
+RangeOutcome applyByteRange(const ByteRangeRequest& request, ResponseHeaderMap& headers, ByteRange& range);
+
+} // namespace Envoy::Http
@@ -0,0 +1,116 @@
+/***********************************************************************************************************************
+ * Unit tests of single byte range requests: parsing, resolving against the body length and If-Range
+ ***********************************************************************************************************************/
+
+#include "byte_range.h"
+#include "test/test_common/utility.h"
+#include "gtest/gtest.h"
+
+namespace Envoy::Http {
+namespace {
+
+std::optional<ByteRangeRequest> parseRange(const std::string& range, const std::string& method = "GET") {
+    TestRequestHeaderMapImpl headers {{":method", method}, {"range", range}};
+    return parseByteRangeRequest(headers);
+}
+
+ByteRangeRequest rangeRequest(std::optional<uint64_t> first, std::optional<uint64_t> last, std::string ifRange = "") {
+    ByteRangeRequest request;
+    request.first_ = first;
+    request.last_ = last;
+    request.if_range_ = std::move(ifRange);
+    return request;
+}
+
+TEST(ByteRangeTest, ParseBoundedAndOpenRanges) {
+    std::optional<ByteRangeRequest> bounded = parseRange("bytes=0-99");
+    ASSERT_TRUE(bounded.has_value());
+    EXPECT_EQ(0, bounded->first_);
+    EXPECT_EQ(99, bounded->last_);
+
+    std::optional<ByteRangeRequest> open = parseRange("bytes=100-");
+    ASSERT_TRUE(open.has_value());
+    EXPECT_EQ(100, open->first_);
+    EXPECT_FALSE(open->last_.has_value());
+
+    std::optional<ByteRangeRequest> suffix = parseRange("bytes=-500");
+    ASSERT_TRUE(suffix.has_value());
+    EXPECT_FALSE(suffix->first_.has_value());
+    EXPECT_EQ(500, suffix->last_);
+}
+
+TEST(ByteRangeTest, ParseRejectsUnservedRanges) {
+    EXPECT_FALSE(parseRange("bytes=0-99", "HEAD").has_value());
+    EXPECT_FALSE(parseRange("bytes=0-1,5-9").has_value());
+    EXPECT_FALSE(parseRange("items=0-99").has_value());
+    EXPECT_FALSE(parseRange("bytes=99-0").has_value());
+    EXPECT_FALSE(parseRange("bytes=-").has_value());
+    EXPECT_FALSE(parseRange("bytes=a-b").has_value());
+    TestRequestHeaderMapImpl noRange {{":method", "GET"}};
+    EXPECT_FALSE(parseByteRangeRequest(noRange).has_value());
+}
+
+TEST(ByteRangeTest, ParseKeepsIfRange) {
+    TestRequestHeaderMapImpl headers {{":method", "GET"}, {"range", "bytes=0-9"}, {"if-range", "\"v1\""}};
+    std::optional<ByteRangeRequest> request = parseByteRangeRequest(headers);
+    ASSERT_TRUE(request.has_value());
+    EXPECT_EQ("\"v1\"", request->if_range_);
+}
+
+TEST(ByteRangeTest, ResolveAgainstBodyLength) {
+    std::optional<ByteRange> bounded = resolveByteRange(rangeRequest(10, 19), 100);
+    ASSERT_TRUE(bounded.has_value());
+    EXPECT_EQ(10, bounded->first_);
+    EXPECT_EQ(19, bounded->last_);
+    EXPECT_EQ(10, bounded->length());
+
+    // Last byte past the end is clamped
+    std::optional<ByteRange> clamped = resolveByteRange(rangeRequest(90, 199), 100);
+    ASSERT_TRUE(clamped.has_value());
+    EXPECT_EQ(99, clamped->last_);
+
+    std::optional<ByteRange> open = resolveByteRange(rangeRequest(40, std::nullopt), 100);
+    ASSERT_TRUE(open.has_value());
+    EXPECT_EQ(40, open->first_);
+    EXPECT_EQ(99, open->last_);
+}
+
+TEST(ByteRangeTest, ResolveSuffixRange) {
+    std::optional<ByteRange> suffix = resolveByteRange(rangeRequest(std::nullopt, 30), 100);
+    ASSERT_TRUE(suffix.has_value());
+    EXPECT_EQ(70, suffix->first_);
+    EXPECT_EQ(99, suffix->last_);
+
+    // Suffix longer than the body is the whole body
+    std::optional<ByteRange> whole = resolveByteRange(rangeRequest(std::nullopt, 500), 100);
+    ASSERT_TRUE(whole.has_value());
+    EXPECT_EQ(0, whole->first_);
+    EXPECT_EQ(99, whole->last_);
+}
+
+TEST(ByteRangeTest, ResolveUnsatisfiable) {
+    EXPECT_FALSE(resolveByteRange(rangeRequest(100, std::nullopt), 100).has_value());
+    EXPECT_FALSE(resolveByteRange(rangeRequest(std::nullopt, 0), 100).has_value());
+    EXPECT_FALSE(resolveByteRange(rangeRequest(0, 9), 0).has_value());
+}
+
+TEST(ByteRangeTest, IfRangeMatchesStrongEtag) {
+    TestResponseHeaderMapImpl stored {{":status", "200"}, {"etag", "\"v1\""}};
+    EXPECT_TRUE(ifRangeMatches(rangeRequest(0, 9), stored));
+    EXPECT_TRUE(ifRangeMatches(rangeRequest(0, 9, "\"v1\""), stored));
+    EXPECT_FALSE(ifRangeMatches(rangeRequest(0, 9, "\"v2\""), stored));
+
+    // Weak validators never match
+    TestResponseHeaderMapImpl weak {{":status", "200"}, {"etag", "W/\"v1\""}};
+    EXPECT_FALSE(ifRangeMatches(rangeRequest(0, 9, "W/\"v1\""), weak));
+}
+
+TEST(ByteRangeTest, IfRangeMatchesLastModified) {
+    TestResponseHeaderMapImpl stored {{":status", "200"}, {"last-modified", "Tue, 14 Nov 2023 22:13:20 GMT"}};
+    EXPECT_TRUE(ifRangeMatches(rangeRequest(0, 9, "Tue, 14 Nov 2023 22:13:20 GMT"), stored));
+    EXPECT_FALSE(ifRangeMatches(rangeRequest(0, 9, "Tue, 14 Nov 2023 22:15:20 GMT"), stored));
+    EXPECT_FALSE(ifRangeMatches(rangeRequest(0, 9, "\"v1\""), stored));
+}
+
+} // namespace
+} // namespace Envoy::Http
@@ -1,71 +1,512 @@
 #include "cache_entry.h"
+#include "body_compression.h"
+#include "source/common/http/headers.h"
+#include <algorithm>
+#include "absl/strings/match.h"
+#include "absl/strings/numbers.h"
 
 namespace Envoy::Http {
 
-void CacheEntryProducer::initCacheEntry(uint32_t ringBufferCapacity, Http::StreamEncoderFilterCallbacks* encoderCallbacks) {
-    cache_entry_ptr_ = std::make_shared<CacheEntry>(ringBufferCapacity);
-    encoder_callbacks_ = encoderCallbacks;
+void ByteCounter::add(uint64_t bytes) {
+    bytes_.fetch_add(bytes, std::memory_order_relaxed);
+    if (parent_ != nullptr) {
+        parent_->add(bytes);
+    }
+}
+
+void ByteCounter::subtract(uint64_t bytes) {
+    bytes_.fetch_sub(bytes, std::memory_order_relaxed);
+    if (parent_ != nullptr) {
+        parent_->subtract(bytes);
+    }
+}
+
+void ByteCounter::checkBudget() const {
+    if (budget_ != 0 && bytes() > budget_ && over_budget_cb_) {
+        over_budget_cb_();
+    }
+}
+
+void CacheEntry::addFootprint(uint64_t bytes) {
+    ByteCounter* byteCounter = nullptr;
+    {
+        std::lock_guard lockGuard(footprint_mtx_);
+        footprint_bytes_.fetch_add(bytes, std::memory_order_relaxed);
+        if (byte_counter_ != nullptr) {
+            byte_counter_->add(bytes);
+            byteCounter = byte_counter_;
+        }
+    }
+    // Eviction takes the shard lock and detaches entries (footprint lock), so the lock must not be held here.
+    // Counters belong to the cache shards and outlive every entry
+    if (byteCounter != nullptr) {
+        byteCounter->checkBudget();
+    }
+}
+
+void CacheEntry::attachByteCounter(ByteCounter* byteCounter) {
+    std::lock_guard lockGuard(footprint_mtx_);
+    byte_counter_ = byteCounter;
+    byte_counter_->add(footprint_bytes_.load(std::memory_order_relaxed));
+}
+
+void CacheEntry::detachByteCounter() {
+    std::lock_guard lockGuard(footprint_mtx_);
+    if (byte_counter_ != nullptr) {
+        byte_counter_->subtract(footprint_bytes_.load(std::memory_order_relaxed));
+        byte_counter_ = nullptr;
+    }
+}
+
+void CacheEntry::subscribe(const CacheEntryConsumerWeakPtr& consumer, Event::Dispatcher& dispatcher) {
+    std::lock_guard lockGuard(subscribers_mtx_);
+    subscribers_.push_back({&dispatcher, consumer});
+}
+
+void CacheEntry::notifySubscribers() {
+    // Sequence is bumped before taking the lock, so a consumer subscribing concurrently either gets posted
+    // or observes the new sequence and reads again
+    write_sequence_.fetch_add(1, std::memory_order_acq_rel);
+    std::vector<CacheEntrySubscriber> subscribers;
+    {
+        std::lock_guard lockGuard(subscribers_mtx_);
+        subscribers.swap(subscribers_);
+    }
+    for (auto& subscriber: subscribers) {
+        subscriber.dispatcher_->post([consumer = std::move(subscriber.consumer_)]() {
+            if (CacheEntryConsumerSharedPtr consumerPtr = consumer.lock()) {
+                consumerPtr->onNewBlocks();
+            }
+        });
+    }
+}
+
+bool CacheEntry::hasTrailers() const {
+    std::shared_lock sharedLock(*trailers_mtx_);
+    return !trailers_buffers_->empty();
+}
+
+void CacheEntry::copyBody(std::string& body) const {
+    if (body_storage_ == BodyStorage::BUFFER_SLICES) {
+        std::shared_lock sharedLock(*data_mtx_);
+        for (const auto& slice: data_slices_) {
+            body.append(reinterpret_cast<const char*>(slice->data_.get()), slice->size_);
+        }
+        return;
+    }
+    if (body_storage_ == BodyStorage::SEGMENTS) {
+        std::shared_lock sharedLock(*data_mtx_);
+        for (const auto& segment: data_segments_) {
+            body.append(reinterpret_cast<const char*>(segment->data_.get()),
+                        segment->published_length_.load(std::memory_order_acquire));
+        }
+        return;
+    }
+    // Every frame is written as full blocks, one remainder block (< 64B, may be empty) and one delimiter block
+    // (empty, or full of binary 1 at the end of stream)
+    const uint32_t blockCount = data_block_count_.load(std::memory_order_acquire);
+    if (blockCount == UINT32_MAX) {
+        return;
+    }
+    uint8_t block[BLOCK_SIZE_BYTES];
+    MessageSize size = 0;
+    bool delimiterNext = false;
+    for (uint32_t i = 0; i < blockCount; ++i) {
+        RingBufferQueueSharedPtr buffer;
+        {
+            std::shared_lock sharedLock(*data_mtx_);
+            buffer = data_buffers_->at(i / single_buffer_blocks_capacity_);
+        }
+        if (!buffer->read(i % single_buffer_blocks_capacity_, block, size)) {
+            return;
+        }
+        if (delimiterNext) {
+            delimiterNext = false;
+            continue;
+        }
+        body.append(reinterpret_cast<const char*>(block), size);
+        delimiterNext = size < BLOCK_SIZE_BYTES;
+    }
+}
+
+void CacheEntry::markAborted() {
+    aborted_.store(true, std::memory_order_release);
+    notifySubscribers();
+}
+
+bool CacheEntry::attachReader(ReaderCursorSharedPtr& cursor) {
+    if (isComplete()) {
+        // Never streamed anymore, the whole body stays until the entry is destroyed
+        return true;
+    }
+    std::lock_guard lockGuard(readers_mtx_);
+    if (released_units_ > 0) {
+        return false;
+    }
+    cursor = std::make_shared<ReaderCursor>();
+    readers_.push_back(cursor);
+    return true;
+}
+
+void CacheEntry::detachReader(const ReaderCursorSharedPtr& cursor) {
+    std::lock_guard lockGuard(readers_mtx_);
+    readers_.erase(std::remove(readers_.begin(), readers_.end(), cursor), readers_.end());
+}
+
+void CacheEntry::releaseReadUnits() {
+    std::lock_guard lockGuard(readers_mtx_);
+    std::unique_lock uniqueLock(*data_mtx_);
+    // Last ring buffer or segment may still be written into
+    uint32_t slowest = 0;
+    switch (body_storage_) {
+    case BodyStorage::BUFFER_SLICES:
+        slowest = first_unit_ + static_cast<uint32_t>(data_slices_.size());
+        break;
+    case BodyStorage::SEGMENTS:
+        slowest = first_unit_ + static_cast<uint32_t>(std::max<size_t>(data_segments_.size(), 1) - 1);
+        break;
+    default:
+        slowest = static_cast<uint32_t>(std::max<size_t>(data_buffers_->size(), 1) - 1);
+        break;
+    }
+    for (const auto& reader: readers_) {
+        slowest = std::min(slowest, reader->unit_.load(std::memory_order_acquire));
+    }
+    // Readers hold their current unit themselves, a released slot is never read again
+    for (uint32_t unit = released_units_; unit < slowest; ++unit) {
+        switch (body_storage_) {
+        case BodyStorage::BUFFER_SLICES:
+            data_slices_[unit - first_unit_].reset();
+            break;
+        case BodyStorage::SEGMENTS:
+            data_segments_[unit - first_unit_].reset();
+            break;
+        default:
+            (*data_buffers_)[unit].reset();
+            break;
+        }
+    }
+    released_units_ = std::max(released_units_, slowest);
+    // A slice or segment per write: the released slots are erased too, so a long stream does not grow the vector
+    if (body_storage_ == BodyStorage::BUFFER_SLICES) {
+        eraseReleasedUnits(data_slices_);
+    }
+    else if (body_storage_ == BodyStorage::SEGMENTS) {
+        eraseReleasedUnits(data_segments_);
+    }
+}
+
+template <class UnitVector> void CacheEntry::eraseReleasedUnits(UnitVector& units) {
+    const uint32_t released = released_units_ - first_unit_;
+    // Only once they are half of the vector, so every unit is moved O(1) times on average
+    if (released == 0 || released < units.size() / 2) {
+        return;
+    }
+    units.erase(units.begin(), units.begin() + released);
+    first_unit_ = released_units_;
+}
+
+void CacheEntry::publishHeaders(HeadersTemplateSharedPtr headers, bool end_stream, SystemTime responseTime) {
+    response_time_.store(responseTime.time_since_epoch().count(), std::memory_order_relaxed);
+    initial_age_seconds_.store(parseAge(*headers), std::memory_order_relaxed);
+    std::unique_lock uniqueLock(*headers_mtx_);
+    headers_template_ = std::move(headers);
+    headers_end_stream_ = end_stream;
+}
+
+HeadersTemplateSharedPtr CacheEntry::headersTemplate() const {
+    std::shared_lock sharedLock(*headers_mtx_);
+    return headers_template_;
+}
+
+void CacheEntry::setFreshness(const Freshness& freshness) {
+    fresh_until_.store(freshness.fresh_until_.time_since_epoch().count(), std::memory_order_relaxed);
+    stale_until_.store(freshness.stale_until_.time_since_epoch().count(), std::memory_order_relaxed);
+}
+
+Freshness CacheEntry::freshness() const {
+    Freshness freshness;
+    freshness.fresh_until_ = SystemTime(SystemTime::duration(fresh_until_.load(std::memory_order_relaxed)));
+    freshness.stale_until_ = SystemTime(SystemTime::duration(stale_until_.load(std::memory_order_relaxed)));
+    return freshness;
+}
+
+bool CacheEntry::hasValidators() const {
+    HeadersTemplateSharedPtr headers = headersTemplate();
+    // Negatively cached error responses expire without revalidation, the next request asks the origin again
+    return headers != nullptr && absl::StartsWith(headers->getStatusValue(), "2") &&
+           (!headers->get(Http::CustomHeaders::get().Etag).empty() ||
+            !headers->get(Http::CustomHeaders::get().LastModified).empty());
+}
+
+HeadersTemplateSharedPtr CacheEntry::mergeNotModifiedHeaders(const ResponseHeaderMap& notModifiedHeaders) const {
+    HeadersTemplateSharedPtr storedHeaders = headersTemplate();
+    ResponseHeaderMapImplPtr mergedHeaders = createHeaderMap<ResponseHeaderMapImpl>(*storedHeaders);
+    // Age of the stored response is not valid anymore, only the one of the 304 (if any)
+    mergedHeaders->remove(LowerCaseString("age"));
+    auto isMerged = [this](absl::string_view key) {
+        // Status and framing belong to the stored response, not to the 304
+        if (key == Http::Headers::get().Status.get() || key == Http::Headers::get().ContentLength.get() ||
+            key == Http::Headers::get().TransferEncoding.get()) {
+            return false;
+        }
+        // Compressed body keeps its coding and its weak ETag
+        return !(compressed_at_rest_ && (key == Http::CustomHeaders::get().ContentEncoding.get() ||
+                                         key == Http::CustomHeaders::get().Etag.get()));
+    };
+    // Every field of the 304 replaces all stored values of its name, repeated fields (Cache-Control, Link, ...)
+    // keep all of their values: the names are removed first, then every value is added
+    notModifiedHeaders.iterate([&isMerged, &mergedHeaders](const HeaderEntry& entry) -> HeaderMap::Iterate {
+        const absl::string_view key = entry.key().getStringView();
+        if (isMerged(key)) {
+            mergedHeaders->remove(LowerCaseString(key));
+        }
+        return HeaderMap::Iterate::Continue;
+    });
+    notModifiedHeaders.iterate([&isMerged, &mergedHeaders](const HeaderEntry& entry) -> HeaderMap::Iterate {
+        const absl::string_view key = entry.key().getStringView();
+        if (isMerged(key)) {
+            mergedHeaders->addCopy(LowerCaseString(key), entry.value().getStringView());
+        }
+        return HeaderMap::Iterate::Continue;
+    });
+    return mergedHeaders;
+}
+
+void CacheEntry::revalidate(HeadersTemplateSharedPtr mergedHeaders, const Freshness& freshness, SystemTime responseTime) {
+    response_time_.store(responseTime.time_since_epoch().count(), std::memory_order_relaxed);
+    initial_age_seconds_.store(parseAge(*mergedHeaders), std::memory_order_relaxed);
+    setFreshness(freshness);
+    std::unique_lock uniqueLock(*headers_mtx_);
+    headers_template_ = std::move(mergedHeaders);
+}
+
+void CacheEntry::setVariant(std::vector<LowerCaseString> varyHeaders, const CacheKey& variantKey,
+                            std::string contentCoding) {
+    vary_headers_ = std::move(varyHeaders);
+    variant_key_ = variantKey;
+    content_coding_ = std::move(contentCoding);
+}
+
+std::shared_ptr<CacheEntry> CacheEntry::createVaryMarker(std::vector<LowerCaseString> varyHeaders) {
+    auto marker = std::make_shared<CacheEntry>(0);
+    uint64_t namesBytes = 0;
+    for (const auto& name: varyHeaders) {
+        namesBytes += sizeof(LowerCaseString) + name.get().size();
+    }
+    marker->addFootprint(namesBytes);
+    marker->vary_headers_ = std::move(varyHeaders);
+    marker->vary_marker_ = true;
+    return marker;
+}
+
+uint64_t CacheEntry::parseAge(const ResponseHeaderMap& headers) {
+    uint64_t age = 0;
+    const auto ageValues = headers.get(LowerCaseString("age"));
+    if (!ageValues.empty() && !absl::SimpleAtoi(ageValues[0]->value().getStringView(), &age)) {
+        age = 0;
+    }
+    return age;
+}
+
+void CacheEntryProducer::initCacheEntry(uint32_t ringBufferCapacity, BodyStorage bodyStorage, uint32_t segmentSize,
+                                        TimeSource& timeSource) {
+    cache_entry_ptr_ = std::make_shared<CacheEntry>(ringBufferCapacity, bodyStorage, segmentSize);
+    time_source_ = &timeSource;
 }
 
 CacheEntrySharedPtr CacheEntryProducer::getCacheEntryPtr() const {
     return cache_entry_ptr_;
 }
 
+void CacheEntryProducer::setCompressor(Compression::Compressor::CompressorPtr compressor) {
+    compressor_ = std::move(compressor);
+    if (compressor_ != nullptr) {
+        cache_entry_ptr_->markCompressedAtRest();
+    }
+}
+
+void CacheEntryProducer::startStreaming() {
+    cache_entry_ptr_->startStreaming();
+    cache_entry_ptr_->releaseReadUnits();
+}
+
 void CacheEntryProducer::writeHeaders(const ResponseHeaderMap& headers, bool end_stream) {
-    ENVOY_STREAM_LOG(debug, "[CacheEntryProducer::writeHeaders] Writing headers", *encoder_callbacks_)
-    buffers_ = cache_entry_ptr_->headers_buffers_;
-    shared_mtx_ = cache_entry_ptr_->headers_mtx_;
-    headers.iterate(collectAndWriteHeadersCb);
-    writeDelimiterBlock(end_stream);
+    writeHeaders(headers, end_stream, time_source_->systemTime());
+}
+
+void CacheEntryProducer::writeHeaders(const ResponseHeaderMap& headers, bool end_stream, SystemTime responseTime) {
+    ENVOY_LOG(debug, "[CacheEntryProducer::writeHeaders] Writing headers")
+    // Parsed once here, every cache hit only clones the template
+    HeadersTemplateSharedPtr headersTemplate = createHeaderMap<ResponseHeaderMapImpl>(headers);
+    if (compressor_ != nullptr) {
+        applyCompressedHeaders(*headersTemplate);
+    }
+    uint64_t contentLength = 0;
+    const bool hasContentLength = absl::SimpleAtoi(headersTemplate->getContentLengthValue(), &contentLength);
+    const uint64_t headersBytes = headersTemplate->byteSize();
+    cache_entry_ptr_->publishHeaders(std::move(headersTemplate), end_stream, responseTime);
+    cache_entry_ptr_->addFootprint(headersBytes);
+    if (hasContentLength) {
+        expected_body_bytes_ = contentLength;
+    }
+    cache_entry_ptr_->notifySubscribers();
 }
 
 void CacheEntryProducer::headersWriteComplete() {
-    ENVOY_STREAM_LOG(debug, "[CacheEntryProducer::headersWriteComplete]", *encoder_callbacks_)
-    cache_entry_ptr_->headers_block_count_.store(current_block_count_, std::memory_order_release);
+    ENVOY_LOG(debug, "[CacheEntryProducer::headersWriteComplete]")
     current_block_count_ = 0;
     headers_write_complete_ = true;
 }
 
 void CacheEntryProducer::writeData(const Buffer::Instance& data, bool end_stream) {
-    ENVOY_STREAM_LOG(debug, "[CacheEntryProducer::writeData] Writing data", *encoder_callbacks_)
+    ENVOY_LOG(debug, "[CacheEntryProducer::writeData] Writing data")
+    if (compressor_ == nullptr) {
+        writeBody(data, end_stream);
+    }
+    else {
+        Buffer::OwnedImpl compressed;
+        compressed.add(data);
+        compressor_->compress(compressed, end_stream ? Compression::Compressor::State::Finish
+                                                     : Compression::Compressor::State::Flush);
+        if (end_stream) {
+            compressor_ = nullptr;
+        }
+        writeBody(compressed, end_stream);
+    }
+    if (cache_entry_ptr_->isStreaming()) {
+        cache_entry_ptr_->releaseReadUnits();
+    }
+}
+
+void CacheEntryProducer::writeBody(const Buffer::Instance& data, bool end_stream) {
+    if (cache_entry_ptr_->body_storage_ == BodyStorage::BUFFER_SLICES) {
+        writeDataSlice(data, end_stream);
+        cache_entry_ptr_->notifySubscribers();
+        return;
+    }
+    if (cache_entry_ptr_->body_storage_ == BodyStorage::SEGMENTS) {
+        writeDataToSegments(data);
+        if (end_stream) {
+            cache_entry_ptr_->data_end_stream_.store(true, std::memory_order_release);
+        }
+        cache_entry_ptr_->notifySubscribers();
+        return;
+    }
     buffers_ = cache_entry_ptr_->data_buffers_;
     shared_mtx_ = cache_entry_ptr_->data_mtx_;
+    // Every frame starts at a new block, blocks inside the frame are full (64B) except the last one
+    if (!cache_entry_ptr_->isStreaming()) {
+        std::unique_lock uniqueLock(*cache_entry_ptr_->data_mtx_);
+        cache_entry_ptr_->data_index_.push_back({body_bytes_written_, current_block_count_});
+    }
     writeStringToBuffer(data.toString());
     writeDelimiterBlock(end_stream);
+    body_bytes_written_ += data.length();
+    cache_entry_ptr_->notifySubscribers();
 }
 
 void CacheEntryProducer::dataWriteComplete() {
-    ENVOY_STREAM_LOG(debug, "[CacheEntryProducer::dataWriteComplete]", *encoder_callbacks_)
+    ENVOY_LOG(debug, "[CacheEntryProducer::dataWriteComplete]")
+    if (compressor_ != nullptr) {
+        // Trailers follow, the compressed body ends here
+        Buffer::OwnedImpl tail;
+        compressor_->compress(tail, Compression::Compressor::State::Finish);
+        compressor_ = nullptr;
+        writeBody(tail, false);
+    }
     cache_entry_ptr_->data_block_count_.store(current_block_count_, std::memory_order_release);
     data_write_complete_ = true;
+    cache_entry_ptr_->notifySubscribers();
 }
 
 void CacheEntryProducer::writeTrailers(const ResponseTrailerMap& trailers) {
-    ENVOY_STREAM_LOG(debug, "[CacheEntryProducer::writeTrailers] Writing trailers", *encoder_callbacks_)
+    ENVOY_LOG(debug, "[CacheEntryProducer::writeTrailers] Writing trailers")
     buffers_ = cache_entry_ptr_->trailers_buffers_;
     shared_mtx_ = cache_entry_ptr_->trailers_mtx_;
     trailers.iterate(collectAndWriteHeadersCb);
     writeDelimiterBlock(false);
+    cache_entry_ptr_->notifySubscribers();
 }
 
 void CacheEntryProducer::writeComplete() {
-    ENVOY_STREAM_LOG(debug, "[CacheEntryProducer::writeComplete] Write complete", *encoder_callbacks_)
-    if (!headers_write_complete_) {
-        cache_entry_ptr_->headers_block_count_.store(current_block_count_, std::memory_order_release);
-    }
-    else if (!data_write_complete_) {
+    ENVOY_LOG(debug, "[CacheEntryProducer::writeComplete] Write complete")
+    // Response without data has its end of stream published together with the headers
+    if (headers_write_complete_ && !data_write_complete_) {
         cache_entry_ptr_->data_block_count_.store(current_block_count_, std::memory_order_release);
     }
-    else {
+    else if (data_write_complete_) {
         writeDelimiterBlock(true);
     }
+    cache_entry_ptr_->markComplete();
+    cache_entry_ptr_->notifySubscribers();
+}
+
+void CacheEntryProducer::abort() {
+    ENVOY_LOG(debug, "[CacheEntryProducer::abort] Write aborted")
+    cache_entry_ptr_->markAborted();
+}
+
+void CacheEntryProducer::writeDataSlice(const Buffer::Instance& data, bool end_stream) {
+    // The only copy of the body bytes, readers share the slice afterwards
+    auto slice = std::make_shared<BodySlice>();
+    slice->size_ = data.length();
+    slice->data_.reset(new uint8_t[slice->size_]);
+    data.copyOut(0, slice->size_, slice->data_.get());
+    slice->end_stream_ = end_stream;
+    {
+        std::unique_lock uniqueLock(*cache_entry_ptr_->data_mtx_);
+        cache_entry_ptr_->data_slices_.emplace_back(std::move(slice));
+        if (!cache_entry_ptr_->isStreaming()) {
+            cache_entry_ptr_->data_index_.push_back({body_bytes_written_, current_block_count_});
+        }
+    }
+    cache_entry_ptr_->addFootprint(sizeof(BodySlice) + data.length());
+    body_bytes_written_ += data.length();
+    ++current_block_count_;
+}
+
+void CacheEntryProducer::writeDataToSegments(const Buffer::Instance& data) {
+    const uint64_t length = data.length();
+    uint64_t offset = 0;
+    while (offset < length) {
+        if (current_segment_ == nullptr || segment_fill_ == current_segment_->capacity_) {
+            allocateSegment();
+        }
+        uint32_t chunk = static_cast<uint32_t>(std::min<uint64_t>(current_segment_->capacity_ - segment_fill_,
+                                                                  length - offset));
+        data.copyOut(offset, chunk, current_segment_->data_.get() + segment_fill_);
+        segment_fill_ += chunk;
+        offset += chunk;
+        body_bytes_written_ += chunk;
+        // Single store per segment and write, readers never look past it
+        current_segment_->published_length_.store(segment_fill_, std::memory_order_release);
+    }
+}
+
+void CacheEntryProducer::allocateSegment() {
+    uint32_t capacity = cache_entry_ptr_->segment_size_;
+    // Known body size: do not allocate more than what is left of it (no slack at the end of the last segment)
+    if (expected_body_bytes_.has_value() && *expected_body_bytes_ > body_bytes_written_) {
+        capacity = static_cast<uint32_t>(std::min<uint64_t>(capacity, *expected_body_bytes_ - body_bytes_written_));
+    }
+    current_segment_ = std::make_shared<BodySegment>(capacity);
+    segment_fill_ = 0;
+    {
+        std::unique_lock uniqueLock(*cache_entry_ptr_->data_mtx_);
+        cache_entry_ptr_->data_segments_.emplace_back(current_segment_);
+        if (!cache_entry_ptr_->isStreaming()) {
+            cache_entry_ptr_->data_index_.push_back({body_bytes_written_, current_block_count_});
+        }
+    }
+    cache_entry_ptr_->addFootprint(sizeof(BodySegment) + capacity);
+    ++current_block_count_;
 }
 
 void CacheEntryProducer::writeStringToBuffer(const std::string_view& data) {
     bool firstWrite = true;
     while ((firstWrite || data_offset_ != 0) && writeToBlock(data)) {
-        ENVOY_STREAM_LOG(trace, "[CacheEntryProducer::writeStringToBuffer] data_offset_: {}",
-                         *encoder_callbacks_, data_offset_)
+        ENVOY_LOG(trace, "[CacheEntryProducer::writeStringToBuffer] data_offset_: {}", data_offset_)
         writeBlockToBuffer();
         firstWrite = false;
     }
@@ -80,8 +521,8 @@ bool CacheEntryProducer::writeToBlock(const std::string_view& data) {
     // Copy the data into the block
     memcpy(data_block_ + message_size_, data.data() + data_offset_, bytesToWrite);
     message_size_ += bytesToWrite;
-    ENVOY_STREAM_LOG(trace, "[CacheEntryProducer::writeToBlock] remainingSpace: {}, remainingDataSize: {}, bytesToWrite: {}, message_size_: {}",
-                     *encoder_callbacks_, remainingSpace, remainingDataSize, bytesToWrite, message_size_)
+    ENVOY_LOG(trace, "[CacheEntryProducer::writeToBlock] remainingSpace: {}, remainingDataSize: {}, bytesToWrite: {}, message_size_: {}",
+              remainingSpace, remainingDataSize, bytesToWrite, message_size_)
     if (message_size_ == BLOCK_SIZE_BYTES) {
         if (remainingSpace < remainingDataSize) {
             // Add written bytes to data offset for next writing
@@ -114,11 +555,12 @@ void CacheEntryProducer::writeDelimiterBlock(bool end_stream) {
 
 void CacheEntryProducer::writeBlockToBuffer() {
     if (buffers_->empty() || !buffers_->back()->write(message_size_, writeBlockCb)) {
-        ENVOY_STREAM_LOG(debug, "[CacheEntryProducer::writeBlockToBuffer] Emplacing new buffer", *encoder_callbacks_)
+        ENVOY_LOG(debug, "[CacheEntryProducer::writeBlockToBuffer] Emplacing new buffer")
         std::unique_lock uniqueLock(*shared_mtx_);
         // Emplace next buffer
         buffers_->emplace_back(std::make_shared<RingBufferQueue>(cache_entry_ptr_->single_buffer_blocks_capacity_));
         uniqueLock.unlock();
+        cache_entry_ptr_->addFootprint(RingBufferQueue::footprintBytes(cache_entry_ptr_->single_buffer_blocks_capacity_));
         buffers_->back()->write(message_size_, writeBlockCb);
     }
     ++current_block_count_;
@@ -129,198 +571,285 @@ void CacheEntryProducer::writeBlockToBuffer() {
 std::atomic<bool> CacheEntryConsumer::is_block_with_ones_initialized_ {false};
 uint8_t CacheEntryConsumer::block_with_ones_[BLOCK_SIZE_BYTES] {};
 
-CacheEntryConsumer::CacheEntryConsumer() {
+CacheEntryConsumer::CacheEntryConsumer(Http::StreamDecoderFilterCallbacks* decoderCallbacks,
+                                       std::optional<ByteRangeRequest> rangeRequest)
+    : decoder_callbacks_(decoderCallbacks), range_request_(std::move(rangeRequest)) {
     if (!is_block_with_ones_initialized_.load(std::memory_order_acquire)) {
         is_block_with_ones_initialized_.store(true, std::memory_order_release);
         memset(block_with_ones_, 0xFF, BLOCK_SIZE_BYTES);
     }
 }
 
-void CacheEntryConsumer::serveCachedResponse(CacheEntrySharedPtr responseEntryPtr, Http::StreamDecoderFilterCallbacks* decoderCallbacks) {
-    cache_entry_ptr_ = std::move(responseEntryPtr);
-    decoder_callbacks_ = decoderCallbacks;
+void CacheEntryConsumer::setContentNegotiation(Compression::Decompressor::DecompressorFactory* decompressorFactory,
+                                               bool acceptsGzip) {
+    decompressor_factory_ = decompressorFactory;
+    accepts_gzip_ = acceptsGzip;
+}
 
-    serveHeaders();
-    if (!end_stream_) {
-        serveData();
-        if (!end_stream_) {
-            serveTrailers();
+void CacheEntryConsumer::serveCachedResponse(CacheEntrySharedPtr responseEntryPtr) {
+    if (decoder_callbacks_ == nullptr || responseEntryPtr == nullptr || phase_ != ServePhase::IDLE) {
+        return;
+    }
+    cache_entry_ptr_ = std::move(responseEntryPtr);
+    if (!cache_entry_ptr_->attachReader(reader_cursor_)) {
+        ENVOY_STREAM_LOG(debug, "[CacheEntryConsumer::serveCachedResponse] Body of the streamed entry was already released",
+                         *decoder_callbacks_)
+        cache_entry_ptr_ = nullptr;
+        phase_ = ServePhase::DONE;
+        if (entry_unavailable_cb_) {
+            decoder_callbacks_->dispatcher().post(std::move(entry_unavailable_cb_));
         }
+        return;
     }
+    // Fires onAboveWriteBufferHighWatermark() right away if the downstream is already above it
+    decoder_callbacks_->addDownstreamWatermarkCallbacks(*this);
+    watermark_callbacks_added_ = true;
+    end_stream_ = false;
+    startPhase(ServePhase::HEADERS);
+    serveAvailable();
 }
 
-void CacheEntryConsumer::serveHeaders() {
-    ENVOY_STREAM_LOG(debug, "[CacheEntryConsumer::serveHeaders] Serving headers", *decoder_callbacks_)
+void CacheEntryConsumer::onNewBlocks() {
+    subscribed_ = false;
+    serveAvailable();
+}
 
-    read_block_count_ = 0;
-    block_index_ = 0;
-    buffer_index_ = 0;
-    end_stream_ = false;
-    headers_ = ResponseHeaderMapImpl::create();
-    std::shared_lock sharedLock(*cache_entry_ptr_->headers_mtx_);
-    sharedLock.unlock();
-    busyWaitToGetNextHeadersBuffer(sharedLock);
+void CacheEntryConsumer::stop() {
+    if (watermark_callbacks_added_) {
+        decoder_callbacks_->removeDownstreamWatermarkCallbacks(*this);
+        watermark_callbacks_added_ = false;
+    }
+    decoder_callbacks_ = nullptr;
+    phase_ = ServePhase::DONE;
+    if (reader_cursor_ != nullptr) {
+        // Units this reader has not passed yet must not be held for it anymore
+        cache_entry_ptr_->detachReader(reader_cursor_);
+        reader_cursor_ = nullptr;
+    }
+    // Release the entry (and its memory if it was already evicted) right away
+    cache_entry_ptr_ = nullptr;
+    current_buffer_ = nullptr;
+}
 
-    // Loop that ends with the block counter being equal to the desired number of blocks
-    // Busy-waiting technique
-    while (read_block_count_ < cache_entry_ptr_->headers_block_count_.load(std::memory_order_acquire)) {
-        if (current_buffer_->read(block_index_, data_block_, message_size_)) {
-            ENVOY_STREAM_LOG(trace, "[CacheEntryConsumer::serveHeaders] message_size_: {}",
-                             *decoder_callbacks_, message_size_)
-            parseAndEncodeHeaders();
-            ++read_block_count_;
-            if (++block_index_ == cache_entry_ptr_->single_buffer_blocks_capacity_) {
-                block_index_ = 0;
-                ++buffer_index_;
-                busyWaitToGetNextHeadersBuffer(sharedLock);
+bool CacheEntryConsumer::isServing() const {
+    return phase_ != ServePhase::IDLE && phase_ != ServePhase::DONE;
+}
+
+void CacheEntryConsumer::onAboveWriteBufferHighWatermark() {
+    ++high_watermark_count_;
+}
+
+void CacheEntryConsumer::onBelowWriteBufferLowWatermark() {
+    if (high_watermark_count_ == 0) {
+        return;
+    }
+    if (--high_watermark_count_ == 0 && isServing()) {
+        ENVOY_STREAM_LOG(trace, "[CacheEntryConsumer::onBelowWriteBufferLowWatermark] Downstream drained; resuming",
+                         *decoder_callbacks_)
+        // Posted, the event may be raised while this consumer is encoding
+        decoder_callbacks_->dispatcher().post([consumer = weak_from_this()]() {
+            if (CacheEntryConsumerSharedPtr consumerPtr = consumer.lock()) {
+                consumerPtr->serveAvailable();
             }
-        }
-        else {
-            ENVOY_STREAM_LOG(debug, "[CacheEntryConsumer::serveHeaders] Busy-wait on reading; read_block_count_: {}, headers_block_count_: {}",
-                             *decoder_callbacks_, read_block_count_, cache_entry_ptr_->headers_block_count_.load(std::memory_order_acquire))
-            // Pass on CPU time to another thread with the same priority
-            std::this_thread::yield();
-        }
+        });
     }
 }
 
-void CacheEntryConsumer::busyWaitToGetNextHeadersBuffer(std::shared_lock<std::shared_mutex>& sharedLock) {
-    // Busy-waiting for vector update
-    while (true) {
-        if (read_block_count_ >= cache_entry_ptr_->headers_block_count_.load(std::memory_order_acquire)) {
-            return;
+void CacheEntryConsumer::serveAvailable() {
+    // Encoding can destroy the stream (and the filter owning this consumer) synchronously
+    CacheEntryConsumerSharedPtr self = shared_from_this();
+    while (isServing() && !isPaused()) {
+        uint64_t writeSequence = cache_entry_ptr_->writeSequence();
+        bool phaseComplete = false;
+        switch (phase_) {
+        case ServePhase::HEADERS:
+            phaseComplete = serveHeaders();
+            break;
+        case ServePhase::DATA:
+            phaseComplete = serveData();
+            updateReaderCursor();
+            break;
+        case ServePhase::TRAILERS:
+            phaseComplete = serveTrailers();
+            break;
+        default:
+            break;
         }
-        sharedLock.lock();
-        if (buffer_index_ >= cache_entry_ptr_->headers_buffers_->size()) {
-            sharedLock.unlock();
-            ENVOY_STREAM_LOG(debug, "[CacheEntryConsumer::busyWaitToGetNextHeadersBuffer] Busy-wait on getting next buffer; read_block_count_: {}, headers_block_count_: {}",
-                             *decoder_callbacks_, read_block_count_, cache_entry_ptr_->headers_block_count_.load(std::memory_order_acquire))
-            // Pass on CPU time to another thread with the same priority
-            std::this_thread::yield();
+        if (phaseComplete || !isServing()) {
             continue;
         }
-        sharedLock.unlock();
-        break;
-    }
-    // Get next vector
-    ENVOY_STREAM_LOG(debug, "[CacheEntryConsumer::busyWaitToGetNextHeadersBuffer] Get next vector; buffer_index_: {}, headers_buffers_->size(): {}",
-                     *decoder_callbacks_, buffer_index_, cache_entry_ptr_->headers_buffers_->size())
-    sharedLock.lock();
-    current_buffer_ = cache_entry_ptr_->headers_buffers_->at(buffer_index_);
-    sharedLock.unlock();
-}
-
-void CacheEntryConsumer::parseAndEncodeHeaders() {
-    // Message with content
-    if (message_size_ > 0) {
-        if (key_length_ == 0 && message_size_ == BLOCK_SIZE_BYTES && isDataBlockIndicatingEndStream()) {
-            // End stream block detected
-            end_stream_ = true;
-            ENVOY_STREAM_LOG(trace, "[CacheEntryConsumer::parseAndEncodeHeaders] encodeHeaders, end_stream_: {}",
-                             *decoder_callbacks_, end_stream_)
-            decoder_callbacks_->encodeHeaders(std::move(headers_), end_stream_, {});
+        if (isPaused()) {
+            // Downstream buffers are full, onBelowWriteBufferLowWatermark() continues from here
+            ENVOY_STREAM_LOG(trace, "[CacheEntryConsumer::serveAvailable] Downstream above high watermark; pausing",
+                             *decoder_callbacks_)
             return;
         }
-        data_str_.append(reinterpret_cast<const char*>(data_block_), message_size_);
-        ENVOY_STREAM_LOG(trace, "[CacheEntryConsumer::parseAndEncodeHeaders]\ndata_str_:\n{}\nend_stream_: {}",
-                         *decoder_callbacks_, data_str_, end_stream_)
-        if (!key_read_done_) {
-            key_length_ += message_size_;
-            if (message_size_ < BLOCK_SIZE_BYTES) {
-                key_read_done_ = true;
-            }
-        }
-        else if (message_size_ < BLOCK_SIZE_BYTES) {
-            ENVOY_STREAM_LOG(trace, "[CacheEntryConsumer::parseAndEncodeHeaders]\nkey: {}, value: {}",
-                             *decoder_callbacks_, data_str_.substr(0, key_length_), data_str_.substr(key_length_))
-            headers_->addCopy(LowerCaseString(data_str_.substr(0, key_length_)),
-                              data_str_.substr(key_length_));
-            data_str_.clear();
-            key_length_ = 0;
-            key_read_done_ = false;
-        }
-    }
-    // Empty message
-    else {
-        // Delimiter block detection (parser is expecting non-empty keys)
-        if (key_length_ == 0) {
-            ENVOY_STREAM_LOG(trace, "[CacheEntryConsumer::parseAndEncodeHeaders] encodeHeaders, end_stream_: {}",
-                             *decoder_callbacks_, false)
-            decoder_callbacks_->encodeHeaders(std::move(headers_), false, {});
-            headers_ = ResponseHeaderMapImpl::create();
-        }
-        else if (!key_read_done_) {
-            key_read_done_ = true;
+        if (cache_entry_ptr_->isAborted()) {
+            // Nothing more will be written, the downstream must not wait for the rest of the response
+            ENVOY_STREAM_LOG(debug, "[CacheEntryConsumer::serveAvailable] Cache entry aborted by its producer; resetting stream",
+                             *decoder_callbacks_)
+            Http::StreamDecoderFilterCallbacks* decoderCallbacks = decoder_callbacks_;
+            stop();
+            decoderCallbacks->resetStream();
+            return;
         }
-        else {
-            ENVOY_STREAM_LOG(trace, "[CacheEntryConsumer::parseAndEncodeHeaders]\nkey: {}, value: {}",
-                             *decoder_callbacks_, data_str_.substr(0, key_length_), data_str_.substr(key_length_))
-            headers_->addCopy(LowerCaseString(data_str_.substr(0, key_length_)),
-                              data_str_.substr(key_length_));
-            data_str_.clear();
-            key_length_ = 0;
-            key_read_done_ = false;
+        // Caught up with the producer: wait for the next write instead of spinning on this worker thread
+        subscribe();
+        if (cache_entry_ptr_->writeSequence() == writeSequence) {
+            ENVOY_STREAM_LOG(trace, "[CacheEntryConsumer::serveAvailable] Waiting for producer; read_block_count_: {}",
+                             *decoder_callbacks_, read_block_count_)
+            return;
         }
+        // Producer wrote in the meantime, the subscription becomes a spurious (harmless) wake up
     }
 }
 
-void CacheEntryConsumer::serveData() {
-    ENVOY_STREAM_LOG(debug, "[CacheEntryConsumer::serveData] Serving data", *decoder_callbacks_)
+void CacheEntryConsumer::subscribe() {
+    if (subscribed_) {
+        return;
+    }
+    subscribed_ = true;
+    cache_entry_ptr_->subscribe(weak_from_this(), decoder_callbacks_->dispatcher());
+}
 
+void CacheEntryConsumer::startPhase(ServePhase phase) {
+    phase_ = phase;
     read_block_count_ = 0;
+    segment_offset_ = 0;
     block_index_ = 0;
     buffer_index_ = 0;
-    std::shared_lock sharedLock(*cache_entry_ptr_->data_mtx_);
-    sharedLock.unlock();
-    busyWaitToGetNextDataBuffer(sharedLock);
+    current_buffer_ = nullptr;
+    if (phase == ServePhase::TRAILERS) {
+        trailers_ = ResponseTrailerMapImpl::create();
+    }
+}
 
-    // Loop that ends with the block counter being equal to the desired number of blocks
-    // Busy-waiting technique
-    while (read_block_count_ < cache_entry_ptr_->data_block_count_.load(std::memory_order_acquire)) {
-        if (current_buffer_->read(block_index_, data_block_, message_size_)) {
-            ENVOY_STREAM_LOG(trace, "[CacheEntryConsumer::serveData] message_size_: {}",
-                             *decoder_callbacks_, message_size_)
-            parseAndEncodeData();
-            ++read_block_count_;
-            if ((++block_index_) == cache_entry_ptr_->single_buffer_blocks_capacity_) {
-                block_index_ = 0;
-                ++buffer_index_;
-                busyWaitToGetNextDataBuffer(sharedLock);
-            }
+bool CacheEntryConsumer::readNextBlock(const BufferVectorSharedPtr& buffers, const SharedMutexSharedPtr& sharedMtx) {
+    if (current_buffer_ == nullptr) {
+        std::shared_lock sharedLock(*sharedMtx);
+        if (buffer_index_ >= buffers->size()) {
+            return false;
         }
-        else {
-            ENVOY_STREAM_LOG(debug, "[CacheEntryConsumer::serveData] Busy-wait on reading; read_block_count_: {}, data_block_count_: {}, block_index_: {}, cache_entry_ptr_->single_buffer_blocks_capacity_: {}",
-                             *decoder_callbacks_, read_block_count_, cache_entry_ptr_->data_block_count_.load(std::memory_order_acquire), block_index_, cache_entry_ptr_->single_buffer_blocks_capacity_)
-            // Pass on CPU time to another thread with the same priority
-            std::this_thread::yield();
+        // Get next vector
+        current_buffer_ = buffers->at(buffer_index_);
+    }
+    if (!current_buffer_->read(block_index_, data_block_, message_size_)) {
+        return false;
+    }
+    if (++block_index_ == cache_entry_ptr_->single_buffer_blocks_capacity_) {
+        block_index_ = 0;
+        ++buffer_index_;
+        current_buffer_ = nullptr;
+    }
+    return true;
+}
+
+bool CacheEntryConsumer::serveHeaders() {
+    ENVOY_STREAM_LOG(debug, "[CacheEntryConsumer::serveHeaders] Serving headers", *decoder_callbacks_)
+    HeadersTemplateSharedPtr headersTemplate = cache_entry_ptr_->headersTemplate();
+    if (headersTemplate == nullptr) {
+        return false;
+    }
+    ResponseHeaderMapImplPtr headers = createHeaderMap<ResponseHeaderMapImpl>(*headersTemplate);
+    patchHeaders(*headers);
+    end_stream_ = cache_entry_ptr_->headersEndStream();
+    if (cache_entry_ptr_->isCompressedAtRest()) {
+        addVaryAcceptEncoding(*headers);
+        if (!accepts_gzip_ && decompressor_factory_ != nullptr) {
+            applyDecompressedHeaders(*headers);
+            decompressor_ = decompressor_factory_->createDecompressor("http_cache_rc.");
+        }
+    }
+    if (range_request_.has_value() && !end_stream_) {
+        ByteRange range;
+        switch (applyByteRange(*range_request_, *headers, range)) {
+        case RangeOutcome::PARTIAL:
+            range_ = range;
+            range_seek_pending_ = true;
+            break;
+        case RangeOutcome::UNSATISFIABLE:
+            end_stream_ = true;
+            break;
+        default:
+            break;
         }
     }
+    if (end_stream_) {
+        phase_ = ServePhase::DONE;
+    }
+    ENVOY_STREAM_LOG(trace, "[CacheEntryConsumer::serveHeaders] encodeHeaders, end_stream_: {}",
+                     *decoder_callbacks_, end_stream_)
+    if (headers_served_cb_) {
+        headers_served_cb_();
+        headers_served_cb_ = nullptr;
+    }
+    decoder_callbacks_->encodeHeaders(std::move(headers), end_stream_, {});
+    if (isServing()) {
+        startPhase(ServePhase::DATA);
+    }
+    return true;
 }
 
-void CacheEntryConsumer::busyWaitToGetNextDataBuffer(std::shared_lock<std::shared_mutex>& sharedLock) {
-    // Busy-waiting for vector update
-    while (true) {
-        if (read_block_count_ >= cache_entry_ptr_->data_block_count_.load(std::memory_order_acquire)) {
-            return;
+void CacheEntryConsumer::patchHeaders(ResponseHeaderMap& headers) const {
+    // Age == age reported by the origin + time the response spent in the cache (Date stays the one of the origin)
+    static const LowerCaseString ageHeader {"age"};
+    const auto residentTime = std::chrono::duration_cast<std::chrono::seconds>(
+        decoder_callbacks_->dispatcher().timeSource().systemTime() - cache_entry_ptr_->responseTime());
+    const uint64_t age = cache_entry_ptr_->initialAgeSeconds() + static_cast<uint64_t>(std::max<int64_t>(residentTime.count(), 0));
+    headers.setCopy(ageHeader, std::to_string(age));
+}
+
+bool CacheEntryConsumer::serveData() {
+    ENVOY_STREAM_LOG(debug, "[CacheEntryConsumer::serveData] Serving data; read_block_count_: {}",
+                     *decoder_callbacks_, read_block_count_)
+    if (range_seek_pending_) {
+        seekToRange();
+    }
+    if (cache_entry_ptr_->body_storage_ == BodyStorage::BUFFER_SLICES) {
+        return serveDataSlices();
+    }
+    if (cache_entry_ptr_->body_storage_ == BodyStorage::SEGMENTS) {
+        return serveDataSegments();
+    }
+    // Loop that ends with the block counter being equal to the desired number of blocks
+    while (read_block_count_ < cache_entry_ptr_->data_block_count_.load(std::memory_order_acquire)) {
+        if (!readNextBlock(cache_entry_ptr_->data_buffers_, cache_entry_ptr_->data_mtx_)) {
+            return false;
         }
-        sharedLock.lock();
-        if (buffer_index_ >= cache_entry_ptr_->data_buffers_->size()) {
-            sharedLock.unlock();
-            ENVOY_STREAM_LOG(debug, "[CacheEntryConsumer::busyWaitToGetNextDataBuffer] Busy-wait on getting next buffer; read_block_count_: {}, data_block_count_: {}",
-                             *decoder_callbacks_, read_block_count_, cache_entry_ptr_->data_block_count_.load(std::memory_order_acquire))
-            // Pass on CPU time to another thread with the same priority
-            std::this_thread::yield();
-            continue;
+        ENVOY_STREAM_LOG(trace, "[CacheEntryConsumer::serveData] message_size_: {}",
+                         *decoder_callbacks_, message_size_)
+        ++read_block_count_;
+        parseAndEncodeData();
+        if (!isServing()) {
+            return true;
+        }
+        if (isRangeServed()) {
+            // Rest of the body and the trailers are not part of the range
+            end_stream_ = true;
+            phase_ = ServePhase::DONE;
+            encodeBody(true);
+            return true;
+        }
+        if (isPaused()) {
+            return false;
         }
-        sharedLock.unlock();
-        break;
     }
-    // Get next vector
-    ENVOY_STREAM_LOG(debug, "[CacheEntryConsumer::busyWaitToGetNextDataBuffer] Get next vector; buffer_index_: {}, data_buffers_->size(): {}",
-                     *decoder_callbacks_, buffer_index_, cache_entry_ptr_->data_buffers_->size())
-    sharedLock.lock();
-    current_buffer_ = cache_entry_ptr_->data_buffers_->at(buffer_index_);
-    sharedLock.unlock();
+    startPhase(ServePhase::TRAILERS);
+    return true;
+}
+
+void CacheEntryConsumer::updateReaderCursor() {
+    if (reader_cursor_ == nullptr) {
+        return;
+    }
+    uint32_t unit = UINT32_MAX; // whole body read
+    if (phase_ == ServePhase::DATA) {
+        unit = cache_entry_ptr_->body_storage_ == BodyStorage::RING_BUFFER_BLOCKS ? buffer_index_ : read_block_count_;
+    }
+    reader_cursor_->unit_.store(unit, std::memory_order_release);
+    if (cache_entry_ptr_->isStreaming()) {
+        cache_entry_ptr_->releaseReadUnits();
+    }
 }
 
 void CacheEntryConsumer::parseAndEncodeData() {
@@ -329,13 +858,15 @@ void CacheEntryConsumer::parseAndEncodeData() {
         if (data_batch_complete_ && message_size_ == BLOCK_SIZE_BYTES && isDataBlockIndicatingEndStream()) {
             // End stream block detected
             end_stream_ = true;
+            phase_ = ServePhase::DONE;
+            data_batch_complete_ = false;
             ENVOY_STREAM_LOG(trace, "[CacheEntryConsumer::parseAndEncodeData] encodeData, data_:\n{}\nend_stream_: {}",
                              *decoder_callbacks_, data_.toString(), end_stream_)
-            decoder_callbacks_->encodeData(data_, end_stream_);
-            data_batch_complete_ = false;
+            encodeBody(end_stream_);
             return;
         }
-        data_.add(data_block_, message_size_);
+        const auto [offset, size] = rangeWindow(message_size_);
+        data_.add(data_block_ + offset, size);
         if (message_size_ < BLOCK_SIZE_BYTES) {
             data_batch_complete_ = true;
         }
@@ -351,69 +882,217 @@ void CacheEntryConsumer::parseAndEncodeData() {
                              *decoder_callbacks_, reinterpret_cast<const char*>(data_block_), message_size_)
             ENVOY_STREAM_LOG(trace, "[CacheEntryConsumer::parseAndEncodeData] encodeData, data_:\n{}\nend_stream_: {}",
                              *decoder_callbacks_, data_.toString(), false)
-            decoder_callbacks_->encodeData(data_, false);
+            encodeBody(false);
             data_batch_complete_ = false;
         }
     }
 }
 
-void CacheEntryConsumer::serveTrailers() {
-    ENVOY_STREAM_LOG(debug, "[CacheEntryConsumer::serveTrailers] Serving trailers", *decoder_callbacks_)
-
-    block_index_ = 0;
-    buffer_index_ = 0;
-    trailers_ = ResponseTrailerMapImpl::create();
-    std::shared_lock sharedLock(*cache_entry_ptr_->trailers_mtx_);
-    sharedLock.unlock();
-    busyWaitToGetNextTrailersBuffer(sharedLock);
+bool CacheEntryConsumer::serveDataSlices() {
+    // Loop that ends with the slice counter being equal to the number of slices written by the producer
+    while (read_block_count_ < cache_entry_ptr_->data_block_count_.load(std::memory_order_acquire)) {
+        BodySliceSharedPtr slice;
+        {
+            std::shared_lock sharedLock(*cache_entry_ptr_->data_mtx_);
+            const uint32_t slot = read_block_count_ - cache_entry_ptr_->first_unit_;
+            if (slot >= cache_entry_ptr_->data_slices_.size()) {
+                return false;
+            }
+            slice = cache_entry_ptr_->data_slices_[slot];
+        }
+        ++read_block_count_;
+        const auto [offset, size] = rangeWindow(slice->size_);
+        if (size > 0) {
+            // Zero-copy: the fragment references the slice memory, the releasor keeps the slice alive until
+            // the downstream connection has written it
+            auto* fragment = new Buffer::BufferFragmentImpl(
+                slice->data_.get() + offset, size,
+                [slice](const void*, size_t, const Buffer::BufferFragmentImpl* self) { delete self; });
+            data_.addBufferFragment(*fragment);
+        }
+        const bool endStream = slice->end_stream_ || isRangeServed();
+        ENVOY_STREAM_LOG(trace, "[CacheEntryConsumer::serveDataSlices] encodeData, size: {}, end_stream: {}",
+                         *decoder_callbacks_, size, endStream)
+        if (endStream) {
+            end_stream_ = true;
+            phase_ = ServePhase::DONE;
+        }
+        else if (size == 0) {
+            continue;
+        }
+        encodeBody(endStream);
+        if (!isServing()) {
+            return true;
+        }
+        if (isPaused()) {
+            return false;
+        }
+    }
+    startPhase(ServePhase::TRAILERS);
+    return true;
+}
 
-    // Loop that ends with the end stream being detected (a block with size 0 full of binary 1)
-    // Busy-waiting technique
+bool CacheEntryConsumer::serveDataSegments() {
+    bool dataComplete = false;
     while (true) {
-        if (current_buffer_->read(block_index_, data_block_, message_size_)) {
-            ENVOY_STREAM_LOG(trace, "[CacheEntryConsumer::serveTrailers] message_size_: {}",
-                             *decoder_callbacks_, message_size_)
-            parseAndEncodeTrailers();
-            // Trailer reading must end with an end_stream block
-            if (end_stream_) {
-                return;
+        // Loaded before the segments, every published length is final once the count is known
+        const uint32_t segmentCount = cache_entry_ptr_->data_block_count_.load(std::memory_order_acquire);
+        BodySegmentSharedPtr segment;
+        {
+            std::shared_lock sharedLock(*cache_entry_ptr_->data_mtx_);
+            const uint32_t slot = read_block_count_ - cache_entry_ptr_->first_unit_;
+            if (slot < cache_entry_ptr_->data_segments_.size()) {
+                segment = cache_entry_ptr_->data_segments_[slot];
             }
-            if (++block_index_ == cache_entry_ptr_->single_buffer_blocks_capacity_) {
-                block_index_ = 0;
-                ++buffer_index_;
-                busyWaitToGetNextTrailersBuffer(sharedLock);
+        }
+        if (segment == nullptr) {
+            dataComplete = read_block_count_ >= segmentCount;
+            break;
+        }
+        const uint32_t publishedLength = segment->published_length_.load(std::memory_order_acquire);
+        if (publishedLength > segment_offset_) {
+            const auto [offset, size] = rangeWindow(publishedLength - segment_offset_);
+            if (size > 0) {
+                // Zero-copy: the fragment keeps the segment alive until the downstream connection has written it
+                auto* fragment = new Buffer::BufferFragmentImpl(
+                    segment->data_.get() + segment_offset_ + offset, size,
+                    [segment](const void*, size_t, const Buffer::BufferFragmentImpl* self) { delete self; });
+                data_.addBufferFragment(*fragment);
             }
+            segment_offset_ = publishedLength;
         }
-        else {
-            ENVOY_STREAM_LOG(debug, "[CacheEntryConsumer::serveTrailers] Busy-wait on reading; end_stream_: {}",
-                             *decoder_callbacks_, end_stream_)
-            // Pass on CPU time to another thread with the same priority
-            std::this_thread::yield();
+        if (isRangeServed()) {
+            end_stream_ = true;
+            phase_ = ServePhase::DONE;
+            encodeBody(true);
+            return true;
+        }
+        if (segment_offset_ < segment->capacity_ && segmentCount == UINT32_MAX) {
+            // Producer is still filling this segment
+            break;
+        }
+        ++read_block_count_;
+        segment_offset_ = 0;
+        if (data_.length() > 0) {
+            // One write per segment, the downstream watermark is checked in between
+            encodeBody(false);
+            if (!isServing()) {
+                return true;
+            }
+            if (isPaused()) {
+                return false;
+            }
+        }
+    }
+
+    if (dataComplete) {
+        const bool endStream = cache_entry_ptr_->data_end_stream_.load(std::memory_order_acquire);
+        ENVOY_STREAM_LOG(trace, "[CacheEntryConsumer::serveDataSegments] encodeData, size: {}, end_stream: {}",
+                         *decoder_callbacks_, data_.length(), endStream)
+        if (endStream) {
+            end_stream_ = true;
+            phase_ = ServePhase::DONE;
+            encodeBody(true);
+            return true;
         }
+        if (data_.length() > 0) {
+            encodeBody(false);
+            if (!isServing()) {
+                return true;
+            }
+        }
+        startPhase(ServePhase::TRAILERS);
+        return true;
     }
+    if (data_.length() > 0) {
+        ENVOY_STREAM_LOG(trace, "[CacheEntryConsumer::serveDataSegments] encodeData, size: {}, end_stream: {}",
+                         *decoder_callbacks_, data_.length(), false)
+        encodeBody(false);
+    }
+    return false;
 }
 
-void CacheEntryConsumer::busyWaitToGetNextTrailersBuffer(std::shared_lock<std::shared_mutex>& sharedLock) {
-    // Busy-waiting for vector update
-    while (true) {
-        sharedLock.lock();
-        if (buffer_index_ >= cache_entry_ptr_->trailers_buffers_->size()) {
-            sharedLock.unlock();
-            ENVOY_STREAM_LOG(debug, "[CacheEntryConsumer::busyWaitToGetNextTrailersBuffer] Busy-wait on getting next buffer; end_stream_: {}",
-                             *decoder_callbacks_, end_stream_)
-            // Pass on CPU time to another thread with the same priority
-            std::this_thread::yield();
-            continue;
+void CacheEntryConsumer::encodeBody(bool endStream) {
+    if (decompressor_ == nullptr) {
+        decoder_callbacks_->encodeData(data_, endStream);
+        return;
+    }
+    // Decompressed frame by frame, only the frame being served is held in its identity form
+    Buffer::OwnedImpl decompressed;
+    decompressor_->decompress(data_, decompressed);
+    data_.drain(data_.length());
+    decoder_callbacks_->encodeData(decompressed, endStream);
+}
+
+void CacheEntryConsumer::seekToRange() {
+    range_seek_pending_ = false;
+    BodyIndexEntry start;
+    bool frameComplete = false;
+    BodySegmentSharedPtr segment;
+    {
+        std::shared_lock sharedLock(*cache_entry_ptr_->data_mtx_);
+        const std::vector<BodyIndexEntry>& index = cache_entry_ptr_->data_index_;
+        // Last unit that starts at or before the first byte of the range
+        auto it = std::upper_bound(index.begin(), index.end(), range_->first_,
+                                   [](uint64_t offset, const BodyIndexEntry& entry) { return offset < entry.body_offset_; });
+        if (it == index.begin()) {
+            // Nothing written yet, the body is read from its start and clipped
+            return;
         }
-        sharedLock.unlock();
-        break;
+        frameComplete = it != index.end();
+        start = *std::prev(it);
+        if (cache_entry_ptr_->body_storage_ == BodyStorage::SEGMENTS) {
+            segment = cache_entry_ptr_->data_segments_[start.unit_index_ - cache_entry_ptr_->first_unit_];
+        }
+    }
+    read_block_count_ = start.unit_index_;
+    body_offset_ = start.body_offset_;
+    const uint64_t skip = range_->first_ - start.body_offset_;
+    if (segment != nullptr) {
+        segment_offset_ = static_cast<uint32_t>(std::min<uint64_t>(
+            skip, segment->published_length_.load(std::memory_order_acquire)));
+        body_offset_ += segment_offset_;
+    }
+    else if (cache_entry_ptr_->body_storage_ == BodyStorage::RING_BUFFER_BLOCKS) {
+        // Blocks of a completely written frame are full except the last one, whole blocks before the range are skipped
+        const uint32_t skippedBlocks = frameComplete ? static_cast<uint32_t>(skip / BLOCK_SIZE_BYTES) : 0;
+        read_block_count_ += skippedBlocks;
+        body_offset_ += static_cast<uint64_t>(skippedBlocks) * BLOCK_SIZE_BYTES;
+        buffer_index_ = read_block_count_ / cache_entry_ptr_->single_buffer_blocks_capacity_;
+        block_index_ = read_block_count_ % cache_entry_ptr_->single_buffer_blocks_capacity_;
+        current_buffer_ = nullptr;
+    }
+    ENVOY_STREAM_LOG(debug, "[CacheEntryConsumer::seekToRange] Range starts at {}; reading from unit {}, offset {}",
+                     *decoder_callbacks_, range_->first_, read_block_count_, body_offset_)
+}
+
+std::pair<uint64_t, uint64_t> CacheEntryConsumer::rangeWindow(uint64_t size) {
+    const uint64_t offset = body_offset_;
+    body_offset_ += size;
+    if (!range_.has_value()) {
+        return {0, size};
+    }
+    const uint64_t begin = std::clamp(range_->first_, offset, offset + size);
+    const uint64_t end = std::clamp(range_->last_ + 1, offset, offset + size);
+    return {begin - offset, end - begin};
+}
+
+bool CacheEntryConsumer::isRangeServed() const {
+    return range_.has_value() && body_offset_ > range_->last_;
+}
+
+bool CacheEntryConsumer::serveTrailers() {
+    ENVOY_STREAM_LOG(debug, "[CacheEntryConsumer::serveTrailers] Serving trailers", *decoder_callbacks_)
+    // Loop that ends with the end stream being detected (a block with size 0 full of binary 1)
+    while (isServing()) {
+        if (!readNextBlock(cache_entry_ptr_->trailers_buffers_, cache_entry_ptr_->trailers_mtx_)) {
+            return false;
+        }
+        ENVOY_STREAM_LOG(trace, "[CacheEntryConsumer::serveTrailers] message_size_: {}",
+                         *decoder_callbacks_, message_size_)
+        parseAndEncodeTrailers();
     }
-    // Get next vector
-    ENVOY_STREAM_LOG(debug, "[CacheEntryConsumer::busyWaitToGetNextTrailersBuffer] Get next vector; buffer_index_: {}, trailers_buffers_->size(): {}",
-                     *decoder_callbacks_, buffer_index_, cache_entry_ptr_->trailers_buffers_->size())
-    sharedLock.lock();
-    current_buffer_ = cache_entry_ptr_->trailers_buffers_->at(buffer_index_);
-    sharedLock.unlock();
+    return true;
 }
 
 void CacheEntryConsumer::parseAndEncodeTrailers() {
@@ -422,6 +1101,7 @@ void CacheEntryConsumer::parseAndEncodeTrailers() {
         if (key_length_ == 0 && message_size_ == BLOCK_SIZE_BYTES && isDataBlockIndicatingEndStream()) {
             // End stream block detected
             end_stream_ = true;
+            phase_ = ServePhase::DONE;
             ENVOY_STREAM_LOG(trace, "[CacheEntryConsumer::parseAndEncodeTrailers] isDataBlockIndicatingEndStream(): {}",
                              *decoder_callbacks_, end_stream_)
             decoder_callbacks_->encodeTrailers(std::move(trailers_));
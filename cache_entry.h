@@ -1,10 +1,20 @@
 #pragma once
 
+#include "envoy/compression/compressor/compressor.h"
+#include "envoy/compression/decompressor/factory.h"
+#include "envoy/event/dispatcher.h"
 #include "envoy/http/filter.h"
 #include "source/common/http/header_map_impl.h"
 #include "source/common/buffer/buffer_impl.h"
 #include "ring_buffer.h"
+#include "freshness.h"
+#include "byte_range.h"
+#include "cache_key.h"
 #include <shared_mutex>
+#include <mutex>
+#include <optional>
+#include <chrono>
+#include <functional>
 
 namespace Envoy::Http {
 
@@ -14,22 +24,228 @@ using SharedMutexSharedPtr = std::shared_ptr<std::shared_mutex>;
 using BufferVector = std::vector<RingBufferQueueSharedPtr>;
 using BufferVectorSharedPtr = std::shared_ptr<BufferVector>;
 
+/**
+ * @brief How the response body is stored in the cache entry.
+ * RING_BUFFER_BLOCKS == body is copied into 64B blocks of ring buffers and copied out of them on every hit
+ * BUFFER_SLICES      == body is copied once into immutable refcounted slices, hits reference them as buffer fragments
+ * SEGMENTS           == body is appended into large contiguous segments, each with a single published-length atomic
+ */
+enum class BodyStorage { RING_BUFFER_BLOCKS, BUFFER_SLICES, SEGMENTS };
+
+constexpr uint32_t DEFAULT_SEGMENT_SIZE_BYTES = 16 * 1024;
+constexpr uint32_t MIN_SEGMENT_SIZE_BYTES = 4 * 1024;
+constexpr uint32_t MAX_SEGMENT_SIZE_BYTES = 64 * 1024;
+
+/**
+ * @brief Immutable part of the response body (one upstream data frame), shared by all readers without copying.
+ */
+struct BodySlice {
+    std::unique_ptr<uint8_t[]> data_ {};
+    size_t size_ {0};
+    bool end_stream_ {false};
+};
+
+using BodySliceSharedPtr = std::shared_ptr<const BodySlice>;
+using BodySliceVector = std::vector<BodySliceSharedPtr>;
+
+/**
+ * @brief Contiguous part of the response body, filled by the producer from the front.
+ * Bytes [0, published_length_) are immutable and may be read without any lock.
+ */
+struct BodySegment {
+    explicit BodySegment(uint32_t capacity) : data_(new uint8_t[capacity]), capacity_(capacity) {}
+
+    const std::unique_ptr<uint8_t[]> data_;
+    const uint32_t capacity_;
+    std::atomic<uint32_t> published_length_ {0};
+};
+
+/**
+ * @brief Position of the first byte of a body unit (frame of blocks, slice or segment).
+ */
+struct BodyIndexEntry {
+    uint64_t body_offset_ {0};
+    uint32_t unit_index_ {0};
+};
+
+using BodySegmentSharedPtr = std::shared_ptr<BodySegment>;
+using BodySegmentVector = std::vector<BodySegmentSharedPtr>;
+
+// Immutable response headers built at fill time
+using HeadersTemplateSharedPtr = std::shared_ptr<const ResponseHeaderMap>;
+
+class CacheEntryConsumer;
+using CacheEntryConsumerSharedPtr = std::shared_ptr<CacheEntryConsumer>;
+using CacheEntryConsumerWeakPtr = std::weak_ptr<CacheEntryConsumer>;
+
+/**
+ * @brief Consumer waiting for the producer to write more blocks, woken up on its own worker thread.
+ */
+struct CacheEntrySubscriber {
+    Event::Dispatcher* dispatcher_ {};
+    CacheEntryConsumerWeakPtr consumer_ {};
+};
+
+/**
+ * @brief Body position of a reader of an entry that is still being written (see CacheEntry::attachReader()).
+ * Body units (ring buffers, slices or segments) before unit_ were completely read.
+ */
+struct ReaderCursor {
+    std::atomic<uint32_t> unit_ {0};
+};
+
+using ReaderCursorSharedPtr = std::shared_ptr<ReaderCursor>;
+
+/**
+ * @brief Memory usage counter that cache entries report their footprint to.
+ * Counters are chained (cache shard -> whole cache), so every level can be read in O(1).
+ */
+struct ByteCounter {
+    void add(uint64_t bytes);
+    void subtract(uint64_t bytes);
+    uint64_t bytes() const { return bytes_.load(std::memory_order_relaxed); }
+    // Runs the callback if the counter exceeds its budget, called by a growing entry outside of its footprint lock
+    void checkBudget() const;
+
+    std::atomic<uint64_t> bytes_ {0};
+    ByteCounter* parent_ {nullptr};
+    // Budget of the counter (0 == unlimited) and the eviction run when growth of an attached entry exceeds it
+    uint64_t budget_ {0};
+    std::function<void()> over_budget_cb_ {};
+};
+
 /**
  * @brief Response from the origin server.
  */
 struct CacheEntry {
-    explicit CacheEntry(uint32_t ringBufferCapacity) : single_buffer_blocks_capacity_(ringBufferCapacity) {}
+    explicit CacheEntry(uint32_t ringBufferCapacity, BodyStorage bodyStorage = BodyStorage::RING_BUFFER_BLOCKS,
+                        uint32_t segmentSize = DEFAULT_SEGMENT_SIZE_BYTES)
+        : single_buffer_blocks_capacity_(ringBufferCapacity), body_storage_(bodyStorage),
+          segment_size_(segmentSize) {}
+    // Called by the producer whenever the entry allocates more memory
+    void addFootprint(uint64_t bytes);
+    // Starts/stops reporting the footprint (current and future growth) to the counter of the cache
+    void attachByteCounter(ByteCounter* byteCounter);
+    void detachByteCounter();
+    // Entry left the shared cache (evicted, removed or replaced), per-worker L1 caches drop it on their next lookup
+    void markEvicted() { evicted_.store(true, std::memory_order_release); }
+    bool isEvicted() const { return evicted_.load(std::memory_order_acquire); }
+    uint64_t footprintBytes() const { return footprint_bytes_.load(std::memory_order_relaxed); }
+    // One-shot registration, the consumer is posted onto its dispatcher after the next write of the producer
+    void subscribe(const CacheEntryConsumerWeakPtr& consumer, Event::Dispatcher& dispatcher);
+    // Called by the producer after every write, posts "new blocks available" event to all subscribers
+    void notifySubscribers();
+    uint64_t writeSequence() const { return write_sequence_.load(std::memory_order_acquire); }
+    // Producer stream was reset, the entry will never be complete
+    void markAborted();
+    bool isAborted() const { return aborted_.load(std::memory_order_acquire); }
+    // Called by the producer after the last write (headers, body and trailers are final)
+    void markComplete() { complete_.store(true, std::memory_order_release); }
+    // Whole response is stored (a streamed entry never is)
+    bool isComplete() const { return complete_.load(std::memory_order_acquire) && !isAborted() && !isStreaming(); }
+    // Oversized response: the entry left the cache and serves only the readers attached to it, body units are
+    // released once every attached reader has passed them. Called by the producer before markComplete()
+    void startStreaming() { streaming_.store(true, std::memory_order_release); }
+    bool isStreaming() const { return streaming_.load(std::memory_order_acquire); }
+    // Readers of an entry that is not complete report their position through the cursor (nullptr for a complete
+    // entry). Returns false if the start of the body was already released, the entry cannot be served anymore
+    bool attachReader(ReaderCursorSharedPtr& cursor);
+    void detachReader(const ReaderCursorSharedPtr& cursor);
+    // Streamed entry only: releases the units every attached reader has passed (never the one being written)
+    void releaseReadUnits();
+    bool hasTrailers() const;
+    // Appends the whole body of a complete entry (any body storage) to body
+    void copyBody(std::string& body) const;
+    // Body is stored gzip-compressed (Content-Encoding of the template), set before the headers are published
+    void markCompressedAtRest() { compressed_at_rest_ = true; }
+    bool isCompressedAtRest() const { return compressed_at_rest_; }
+    // Called once by the producer, before that headersTemplate() returns nullptr
+    void publishHeaders(HeadersTemplateSharedPtr headers, bool end_stream, SystemTime responseTime);
+    HeadersTemplateSharedPtr headersTemplate() const;
+    // Valid only once headersTemplate() returned the headers
+    bool headersEndStream() const { return headers_end_stream_; }
+    SystemTime responseTime() const { return SystemTime(SystemTime::duration(response_time_.load(std::memory_order_relaxed))); }
+    uint64_t initialAgeSeconds() const { return initial_age_seconds_.load(std::memory_order_relaxed); }
+    // Set before the entry is inserted into the cache, updated in place only by a successful revalidation
+    void setFreshness(const Freshness& freshness);
+    Freshness freshness() const;
+    bool isFresh(SystemTime now) const { return now.time_since_epoch().count() < fresh_until_.load(std::memory_order_relaxed); }
+    // Expired, but may still be served while a background refresh replaces it
+    bool isStaleServable(SystemTime now) const { return now.time_since_epoch().count() < stale_until_.load(std::memory_order_relaxed); }
+    // Stored 2xx response has ETag or Last-Modified, so it can be revalidated with a conditional request
+    bool hasValidators() const;
+    // Stored headers updated with the headers of a 304 response (RFC 9111 Section 4.3.4), the body stays as it is
+    HeadersTemplateSharedPtr mergeNotModifiedHeaders(const ResponseHeaderMap& notModifiedHeaders) const;
+    // 304 received: the merged headers and their freshness replace the stored ones in place
+    void revalidate(HeadersTemplateSharedPtr mergedHeaders, const Freshness& freshness, SystemTime responseTime);
+    // Response varies on request headers (Vary), set before the entry is published or inserted and never changed
+    // contentCoding == lower-case Content-Encoding returned by the origin ("" == identity or compressed at rest)
+    void setVariant(std::vector<LowerCaseString> varyHeaders, const CacheKey& variantKey, std::string contentCoding);
+    const std::vector<LowerCaseString>& varyHeaders() const { return vary_headers_; }
+    const CacheKey& variantKey() const { return variant_key_; }
+    const std::string& contentCoding() const { return content_coding_; }
+    // Entry stored under the primary key of a varying response, it only names the headers that select the variant
+    static std::shared_ptr<CacheEntry> createVaryMarker(std::vector<LowerCaseString> varyHeaders);
+    bool isVaryMarker() const { return vary_marker_; }
+
     const uint32_t single_buffer_blocks_capacity_ {};
-    // Counter to provide information for buffer readers
-    std::atomic<uint32_t> headers_block_count_ {UINT32_MAX};
-    // Counter to provide information for buffer readers
+    const BodyStorage body_storage_ {};
+    const uint32_t segment_size_ {};
+    // Counter to provide information for buffer readers (number of blocks, slices or segments based on body_storage_)
     std::atomic<uint32_t> data_block_count_ {UINT32_MAX};
+    // BUFFER_SLICES and SEGMENTS only, set before data_block_count_ is published
+    std::atomic<bool> data_end_stream_ {false};
     SharedMutexSharedPtr headers_mtx_ {std::make_shared<std::shared_mutex>()};
-    BufferVectorSharedPtr headers_buffers_ {std::make_shared<BufferVector>()};
     SharedMutexSharedPtr data_mtx_ {std::make_shared<std::shared_mutex>()};
     BufferVectorSharedPtr data_buffers_ {std::make_shared<BufferVector>()};
+    // BUFFER_SLICES only (guarded by data_mtx_)
+    BodySliceVector data_slices_ {};
+    // SEGMENTS only (vector guarded by data_mtx_, content of segments by their published length)
+    BodySegmentVector data_segments_ {};
+    // Streamed entry only: number of units erased from the front of data_slices_ or data_segments_, the slot of
+    // unit i is i - first_unit_ (guarded by data_mtx_)
+    uint32_t first_unit_ {0};
+    // Byte offset index of the body, sorted by offset, not extended once the entry streams (guarded by data_mtx_)
+    std::vector<BodyIndexEntry> data_index_ {};
     SharedMutexSharedPtr trailers_mtx_ {std::make_shared<std::shared_mutex>()};
     BufferVectorSharedPtr trailers_buffers_ {std::make_shared<BufferVector>()};
+
+private:
+    // Real memory footprint of the entry: headers template, body storage and ring buffers including Block padding
+    std::atomic<uint64_t> footprint_bytes_ {sizeof(CacheEntry)};
+    // Guards attaching/detaching, so growth is never lost or counted twice while the entry leaves the cache
+    std::mutex footprint_mtx_ {};
+    ByteCounter* byte_counter_ {nullptr};
+    // Incremented after every write, lets consumers detect a write that raced with their subscription
+    std::atomic<uint64_t> write_sequence_ {0};
+    std::atomic<bool> aborted_ {false};
+    std::atomic<bool> complete_ {false};
+    std::atomic<bool> streaming_ {false};
+    std::mutex readers_mtx_ {};
+    std::vector<ReaderCursorSharedPtr> readers_ {};
+    // Number of body units released from the front of the body (guarded by readers_mtx_)
+    uint32_t released_units_ {0};
+    std::atomic<bool> evicted_ {false};
+    std::mutex subscribers_mtx_ {};
+    std::vector<CacheEntrySubscriber> subscribers_ {};
+    static uint64_t parseAge(const ResponseHeaderMap& headers);
+    // Called by releaseReadUnits() with data_mtx_ held
+    template <class UnitVector> void eraseReleasedUnits(UnitVector& units);
+
+    // Guarded by headers_mtx_, replaced only by revalidation
+    HeadersTemplateSharedPtr headers_template_ {};
+    // Written once by publishHeaders()
+    bool headers_end_stream_ {false};
+    bool compressed_at_rest_ {false};
+    std::atomic<SystemTime::rep> response_time_ {0};
+    std::atomic<uint64_t> initial_age_seconds_ {0};
+    std::atomic<SystemTime::rep> fresh_until_ {SystemTime::max().time_since_epoch().count()};
+    std::atomic<SystemTime::rep> stale_until_ {SystemTime::max().time_since_epoch().count()};
+
+    std::vector<LowerCaseString> vary_headers_ {};
+    CacheKey variant_key_ {};
+    std::string content_coding_ {};
+    bool vary_marker_ {false};
 };
 
 using CacheEntrySharedPtr = std::shared_ptr<CacheEntry>;
@@ -40,16 +256,29 @@ using CacheEntrySharedPtr = std::shared_ptr<CacheEntry>;
  */
 class CacheEntryProducer : public Logger::Loggable<Logger::Id::filter> {
 public:
-    void initCacheEntry(uint32_t ringBufferCapacity, Http::StreamEncoderFilterCallbacks* encoderCallbacks);
+    void initCacheEntry(uint32_t ringBufferCapacity, BodyStorage bodyStorage, uint32_t segmentSize,
+                        TimeSource& timeSource);
     CacheEntrySharedPtr getCacheEntryPtr() const;
+    // Body is stored compressed by the compressor (set before the headers are written), nullptr stores it as is
+    void setCompressor(Compression::Compressor::CompressorPtr compressor);
+    // Oversized fill: nothing of the body is kept longer than its attached readers need it
+    void startStreaming();
     void writeHeaders(const ResponseHeaderMap& headers, bool end_stream);
+    // Response restored from storage keeps the time it was originally received (Age of cache hits)
+    void writeHeaders(const ResponseHeaderMap& headers, bool end_stream, SystemTime responseTime);
     void headersWriteComplete();
     void writeData(const Buffer::Instance& data, bool end_stream);
     void dataWriteComplete();
     void writeTrailers(const ResponseTrailerMap& trailers);
     void writeComplete();
+    // Upstream response ended prematurely, readers of the entry reset their streams
+    void abort();
 
 private:
+    void writeBody(const Buffer::Instance& data, bool end_stream);
+    void writeDataSlice(const Buffer::Instance& data, bool end_stream);
+    void writeDataToSegments(const Buffer::Instance& data);
+    void allocateSegment();
     void writeStringToBuffer(const std::string_view& data);
     bool writeToBlock(const std::string_view& data);
     void writeDelimiterBlock(bool end_stream);
@@ -61,15 +290,17 @@ private:
         return HeaderMap::Iterate::Continue;
     };
     WriteCallback writeBlockCb = [this](uint8_t* data) {
-        ENVOY_STREAM_LOG(trace, "[CacheEntryProducer::writeBlockCb] data_block_:\n{}\nmessage_size_: {}",
-                         *encoder_callbacks_, reinterpret_cast<const char*>(data_block_), message_size_)
+        ENVOY_LOG(trace, "[CacheEntryProducer::writeBlockCb] data_block_:\n{}\nmessage_size_: {}",
+                  reinterpret_cast<const char*>(data_block_), message_size_)
         memcpy(data, data_block_, message_size_);
         message_size_ = 0;
     };
 
     CacheEntrySharedPtr cache_entry_ptr_ {};
-    // Used only for logging
-    Http::StreamEncoderFilterCallbacks* encoder_callbacks_ {};
+    // Every frame is flushed so readers never wait for more input; finished by the last frame or the trailers
+    Compression::Compressor::CompressorPtr compressor_ {};
+    // Time of the response (Age of cache hits), the producer may run without a downstream stream (refresh)
+    TimeSource* time_source_ {};
 
     SharedMutexSharedPtr shared_mtx_ {};
     BufferVectorSharedPtr buffers_ {};
@@ -77,6 +308,12 @@ private:
 
     bool headers_write_complete_ {false}, data_write_complete_ {false};
 
+    // SEGMENTS only: segment being filled, its fill level and the body size announced by Content-Length
+    BodySegmentSharedPtr current_segment_ {};
+    uint32_t segment_fill_ {0};
+    uint64_t body_bytes_written_ {0};
+    std::optional<uint64_t> expected_body_bytes_ {};
+
     // Data block to be written into cache
     uint8_t data_block_[BLOCK_SIZE_BYTES];
     MessageSize message_size_ {0};
@@ -85,36 +322,99 @@ private:
 
 
 /**
- * @brief Reader class that supports concurrent writing and reading of data, based on busy-waiting.
+ * @brief Reader class that supports concurrent writing and reading of data, driven by events.
+ * Encodes everything the producer has written so far and returns to the event loop; when it catches up with
+ * the producer it subscribes to the entry and continues on the next "new blocks available" event.
+ * Each consumer serves exactly one downstream stream and runs only on the worker thread of that stream.
+ * Reading stops while the downstream connection is above its high watermark and continues below its low watermark,
+ * so a slow client never holds more of the body than its write buffer limit.
  */
-class CacheEntryConsumer : public Logger::Loggable<Logger::Id::filter> {
+class CacheEntryConsumer : public Logger::Loggable<Logger::Id::filter>,
+                           public DownstreamWatermarkCallbacks,
+                           public std::enable_shared_from_this<CacheEntryConsumer> {
 public:
-    CacheEntryConsumer();
-    void serveCachedResponse(CacheEntrySharedPtr responseEntryPtr, Http::StreamDecoderFilterCallbacks* decoderCallbacks);
+    // With a range request, complete 200 responses are served as 206 (or 416) from the stored body
+    explicit CacheEntryConsumer(Http::StreamDecoderFilterCallbacks* decoderCallbacks,
+                                std::optional<ByteRangeRequest> rangeRequest = std::nullopt);
+    // Never blocks, the rest of the response is served asynchronously
+    void serveCachedResponse(CacheEntrySharedPtr responseEntryPtr);
+    // Called once, right before the response headers are encoded
+    void onHeadersServed(std::function<void()> callback) { headers_served_cb_ = std::move(callback); }
+    // Posted instead of serving if the body of the (streamed) entry was already released
+    void onEntryUnavailable(std::function<void()> callback) { entry_unavailable_cb_ = std::move(callback); }
+    // Compressed entries are served as stored if the request accepts gzip, otherwise decompressed by the factory
+    void setContentNegotiation(Compression::Decompressor::DecompressorFactory* decompressorFactory, bool acceptsGzip);
+    // Event posted by the producer onto the dispatcher of this consumer
+    void onNewBlocks();
+    // Downstream stream is gone, nothing is encoded anymore
+    void stop();
+    bool isServing() const;
+
+    // Http::DownstreamWatermarkCallbacks
+    void onAboveWriteBufferHighWatermark() override;
+    void onBelowWriteBufferLowWatermark() override;
 
 private:
-    void serveHeaders();
-    void busyWaitToGetNextHeadersBuffer(std::shared_lock<std::shared_mutex>& sharedLock);
-    void parseAndEncodeHeaders();
-    void serveData();
-    void busyWaitToGetNextDataBuffer(std::shared_lock<std::shared_mutex>& sharedLock);
+    /**
+     * @brief Part of the response that is being served.
+     */
+    enum class ServePhase { IDLE, HEADERS, DATA, TRAILERS, DONE };
+
+    void serveAvailable();
+    bool isPaused() const { return high_watermark_count_ > 0; }
+    void subscribe();
+    void startPhase(ServePhase phase);
+    // Each serve function returns true when its part of the response is completely served
+    bool serveHeaders();
+    void patchHeaders(ResponseHeaderMap& headers) const;
+    bool serveData();
     void parseAndEncodeData();
-    void serveTrailers();
-    void busyWaitToGetNextTrailersBuffer(std::shared_lock<std::shared_mutex>& sharedLock);
+    // Reports the body position to a streamed entry and releases the units behind the slowest reader
+    void updateReaderCursor();
+    // Encodes (and drains) data_, decompressed if the client does not accept the stored coding
+    void encodeBody(bool endStream);
+    bool serveDataSlices();
+    bool serveDataSegments();
+    // Jumps to the body unit holding the first byte of the range (body offset index)
+    void seekToRange();
+    // Part [offset, offset + size) of the next `size` body bytes that is inside the served range
+    std::pair<uint64_t, uint64_t> rangeWindow(uint64_t size);
+    bool isRangeServed() const;
+    bool serveTrailers();
     void parseAndEncodeTrailers();
+    // Returns false if the producer has not written the next block of the section yet
+    bool readNextBlock(const BufferVectorSharedPtr& buffers, const SharedMutexSharedPtr& sharedMtx);
     bool isDataBlockIndicatingEndStream() const;
 
     CacheEntrySharedPtr cache_entry_ptr_ {};
     Http::StreamDecoderFilterCallbacks* decoder_callbacks_ {};
+    ServePhase phase_ {ServePhase::IDLE};
+    bool subscribed_ {false};
+    // Nested high watermark events of the downstream, reading is paused while non-zero
+    uint32_t high_watermark_count_ {0};
+    bool watermark_callbacks_added_ {false};
 
     RingBufferQueueSharedPtr current_buffer_ {};
-    uint32_t read_block_count_ {}, buffer_index_ {}, block_index_ {}, key_length_ {0};
+    uint32_t read_block_count_ {}, buffer_index_ {}, block_index_ {}, key_length_ {0}, segment_offset_ {0};
     std::string data_str_ {};
     bool key_read_done_ {false}, data_batch_complete_ {false}, end_stream_ {};
-    ResponseHeaderMapImplPtr headers_ {};
     ResponseTrailerMapImplPtr trailers_ {};
     Buffer::OwnedImpl data_ {};
 
+    std::function<void()> headers_served_cb_ {};
+    std::function<void()> entry_unavailable_cb_ {};
+    // Set while serving an entry that was not complete
+    ReaderCursorSharedPtr reader_cursor_ {};
+    Compression::Decompressor::DecompressorFactory* decompressor_factory_ {};
+    bool accepts_gzip_ {true};
+    Compression::Decompressor::DecompressorPtr decompressor_ {};
+    std::optional<ByteRangeRequest> range_request_ {};
+    // Set once the headers were served as 206
+    std::optional<ByteRange> range_ {};
+    // Offset of the next body byte that is read
+    uint64_t body_offset_ {0};
+    bool range_seek_pending_ {false};
+
     // Data block that data are copied into
     uint8_t data_block_[BLOCK_SIZE_BYTES] {};
     mutable MessageSize message_size_ {0};
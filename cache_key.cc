@@ -0,0 +1,223 @@
+#include "cache_key.h"
+
+#include "source/common/common/hash.h"
+#include "source/common/http/headers.h"
+#include "absl/strings/ascii.h"
+#include "absl/strings/match.h"
+#include "absl/strings/numbers.h"
+#include "absl/strings/str_join.h"
+#include "absl/strings/str_split.h"
+#include <algorithm>
+
+namespace Envoy::Http {
+
+namespace {
+
+// Mixed into the seed of every part, keeps the length of the part (or its absence) in the hash
+constexpr uint64_t LENGTH_PRIME = 0x9FB21C651E98DF25ULL;
+constexpr uint64_t MISSING_PART = 0xFFFFFFFFFFFFFFFFULL;
+
+// Codings in the order of preference of a typical origin, the first accepted one selects the variant
+constexpr absl::string_view CONTENT_CODINGS[] = {"br", "zstd", "gzip", "deflate"};
+
+// Codings listed in Accept-Encoding (including "*") split by their quality: q=0 rejects the coding
+void parseAcceptEncoding(const RequestHeaderMap& headers, std::vector<absl::string_view>& accepted,
+                         std::vector<absl::string_view>& rejected) {
+    const auto values = headers.get(Http::CustomHeaders::get().AcceptEncoding);
+    for (size_t i = 0; i < values.size(); ++i) {
+        for (absl::string_view element: absl::StrSplit(values[i]->value().getStringView(), ',')) {
+            std::vector<absl::string_view> parameters = absl::StrSplit(element, ';');
+            absl::string_view coding = absl::StripAsciiWhitespace(parameters[0]);
+            bool isRejected = false;
+            for (size_t p = 1; p < parameters.size(); ++p) {
+                absl::string_view parameter = absl::StripAsciiWhitespace(parameters[p]);
+                double quality = 1.0;
+                if (absl::ConsumePrefix(&parameter, "q=") && absl::SimpleAtod(parameter, &quality) && quality <= 0.0) {
+                    isRejected = true;
+                }
+            }
+            (isRejected ? rejected : accepted).push_back(coding);
+        }
+    }
+}
+
+bool containsCoding(const std::vector<absl::string_view>& codings, absl::string_view coding) {
+    return std::any_of(codings.begin(), codings.end(),
+                       [coding](absl::string_view value) { return absl::EqualsIgnoreCase(value, coding); });
+}
+
+std::string normalizeAcceptEncoding(const RequestHeaderMap& headers) {
+    std::vector<absl::string_view> accepted;
+    std::vector<absl::string_view> rejected;
+    parseAcceptEncoding(headers, accepted, rejected);
+    for (absl::string_view coding: CONTENT_CODINGS) {
+        if (containsCoding(accepted, coding)) {
+            return std::string(coding);
+        }
+    }
+    if (containsCoding(accepted, "*")) {
+        // Wildcard covers every coding not rejected by its name, gzip is the one origins pick for it
+        if (!containsCoding(rejected, "gzip")) {
+            return "gzip";
+        }
+        for (absl::string_view coding: CONTENT_CODINGS) {
+            if (!containsCoding(rejected, coding)) {
+                return std::string(coding);
+            }
+        }
+    }
+    return "identity";
+}
+
+} // namespace
+
+CacheKeySpec CacheKeySpec::defaultSpec() {
+    return CacheKeySpec {};
+}
+
+void CacheKeyBuilder::Hasher::add(absl::string_view part) {
+    const uint64_t length = part.size();
+    high_ = HashUtil::xxHash64(part, high_ ^ (length * LENGTH_PRIME));
+    low_ = HashUtil::xxHash64(part, low_ ^ (length * LENGTH_PRIME));
+}
+
+void CacheKeyBuilder::Hasher::addMissing() {
+    high_ = HashUtil::xxHash64({}, high_ ^ MISSING_PART);
+    low_ = HashUtil::xxHash64({}, low_ ^ MISSING_PART);
+}
+
+CacheKey CacheKeyBuilder::build(const RequestHeaderMap& headers) const {
+    Hasher hasher;
+    if (spec_.include_host_) {
+        hasher.add(headers.getHostValue());
+    }
+    absl::string_view path = headers.getPathValue();
+    absl::string_view query;
+    if (!spec_.query_parameters_.empty()) {
+        // Only the listed query parameters are part of the key, not the whole query string
+        size_t queryStart = path.find('?');
+        if (queryStart != absl::string_view::npos) {
+            query = path.substr(queryStart + 1);
+            path = path.substr(0, queryStart);
+        }
+    }
+    if (spec_.include_path_) {
+        hasher.add(path);
+    }
+    if (spec_.include_method_) {
+        hasher.add(headers.getMethodValue());
+    }
+    if (spec_.include_scheme_) {
+        hasher.add(headers.getSchemeValue());
+    }
+    for (const auto& name: spec_.headers_) {
+        const auto values = headers.get(name);
+        if (values.empty()) {
+            hasher.addMissing();
+            continue;
+        }
+        for (size_t i = 0; i < values.size(); ++i) {
+            hasher.add(values[i]->value().getStringView());
+        }
+    }
+    for (const auto& name: spec_.query_parameters_) {
+        addQueryParameter(hasher, query, name);
+    }
+    for (const auto& name: spec_.cookies_) {
+        addCookie(hasher, headers, name);
+    }
+    return hasher.key();
+}
+
+CacheKey CacheKeyBuilder::fromString(absl::string_view value) {
+    Hasher hasher;
+    hasher.add(value);
+    return hasher.key();
+}
+
+CacheKey CacheKeyBuilder::variantKey(const CacheKey& primaryKey, const std::vector<LowerCaseString>& varyHeaders,
+                                     const RequestHeaderMap& headers) {
+    Hasher hasher(primaryKey);
+    for (const auto& name: varyHeaders) {
+        if (headers.get(name).empty() && name != Http::CustomHeaders::get().AcceptEncoding) {
+            hasher.addMissing();
+            continue;
+        }
+        hasher.add(normalizeVaryValue(name, headers));
+    }
+    return hasher.key();
+}
+
+void CacheKeyBuilder::addQueryParameter(Hasher& hasher, absl::string_view query, absl::string_view name) const {
+    for (absl::string_view parameter: absl::StrSplit(query, '&')) {
+        std::pair<absl::string_view, absl::string_view> nameValue = absl::StrSplit(parameter, absl::MaxSplits('=', 1));
+        if (nameValue.first == name) {
+            hasher.add(nameValue.second);
+            return;
+        }
+    }
+    hasher.addMissing();
+}
+
+void CacheKeyBuilder::addCookie(Hasher& hasher, const RequestHeaderMap& headers, absl::string_view name) const {
+    const auto values = headers.get(Http::Headers::get().Cookie);
+    for (size_t i = 0; i < values.size(); ++i) {
+        for (absl::string_view cookie: absl::StrSplit(values[i]->value().getStringView(), ';')) {
+            std::pair<absl::string_view, absl::string_view> nameValue =
+                absl::StrSplit(absl::StripAsciiWhitespace(cookie), absl::MaxSplits('=', 1));
+            if (nameValue.first == name) {
+                hasher.add(nameValue.second);
+                return;
+            }
+        }
+    }
+    hasher.addMissing();
+}
+
+std::optional<std::vector<LowerCaseString>> parseVaryHeaders(const ResponseHeaderMap& headers) {
+    std::vector<LowerCaseString> varyHeaders;
+    const auto values = headers.get(Http::CustomHeaders::get().Vary);
+    for (size_t i = 0; i < values.size(); ++i) {
+        for (absl::string_view name: absl::StrSplit(values[i]->value().getStringView(), ',', absl::SkipWhitespace())) {
+            name = absl::StripAsciiWhitespace(name);
+            if (name == "*") {
+                return std::nullopt;
+            }
+            varyHeaders.emplace_back(name);
+        }
+    }
+    std::sort(varyHeaders.begin(), varyHeaders.end(),
+              [](const LowerCaseString& a, const LowerCaseString& b) { return a.get() < b.get(); });
+    varyHeaders.erase(std::unique(varyHeaders.begin(), varyHeaders.end()), varyHeaders.end());
+    return varyHeaders;
+}
+
+std::string normalizeVaryValue(const LowerCaseString& name, const RequestHeaderMap& headers) {
+    if (name == Http::CustomHeaders::get().AcceptEncoding) {
+        return normalizeAcceptEncoding(headers);
+    }
+    std::vector<absl::string_view> elements;
+    const auto values = headers.get(name);
+    for (size_t i = 0; i < values.size(); ++i) {
+        for (absl::string_view element: absl::StrSplit(values[i]->value().getStringView(), ',')) {
+            elements.push_back(absl::StripAsciiWhitespace(element));
+        }
+    }
+    return absl::StrJoin(elements, ",");
+}
+
+bool acceptsContentCoding(const RequestHeaderMap& headers, absl::string_view coding) {
+    std::vector<absl::string_view> accepted;
+    std::vector<absl::string_view> rejected;
+    parseAcceptEncoding(headers, accepted, rejected);
+    if (containsCoding(rejected, coding)) {
+        return false;
+    }
+    if (containsCoding(accepted, coding) || containsCoding(accepted, "*")) {
+        return true;
+    }
+    // Identity is acceptable unless it is rejected by its name or by "*;q=0" (RFC 9110 Section 12.5.3)
+    return absl::EqualsIgnoreCase(coding, "identity") && !containsCoding(rejected, "*");
+}
+
+} // namespace Envoy::Http
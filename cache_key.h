@@ -0,0 +1,97 @@
+/***********************************************************************************************************************
+ * Cache key built from configurable parts of the request, hashed into 128 bits without allocating
+ ***********************************************************************************************************************/
+
+#pragma once
+
+#include "envoy/http/header_map.h"
+#include "absl/strings/string_view.h"
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <vector>
+
+namespace Envoy::Http {
+
+/**
+ * @brief 128-bit hash of the request parts that identify a response.
+ * Used as the key of the cache and of the map of coalesced requests instead of the raw string of the parts.
+ */
+struct CacheKey {
+    uint64_t high_ {0};
+    uint64_t low_ {0};
+
+    bool operator==(const CacheKey& other) const { return high_ == other.high_ && low_ == other.low_; }
+    bool operator!=(const CacheKey& other) const { return !(*this == other); }
+};
+
+struct CacheKeyHash {
+    size_t operator()(const CacheKey& key) const { return static_cast<size_t>(key.high_); }
+};
+
+/**
+ * @brief Parts of the request included in the cache key.
+ * Headers are hashed with all their values, query parameters and cookies only by their value.
+ * If any query parameter is listed, the path is included without its query string.
+ */
+struct CacheKeySpec {
+    bool include_host_ {true};
+    bool include_path_ {true};
+    bool include_method_ {true};
+    bool include_scheme_ {true};
+    std::vector<LowerCaseString> headers_ {};
+    std::vector<std::string> query_parameters_ {};
+    std::vector<std::string> cookies_ {};
+
+    // Host, path, method and scheme; request headers that select a variant come from Vary of the response
+    static CacheKeySpec defaultSpec();
+};
+
+/**
+ * @brief Computes the cache key of a request according to the spec.
+ * Every part is fed into two chained xxHash64 states (different seeds) together with its length,
+ * so parts cannot shift into each other ("ab" + "c" != "a" + "bc") and a missing part differs from an empty one.
+ */
+class CacheKeyBuilder {
+public:
+    explicit CacheKeyBuilder(CacheKeySpec spec) : spec_(std::move(spec)) {}
+    CacheKey build(const RequestHeaderMap& headers) const;
+    // Key of an arbitrary string (tests and benchmarks)
+    static CacheKey fromString(absl::string_view value);
+    // Key of the variant of a response stored under the primary key, selected by the (normalized) values of
+    // the request headers listed in Vary
+    static CacheKey variantKey(const CacheKey& primaryKey, const std::vector<LowerCaseString>& varyHeaders,
+                               const RequestHeaderMap& headers);
+    const CacheKeySpec& spec() const { return spec_; }
+
+private:
+    class Hasher {
+    public:
+        Hasher() = default;
+        explicit Hasher(const CacheKey& seed) : high_(seed.high_), low_(seed.low_) {}
+        void add(absl::string_view part);
+        void addMissing();
+        CacheKey key() const { return CacheKey {high_, low_}; }
+
+    private:
+        uint64_t high_ {0x9E3779B97F4A7C15ULL};
+        uint64_t low_ {0xC2B2AE3D27D4EB4FULL};
+    };
+
+    void addQueryParameter(Hasher& hasher, absl::string_view query, absl::string_view name) const;
+    void addCookie(Hasher& hasher, const RequestHeaderMap& headers, absl::string_view name) const;
+
+    const CacheKeySpec spec_;
+};
+
+// Sorted, deduplicated header names listed in Vary (empty if the response does not vary),
+// nullopt for "Vary: *" (the response can never be selected by a cache)
+std::optional<std::vector<LowerCaseString>> parseVaryHeaders(const ResponseHeaderMap& headers);
+// Value of a request header as seen by the variant key: Accept-Encoding is reduced to the coding the origin
+// is expected to pick (br, zstd, gzip, deflate or identity), other headers to their trimmed, comma-joined values
+std::string normalizeVaryValue(const LowerCaseString& name, const RequestHeaderMap& headers);
+// Accept-Encoding of the request lists the coding (or "*") and does not reject it with q=0,
+// identity is accepted unless rejected
+bool acceptsContentCoding(const RequestHeaderMap& headers, absl::string_view coding);
+
+} // namespace Envoy::Http
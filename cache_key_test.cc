@@ -0,0 +1,198 @@
+/***********************************************************************************************************************
+ * Unit tests of the cache key built from the configurable parts of the request, of the Accept-Encoding
+ * normalization of variant keys and of content coding negotiation
+ ***********************************************************************************************************************/
+
+#include "cache_key.h"
+#include "test/test_common/utility.h"
+#include "gtest/gtest.h"
+
+namespace Envoy::Http {
+namespace {
+
+TestRequestHeaderMapImpl requestHeaders(const std::string& path = "/index.html") {
+    return {{":method", "GET"}, {":path", path}, {":scheme", "https"}, {":authority", "example.com"}};
+}
+
+CacheKey buildKey(const CacheKeySpec& spec, const TestRequestHeaderMapImpl& headers) {
+    return CacheKeyBuilder(spec).build(headers);
+}
+
+// The request differs from the base one only by the header, the keys differ iff the spec includes it
+void expectPartIncluded(const CacheKeySpec& spec, const std::string& name, const std::string& value, bool included) {
+    TestRequestHeaderMapImpl changed = requestHeaders();
+    changed.setCopy(LowerCaseString(name), value);
+    EXPECT_EQ(included, buildKey(spec, requestHeaders()) != buildKey(spec, changed)) << name;
+}
+
+TEST(CacheKeyTest, SameRequestSameKey) {
+    EXPECT_EQ(buildKey(CacheKeySpec {}, requestHeaders()), buildKey(CacheKeySpec {}, requestHeaders()));
+    EXPECT_NE(buildKey(CacheKeySpec {}, requestHeaders("/a")), buildKey(CacheKeySpec {}, requestHeaders("/b")));
+}
+
+TEST(CacheKeyTest, RequestPartsFollowTheSpec) {
+    const CacheKeySpec included {};
+    expectPartIncluded(included, ":authority", "example.org", true);
+    expectPartIncluded(included, ":path", "/other.html", true);
+    expectPartIncluded(included, ":method", "HEAD", true);
+    expectPartIncluded(included, ":scheme", "http", true);
+
+    CacheKeySpec withoutHost;
+    withoutHost.include_host_ = false;
+    expectPartIncluded(withoutHost, ":authority", "example.org", false);
+    expectPartIncluded(withoutHost, ":path", "/other.html", true);
+
+    CacheKeySpec withoutPath;
+    withoutPath.include_path_ = false;
+    expectPartIncluded(withoutPath, ":path", "/other.html", false);
+    expectPartIncluded(withoutPath, ":authority", "example.org", true);
+
+    CacheKeySpec withoutMethod;
+    withoutMethod.include_method_ = false;
+    expectPartIncluded(withoutMethod, ":method", "HEAD", false);
+
+    CacheKeySpec withoutScheme;
+    withoutScheme.include_scheme_ = false;
+    expectPartIncluded(withoutScheme, ":scheme", "http", false);
+}
+
+TEST(CacheKeyTest, ListedHeadersOnly) {
+    CacheKeySpec spec;
+    spec.headers_.emplace_back("accept-language");
+    expectPartIncluded(spec, "accept-language", "fr", true);
+    expectPartIncluded(spec, "user-agent", "curl", false);
+}
+
+TEST(CacheKeyTest, RepeatedHeaderValuesAreAllIncluded) {
+    CacheKeySpec spec;
+    spec.headers_.emplace_back("x-tenant");
+    TestRequestHeaderMapImpl one = requestHeaders();
+    one.addCopy(LowerCaseString("x-tenant"), "a");
+    TestRequestHeaderMapImpl two = requestHeaders();
+    two.addCopy(LowerCaseString("x-tenant"), "a");
+    two.addCopy(LowerCaseString("x-tenant"), "b");
+    EXPECT_NE(buildKey(spec, one), buildKey(spec, two));
+}
+
+TEST(CacheKeyTest, ListedQueryParametersOnly) {
+    CacheKeySpec spec;
+    spec.query_parameters_ = {"id", "page"};
+    const CacheKey key = buildKey(spec, requestHeaders("/list?id=1&page=2"));
+    // Order of the query string and unlisted parameters do not matter
+    EXPECT_EQ(key, buildKey(spec, requestHeaders("/list?page=2&utm_source=mail&id=1")));
+    EXPECT_NE(key, buildKey(spec, requestHeaders("/list?id=1&page=3")));
+    // Path without its query string stays in the key
+    EXPECT_NE(key, buildKey(spec, requestHeaders("/other?id=1&page=2")));
+}
+
+TEST(CacheKeyTest, ListedCookiesOnly) {
+    CacheKeySpec spec;
+    spec.cookies_ = {"session"};
+    TestRequestHeaderMapImpl first = requestHeaders();
+    first.addCopy(LowerCaseString("cookie"), "theme=dark; session=abc");
+    TestRequestHeaderMapImpl reordered = requestHeaders();
+    reordered.addCopy(LowerCaseString("cookie"), "session=abc; theme=light");
+    TestRequestHeaderMapImpl otherSession = requestHeaders();
+    otherSession.addCopy(LowerCaseString("cookie"), "theme=dark; session=xyz");
+    EXPECT_EQ(buildKey(spec, first), buildKey(spec, reordered));
+    EXPECT_NE(buildKey(spec, first), buildKey(spec, otherSession));
+}
+
+TEST(CacheKeyTest, MissingPartDiffersFromEmptyPart) {
+    CacheKeySpec querySpec;
+    querySpec.query_parameters_ = {"id"};
+    EXPECT_NE(buildKey(querySpec, requestHeaders("/list")), buildKey(querySpec, requestHeaders("/list?id=")));
+
+    CacheKeySpec cookieSpec;
+    cookieSpec.cookies_ = {"session"};
+    TestRequestHeaderMapImpl emptyCookie = requestHeaders();
+    emptyCookie.addCopy(LowerCaseString("cookie"), "session=");
+    EXPECT_NE(buildKey(cookieSpec, requestHeaders()), buildKey(cookieSpec, emptyCookie));
+
+    CacheKeySpec headerSpec;
+    headerSpec.headers_.emplace_back("x-tenant");
+    TestRequestHeaderMapImpl emptyHeader = requestHeaders();
+    emptyHeader.addCopy(LowerCaseString("x-tenant"), "");
+    EXPECT_NE(buildKey(headerSpec, requestHeaders()), buildKey(headerSpec, emptyHeader));
+}
+
+TEST(CacheKeyTest, PartsDoNotShiftIntoEachOther) {
+    CacheKeySpec spec;
+    spec.include_method_ = false;
+    spec.include_scheme_ = false;
+    TestRequestHeaderMapImpl first {{":authority", "ab"}, {":path", "c"}};
+    TestRequestHeaderMapImpl second {{":authority", "a"}, {":path", "bc"}};
+    EXPECT_NE(buildKey(spec, first), buildKey(spec, second));
+}
+
+std::string normalizedAcceptEncoding(const std::string& acceptEncoding) {
+    TestRequestHeaderMapImpl headers {{"accept-encoding", acceptEncoding}};
+    return normalizeVaryValue(LowerCaseString("accept-encoding"), headers);
+}
+
+bool accepts(const std::string& acceptEncoding, absl::string_view coding) {
+    TestRequestHeaderMapImpl headers {{"accept-encoding", acceptEncoding}};
+    return acceptsContentCoding(headers, coding);
+}
+
+TEST(CacheKeyTest, NormalizedAcceptEncodingPrefersOriginOrder) {
+    EXPECT_EQ("br", normalizedAcceptEncoding("gzip, br"));
+    EXPECT_EQ("gzip", normalizedAcceptEncoding("deflate, gzip"));
+    EXPECT_EQ("zstd", normalizedAcceptEncoding("gzip;q=0.5, zstd;q=0.1"));
+}
+
+TEST(CacheKeyTest, NormalizedAcceptEncodingSkipsRejectedCodings) {
+    EXPECT_EQ("gzip", normalizedAcceptEncoding("br;q=0, gzip"));
+    EXPECT_EQ("identity", normalizedAcceptEncoding("gzip;q=0.0"));
+    EXPECT_EQ("identity", normalizedAcceptEncoding("gzip;q=0, br;q=0"));
+}
+
+TEST(CacheKeyTest, NormalizedAcceptEncodingWildcard) {
+    EXPECT_EQ("gzip", normalizedAcceptEncoding("*"));
+    EXPECT_EQ("br", normalizedAcceptEncoding("*, gzip;q=0"));
+    EXPECT_EQ("identity", normalizedAcceptEncoding("*;q=0"));
+}
+
+TEST(CacheKeyTest, NormalizedAcceptEncodingIdentity) {
+    EXPECT_EQ("identity", normalizedAcceptEncoding("identity"));
+    EXPECT_EQ("identity", normalizedAcceptEncoding(""));
+    TestRequestHeaderMapImpl headers {};
+    EXPECT_EQ("identity", normalizeVaryValue(LowerCaseString("accept-encoding"), headers));
+}
+
+TEST(CacheKeyTest, AcceptsContentCodingRejectedWithZeroQuality) {
+    EXPECT_TRUE(accepts("gzip, br", "gzip"));
+    EXPECT_FALSE(accepts("gzip;q=0, br", "gzip"));
+    EXPECT_FALSE(accepts("br", "gzip"));
+}
+
+TEST(CacheKeyTest, AcceptsContentCodingWildcard) {
+    EXPECT_TRUE(accepts("*", "br"));
+    EXPECT_FALSE(accepts("*, br;q=0", "br"));
+    EXPECT_FALSE(accepts("*;q=0", "gzip"));
+}
+
+TEST(CacheKeyTest, AcceptsIdentityUnlessRejected) {
+    TestRequestHeaderMapImpl headers {};
+    EXPECT_TRUE(acceptsContentCoding(headers, "identity"));
+    EXPECT_FALSE(acceptsContentCoding(headers, "gzip"));
+    EXPECT_TRUE(accepts("br", "identity"));
+    EXPECT_FALSE(accepts("identity;q=0", "identity"));
+    EXPECT_FALSE(accepts("gzip, *;q=0", "identity"));
+    EXPECT_TRUE(accepts("identity, *;q=0", "identity"));
+}
+
+TEST(CacheKeyTest, VariantKeyFollowsNormalizedAcceptEncoding) {
+    const CacheKey primaryKey = CacheKeyBuilder::fromString("host/path");
+    const std::vector<LowerCaseString> varyHeaders {LowerCaseString("accept-encoding")};
+    TestRequestHeaderMapImpl brFirst {{"accept-encoding", "br, gzip"}};
+    TestRequestHeaderMapImpl brOnly {{"accept-encoding", "br"}};
+    TestRequestHeaderMapImpl gzipOnly {{"accept-encoding", "gzip"}};
+    EXPECT_EQ(CacheKeyBuilder::variantKey(primaryKey, varyHeaders, brFirst),
+              CacheKeyBuilder::variantKey(primaryKey, varyHeaders, brOnly));
+    EXPECT_NE(CacheKeyBuilder::variantKey(primaryKey, varyHeaders, brOnly),
+              CacheKeyBuilder::variantKey(primaryKey, varyHeaders, gzipOnly));
+}
+
+} // namespace
+} // namespace Envoy::Http
@@ -0,0 +1,229 @@
+#include "cache_refresher.h"
+#include "source/common/http/utility.h"
+#include "absl/strings/numbers.h"
+
+namespace Envoy::Http {
+
+CacheRefresher::CacheRefresher(const CacheKey& primaryKey, const CacheKey& key,
+                               ResponseForCoalescedRequestsSharedPtr groupPtr, CacheEntrySharedPtr storedEntry,
+                               HttpCacheRCConfigSharedPtr config, Event::Dispatcher& dispatcher)
+    : primary_key_(primaryKey), key_(key), stored_key_(key), group_ptr_(std::move(groupPtr)), stored_entry_(std::move(storedEntry)), config_(std::move(config)),
+      dispatcher_(dispatcher) {}
+
+void CacheRefresher::start(Upstream::ClusterManager& clusterManager, const std::string& clusterName,
+                           std::chrono::milliseconds timeout, const RequestHeaderMap& requestHeaders) {
+    Upstream::ThreadLocalCluster* cluster = clusterManager.getThreadLocalCluster(clusterName);
+    if (cluster == nullptr) {
+        ENVOY_LOG(debug, "[CacheRefresher::start] Unknown cluster '{}'; refresh skipped", clusterName);
+        releaseRCGroup();
+        return;
+    }
+    request_headers_ = createHeaderMap<RequestHeaderMapImpl>(requestHeaders);
+    // Conditions of the client are not ours, the response (200 or 304) must be valid for the stored entry
+    request_headers_->remove(Http::CustomHeaders::get().IfNoneMatch);
+    request_headers_->remove(Http::CustomHeaders::get().IfModifiedSince);
+    // Whole response is cached, never a part of it
+    request_headers_->remove(rangeHeader());
+    request_headers_->remove(ifRangeHeader());
+    addValidators();
+    fill_epoch_ = HttpCacheRCFilter::purge_index_.epoch();
+    self_ = shared_from_this();
+    // Router answers a timed out refresh with 504, the stale entry is kept and the parked requests are released
+    stream_ = cluster->httpAsyncClient().start(
+        *this, AsyncClient::StreamOptions().setTimeout(timeout.count() > 0 ? timeout : DEFAULT_REFRESH_TIMEOUT));
+    if (stream_ == nullptr) {
+        ENVOY_LOG(debug, "[CacheRefresher::start] Async stream could not be started; refresh skipped");
+        releaseRCGroup();
+        finish();
+        return;
+    }
+    ENVOY_LOG(debug, "[CacheRefresher::start] Refreshing stale response from cluster '{}'", clusterName);
+    stream_->sendHeaders(*request_headers_, true);
+}
+
+void CacheRefresher::addValidators() {
+    if (stored_entry_ == nullptr || stored_entry_->isAborted()) {
+        return;
+    }
+    HeadersTemplateSharedPtr storedHeaders = stored_entry_->headersTemplate();
+    if (storedHeaders == nullptr) {
+        return;
+    }
+    const auto etag = storedHeaders->get(Http::CustomHeaders::get().Etag);
+    if (!etag.empty()) {
+        request_headers_->setCopy(Http::CustomHeaders::get().IfNoneMatch, etag[0]->value().getStringView());
+        conditional_ = true;
+    }
+    const auto lastModified = storedHeaders->get(Http::CustomHeaders::get().LastModified);
+    if (!lastModified.empty()) {
+        request_headers_->setCopy(Http::CustomHeaders::get().IfModifiedSince, lastModified[0]->value().getStringView());
+        conditional_ = true;
+    }
+}
+
+void CacheRefresher::onHeaders(ResponseHeaderMapPtr&& headers, bool end_stream) {
+    if (conditional_ && Http::Utility::getResponseStatus(*headers) == enumToInt(Code::NotModified)) {
+        if (revalidateStoredEntry(*headers)) {
+            return;
+        }
+        HttpCacheRCFilter::cache_.remove(key_, stored_entry_);
+        HttpCacheRCFilter::abandonRCGroup(key_, group_ptr_);
+        return;
+    }
+    uint64_t statusCode = 0;
+    bool successful = absl::SimpleAtoi(headers->getStatusValue(), &statusCode) && statusCode >= 200 && statusCode < 300;
+    const SystemTime now = dispatcher_.timeSource().systemTime();
+    Freshness freshness;
+    if (successful) {
+        freshness = computeFreshness(*headers, now, config_->freshness_options());
+    }
+    else if (stored_entry_ == nullptr || !stored_entry_->isStaleServable(now)) {
+        // Nothing stale left to serve: the error is cached (negative caching) like on a regular miss, otherwise
+        // the released requests would all query the failing origin
+        freshness = computeErrorFreshness(*headers, statusCode, now, config_->freshness_options());
+        error_cached_ = freshness.cacheable_;
+    }
+    else {
+        freshness.cacheable_ = false;
+    }
+    std::optional<std::vector<LowerCaseString>> varyHeaders = parseVaryHeaders(*headers);
+    uint64_t contentLength = 0;
+    const bool oversized = absl::SimpleAtoi(headers->getContentLengthValue(), &contentLength) &&
+                           config_->exceedsMaxObjectBytes(contentLength);
+    if (oversized) {
+        config_->stats().oversized_.inc();
+    }
+    if (!freshness.cacheable_ || !varyHeaders.has_value() || oversized) {
+        // Stale entry keeps being served, requests parked in the group query the origin on their own
+        ENVOY_LOG(debug, "[CacheRefresher::onHeaders] Response status code: '{}', cacheable: {} -> stale entry kept",
+                  headers->getStatusValue(), freshness.cacheable_ && varyHeaders.has_value() && !oversized);
+        HttpCacheRCFilter::abandonRCGroup(key_, group_ptr_);
+        return;
+    }
+    caching_ = true;
+    cache_entry_producer_.initCacheEntry(config_->ring_buffer_capacity(), config_->body_storage(),
+                                         config_->segment_size(), dispatcher_.timeSource());
+    cache_entry_producer_.getCacheEntryPtr()->setFreshness(freshness);
+    if (!end_stream) {
+        cache_entry_producer_.setCompressor(config_->createCompressor(*headers));
+    }
+    // Requests parked in the group read the refreshed response while it is being written, the stale entry stays
+    // in the cache until the body is complete (onComplete()), so a reset refresh leaves the key cached
+    stored_key_ = HttpCacheRCFilter::tagVariant(primary_key_, *request_headers_, *headers, *varyHeaders,
+                                                cache_entry_producer_.getCacheEntryPtr());
+    vary_headers_ = std::move(*varyHeaders);
+    HttpCacheRCFilter::publishResponseToRCGroup(group_ptr_, cache_entry_producer_.getCacheEntryPtr());
+    cache_entry_producer_.writeHeaders(*headers, end_stream);
+    response_headers_ = std::move(headers);
+}
+
+bool CacheRefresher::revalidateStoredEntry(const ResponseHeaderMap& notModifiedHeaders) {
+    if (stored_entry_->isEvicted()) {
+        // Purged (or evicted) meanwhile, a 304 must not bring it back
+        ENVOY_LOG(debug, "[CacheRefresher::revalidateStoredEntry] Stored response left the cache");
+        return false;
+    }
+    HeadersTemplateSharedPtr mergedHeaders = stored_entry_->mergeNotModifiedHeaders(notModifiedHeaders);
+    const SystemTime now = dispatcher_.timeSource().systemTime();
+    Freshness freshness = computeFreshness(*mergedHeaders, now, config_->freshness_options());
+    if (!freshness.cacheable_) {
+        ENVOY_LOG(debug, "[CacheRefresher::revalidateStoredEntry] Stored response is not cacheable anymore");
+        return false;
+    }
+    ENVOY_LOG(debug, "[CacheRefresher::revalidateStoredEntry] 304 Not Modified; stored response revalidated in place");
+    stored_entry_->revalidate(std::move(mergedHeaders), freshness, now);
+    // Requests that waited for the revalidation are served from the stored entry
+    HttpCacheRCFilter::publishResponseToRCGroup(group_ptr_, stored_entry_);
+    HttpCacheRCFilter::detachRCGroup(key_, group_ptr_);
+    complete_ = true;
+    return true;
+}
+
+void CacheRefresher::onData(Buffer::Instance& data, bool end_stream) {
+    if (!caching_) {
+        return;
+    }
+    if (is_first_data_) {
+        cache_entry_producer_.headersWriteComplete();
+        is_first_data_ = false;
+    }
+    body_bytes_ += data.length();
+    if (!oversized_ && config_->exceedsMaxObjectBytes(body_bytes_)) {
+        // Refreshed response is not cached, requests already reading it get the rest of it
+        ENVOY_LOG(debug, "[CacheRefresher::onData] Body over max_object_bytes; streaming it without caching");
+        config_->stats().oversized_.inc();
+        oversized_ = true;
+        HttpCacheRCFilter::detachRCGroup(key_, group_ptr_);
+        cache_entry_producer_.startStreaming();
+    }
+    cache_entry_producer_.writeData(data, end_stream);
+}
+
+void CacheRefresher::onTrailers(ResponseTrailerMapPtr&& trailers) {
+    if (!caching_) {
+        return;
+    }
+    if (is_first_data_) {
+        cache_entry_producer_.headersWriteComplete();
+        is_first_data_ = false;
+    }
+    if (is_first_trailers_) {
+        cache_entry_producer_.dataWriteComplete();
+        is_first_trailers_ = false;
+    }
+    cache_entry_producer_.writeTrailers(*trailers);
+}
+
+void CacheRefresher::onComplete() {
+    complete_ = true;
+    if (caching_) {
+        cache_entry_producer_.writeComplete();
+        if (!oversized_) {
+            // Replaces the stale entry
+            HttpCacheRCFilter::insertResponse(primary_key_, stored_key_, *request_headers_, *response_headers_,
+                                              std::move(vary_headers_), cache_entry_producer_.getCacheEntryPtr(),
+                                              fill_epoch_, config_->stats());
+            if (error_cached_ && !cache_entry_producer_.getCacheEntryPtr()->isEvicted()) {
+                config_->stats().errors_cached_.inc();
+            }
+        }
+        HttpCacheRCFilter::detachRCGroup(key_, group_ptr_);
+    }
+    finish();
+}
+
+void CacheRefresher::onReset() {
+    ENVOY_LOG(debug, "[CacheRefresher::onReset] Refresh stream reset");
+    if (caching_ && !complete_) {
+        // Refreshed response was never inserted, the stale entry keeps being served
+        cache_entry_producer_.abort();
+    }
+    if (!complete_) {
+        releaseRCGroup();
+    }
+    finish();
+}
+
+void CacheRefresher::releaseRCGroup() {
+    const SystemTime now = dispatcher_.timeSource().systemTime();
+    if (stored_entry_ != nullptr && !stored_entry_->isAborted() && !stored_entry_->isEvicted() &&
+        stored_entry_->isStaleServable(now)) {
+        // Requests coalesced into the failed refresh are served the stored response, like a stale hit
+        HttpCacheRCFilter::publishResponseToRCGroup(group_ptr_, stored_entry_);
+        HttpCacheRCFilter::detachRCGroup(key_, group_ptr_);
+        return;
+    }
+    HttpCacheRCFilter::abandonRCGroup(key_, group_ptr_);
+}
+
+void CacheRefresher::finish() {
+    if (finished_) {
+        return;
+    }
+    finished_ = true;
+    stream_ = nullptr;
+    // Callbacks of the stream are still on the stack, release this object on the next dispatcher iteration
+    dispatcher_.post([self = std::move(self_)]() {});
+}
+
+} // namespace Envoy::Http
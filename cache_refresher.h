@@ -0,0 +1,81 @@
+#pragma once
+
+#include "envoy/http/async_client.h"
+#include "envoy/upstream/cluster_manager.h"
+#include "http_cache_rc_filter.h"
+
+namespace Envoy::Http {
+
+// Timeout of a refresh whose route has no timeout (Envoy default of a route)
+constexpr std::chrono::milliseconds DEFAULT_REFRESH_TIMEOUT {15000};
+
+class CacheRefresher;
+using CacheRefresherSharedPtr = std::shared_ptr<CacheRefresher>;
+
+/**
+ * @brief Background fetch of a stale cache entry (stale-while-revalidate) or of an expired entry that is revalidated.
+ * If the stored response has ETag/Last-Modified, the fetch is conditional and a 304 only refreshes the headers and
+ * freshness of the stored entry in place (no body is transferred or copied again).
+ * Leads the RC group of the key like a regular leader, so there is at most one refresh per key and requests that
+ * miss meanwhile are coalesced into it. A successful response replaces the stale entry in the cache once its body is
+ * complete, otherwise (error, reset) the stale entry stays until its stale window ends; requests coalesced into a
+ * reset refresh are served the stale entry while it is servable. An error response replaces an entry past its stale
+ * window if its status is negatively cached.
+ * Runs on the worker thread of the request that found the stale entry and keeps itself alive until the stream ends.
+ */
+class CacheRefresher : public AsyncClient::StreamCallbacks,
+                       public Logger::Loggable<Logger::Id::filter>,
+                       public std::enable_shared_from_this<CacheRefresher> {
+public:
+    CacheRefresher(const CacheKey& primaryKey, const CacheKey& key, ResponseForCoalescedRequestsSharedPtr groupPtr,
+                   CacheEntrySharedPtr storedEntry, HttpCacheRCConfigSharedPtr config, Event::Dispatcher& dispatcher);
+    // Timeout of the route (0 == none, DEFAULT_REFRESH_TIMEOUT is used), a hung origin must not hold the group
+    void start(Upstream::ClusterManager& clusterManager, const std::string& clusterName,
+               std::chrono::milliseconds timeout, const RequestHeaderMap& requestHeaders);
+
+    // AsyncClient::StreamCallbacks
+    void onHeaders(ResponseHeaderMapPtr&& headers, bool end_stream) override;
+    void onData(Buffer::Instance& data, bool end_stream) override;
+    void onTrailers(ResponseTrailerMapPtr&& trailers) override;
+    void onComplete() override;
+    void onReset() override;
+    void onBeforeFinalizeUpstreamSpan(Tracing::Span&, const ResponseHeaderMap*) override {}
+
+private:
+    void addValidators();
+    // Returns true if the 304 revalidated the stored entry
+    bool revalidateStoredEntry(const ResponseHeaderMap& notModifiedHeaders);
+    // Refresh failed: the RC group gets the stored entry while it is servable, otherwise its requests go to the origin
+    void releaseRCGroup();
+    void finish();
+
+    const CacheKey primary_key_;
+    // Key of the stale entry and of the RC group
+    const CacheKey key_;
+    // Key the refreshed response is stored under (variant key if the response varies)
+    CacheKey stored_key_ {};
+    // Refreshed response, inserted into the cache once its body is complete
+    ResponseHeaderMapPtr response_headers_ {};
+    std::vector<LowerCaseString> vary_headers_ {};
+    ResponseForCoalescedRequestsSharedPtr group_ptr_ {};
+    // Entry being refreshed, revalidated in place on 304
+    CacheEntrySharedPtr stored_entry_ {};
+    const HttpCacheRCConfigSharedPtr config_ {};
+    Event::Dispatcher& dispatcher_;
+    // Must outlive the stream
+    RequestHeaderMapPtr request_headers_ {};
+    AsyncClient::Stream* stream_ {};
+    CacheEntryProducer cache_entry_producer_ {};
+    // Purge epoch when the refresh started
+    uint64_t fill_epoch_ {0};
+    // Body bytes received (max_object_bytes)
+    uint64_t body_bytes_ {0};
+    bool caching_ {false}, conditional_ {false}, is_first_data_ {true}, is_first_trailers_ {true}, complete_ {false},
+         finished_ {false}, oversized_ {false},
+         // Error response cached in place of an entry past its stale window (negative caching)
+         error_cached_ {false};
+    // Set while the stream is open
+    CacheRefresherSharedPtr self_ {};
+};
+
+} // namespace Envoy::Http
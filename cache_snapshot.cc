@@ -0,0 +1,411 @@
+#include "cache_snapshot.h"
+
+#include "source/common/common/hash.h"
+#include "source/common/common/utility.h"
+#include "absl/strings/str_cat.h"
+#include <algorithm>
+#include <cstdio>
+#include <fcntl.h>
+#include <fstream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <tuple>
+#include <unistd.h>
+
+namespace Envoy::Http {
+
+namespace {
+
+constexpr uint64_t SNAPSHOT_MAGIC = 0x50414e5343524348; // "HCRCSNAP"
+constexpr size_t RECORD_ALIGNMENT = 8;
+
+} // namespace
+
+CacheSnapshot::~CacheSnapshot() {
+    stop();
+    if (mapping_ != nullptr) {
+        ::munmap(const_cast<uint8_t*>(mapping_), mapping_bytes_);
+    }
+}
+
+bool CacheSnapshot::load(const std::string& path, Api::Api& api) {
+    std::lock_guard lockGuard(mtx_);
+    if (isLoaded()) {
+        return true;
+    }
+    const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        ENVOY_LOG(info, "[CacheSnapshot::load] No snapshot at '{}': {}", path, errorDetails(errno));
+        return false;
+    }
+    struct stat fileStat {};
+    if (::fstat(fd, &fileStat) != 0 || static_cast<uint64_t>(fileStat.st_size) < sizeof(FileHeader)) {
+        ENVOY_LOG(warn, "[CacheSnapshot::load] Snapshot '{}' is truncated; ignored", path);
+        ::close(fd);
+        return false;
+    }
+    const auto fileBytes = static_cast<size_t>(fileStat.st_size);
+    void* mapping = ::mmap(nullptr, fileBytes, PROT_READ, MAP_PRIVATE, fd, 0);
+    // The mapping keeps the file open
+    ::close(fd);
+    if (mapping == MAP_FAILED) {
+        ENVOY_LOG(warn, "[CacheSnapshot::load] Cannot map snapshot '{}': {}", path, errorDetails(errno));
+        return false;
+    }
+    FileHeader header;
+    memcpy(&header, mapping, sizeof(header));
+    if (header.magic_ != SNAPSHOT_MAGIC || header.version_ != SNAPSHOT_FORMAT_VERSION ||
+        header.checksum_ != fileHeaderChecksum(header) || header.index_offset_ < sizeof(FileHeader) ||
+        header.index_offset_ % RECORD_ALIGNMENT != 0 || header.index_offset_ > fileBytes ||
+        header.markers_end_ < sizeof(FileHeader) || header.markers_end_ > header.index_offset_ ||
+        header.record_count_ > (fileBytes - header.index_offset_) / sizeof(IndexRecord)) {
+        ENVOY_LOG(warn, "[CacheSnapshot::load] Snapshot '{}' is damaged or of another format version; ignored", path);
+        ::munmap(mapping, fileBytes);
+        return false;
+    }
+    // Records are restored in the order of requests, read-ahead of neighbouring pages would be wasted. Workers
+    // search the index and take Vary markers, those pages are read ahead without waiting for them
+    auto* bytes = static_cast<uint8_t*>(mapping);
+    ::madvise(mapping, fileBytes, MADV_RANDOM);
+    ::madvise(mapping, header.markers_end_, MADV_WILLNEED);
+    const size_t indexPage = header.index_offset_ - header.index_offset_ % static_cast<size_t>(::sysconf(_SC_PAGESIZE));
+    ::madvise(bytes + indexPage, fileBytes - indexPage, MADV_WILLNEED);
+    mapping_ = bytes;
+    mapping_bytes_ = fileBytes;
+    index_ = reinterpret_cast<const IndexRecord*>(mapping_ + header.index_offset_);
+    record_count_ = header.record_count_;
+    markers_end_ = header.markers_end_;
+    time_source_ = &api.timeSource();
+    Thread::Options threadOptions;
+    threadOptions.name_ = "cache_rc_restore";
+    restore_thread_ = api.threadFactory().createThread([this]() { restoreLoop(); }, threadOptions);
+    loaded_.store(true, std::memory_order_release);
+    ENVOY_LOG(info, "[CacheSnapshot::load] Mapped snapshot '{}': {} records, {} bytes", path, record_count_, fileBytes);
+    return true;
+}
+
+CacheEntrySharedPtr CacheSnapshot::takeVaryMarker(const CacheKey& key, SystemTime now) {
+    if (!isLoaded()) {
+        return nullptr;
+    }
+    const IndexRecord* indexRecord = find(key);
+    if (indexRecord == nullptr || indexRecord->offset_ >= markers_end_ ||
+        now.time_since_epoch().count() >= indexRecord->stale_until_ || !claim(key)) {
+        return nullptr;
+    }
+    RecordHeader header;
+    ResponseHeaderMapPtr headers = parseRecord(*indexRecord, header);
+    if (headers == nullptr || header.vary_marker_ == 0) {
+        ENVOY_LOG(warn, "[CacheSnapshot::takeVaryMarker] Record at offset {} is damaged; not restored", indexRecord->offset_);
+        return nullptr;
+    }
+    std::vector<LowerCaseString> varyHeaders;
+    headers->iterate([&varyHeaders](const HeaderEntry& entry) -> HeaderMap::Iterate {
+        varyHeaders.emplace_back(entry.key().getStringView());
+        return HeaderMap::Iterate::Continue;
+    });
+    return CacheEntry::createVaryMarker(std::move(varyHeaders));
+}
+
+bool CacheSnapshot::contains(const CacheKey& key, SystemTime now) {
+    if (!isLoaded()) {
+        return false;
+    }
+    const IndexRecord* indexRecord = find(key);
+    if (indexRecord == nullptr || indexRecord->offset_ < markers_end_ ||
+        now.time_since_epoch().count() >= indexRecord->stale_until_) {
+        return false;
+    }
+    std::lock_guard lockGuard(mtx_);
+    return taken_.count(key) == 0;
+}
+
+void CacheSnapshot::restore(const CacheKey& key, const DiskEntryOptions& entryOptions, Event::Dispatcher& dispatcher,
+                            DiskReadCallback callback) {
+    {
+        std::lock_guard lockGuard(queue_mtx_);
+        if (!shutdown_) {
+            restores_.push_back({key, entryOptions, &dispatcher, std::move(callback)});
+            queue_cv_.notify_one();
+            return;
+        }
+    }
+    dispatcher.post([callback = std::move(callback)]() { callback(nullptr); });
+}
+
+void CacheSnapshot::remove(const CacheKey& key) {
+    if (!isLoaded() || find(key) == nullptr) {
+        return;
+    }
+    std::lock_guard lockGuard(mtx_);
+    taken_.insert(key);
+}
+
+void CacheSnapshot::stop() {
+    std::deque<PendingRestore> restores;
+    {
+        std::lock_guard lockGuard(queue_mtx_);
+        if (shutdown_) {
+            return;
+        }
+        shutdown_ = true;
+        restores.swap(restores_);
+    }
+    queue_cv_.notify_all();
+    if (restore_thread_ != nullptr) {
+        restore_thread_->join();
+    }
+    // Requests still waiting for a restore go to the origin
+    for (auto& restore: restores) {
+        restore.dispatcher_->post([callback = std::move(restore.callback_)]() { callback(nullptr); });
+    }
+}
+
+void CacheSnapshot::restoreLoop() {
+    while (true) {
+        std::unique_lock uniqueLock(queue_mtx_);
+        queue_cv_.wait(uniqueLock, [this]() { return shutdown_ || !restores_.empty(); });
+        if (shutdown_) {
+            return;
+        }
+        PendingRestore restore = std::move(restores_.front());
+        restores_.pop_front();
+        uniqueLock.unlock();
+        serveRestore(restore);
+    }
+}
+
+void CacheSnapshot::serveRestore(const PendingRestore& restore) {
+    auto postResult = [&restore](CacheEntrySharedPtr entry) {
+        restore.dispatcher_->post([callback = restore.callback_, entry = std::move(entry)]() { callback(entry); });
+    };
+    const IndexRecord* indexRecord = find(restore.key_);
+    if (indexRecord == nullptr || indexRecord->offset_ < markers_end_ || !claim(restore.key_)) {
+        // Restored or superseded since the request checked the index
+        postResult(nullptr);
+        return;
+    }
+    RecordHeader header;
+    ResponseHeaderMapPtr headers = parseRecord(*indexRecord, header);
+    if (headers == nullptr || header.vary_marker_ != 0) {
+        ENVOY_LOG(warn, "[CacheSnapshot::serveRestore] Record at offset {} is damaged; not restored", indexRecord->offset_);
+        postResult(nullptr);
+        return;
+    }
+
+    CacheEntryProducer producer;
+    producer.initCacheEntry(restore.entry_options_.ring_buffer_capacity_, restore.entry_options_.body_storage_,
+                            restore.entry_options_.segment_size_, *time_source_);
+    CacheEntrySharedPtr entry = producer.getCacheEntryPtr();
+    Freshness freshness;
+    freshness.fresh_until_ = SystemTime(SystemTime::duration(header.fresh_until_));
+    freshness.stale_until_ = SystemTime(SystemTime::duration(header.stale_until_));
+    entry->setFreshness(freshness);
+    if (header.compressed_at_rest_ != 0) {
+        entry->markCompressedAtRest();
+    }
+    producer.writeHeaders(*headers, header.headers_end_stream_ != 0, SystemTime(SystemTime::duration(header.response_time_)));
+    // The worker serves the entry while the body is streamed into it
+    postResult(entry);
+    if (header.headers_end_stream_ == 0) {
+        producer.headersWriteComplete();
+        const absl::string_view body = recordBytes(*indexRecord).substr(sizeof(RecordHeader) + header.headers_bytes_);
+        size_t offset = 0;
+        uint64_t checksum = 0;
+        do {
+            const size_t size = std::min<size_t>(body.size() - offset, DISK_IO_CHUNK_BYTES);
+            checksum = HashUtil::xxHash64(body.substr(offset, size), checksum);
+            offset += size;
+            // Verified before the last chunk is written, a damaged body never completes
+            if (offset == body.size() && checksum != header.body_checksum_) {
+                ENVOY_LOG(warn, "[CacheSnapshot::serveRestore] Body of the record at offset {} is damaged; entry aborted",
+                          indexRecord->offset_);
+                producer.abort();
+                return;
+            }
+            Buffer::OwnedImpl data(body.data() + offset - size, size);
+            producer.writeData(data, offset == body.size());
+        } while (offset < body.size());
+    }
+    producer.writeComplete();
+}
+
+uint64_t CacheSnapshot::write(const std::string& path,
+                              const std::vector<std::pair<CacheKey, CacheEntrySharedPtr>>& entries, SystemTime now) {
+    // Written aside and renamed, a crash while writing never leaves a partial snapshot behind
+    const std::string tmpPath = absl::StrCat(path, ".tmp");
+    std::ofstream file(tmpPath, std::ios::binary | std::ios::trunc);
+    if (!file) {
+        ENVOY_LOG(error, "[CacheSnapshot::write] Cannot open '{}'", tmpPath);
+        return 0;
+    }
+    // Copied, so workers taking and removing records never wait for the disk
+    std::unordered_set<CacheKey, CacheKeyHash> taken;
+    if (isLoaded()) {
+        std::lock_guard lockGuard(mtx_);
+        taken = taken_;
+    }
+    const FileHeader placeholder;
+    file.write(reinterpret_cast<const char*>(&placeholder), sizeof(placeholder));
+    uint64_t offset = sizeof(FileHeader);
+    std::vector<IndexRecord> index;
+    index.reserve(entries.size());
+    auto appendRecord = [&file, &offset, &index](const CacheKey& key, absl::string_view record, SystemTime::rep staleUntil) {
+        static const char padding[RECORD_ALIGNMENT] {};
+        file.write(record.data(), record.size());
+        const size_t paddingBytes = (RECORD_ALIGNMENT - record.size() % RECORD_ALIGNMENT) % RECORD_ALIGNMENT;
+        file.write(padding, paddingBytes);
+        index.push_back({key.high_, key.low_, offset, record.size(), staleUntil});
+        offset += record.size() + paddingBytes;
+    };
+
+    // Vary markers first (read ahead by the next process), then the responses
+    std::unordered_set<CacheKey, CacheKeyHash> writtenKeys;
+    std::string record;
+    uint64_t markersEnd = 0;
+    for (bool markers: {true, false}) {
+        for (const auto& [key, entry]: entries) {
+            record.clear();
+            if (entry->isVaryMarker() != markers || !entry->isStaleServable(now) || !serializeEntry(entry, record)) {
+                continue;
+            }
+            writtenKeys.insert(key);
+            appendRecord(key, record, entry->freshness().stale_until_.time_since_epoch().count());
+        }
+        // Records of the previous snapshot that were never requested are carried over as they are
+        for (uint64_t i = 0; isLoaded() && i < record_count_; ++i) {
+            const IndexRecord& indexRecord = index_[i];
+            const CacheKey key {indexRecord.key_high_, indexRecord.key_low_};
+            const absl::string_view previousRecord = recordBytes(indexRecord);
+            if ((indexRecord.offset_ < markers_end_) == markers && now.time_since_epoch().count() < indexRecord.stale_until_ &&
+                !previousRecord.empty() && taken.count(key) == 0 && writtenKeys.count(key) == 0) {
+                appendRecord(key, previousRecord, indexRecord.stale_until_);
+            }
+        }
+        if (markers) {
+            markersEnd = offset;
+        }
+    }
+
+    std::sort(index.begin(), index.end(), [](const IndexRecord& left, const IndexRecord& right) {
+        return std::tie(left.key_high_, left.key_low_) < std::tie(right.key_high_, right.key_low_);
+    });
+    file.write(reinterpret_cast<const char*>(index.data()), index.size() * sizeof(IndexRecord));
+    const FileHeader header = createFileHeader(index.size(), offset, markersEnd, now);
+    file.seekp(0);
+    file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    file.close();
+    if (!file || std::rename(tmpPath.c_str(), path.c_str()) != 0) {
+        ENVOY_LOG(error, "[CacheSnapshot::write] Writing snapshot '{}' failed: {}", path, errorDetails(errno));
+        std::remove(tmpPath.c_str());
+        return 0;
+    }
+    ENVOY_LOG(info, "[CacheSnapshot::write] Wrote snapshot '{}': {} records, {} bytes", path, index.size(),
+              offset + index.size() * sizeof(IndexRecord));
+    return index.size();
+}
+
+const CacheSnapshot::IndexRecord* CacheSnapshot::find(const CacheKey& key) const {
+    const IndexRecord* end = index_ + record_count_;
+    const IndexRecord* itRecord =
+        std::lower_bound(index_, end, key, [](const IndexRecord& record, const CacheKey& searchedKey) {
+            return std::tie(record.key_high_, record.key_low_) < std::tie(searchedKey.high_, searchedKey.low_);
+        });
+    return itRecord != end && itRecord->key_high_ == key.high_ && itRecord->key_low_ == key.low_ ? itRecord : nullptr;
+}
+
+absl::string_view CacheSnapshot::recordBytes(const IndexRecord& indexRecord) const {
+    // Index records are not validated on load, one pointing outside the records is treated as missing
+    const auto indexOffset = static_cast<uint64_t>(reinterpret_cast<const uint8_t*>(index_) - mapping_);
+    if (indexRecord.offset_ < sizeof(FileHeader) || indexRecord.offset_ > indexOffset ||
+        indexRecord.record_bytes_ > indexOffset - indexRecord.offset_) {
+        return {};
+    }
+    return {reinterpret_cast<const char*>(mapping_ + indexRecord.offset_), indexRecord.record_bytes_};
+}
+
+ResponseHeaderMapPtr CacheSnapshot::parseRecord(const IndexRecord& indexRecord, RecordHeader& header) const {
+    const absl::string_view record = recordBytes(indexRecord);
+    if (record.size() < sizeof(RecordHeader)) {
+        return nullptr;
+    }
+    memcpy(&header, record.data(), sizeof(header));
+    if (sizeof(RecordHeader) + header.headers_bytes_ + header.body_bytes_ != record.size()) {
+        return nullptr;
+    }
+    const absl::string_view prefix = record.substr(0, sizeof(RecordHeader) + header.headers_bytes_);
+    if (headersChecksum(prefix) != header.headers_checksum_) {
+        return nullptr;
+    }
+    return DiskCache::parseHeaders(prefix.substr(sizeof(RecordHeader)));
+}
+
+bool CacheSnapshot::claim(const CacheKey& key) {
+    std::lock_guard lockGuard(mtx_);
+    return taken_.insert(key).second;
+}
+
+bool CacheSnapshot::serializeEntry(const CacheEntrySharedPtr& entry, std::string& record) {
+    RecordHeader header;
+    record.assign(sizeof(RecordHeader), '\0');
+    if (entry->isVaryMarker()) {
+        header.vary_marker_ = 1;
+        ResponseHeaderMapPtr varyHeaders = ResponseHeaderMapImpl::create();
+        for (const auto& name: entry->varyHeaders()) {
+            varyHeaders->addCopy(name, "");
+        }
+        DiskCache::serializeHeaders(*varyHeaders, record);
+        header.headers_bytes_ = static_cast<uint32_t>(record.size() - sizeof(RecordHeader));
+    }
+    else {
+        if (!entry->isComplete() || entry->hasTrailers()) {
+            return false;
+        }
+        DiskCache::serializeHeaders(*entry->headersTemplate(), record);
+        header.headers_bytes_ = static_cast<uint32_t>(record.size() - sizeof(RecordHeader));
+        entry->copyBody(record);
+        header.body_bytes_ = record.size() - sizeof(RecordHeader) - header.headers_bytes_;
+        header.body_checksum_ =
+            DiskCache::bodyChecksum(absl::string_view(record).substr(sizeof(RecordHeader) + header.headers_bytes_));
+        header.response_time_ = entry->responseTime().time_since_epoch().count();
+        header.headers_end_stream_ = entry->headersEndStream() ? 1 : 0;
+        header.compressed_at_rest_ = entry->isCompressedAtRest() ? 1 : 0;
+    }
+    const Freshness freshness = entry->freshness();
+    header.fresh_until_ = freshness.fresh_until_.time_since_epoch().count();
+    header.stale_until_ = freshness.stale_until_.time_since_epoch().count();
+    memcpy(record.data(), &header, sizeof(header));
+    header.headers_checksum_ =
+        headersChecksum(absl::string_view(record).substr(0, sizeof(RecordHeader) + header.headers_bytes_));
+    memcpy(record.data(), &header, sizeof(header));
+    return true;
+}
+
+uint64_t CacheSnapshot::headersChecksum(absl::string_view recordPrefix) {
+    RecordHeader header;
+    memcpy(&header, recordPrefix.data(), sizeof(header));
+    header.headers_checksum_ = 0;
+    header.body_checksum_ = 0;
+    const uint64_t headerChecksum =
+        HashUtil::xxHash64(absl::string_view(reinterpret_cast<const char*>(&header), sizeof(header)));
+    return HashUtil::xxHash64(recordPrefix.substr(sizeof(RecordHeader)), headerChecksum);
+}
+
+CacheSnapshot::FileHeader CacheSnapshot::createFileHeader(uint64_t recordCount, uint64_t indexOffset,
+                                                          uint64_t markersEnd, SystemTime now) {
+    FileHeader header;
+    header.magic_ = SNAPSHOT_MAGIC;
+    header.version_ = SNAPSHOT_FORMAT_VERSION;
+    header.record_count_ = recordCount;
+    header.index_offset_ = indexOffset;
+    header.markers_end_ = markersEnd;
+    header.created_at_ = now.time_since_epoch().count();
+    header.checksum_ = fileHeaderChecksum(header);
+    return header;
+}
+
+uint64_t CacheSnapshot::fileHeaderChecksum(const FileHeader& header) {
+    return HashUtil::xxHash64(absl::string_view(reinterpret_cast<const char*>(&header), offsetof(FileHeader, checksum_)));
+}
+
+} // namespace Envoy::Http
@@ -0,0 +1,139 @@
+/***********************************************************************************************************************
+ * Snapshot of the RAM cache for warm restarts: written on shutdown, mapped by the next process on start
+ ***********************************************************************************************************************/
+
+#pragma once
+
+#include "envoy/api/api.h"
+#include "envoy/event/dispatcher.h"
+#include "envoy/thread/thread.h"
+#include "cache_entry.h"
+#include "cache_key.h"
+#include "disk_cache.h"
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <unordered_set>
+
+namespace Envoy::Http {
+
+constexpr uint32_t SNAPSHOT_FORMAT_VERSION = 2;
+
+/**
+ * @brief Snapshot file of a previous process, restored lazily.
+ * File layout: header, Vary marker records, response records (headers and body), key index sorted by key.
+ * load() maps the file and validates only its header, so the start does not depend on the size of the snapshot.
+ * The kernel reads the index and the markers ahead, a RAM miss binary-searches the mapped index and takes a Vary
+ * marker right away. A response record is restored by the restore thread into a new entry that is posted to the
+ * worker once its headers are restored, the body is streamed into it in chunks (pages of the record are read in
+ * on the restore thread, never on a worker). Every record is restored at most once, a newer response of the key
+ * supersedes it.
+ * write() stores the entries of the cache together with the records that were not restored yet, into a new file
+ * that atomically replaces the old one (the mapping of the old one stays valid).
+ */
+class CacheSnapshot : public Logger::Loggable<Logger::Id::filter> {
+public:
+    ~CacheSnapshot();
+    // Returns false if there is no usable snapshot at path (missing, truncated or of another format version),
+    // otherwise starts the restore thread
+    bool load(const std::string& path, Api::Api& api);
+    bool isLoaded() const { return loaded_.load(std::memory_order_acquire); }
+    // Vary marker of key (no response record is read), nullptr if there is none, it was taken or superseded or its
+    // stale window ended
+    CacheEntrySharedPtr takeVaryMarker(const CacheKey& key, SystemTime now);
+    // Index lookup only: key has a response record that was not taken and is within its stale window
+    bool contains(const CacheKey& key, SystemTime now);
+    // Never blocks, the callback is posted onto the dispatcher (nullptr if the record was taken meanwhile or is damaged)
+    void restore(const CacheKey& key, const DiskEntryOptions& entryOptions, Event::Dispatcher& dispatcher,
+                 DiskReadCallback callback);
+    // The cache holds a newer response of the key (or it was purged), its record must not be restored
+    void remove(const CacheKey& key);
+    // Skips entries that are incomplete, have trailers or are past their stale window. Returns the number of records
+    uint64_t write(const std::string& path, const std::vector<std::pair<CacheKey, CacheEntrySharedPtr>>& entries,
+                   SystemTime now);
+    // Server shutdown: joins the restore thread, following restores are answered with nullptr
+    void stop();
+
+private:
+    struct FileHeader {
+        uint64_t magic_ {0};
+        uint32_t version_ {0};
+        uint32_t padding_ {0};
+        uint64_t record_count_ {0};
+        uint64_t index_offset_ {0};
+        // Vary marker records are stored in front of the response records, up to this offset
+        uint64_t markers_end_ {0};
+        SystemTime::rep created_at_ {0};
+        // xxHash64 of the fields above
+        uint64_t checksum_ {0};
+    };
+    struct IndexRecord {
+        uint64_t key_high_ {0};
+        uint64_t key_low_ {0};
+        uint64_t offset_ {0};
+        uint64_t record_bytes_ {0};
+        SystemTime::rep stale_until_ {0};
+    };
+    /**
+     * @brief Fixed-size header of a record, followed by the serialized headers (names of the Vary headers for
+     * a Vary marker) and the body. Records start at 8-byte boundaries.
+     */
+    struct RecordHeader {
+        uint32_t headers_bytes_ {0};
+        uint32_t padding_ {0};
+        uint64_t body_bytes_ {0};
+        SystemTime::rep response_time_ {0};
+        SystemTime::rep fresh_until_ {0};
+        SystemTime::rep stale_until_ {0};
+        // xxHash64 of this header (with both checksums zero) and the serialized headers
+        uint64_t headers_checksum_ {0};
+        // xxHash64 chained over DISK_IO_CHUNK_BYTES chunks of the body, verified while the body is restored
+        uint64_t body_checksum_ {0};
+        uint8_t headers_end_stream_ {0};
+        uint8_t vary_marker_ {0};
+        uint8_t compressed_at_rest_ {0};
+        uint8_t reserved_[5] {};
+    };
+    struct PendingRestore {
+        CacheKey key_ {};
+        DiskEntryOptions entry_options_ {};
+        Event::Dispatcher* dispatcher_ {};
+        DiskReadCallback callback_ {};
+    };
+
+    // Binary search in the mapped index
+    const IndexRecord* find(const CacheKey& key) const;
+    // Bytes of the record in the mapping, empty if the index record points outside the records
+    absl::string_view recordBytes(const IndexRecord& indexRecord) const;
+    // Headers of the record (header checksum verified), nullptr if the record is damaged
+    ResponseHeaderMapPtr parseRecord(const IndexRecord& indexRecord, RecordHeader& header) const;
+    // Marks the record of key as restored, returns false if it already was (or was superseded)
+    bool claim(const CacheKey& key);
+    void restoreLoop();
+    void serveRestore(const PendingRestore& restore);
+    // Returns false if the entry is not stored (incomplete, aborted or with trailers)
+    static bool serializeEntry(const CacheEntrySharedPtr& entry, std::string& record);
+    static uint64_t headersChecksum(absl::string_view recordPrefix);
+    static FileHeader createFileHeader(uint64_t recordCount, uint64_t indexOffset, uint64_t markersEnd, SystemTime now);
+    static uint64_t fileHeaderChecksum(const FileHeader& header);
+
+    std::atomic<bool> loaded_ {false};
+    const uint8_t* mapping_ {};
+    size_t mapping_bytes_ {0};
+    const IndexRecord* index_ {};
+    uint64_t record_count_ {0};
+    uint64_t markers_end_ {0};
+    TimeSource* time_source_ {};
+    Thread::ThreadPtr restore_thread_ {};
+
+    mutable std::mutex mtx_ {};
+    // Records restored or superseded since the start, grows with the use of the snapshot and not with its size
+    std::unordered_set<CacheKey, CacheKeyHash> taken_ {};
+
+    std::mutex queue_mtx_ {};
+    std::condition_variable queue_cv_ {};
+    std::deque<PendingRestore> restores_ {};
+    bool shutdown_ {false};
+};
+
+} // namespace Envoy::Http
@@ -0,0 +1,542 @@
+#include "disk_cache.h"
+
+#include "source/common/common/hash.h"
+#include "source/common/common/utility.h"
+#include "absl/strings/match.h"
+#include "absl/strings/str_cat.h"
+#include <fcntl.h>
+#include <filesystem>
+#include <unistd.h>
+
+namespace Envoy::Http {
+
+namespace {
+
+constexpr uint32_t RECORD_MAGIC = 0x43524348; // "HCRC"
+constexpr absl::string_view SEGMENT_FILE_PREFIX = "segment_";
+constexpr absl::string_view SEGMENT_FILE_SUFFIX = ".dat";
+
+bool preadAll(int fd, void* data, size_t size, uint64_t offset) {
+    auto* bytes = static_cast<uint8_t*>(data);
+    while (size > 0) {
+        const ssize_t result = ::pread(fd, bytes, size, static_cast<off_t>(offset));
+        if (result < 0 && errno == EINTR) {
+            continue;
+        }
+        if (result <= 0) {
+            return false;
+        }
+        bytes += result;
+        size -= result;
+        offset += result;
+    }
+    return true;
+}
+
+bool pwriteAll(int fd, const void* data, size_t size, uint64_t offset) {
+    const auto* bytes = static_cast<const uint8_t*>(data);
+    while (size > 0) {
+        const ssize_t result = ::pwrite(fd, bytes, size, static_cast<off_t>(offset));
+        if (result < 0 && errno == EINTR) {
+            continue;
+        }
+        if (result <= 0) {
+            return false;
+        }
+        bytes += result;
+        size -= result;
+        offset += result;
+    }
+    return true;
+}
+
+} // namespace
+
+DiskCache::~DiskCache() {
+    stop();
+}
+
+void DiskCache::stop() {
+    std::deque<PendingRead> reads;
+    {
+        std::lock_guard lockGuard(queue_mtx_);
+        if (shutdown_) {
+            return;
+        }
+        shutdown_ = true;
+        reads.swap(reads_);
+    }
+    queue_cv_.notify_all();
+    if (io_thread_ != nullptr) {
+        io_thread_->join();
+    }
+    // Readers of an entry still being streamed see it aborted, requests still waiting for a read go to the origin
+    for (auto& active: active_reads_) {
+        active.producer_.abort();
+    }
+    active_reads_.clear();
+    for (auto& read: reads) {
+        read.dispatcher_->post([callback = std::move(read.callback_)]() { callback(nullptr); });
+    }
+    for (auto& segment: segments_) {
+        ::close(segment.fd_);
+    }
+    segments_.clear();
+}
+
+void DiskCache::init(const DiskCacheOptions& options, Api::Api& api) {
+    std::call_once(init_flag_, [&] {
+        options_ = options;
+        // At least 4 segments fit into the budget, so evicting the oldest one never empties a large part of the tier
+        options_.segment_bytes_ = std::min<uint64_t>({options.segment_bytes_ > 0 ? options.segment_bytes_ : DEFAULT_DISK_SEGMENT_BYTES,
+                                                      std::max<uint64_t>(options.max_bytes_ / 4, 1), UINT32_MAX});
+        time_source_ = &api.timeSource();
+        std::error_code error;
+        std::filesystem::create_directories(options_.path_, error);
+        if (error) {
+            ENVOY_LOG(error, "[DiskCache::init] Cannot create directory '{}': {}; disk tier disabled", options_.path_, error.message());
+            return;
+        }
+        // The index is not persisted, records of a previous run are unreachable
+        std::vector<std::filesystem::path> staleFiles;
+        for (const auto& file: std::filesystem::directory_iterator(options_.path_, error)) {
+            const std::string name = file.path().filename().string();
+            if (absl::StartsWith(name, SEGMENT_FILE_PREFIX) && absl::EndsWith(name, SEGMENT_FILE_SUFFIX)) {
+                staleFiles.push_back(file.path());
+            }
+        }
+        for (const auto& file: staleFiles) {
+            std::filesystem::remove(file, error);
+        }
+        Thread::Options threadOptions;
+        threadOptions.name_ = "cache_rc_disk";
+        io_thread_ = api.threadFactory().createThread([this]() { ioLoop(); }, threadOptions);
+        enabled_.store(true, std::memory_order_release);
+        ENVOY_LOG(info, "[DiskCache::init] path: '{}', max bytes: {}, segment bytes: {}", options_.path_,
+                  options_.max_bytes_, options_.segment_bytes_);
+    });
+}
+
+void DiskCache::spill(const CacheKey& key, const CacheEntrySharedPtr& entry) {
+    if (!isEnabled()) {
+        return;
+    }
+    if (entry->isVaryMarker()) {
+        // Without its marker, no RAM miss would find the variant records of the key
+        std::lock_guard lockGuard(index_mtx_);
+        if (vary_markers_.size() < MAX_DISK_VARY_MARKERS || vary_markers_.count(key) != 0) {
+            vary_markers_.insert_or_assign(key, entry->varyHeaders());
+        }
+        return;
+    }
+    if (entry->isAborted() || !entry->isFresh(time_source_->systemTime())) {
+        return;
+    }
+    const uint64_t bytes = entry->footprintBytes();
+    {
+        std::lock_guard lockGuard(queue_mtx_);
+        if (shutdown_ || pending_bytes_ + bytes > MAX_PENDING_SPILL_BYTES) {
+            ENVOY_LOG(debug, "[DiskCache::spill] Writer is behind; evicted entry dropped");
+            return;
+        }
+        pending_bytes_ += bytes;
+        pending_keys_[key] = ++write_sequence_;
+        writes_.push_back({key, entry, write_sequence_, bytes});
+    }
+    queue_cv_.notify_one();
+}
+
+bool DiskCache::contains(const CacheKey& key, SystemTime now) {
+    if (!isEnabled()) {
+        return false;
+    }
+    std::lock_guard lockGuard(index_mtx_);
+    auto itIndex = index_.find(key);
+    if (itIndex == index_.end()) {
+        return false;
+    }
+    if (now.time_since_epoch().count() >= itIndex->second.fresh_until_) {
+        // Expired records are not served, their space is reclaimed with their segment
+        index_.erase(itIndex);
+        entry_count_.fetch_sub(1, std::memory_order_relaxed);
+        return false;
+    }
+    return true;
+}
+
+CacheEntrySharedPtr DiskCache::takeVaryMarker(const CacheKey& key) {
+    if (!isEnabled()) {
+        return nullptr;
+    }
+    std::vector<LowerCaseString> varyHeaders;
+    {
+        std::lock_guard lockGuard(index_mtx_);
+        auto itMarker = vary_markers_.find(key);
+        if (itMarker == vary_markers_.end()) {
+            return nullptr;
+        }
+        varyHeaders = std::move(itMarker->second);
+        vary_markers_.erase(itMarker);
+    }
+    return CacheEntry::createVaryMarker(std::move(varyHeaders));
+}
+
+bool DiskCache::isStored(const CacheKey& key) const {
+    if (!isEnabled()) {
+        return false;
+    }
+    {
+        std::lock_guard lockGuard(index_mtx_);
+        if (index_.find(key) != index_.end() || vary_markers_.find(key) != vary_markers_.end()) {
+            return true;
+        }
+    }
+    std::lock_guard lockGuard(queue_mtx_);
+    return pending_keys_.find(key) != pending_keys_.end();
+}
+
+void DiskCache::read(const CacheKey& key, const DiskEntryOptions& entryOptions, Event::Dispatcher& dispatcher,
+                     DiskReadCallback callback) {
+    {
+        std::lock_guard lockGuard(queue_mtx_);
+        if (!shutdown_) {
+            reads_.push_back({key, entryOptions, &dispatcher, std::move(callback)});
+            queue_cv_.notify_one();
+            return;
+        }
+    }
+    dispatcher.post([callback = std::move(callback)]() { callback(nullptr); });
+}
+
+bool DiskCache::remove(const CacheKey& key) {
+    if (!isEnabled()) {
+        return false;
+    }
+    std::lock_guard indexLock(index_mtx_);
+    bool removed = index_.erase(key) > 0;
+    if (removed) {
+        entry_count_.fetch_sub(1, std::memory_order_relaxed);
+    }
+    removed |= vary_markers_.erase(key) > 0;
+    std::lock_guard queueLock(queue_mtx_);
+    // Queued write is skipped by the writer
+    removed |= pending_keys_.erase(key) > 0;
+    return removed;
+}
+
+void DiskCache::ioLoop() {
+    uint32_t readChunks = 0;
+    while (true) {
+        std::unique_lock uniqueLock(queue_mtx_);
+        queue_cv_.wait(uniqueLock, [this]() {
+            return shutdown_ || !reads_.empty() || !writes_.empty() || !active_reads_.empty();
+        });
+        if (shutdown_) {
+            return;
+        }
+        // A read has a request waiting for it, a write only frees memory, but it must not wait for all reads
+        const bool reading = !reads_.empty() || !active_reads_.empty();
+        if (!writes_.empty() && (!reading || readChunks >= MAX_READ_CHUNKS_PER_WRITE)) {
+            PendingWrite write = std::move(writes_.front());
+            writes_.pop_front();
+            pending_bytes_ -= write.bytes_;
+            uniqueLock.unlock();
+            readChunks = 0;
+            writeRecord(write);
+            continue;
+        }
+        ++readChunks;
+        if (!reads_.empty()) {
+            // Headers first, they are the time to first byte of the waiting request
+            PendingRead read = std::move(reads_.front());
+            reads_.pop_front();
+            uniqueLock.unlock();
+            serveRead(read);
+            continue;
+        }
+        uniqueLock.unlock();
+        // One chunk of the next record, then it queues up behind the other records being read
+        auto itActive = active_reads_.begin();
+        if (streamChunk(*itActive)) {
+            active_reads_.erase(itActive);
+        }
+        else {
+            active_reads_.splice(active_reads_.end(), active_reads_, itActive);
+        }
+    }
+}
+
+void DiskCache::writeRecord(const PendingWrite& write) {
+    const CacheEntrySharedPtr& entry = write.entry_;
+    {
+        std::lock_guard lockGuard(queue_mtx_);
+        auto itPending = pending_keys_.find(write.key_);
+        if (itPending == pending_keys_.end() || itPending->second != write.sequence_) {
+            // Removed meanwhile (purged or replaced in RAM) or queued again by a later eviction
+            return;
+        }
+        // Only complete responses without trailers are stored (entry evicted while it was being filled is dropped)
+        if (!entry->isComplete() || entry->hasTrailers()) {
+            pending_keys_.erase(itPending);
+            return;
+        }
+    }
+
+    std::string record(sizeof(RecordHeader), '\0');
+    serializeHeaders(*entry->headersTemplate(), record);
+    const size_t headersEnd = record.size();
+    entry->copyBody(record);
+    if (record.size() > options_.segment_bytes_) {
+        ENVOY_LOG(debug, "[DiskCache::writeRecord] Record of {} bytes does not fit into a segment; not stored", record.size());
+        cancelPendingWrite(write);
+        return;
+    }
+    RecordHeader header;
+    header.magic_ = RECORD_MAGIC;
+    header.headers_bytes_ = static_cast<uint32_t>(headersEnd - sizeof(RecordHeader));
+    header.key_high_ = write.key_.high_;
+    header.key_low_ = write.key_.low_;
+    header.response_time_ = entry->responseTime().time_since_epoch().count();
+    const Freshness freshness = entry->freshness();
+    header.fresh_until_ = freshness.fresh_until_.time_since_epoch().count();
+    header.stale_until_ = freshness.stale_until_.time_since_epoch().count();
+    header.body_bytes_ = record.size() - headersEnd;
+    header.headers_end_stream_ = entry->headersEndStream() ? 1 : 0;
+    header.compressed_at_rest_ = entry->isCompressedAtRest() ? 1 : 0;
+    memcpy(record.data(), &header, sizeof(header));
+    header.headers_checksum_ = HashUtil::xxHash64(absl::string_view(record.data(), headersEnd));
+    header.body_checksum_ = bodyChecksum(absl::string_view(record).substr(headersEnd));
+    memcpy(record.data(), &header, sizeof(header));
+
+    if ((segments_.empty() || segments_.back().size_ + record.size() > options_.segment_bytes_) && !openSegment()) {
+        cancelPendingWrite(write);
+        return;
+    }
+    Segment& segment = segments_.back();
+    if (!pwriteAll(segment.fd_, record.data(), record.size(), segment.size_)) {
+        ENVOY_LOG(warn, "[DiskCache::writeRecord] Write into segment {} failed: {}", segment.id_, errorDetails(errno));
+        cancelPendingWrite(write);
+        return;
+    }
+    const IndexEntry indexEntry {segment.id_, static_cast<uint32_t>(record.size()), segment.size_, header.fresh_until_};
+    segment.size_ += record.size();
+    segment.keys_.push_back(write.key_);
+    bytes_.fetch_add(record.size(), std::memory_order_relaxed);
+    {
+        std::lock_guard indexLock(index_mtx_);
+        std::lock_guard queueLock(queue_mtx_);
+        auto itPending = pending_keys_.find(write.key_);
+        // A removal while the record was written leaves it as dead space of the segment
+        if (itPending != pending_keys_.end() && itPending->second == write.sequence_) {
+            pending_keys_.erase(itPending);
+            if (index_.insert_or_assign(write.key_, indexEntry).second) {
+                entry_count_.fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+    }
+    ENVOY_LOG(trace, "[DiskCache::writeRecord] Stored {} bytes at segment {}, offset {}", record.size(),
+              indexEntry.segment_id_, indexEntry.offset_);
+    evictSegments();
+}
+
+void DiskCache::cancelPendingWrite(const PendingWrite& write) {
+    std::lock_guard lockGuard(queue_mtx_);
+    auto itPending = pending_keys_.find(write.key_);
+    if (itPending != pending_keys_.end() && itPending->second == write.sequence_) {
+        pending_keys_.erase(itPending);
+    }
+}
+
+void DiskCache::serveRead(const PendingRead& read) {
+    auto postResult = [&read](CacheEntrySharedPtr entry) {
+        read.dispatcher_->post([callback = read.callback_, entry = std::move(entry)]() { callback(entry); });
+    };
+    IndexEntry indexEntry;
+    {
+        std::lock_guard lockGuard(index_mtx_);
+        auto itIndex = index_.find(read.key_);
+        if (itIndex == index_.end()) {
+            postResult(nullptr);
+            return;
+        }
+        indexEntry = itIndex->second;
+    }
+    const int fd = segmentFd(indexEntry.segment_id_);
+    RecordHeader header;
+    std::string prefix;
+    bool valid = fd >= 0 && indexEntry.record_bytes_ >= sizeof(RecordHeader) &&
+                 preadAll(fd, &header, sizeof(header), indexEntry.offset_) && header.magic_ == RECORD_MAGIC &&
+                 header.key_high_ == read.key_.high_ && header.key_low_ == read.key_.low_ &&
+                 sizeof(RecordHeader) + header.headers_bytes_ + header.body_bytes_ == indexEntry.record_bytes_;
+    if (valid) {
+        prefix.resize(sizeof(RecordHeader) + header.headers_bytes_);
+        valid = preadAll(fd, prefix.data(), prefix.size(), indexEntry.offset_);
+    }
+    if (valid) {
+        RecordHeader unsummed = header;
+        unsummed.headers_checksum_ = 0;
+        unsummed.body_checksum_ = 0;
+        memcpy(prefix.data(), &unsummed, sizeof(unsummed));
+        valid = HashUtil::xxHash64(prefix) == header.headers_checksum_;
+    }
+    ResponseHeaderMapPtr headers = valid ? parseHeaders(absl::string_view(prefix).substr(sizeof(RecordHeader))) : nullptr;
+    if (headers == nullptr) {
+        ENVOY_LOG(warn, "[DiskCache::serveRead] Record at segment {}, offset {} is damaged; dropped",
+                  indexEntry.segment_id_, indexEntry.offset_);
+        remove(read.key_);
+        postResult(nullptr);
+        return;
+    }
+
+    ActiveRead& active = active_reads_.emplace_back();
+    active.key_ = read.key_;
+    active.index_entry_ = indexEntry;
+    active.header_ = header;
+    active.offset_ = indexEntry.offset_ + sizeof(RecordHeader) + header.headers_bytes_;
+    active.remaining_ = header.body_bytes_;
+    CacheEntryProducer& producer = active.producer_;
+    producer.initCacheEntry(read.entry_options_.ring_buffer_capacity_, read.entry_options_.body_storage_,
+                            read.entry_options_.segment_size_, *time_source_);
+    CacheEntrySharedPtr entry = producer.getCacheEntryPtr();
+    Freshness freshness;
+    freshness.fresh_until_ = SystemTime(SystemTime::duration(header.fresh_until_));
+    freshness.stale_until_ = SystemTime(SystemTime::duration(header.stale_until_));
+    entry->setFreshness(freshness);
+    if (header.compressed_at_rest_ != 0) {
+        entry->markCompressedAtRest();
+    }
+    producer.writeHeaders(*headers, header.headers_end_stream_ != 0, SystemTime(SystemTime::duration(header.response_time_)));
+    // The reader serves the entry while the body is streamed into it
+    postResult(entry);
+    if (header.headers_end_stream_ == 0) {
+        producer.headersWriteComplete();
+        return;
+    }
+    producer.writeComplete();
+    active_reads_.pop_back();
+}
+
+bool DiskCache::streamChunk(ActiveRead& active) {
+    // Segment may have been evicted by a write since the previous chunk (ids are never reused)
+    const int fd = segmentFd(active.index_entry_.segment_id_);
+    const auto size = static_cast<uint32_t>(std::min<uint64_t>(active.remaining_, DISK_IO_CHUNK_BYTES));
+    std::unique_ptr<uint8_t[]> chunk(new uint8_t[DISK_IO_CHUNK_BYTES]);
+    bool valid = fd >= 0 && preadAll(fd, chunk.get(), size, active.offset_);
+    if (valid) {
+        active.checksum_ = HashUtil::xxHash64(absl::string_view(reinterpret_cast<const char*>(chunk.get()), size),
+                                              active.checksum_);
+        active.offset_ += size;
+        active.remaining_ -= size;
+        // Verified before the last chunk is written, a damaged body never completes
+        valid = active.remaining_ > 0 || active.checksum_ == active.header_.body_checksum_;
+    }
+    if (!valid) {
+        ENVOY_LOG(warn, "[DiskCache::streamChunk] Body of the record at segment {}, offset {} is damaged or gone; entry aborted",
+                  active.index_entry_.segment_id_, active.index_entry_.offset_);
+        remove(active.key_);
+        active.producer_.abort();
+        return true;
+    }
+    Buffer::OwnedImpl data(chunk.get(), size);
+    active.producer_.writeData(data, active.remaining_ == 0);
+    if (active.remaining_ > 0) {
+        return false;
+    }
+    active.producer_.writeComplete();
+    return true;
+}
+
+bool DiskCache::openSegment() {
+    const uint32_t id = next_segment_id_++;
+    const std::string path = segmentPath(id);
+    const int fd = ::open(path.c_str(), O_CREAT | O_TRUNC | O_RDWR | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        ENVOY_LOG(error, "[DiskCache::openSegment] Cannot open '{}': {}", path, errorDetails(errno));
+        return false;
+    }
+    segments_.push_back({id, fd, 0, {}});
+    return true;
+}
+
+void DiskCache::evictSegments() {
+    // The segment being appended to is never evicted
+    while (bytes_.load(std::memory_order_relaxed) > options_.max_bytes_ && segments_.size() > 1) {
+        Segment& oldest = segments_.front();
+        {
+            std::lock_guard lockGuard(index_mtx_);
+            for (const auto& key: oldest.keys_) {
+                auto itIndex = index_.find(key);
+                // Key may have been written again into a newer segment
+                if (itIndex != index_.end() && itIndex->second.segment_id_ == oldest.id_) {
+                    index_.erase(itIndex);
+                    entry_count_.fetch_sub(1, std::memory_order_relaxed);
+                }
+            }
+        }
+        ENVOY_LOG(debug, "[DiskCache::evictSegments] Deleting segment {} ({} bytes)", oldest.id_, oldest.size_);
+        ::close(oldest.fd_);
+        ::unlink(segmentPath(oldest.id_).c_str());
+        bytes_.fetch_sub(oldest.size_, std::memory_order_relaxed);
+        segments_.pop_front();
+    }
+}
+
+std::string DiskCache::segmentPath(uint32_t id) const {
+    return absl::StrCat(options_.path_, "/", SEGMENT_FILE_PREFIX, id, SEGMENT_FILE_SUFFIX);
+}
+
+int DiskCache::segmentFd(uint32_t id) const {
+    for (const auto& segment: segments_) {
+        if (segment.id_ == id) {
+            return segment.fd_;
+        }
+    }
+    return -1;
+}
+
+void DiskCache::serializeHeaders(const ResponseHeaderMap& headers, std::string& record) {
+    // Length-prefixed key and value of every header, in the order of the map
+    headers.iterate([&record](const HeaderEntry& entry) -> HeaderMap::Iterate {
+        for (absl::string_view part: {entry.key().getStringView(), entry.value().getStringView()}) {
+            const auto length = static_cast<uint32_t>(part.size());
+            record.append(reinterpret_cast<const char*>(&length), sizeof(length));
+            record.append(part.data(), part.size());
+        }
+        return HeaderMap::Iterate::Continue;
+    });
+}
+
+ResponseHeaderMapPtr DiskCache::parseHeaders(absl::string_view serialized) {
+    ResponseHeaderMapPtr headers = ResponseHeaderMapImpl::create();
+    while (!serialized.empty()) {
+        absl::string_view parts[2];
+        for (auto& part: parts) {
+            uint32_t length = 0;
+            if (serialized.size() < sizeof(length)) {
+                return nullptr;
+            }
+            memcpy(&length, serialized.data(), sizeof(length));
+            serialized.remove_prefix(sizeof(length));
+            if (serialized.size() < length) {
+                return nullptr;
+            }
+            part = serialized.substr(0, length);
+            serialized.remove_prefix(length);
+        }
+        headers->addCopy(LowerCaseString(parts[0]), parts[1]);
+    }
+    return headers;
+}
+
+uint64_t DiskCache::bodyChecksum(absl::string_view body) {
+    uint64_t checksum = 0;
+    size_t offset = 0;
+    do {
+        const size_t size = std::min<size_t>(body.size() - offset, DISK_IO_CHUNK_BYTES);
+        checksum = HashUtil::xxHash64(body.substr(offset, size), checksum);
+        offset += size;
+    } while (offset < body.size());
+    return checksum;
+}
+
+} // namespace Envoy::Http
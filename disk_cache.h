@@ -0,0 +1,197 @@
+/***********************************************************************************************************************
+ * Disk tier (L2) of the cache: entries evicted from RAM are appended into segment files on local disk
+ ***********************************************************************************************************************/
+
+#pragma once
+
+#include "envoy/api/api.h"
+#include "envoy/event/dispatcher.h"
+#include "envoy/thread/thread.h"
+#include "cache_entry.h"
+#include "cache_key.h"
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+
+namespace Envoy::Http {
+
+constexpr uint64_t DEFAULT_DISK_SEGMENT_BYTES = 64 * 1024 * 1024;
+// Evicted entries waiting for the writer, further evictions are dropped instead of holding more memory
+constexpr uint64_t MAX_PENDING_SPILL_BYTES = 64 * 1024 * 1024;
+// Unit of body reads (one write of the restored entry) and of the body checksum
+constexpr uint32_t DISK_IO_CHUNK_BYTES = 64 * 1024;
+// Body chunks read while evicted entries wait for the writer, a write is taken at least this often
+constexpr uint32_t MAX_READ_CHUNKS_PER_WRITE = 16;
+// Vary markers kept by the tier (names of the Vary headers only), further evicted markers are dropped
+constexpr size_t MAX_DISK_VARY_MARKERS = 64 * 1024;
+
+struct DiskCacheOptions {
+    std::string path_ {};                                    // directory of the segment files
+    uint64_t max_bytes_ {0};                                 // budget of all segment files
+    uint64_t segment_bytes_ {DEFAULT_DISK_SEGMENT_BYTES};    // size of one segment file (and of the largest record)
+};
+
+/**
+ * @brief Body storage of entries restored from disk (the one of the filter config reading them).
+ */
+struct DiskEntryOptions {
+    uint32_t ring_buffer_capacity_ {0};
+    BodyStorage body_storage_ {BodyStorage::RING_BUFFER_BLOCKS};
+    uint32_t segment_size_ {DEFAULT_SEGMENT_SIZE_BYTES};
+};
+
+// Invoked on the dispatcher of the reader: entry with its headers restored (the body is still being streamed into it)
+// or nullptr if the record is gone or damaged
+using DiskReadCallback = std::function<void(const CacheEntrySharedPtr& entry)>;
+
+/**
+ * @brief Optional L2 tier behind HTTPLRURAMCache.
+ * Evicted entries are queued by the RAM cache and appended by a single I/O thread into append-only segment files,
+ * the in-memory index maps a key to the position of its record (no body bytes are kept in memory).
+ * A RAM miss checks the index only; a hit is read by the I/O thread with pread() and streamed into a new entry
+ * in chunks, so the worker never waits for the disk and serves the entry like one that is still being filled.
+ * Bodies of all records being read advance one chunk at a time in turns, so a large record does not hold back
+ * the others, and queued writes get a turn at least every MAX_READ_CHUNKS_PER_WRITE chunks.
+ * Eviction is FIFO over whole segments: when the tier exceeds its budget, the oldest segment file is deleted
+ * together with its index entries (hot records were promoted back into RAM by their hits).
+ * Vary markers are not written into segments: the names of their Vary headers are kept in memory next to the index,
+ * so the variant key of a RAM miss is found without I/O and its variant record stays reachable.
+ * The index lives only in memory, segment files of a previous run are deleted on start.
+ */
+class DiskCache : public Logger::Loggable<Logger::Id::filter> {
+public:
+    ~DiskCache();
+    // Only the first call initializes the tier and starts its I/O thread, following calls are no-op
+    void init(const DiskCacheOptions& options, Api::Api& api);
+    // Server shutdown: joins the I/O thread while the dispatchers are still running, following reads are answered
+    // with nullptr and entries still being read are aborted
+    void stop();
+    bool isEnabled() const { return enabled_.load(std::memory_order_acquire); }
+    // Called by the RAM cache under a shard lock: only queues the entry, never touches the disk
+    void spill(const CacheKey& key, const CacheEntrySharedPtr& entry);
+    // Index lookup (no I/O), records that are not fresh at now are dropped
+    bool contains(const CacheKey& key, SystemTime now);
+    // Vary marker evicted from RAM, nullptr if there is none (the marker leaves the tier, the caller reinserts it)
+    CacheEntrySharedPtr takeVaryMarker(const CacheKey& key);
+    // Indexed or waiting for the writer
+    bool isStored(const CacheKey& key) const;
+    // Never blocks, the callback is posted onto the dispatcher
+    void read(const CacheKey& key, const DiskEntryOptions& entryOptions, Event::Dispatcher& dispatcher,
+              DiskReadCallback callback);
+    // Drops the record and a pending write of the key, returns true if there was any
+    bool remove(const CacheKey& key);
+    // Number of indexed records and size of all segment files, O(1)
+    size_t size() const { return entry_count_.load(std::memory_order_relaxed); }
+    uint64_t sizeBytes() const { return bytes_.load(std::memory_order_relaxed); }
+    // Length-prefixed header pairs of a record (shared with CacheSnapshot), nullptr if the bytes are truncated
+    static void serializeHeaders(const ResponseHeaderMap& headers, std::string& record);
+    static ResponseHeaderMapPtr parseHeaders(absl::string_view serialized);
+    // xxHash64 chained over DISK_IO_CHUNK_BYTES chunks (shared with CacheSnapshot), verifiable while streaming the body
+    static uint64_t bodyChecksum(absl::string_view body);
+
+private:
+    /**
+     * @brief Fixed-size header of a record, followed by the serialized headers and the body.
+     */
+    struct RecordHeader {
+        uint32_t magic_ {0};
+        uint32_t headers_bytes_ {0};
+        uint64_t key_high_ {0};
+        uint64_t key_low_ {0};
+        SystemTime::rep response_time_ {0};
+        SystemTime::rep fresh_until_ {0};
+        SystemTime::rep stale_until_ {0};
+        uint64_t body_bytes_ {0};
+        // xxHash64 of this header (with both checksums zero) and the serialized headers
+        uint64_t headers_checksum_ {0};
+        // xxHash64 chained over DISK_IO_CHUNK_BYTES chunks of the body
+        uint64_t body_checksum_ {0};
+        uint8_t headers_end_stream_ {0};
+        // Body is gzip-compressed (CacheEntry::isCompressedAtRest())
+        uint8_t compressed_at_rest_ {0};
+        uint8_t padding_[6] {};
+    };
+    struct IndexEntry {
+        uint32_t segment_id_ {0};
+        uint32_t record_bytes_ {0};
+        uint64_t offset_ {0};
+        SystemTime::rep fresh_until_ {0};
+    };
+    struct Segment {
+        uint32_t id_ {0};
+        int fd_ {-1};
+        uint64_t size_ {0};
+        // Keys written into the segment, their index entries are dropped with it (unless rewritten elsewhere)
+        std::vector<CacheKey> keys_ {};
+    };
+    struct PendingWrite {
+        CacheKey key_ {};
+        CacheEntrySharedPtr entry_ {};
+        uint64_t sequence_ {0};
+        uint64_t bytes_ {0};
+    };
+    struct PendingRead {
+        CacheKey key_ {};
+        DiskEntryOptions entry_options_ {};
+        Event::Dispatcher* dispatcher_ {};
+        DiskReadCallback callback_ {};
+    };
+    // Record whose headers were served, its body is streamed into the restored entry chunk by chunk
+    struct ActiveRead {
+        CacheKey key_ {};
+        IndexEntry index_entry_ {};
+        RecordHeader header_ {};
+        CacheEntryProducer producer_ {};
+        uint64_t offset_ {0};
+        uint64_t remaining_ {0};
+        uint64_t checksum_ {0};
+    };
+
+    void ioLoop();
+    void writeRecord(const PendingWrite& write);
+    // Forgets the pending write unless the key was queued again meanwhile
+    void cancelPendingWrite(const PendingWrite& write);
+    // Serves the headers, the body (if any) continues as an active read
+    void serveRead(const PendingRead& read);
+    // Returns true once the read is finished (body complete, or aborted if the record is damaged or its segment is gone)
+    bool streamChunk(ActiveRead& active);
+    bool openSegment();
+    // Deletes the oldest segments until the tier fits its budget
+    void evictSegments();
+    std::string segmentPath(uint32_t id) const;
+    int segmentFd(uint32_t id) const;
+
+    std::once_flag init_flag_ {};
+    std::atomic<bool> enabled_ {false};
+    DiskCacheOptions options_ {};
+    TimeSource* time_source_ {};
+    Thread::ThreadPtr io_thread_ {};
+
+    // Guards the index; taken before queue_mtx_ when both are needed
+    mutable std::mutex index_mtx_ {};
+    std::unordered_map<CacheKey, IndexEntry, CacheKeyHash> index_ {};
+    std::unordered_map<CacheKey, std::vector<LowerCaseString>, CacheKeyHash> vary_markers_ {};
+    std::atomic<uint64_t> entry_count_ {0};
+    std::atomic<uint64_t> bytes_ {0};
+
+    mutable std::mutex queue_mtx_ {};
+    std::condition_variable queue_cv_ {};
+    // Headers of new reads are served before body chunks and writes (bounded by MAX_READ_CHUNKS_PER_WRITE)
+    std::deque<PendingRead> reads_ {};
+    std::deque<PendingWrite> writes_ {};
+    // Latest queued write of a key (a removal cancels it)
+    std::unordered_map<CacheKey, uint64_t, CacheKeyHash> pending_keys_ {};
+    uint64_t pending_bytes_ {0};
+    uint64_t write_sequence_ {0};
+    bool shutdown_ {false};
+
+    // I/O thread only (and stop() after the thread is joined)
+    std::list<ActiveRead> active_reads_ {};
+    std::deque<Segment> segments_ {};
+    uint32_t next_segment_id_ {0};
+};
+
+} // namespace Envoy::Http
@@ -0,0 +1,80 @@
+#include "frequency_sketch.h"
+
+#include <algorithm>
+
+namespace {
+
+constexpr uint32_t SKETCH_ROWS = 4;
+constexpr uint64_t SKETCH_SEEDS[SKETCH_ROWS] = {0xc3a5c85c97cb3127ULL, 0xb492b66fbe98f273ULL,
+                                                0x9ae16a3b2f90404fULL, 0xcbf29ce484222325ULL};
+// Mask of the lower 3 bits of every 4-bit counter (used when halving the counters)
+constexpr uint64_t RESET_MASK = 0x7777777777777777ULL;
+constexpr uint64_t COUNTER_MAX = 15;
+
+uint64_t nextPowerOfTwo(uint64_t value) {
+    uint64_t power = 1;
+    while (power < value) {
+        power <<= 1;
+    }
+    return power;
+}
+
+} // namespace
+
+FrequencySketch::FrequencySketch(uint32_t maximumSize)
+    : table_(nextPowerOfTwo(std::max<uint32_t>(maximumSize, 16))),
+      table_mask_(table_.size() - 1),
+      sample_size_(10 * std::max<uint32_t>(maximumSize, 16)) {}
+
+void FrequencySketch::increment(uint64_t hash) {
+    // Every row uses different counter inside the word (selected by the top bits of the spread hash)
+    bool added = false;
+    for (uint32_t row = 0; row < SKETCH_ROWS; ++row) {
+        uint64_t index = indexOf(hash, row);
+        added |= incrementAt(index & table_mask_, static_cast<uint32_t>(index >> 60));
+    }
+    if (added && size_.fetch_add(1, std::memory_order_relaxed) + 1 >= sample_size_) {
+        reset();
+    }
+}
+
+uint32_t FrequencySketch::frequency(uint64_t hash) const {
+    uint64_t frequency = COUNTER_MAX;
+    for (uint32_t row = 0; row < SKETCH_ROWS; ++row) {
+        uint64_t index = indexOf(hash, row);
+        uint64_t word = table_[index & table_mask_].load(std::memory_order_relaxed);
+        frequency = std::min(frequency, (word >> ((index >> 60) << 2)) & COUNTER_MAX);
+    }
+    return static_cast<uint32_t>(frequency);
+}
+
+uint64_t FrequencySketch::indexOf(uint64_t hash, uint32_t row) const {
+    uint64_t spread = (hash + SKETCH_SEEDS[row]) * SKETCH_SEEDS[row];
+    spread += spread >> 32;
+    return spread;
+}
+
+bool FrequencySketch::incrementAt(uint64_t index, uint32_t counterOffset) {
+    uint32_t shift = counterOffset << 2;
+    uint64_t word = table_[index].load(std::memory_order_relaxed);
+    while (((word >> shift) & COUNTER_MAX) != COUNTER_MAX) {
+        if (table_[index].compare_exchange_weak(word, word + (1ULL << shift), std::memory_order_relaxed)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void FrequencySketch::reset() {
+    // Only one thread performs the aging, others keep counting meanwhile
+    bool expected = false;
+    if (!resetting_.compare_exchange_strong(expected, true, std::memory_order_acquire)) {
+        return;
+    }
+    for (auto& word: table_) {
+        uint64_t value = word.load(std::memory_order_relaxed);
+        while (!word.compare_exchange_weak(value, (value >> 1) & RESET_MASK, std::memory_order_relaxed)) {}
+    }
+    size_.store(size_.load(std::memory_order_relaxed) / 2, std::memory_order_relaxed);
+    resetting_.store(false, std::memory_order_release);
+}
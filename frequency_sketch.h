@@ -0,0 +1,37 @@
+/***********************************************************************************************************************
+ * Count-Min Sketch with 4-bit counters used by the W-TinyLFU admission policy
+ * INSPIRATION TAKEN FROM: https://github.com/ben-manes/caffeine (FrequencySketch)
+ * PAPER: https://arxiv.org/abs/1512.00727 (TinyLFU: A Highly Efficient Cache Admission Policy)
+ ***********************************************************************************************************************/
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+/**
+ * @brief Approximate access frequency of keys (popularity history), lock-free.
+ * Each 64-bit word holds 16 counters of 4 bits, every key is counted in 4 rows and the minimum is its estimate.
+ * After sample size of increments all counters are halved (aging), so the history adapts to a changing workload.
+ */
+class FrequencySketch {
+public:
+    explicit FrequencySketch(uint32_t maximumSize);
+    // Record an access of the key with given hash
+    void increment(uint64_t hash);
+    // Estimated number of accesses (0 - 15)
+    uint32_t frequency(uint64_t hash) const;
+
+private:
+    uint64_t indexOf(uint64_t hash, uint32_t row) const;
+    bool incrementAt(uint64_t index, uint32_t counterOffset);
+    void reset();
+
+    std::vector<std::atomic<uint64_t>> table_;
+    uint64_t table_mask_ {};
+    // Number of increments after which the counters are halved
+    uint32_t sample_size_ {};
+    std::atomic<uint32_t> size_ {0};
+    std::atomic<bool> resetting_ {false};
+};
@@ -0,0 +1,173 @@
+#include "freshness.h"
+
+#include "source/common/http/headers.h"
+#include "absl/strings/ascii.h"
+#include "absl/strings/match.h"
+#include "absl/strings/numbers.h"
+#include "absl/strings/str_split.h"
+#include "absl/time/time.h"
+#include <optional>
+
+namespace Envoy::Http {
+
+namespace {
+
+// IMF-fixdate (RFC 9110 Section 5.6.7), the only date format generated by current origins
+constexpr absl::string_view HTTP_DATE_FORMAT = "%a, %d %b %Y %H:%M:%S GMT";
+
+std::optional<SystemTime> parseHttpDate(absl::string_view value) {
+    absl::Time time;
+    std::string error;
+    if (!absl::ParseTime(HTTP_DATE_FORMAT, value, absl::UTCTimeZone(), &time, &error)) {
+        return std::nullopt;
+    }
+    return absl::ToChronoTime(time);
+}
+
+std::optional<absl::string_view> headerValue(const ResponseHeaderMap& headers, const LowerCaseString& name) {
+    const auto values = headers.get(name);
+    if (values.empty()) {
+        return std::nullopt;
+    }
+    return values[0]->value().getStringView();
+}
+
+struct CacheControl {
+    bool no_store_ {false};
+    std::optional<uint64_t> s_maxage_ {};
+    std::optional<uint64_t> max_age_ {};
+    std::optional<uint64_t> stale_while_revalidate_ {};
+};
+
+void parseCacheControl(absl::string_view value, CacheControl& cacheControl) {
+    for (absl::string_view directive: absl::StrSplit(value, ',')) {
+        std::pair<absl::string_view, absl::string_view> nameValue =
+            absl::StrSplit(absl::StripAsciiWhitespace(directive), absl::MaxSplits('=', 1));
+        absl::string_view name = nameValue.first;
+        absl::string_view argument = absl::StripAsciiWhitespace(nameValue.second);
+        argument = absl::StripPrefix(absl::StripSuffix(argument, "\""), "\"");
+        uint64_t seconds = 0;
+        if (absl::EqualsIgnoreCase(name, "no-store") || absl::EqualsIgnoreCase(name, "no-cache") ||
+            absl::EqualsIgnoreCase(name, "private")) {
+            cacheControl.no_store_ = true;
+        }
+        else if (absl::EqualsIgnoreCase(name, "s-maxage") && absl::SimpleAtoi(argument, &seconds)) {
+            cacheControl.s_maxage_ = seconds;
+        }
+        else if (absl::EqualsIgnoreCase(name, "max-age") && absl::SimpleAtoi(argument, &seconds)) {
+            cacheControl.max_age_ = seconds;
+        }
+        else if (absl::EqualsIgnoreCase(name, "stale-while-revalidate") && absl::SimpleAtoi(argument, &seconds)) {
+            cacheControl.stale_while_revalidate_ = seconds;
+        }
+    }
+}
+
+// Directives may be split over several Cache-Control lines, all of them apply (RFC 9110 Section 5.3)
+CacheControl parseCacheControl(const ResponseHeaderMap& headers) {
+    CacheControl cacheControl;
+    const auto values = headers.get(Http::CustomHeaders::get().CacheControl);
+    for (size_t i = 0; i < values.size(); ++i) {
+        parseCacheControl(values[i]->value().getStringView(), cacheControl);
+    }
+    return cacheControl;
+}
+
+} // namespace
+
+Freshness computeFreshness(const ResponseHeaderMap& headers, SystemTime responseTime, const FreshnessOptions& options) {
+    static const LowerCaseString expiresHeader {"expires"};
+    static const LowerCaseString dateHeader {"date"};
+    static const LowerCaseString ageHeader {"age"};
+
+    Freshness freshness;
+    const CacheControl cacheControl = parseCacheControl(headers);
+    if (cacheControl.no_store_) {
+        freshness.cacheable_ = false;
+        return freshness;
+    }
+
+    std::optional<std::chrono::milliseconds> lifetime;
+    if (cacheControl.s_maxage_.has_value()) {
+        lifetime = std::chrono::seconds(*cacheControl.s_maxage_);
+    }
+    else if (cacheControl.max_age_.has_value()) {
+        lifetime = std::chrono::seconds(*cacheControl.max_age_);
+    }
+    else if (auto expires = headerValue(headers, expiresHeader)) {
+        std::optional<SystemTime> expiresTime = parseHttpDate(*expires);
+        std::optional<SystemTime> dateTime;
+        if (auto date = headerValue(headers, dateHeader)) {
+            dateTime = parseHttpDate(*date);
+        }
+        // Invalid Expires (e.g. "0") means already expired
+        lifetime = expiresTime.has_value()
+                   ? std::max(std::chrono::duration_cast<std::chrono::milliseconds>(*expiresTime - dateTime.value_or(responseTime)),
+                              std::chrono::milliseconds(0))
+                   : std::chrono::milliseconds(0);
+    }
+    else if (options.default_ttl_.count() > 0) {
+        lifetime = options.default_ttl_;
+    }
+    if (!lifetime.has_value()) {
+        // No explicit freshness: the response lives until it is evicted
+        return freshness;
+    }
+
+    uint64_t age = 0;
+    if (auto value = headerValue(headers, ageHeader)) {
+        if (!absl::SimpleAtoi(*value, &age)) {
+            age = 0;
+        }
+    }
+    const std::chrono::milliseconds remaining =
+        std::max<std::chrono::milliseconds>(*lifetime - std::chrono::seconds(age), std::chrono::milliseconds(0));
+    freshness.fresh_until_ = responseTime + remaining;
+    const std::chrono::milliseconds staleWindow = cacheControl.stale_while_revalidate_.has_value()
+                                                  ? std::chrono::seconds(*cacheControl.stale_while_revalidate_)
+                                                  : options.stale_while_revalidate_;
+    freshness.stale_until_ = freshness.fresh_until_ + staleWindow;
+    return freshness;
+}
+
+Freshness computeErrorFreshness(const ResponseHeaderMap& headers, uint64_t status, SystemTime responseTime,
+                                const FreshnessOptions& options) {
+    static const LowerCaseString retryAfterHeader {"retry-after"};
+
+    Freshness freshness;
+    freshness.cacheable_ = false;
+    std::chrono::milliseconds lifetime {0};
+    if (auto it = options.error_ttls_.find(status); it != options.error_ttls_.end()) {
+        lifetime = it->second;
+    }
+    else if (status >= 500 && status < 600) {
+        lifetime = options.server_error_ttl_;
+    }
+    if (lifetime.count() <= 0) {
+        return freshness;
+    }
+    if (parseCacheControl(headers).no_store_) {
+        return freshness;
+    }
+
+    // Retry-After (RFC 9110 Section 10.2.3): the origin tells how long the error lasts
+    if (auto value = headerValue(headers, retryAfterHeader)) {
+        uint64_t seconds = 0;
+        if (absl::SimpleAtoi(absl::StripAsciiWhitespace(*value), &seconds)) {
+            lifetime = std::chrono::seconds(seconds);
+        }
+        else if (std::optional<SystemTime> retryTime = parseHttpDate(absl::StripAsciiWhitespace(*value))) {
+            lifetime = std::chrono::duration_cast<std::chrono::milliseconds>(*retryTime - responseTime);
+        }
+        lifetime = std::min(lifetime, options.max_retry_after_);
+        if (lifetime.count() <= 0) {
+            return freshness;
+        }
+    }
+    freshness.cacheable_ = true;
+    freshness.fresh_until_ = responseTime + lifetime;
+    freshness.stale_until_ = freshness.fresh_until_;
+    return freshness;
+}
+
+} // namespace Envoy::Http
@@ -0,0 +1,55 @@
+/***********************************************************************************************************************
+ * Freshness of cached responses (RFC 9111 Section 4.2, RFC 5861 stale-while-revalidate)
+ ***********************************************************************************************************************/
+
+#pragma once
+
+#include "envoy/common/time.h"
+#include "envoy/http/header_map.h"
+#include <chrono>
+#include <unordered_map>
+
+namespace Envoy::Http {
+
+// Error responses asking for a longer Retry-After are not held for longer (the origin may recover sooner)
+constexpr std::chrono::seconds DEFAULT_MAX_RETRY_AFTER {300};
+
+struct FreshnessOptions {
+    // Lifetime of responses without max-age/s-maxage/Expires (0 == they never expire)
+    std::chrono::milliseconds default_ttl_ {0};
+    // Stale window used when the response has no stale-while-revalidate directive
+    std::chrono::milliseconds stale_while_revalidate_ {0};
+    // Negative caching: lifetime of error responses by status code (an unlisted status is not cached)
+    std::unordered_map<uint64_t, std::chrono::milliseconds> error_ttls_ {};
+    // Lifetime of 5xx responses not listed in error_ttls_ (0 == not cached)
+    std::chrono::milliseconds server_error_ttl_ {0};
+    // Retry-After of a cached error response replaces its TTL up to this lifetime
+    std::chrono::milliseconds max_retry_after_ {DEFAULT_MAX_RETRY_AFTER};
+};
+
+/**
+ * @brief Result of evaluating response headers at the time the response is stored.
+ * fresh_until_ == served as a regular cache hit until this time
+ * stale_until_ == served stale (and refreshed in the background) until this time, a cache miss afterwards
+ */
+struct Freshness {
+    bool cacheable_ {true};
+    SystemTime fresh_until_ {SystemTime::max()};
+    SystemTime stale_until_ {SystemTime::max()};
+};
+
+/**
+ * @brief Lifetime precedence: s-maxage, max-age, Expires - Date, options default; Age of the origin is subtracted.
+ * Responses with no-store, no-cache or private are not cacheable by this (shared) cache.
+ */
+Freshness computeFreshness(const ResponseHeaderMap& headers, SystemTime responseTime, const FreshnessOptions& options);
+
+/**
+ * @brief Negative caching of a non-2xx response: fresh for the TTL of its status, or until its Retry-After
+ * (delay-seconds or HTTP-date, capped by max_retry_after_). Not cacheable without a TTL, with no-store, no-cache
+ * or private, or with a Retry-After already elapsed. Errors have no stale window.
+ */
+Freshness computeErrorFreshness(const ResponseHeaderMap& headers, uint64_t status, SystemTime responseTime,
+                                const FreshnessOptions& options);
+
+} // namespace Envoy::Http
@@ -0,0 +1,192 @@
+/***********************************************************************************************************************
+ * Unit tests of the freshness of cached responses: lifetime precedence, Age, stale-while-revalidate window and the
+ * lifetime of negatively cached error responses (TTL by status, Retry-After)
+ ***********************************************************************************************************************/
+
+#include "freshness.h"
+#include "test/test_common/utility.h"
+#include "gtest/gtest.h"
+
+namespace Envoy::Http {
+namespace {
+
+// Tue, 14 Nov 2023 22:13:20 GMT
+const SystemTime RESPONSE_TIME = std::chrono::system_clock::from_time_t(1700000000);
+
+Freshness freshness(TestResponseHeaderMapImpl headers, const FreshnessOptions& options = {}) {
+    return computeFreshness(headers, RESPONSE_TIME, options);
+}
+
+TEST(FreshnessTest, SharedMaxAgeWins) {
+    Freshness result = freshness({{":status", "200"},
+                                  {"cache-control", "max-age=60, s-maxage=120"},
+                                  {"date", "Tue, 14 Nov 2023 22:13:20 GMT"},
+                                  {"expires", "Tue, 14 Nov 2023 22:23:20 GMT"}});
+    EXPECT_TRUE(result.cacheable_);
+    EXPECT_EQ(RESPONSE_TIME + std::chrono::seconds(120), result.fresh_until_);
+    EXPECT_EQ(result.fresh_until_, result.stale_until_);
+}
+
+TEST(FreshnessTest, MaxAgeWinsOverExpires) {
+    Freshness result = freshness({{":status", "200"},
+                                  {"cache-control", "max-age=60"},
+                                  {"date", "Tue, 14 Nov 2023 22:13:20 GMT"},
+                                  {"expires", "Tue, 14 Nov 2023 22:23:20 GMT"}});
+    EXPECT_EQ(RESPONSE_TIME + std::chrono::seconds(60), result.fresh_until_);
+}
+
+TEST(FreshnessTest, ExpiresRelativeToDate) {
+    // Date one minute behind the local clock, the lifetime is Expires - Date
+    Freshness result = freshness({{":status", "200"},
+                                  {"date", "Tue, 14 Nov 2023 22:12:20 GMT"},
+                                  {"expires", "Tue, 14 Nov 2023 22:17:20 GMT"}});
+    EXPECT_TRUE(result.cacheable_);
+    EXPECT_EQ(RESPONSE_TIME + std::chrono::seconds(300), result.fresh_until_);
+
+    // Without Date the lifetime is relative to the response time
+    Freshness noDate = freshness({{":status", "200"}, {"expires", "Tue, 14 Nov 2023 22:15:20 GMT"}});
+    EXPECT_EQ(RESPONSE_TIME + std::chrono::seconds(120), noDate.fresh_until_);
+}
+
+TEST(FreshnessTest, InvalidExpiresIsExpired) {
+    FreshnessOptions options;
+    options.default_ttl_ = std::chrono::seconds(600);
+    Freshness result = freshness({{":status", "200"}, {"expires", "0"}}, options);
+    EXPECT_TRUE(result.cacheable_);
+    EXPECT_EQ(RESPONSE_TIME, result.fresh_until_);
+    EXPECT_EQ(RESPONSE_TIME, result.stale_until_);
+}
+
+TEST(FreshnessTest, AgeIsSubtracted) {
+    Freshness result = freshness({{":status", "200"}, {"cache-control", "max-age=60"}, {"age", "20"}});
+    EXPECT_EQ(RESPONSE_TIME + std::chrono::seconds(40), result.fresh_until_);
+
+    // Older than its lifetime
+    Freshness expired = freshness({{":status", "200"}, {"cache-control", "max-age=60"}, {"age", "90"}});
+    EXPECT_EQ(RESPONSE_TIME, expired.fresh_until_);
+}
+
+TEST(FreshnessTest, DefaultTtl) {
+    FreshnessOptions options;
+    options.default_ttl_ = std::chrono::seconds(30);
+    Freshness result = freshness({{":status", "200"}}, options);
+    EXPECT_TRUE(result.cacheable_);
+    EXPECT_EQ(RESPONSE_TIME + std::chrono::seconds(30), result.fresh_until_);
+
+    // Without default_ttl the entry lives until it is evicted
+    Freshness unset = freshness({{":status", "200"}});
+    EXPECT_TRUE(unset.cacheable_);
+    EXPECT_EQ(SystemTime::max(), unset.fresh_until_);
+    EXPECT_EQ(SystemTime::max(), unset.stale_until_);
+}
+
+TEST(FreshnessTest, StaleWindowFromDirective) {
+    FreshnessOptions options;
+    options.stale_while_revalidate_ = std::chrono::seconds(5);
+    Freshness result = freshness({{":status", "200"}, {"cache-control", "max-age=60, stale-while-revalidate=30"}}, options);
+    EXPECT_EQ(RESPONSE_TIME + std::chrono::seconds(60), result.fresh_until_);
+    EXPECT_EQ(RESPONSE_TIME + std::chrono::seconds(90), result.stale_until_);
+}
+
+TEST(FreshnessTest, StaleWindowFromConfig) {
+    FreshnessOptions options;
+    options.stale_while_revalidate_ = std::chrono::seconds(5);
+    Freshness result = freshness({{":status", "200"}, {"cache-control", "max-age=60"}}, options);
+    EXPECT_EQ(RESPONSE_TIME + std::chrono::seconds(60), result.fresh_until_);
+    EXPECT_EQ(RESPONSE_TIME + std::chrono::seconds(65), result.stale_until_);
+}
+
+TEST(FreshnessTest, NotStoredDirectives) {
+    EXPECT_FALSE(freshness({{":status", "200"}, {"cache-control", "no-store"}}).cacheable_);
+    EXPECT_FALSE(freshness({{":status", "200"}, {"cache-control", "max-age=60, no-cache"}}).cacheable_);
+    EXPECT_FALSE(freshness({{":status", "200"}, {"cache-control", "Private"}}).cacheable_);
+}
+
+TEST(FreshnessTest, DirectivesOfEveryCacheControlLine) {
+    Freshness result = freshness({{":status", "200"}, {"cache-control", "max-age=60"}, {"cache-control", "s-maxage=120"}});
+    EXPECT_EQ(RESPONSE_TIME + std::chrono::seconds(120), result.fresh_until_);
+
+    EXPECT_FALSE(freshness({{":status", "200"}, {"cache-control", "max-age=60"}, {"cache-control", "no-store"}}).cacheable_);
+}
+
+TEST(FreshnessTest, SubSecondDefaultTtlAndStaleWindow) {
+    FreshnessOptions options;
+    options.default_ttl_ = std::chrono::milliseconds(500);
+    options.stale_while_revalidate_ = std::chrono::milliseconds(1500);
+    Freshness result = freshness({{":status", "200"}}, options);
+    EXPECT_EQ(RESPONSE_TIME + std::chrono::milliseconds(500), result.fresh_until_);
+    EXPECT_EQ(RESPONSE_TIME + std::chrono::milliseconds(2000), result.stale_until_);
+}
+
+FreshnessOptions errorOptions() {
+    FreshnessOptions options;
+    options.error_ttls_[404] = std::chrono::seconds(30);
+    options.server_error_ttl_ = std::chrono::seconds(10);
+    options.max_retry_after_ = std::chrono::seconds(300);
+    return options;
+}
+
+Freshness errorFreshness(uint64_t status, TestResponseHeaderMapImpl headers) {
+    return computeErrorFreshness(headers, status, RESPONSE_TIME, errorOptions());
+}
+
+TEST(FreshnessTest, ErrorTtlByStatus) {
+    Freshness notFound = errorFreshness(404, {{":status", "404"}});
+    EXPECT_TRUE(notFound.cacheable_);
+    EXPECT_EQ(RESPONSE_TIME + std::chrono::seconds(30), notFound.fresh_until_);
+    EXPECT_EQ(notFound.fresh_until_, notFound.stale_until_);
+
+    Freshness unavailable = errorFreshness(503, {{":status", "503"}});
+    EXPECT_TRUE(unavailable.cacheable_);
+    EXPECT_EQ(RESPONSE_TIME + std::chrono::seconds(10), unavailable.fresh_until_);
+
+    EXPECT_FALSE(errorFreshness(403, {{":status", "403"}}).cacheable_);
+    EXPECT_FALSE(errorFreshness(503, {{":status", "503"}, {"cache-control", "no-store"}}).cacheable_);
+}
+
+TEST(FreshnessTest, RetryAfterSeconds) {
+    Freshness freshness = errorFreshness(503, {{":status", "503"}, {"retry-after", "120"}});
+    EXPECT_TRUE(freshness.cacheable_);
+    EXPECT_EQ(RESPONSE_TIME + std::chrono::seconds(120), freshness.fresh_until_);
+
+    EXPECT_FALSE(errorFreshness(503, {{":status", "503"}, {"retry-after", "0"}}).cacheable_);
+}
+
+TEST(FreshnessTest, RetryAfterHttpDate) {
+    Freshness freshness = errorFreshness(503, {{":status", "503"}, {"retry-after", "Tue, 14 Nov 2023 22:15:20 GMT"}});
+    EXPECT_TRUE(freshness.cacheable_);
+    EXPECT_EQ(RESPONSE_TIME + std::chrono::seconds(120), freshness.fresh_until_);
+
+    // Already elapsed
+    EXPECT_FALSE(
+        errorFreshness(503, {{":status", "503"}, {"retry-after", "Tue, 14 Nov 2023 22:11:40 GMT"}}).cacheable_);
+}
+
+TEST(FreshnessTest, RetryAfterIsCapped) {
+    Freshness seconds = errorFreshness(503, {{":status", "503"}, {"retry-after", "86400"}});
+    EXPECT_TRUE(seconds.cacheable_);
+    EXPECT_EQ(RESPONSE_TIME + std::chrono::seconds(300), seconds.fresh_until_);
+
+    Freshness date = errorFreshness(503, {{":status", "503"}, {"retry-after", "Wed, 15 Nov 2023 22:13:20 GMT"}});
+    EXPECT_TRUE(date.cacheable_);
+    EXPECT_EQ(RESPONSE_TIME + std::chrono::seconds(300), date.fresh_until_);
+}
+
+TEST(FreshnessTest, RetryAfterWithoutTtlIsNotCached) {
+    EXPECT_FALSE(errorFreshness(429, {{":status", "429"}, {"retry-after", "60"}}).cacheable_);
+}
+
+TEST(FreshnessTest, SubSecondErrorTtl) {
+    FreshnessOptions options = errorOptions();
+    options.error_ttls_[404] = std::chrono::milliseconds(250);
+    options.server_error_ttl_ = std::chrono::milliseconds(1500);
+    TestResponseHeaderMapImpl notFound {{":status", "404"}};
+    EXPECT_EQ(RESPONSE_TIME + std::chrono::milliseconds(250),
+              computeErrorFreshness(notFound, 404, RESPONSE_TIME, options).fresh_until_);
+    TestResponseHeaderMapImpl unavailable {{":status", "503"}};
+    EXPECT_EQ(RESPONSE_TIME + std::chrono::milliseconds(1500),
+              computeErrorFreshness(unavailable, 503, RESPONSE_TIME, options).fresh_until_);
+}
+
+} // namespace
+} // namespace Envoy::Http
@@ -0,0 +1,380 @@
+/***********************************************************************************************************************
+ * Microbenchmarks of the cache data path.
+ * Run with: bazel run -c opt //:http_cache_rc_benchmark
+ * Compare runs with: bazel run -c opt //:http_cache_rc_benchmark -- --benchmark_out=run.json --benchmark_out_format=json
+ * Throughput is reported as items_per_second (ops/s) and bytes_per_second.
+ ***********************************************************************************************************************/
+
+#include "benchmark/benchmark.h"
+#include "http_lru_ram_cache.h"
+#include "l1_cache.h"
+#include "ring_buffer.h"
+#include "source/common/common/utility.h"
+#include "test/mocks/http/mocks.h"
+
+#include <cmath>
+#include <random>
+
+namespace Envoy::Http {
+
+constexpr uint32_t BENCHMARK_CACHE_CAPACITY = 4096; // number of entries
+constexpr uint32_t BENCHMARK_HOT_KEYS = 1024;       // working set, fits into the cache
+
+static std::vector<CacheKey> createKeys(uint32_t keyCount) {
+    std::vector<CacheKey> keys;
+    keys.reserve(keyCount);
+    for (uint32_t i = 0; i < keyCount; ++i) {
+        keys.emplace_back(CacheKeyBuilder::fromString("www.envoyproxy.io/docs/" + std::to_string(i) + "GEThttpcurl/8.5.0"));
+    }
+    return keys;
+}
+
+/**
+ * @brief Generator of key indexes with Zipfian distribution (index 0 is the most popular key).
+ */
+class ZipfianGenerator {
+public:
+    ZipfianGenerator(uint32_t keyCount, double exponent, uint32_t seed) : random_engine_(seed) {
+        cdf_.reserve(keyCount);
+        double sum = 0;
+        for (uint32_t i = 1; i <= keyCount; ++i) {
+            sum += 1.0 / std::pow(i, exponent);
+            cdf_.push_back(sum);
+        }
+        for (auto& value: cdf_) {
+            value /= sum;
+        }
+    }
+    uint32_t next() {
+        double sample = distribution_(random_engine_);
+        return static_cast<uint32_t>(std::lower_bound(cdf_.begin(), cdf_.end(), sample) - cdf_.begin());
+    }
+
+private:
+    std::vector<double> cdf_ {};
+    std::mt19937 random_engine_;
+    std::uniform_real_distribution<double> distribution_ {0.0, 1.0};
+};
+
+// Downstream of the consumer: encoded data are dropped, so repeated serving does not accumulate buffers
+static void drainEncodedData(testing::NiceMock<MockStreamDecoderFilterCallbacks>& decoderCallbacks) {
+    ON_CALL(decoderCallbacks, encodeData(testing::_, testing::_))
+        .WillByDefault([](Buffer::Instance& data, bool) { data.drain(data.length()); });
+}
+
+// Complete response with body of bodySize bytes received in 16 KiB frames
+static CacheEntrySharedPtr fillCacheEntry(BodyStorage bodyStorage, uint64_t bodySize, TimeSource& timeSource) {
+    constexpr uint32_t frameSize = 16 * 1024;
+    auto headers = ResponseHeaderMapImpl::create();
+    headers->setStatus(200);
+    headers->setContentLength(bodySize);
+    Buffer::OwnedImpl frame(std::string(std::min<uint64_t>(frameSize, bodySize), 'x'));
+    CacheEntryProducer producer;
+    producer.initCacheEntry(1024, bodyStorage, DEFAULT_SEGMENT_SIZE_BYTES, timeSource);
+    producer.writeHeaders(*headers, false);
+    producer.headersWriteComplete();
+    for (uint64_t written = 0; written < bodySize; written += frame.length()) {
+        producer.writeData(frame, written + frame.length() >= bodySize);
+    }
+    producer.writeComplete();
+    return producer.getCacheEntryPtr();
+}
+
+// Hit throughput of HTTPLRURAMCache::at() with state.range(0) shards and eviction policy state.range(1)
+// (0 == LRU, 1 == CLOCK), run with 1..N worker threads
+static void BM_HTTPLRURAMCacheHit(benchmark::State& state) {
+    static std::unique_ptr<HTTPLRURAMCache> cache;
+    static std::vector<CacheKey> keys;
+    if (state.thread_index() == 0) {
+        cache = std::make_unique<HTTPLRURAMCache>();
+        HTTPLRURAMCacheOptions options;
+        options.capacity_ = BENCHMARK_CACHE_CAPACITY;
+        options.shard_count_ = static_cast<uint32_t>(state.range(0));
+        options.eviction_policy_ = state.range(1) == 1 ? EvictionPolicy::CLOCK : EvictionPolicy::LRU;
+        cache->initCache(options);
+        keys = createKeys(BENCHMARK_HOT_KEYS);
+        for (const auto& key: keys) {
+            cache->insert(key, std::make_shared<CacheEntry>(1));
+        }
+    }
+    // Every thread walks the hot set with a different stride, so threads do not hit the same key in lockstep
+    uint32_t index = static_cast<uint32_t>(state.thread_index()) * 7919;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(cache->at(keys[index % BENCHMARK_HOT_KEYS]));
+        index += 31;
+    }
+    state.SetItemsProcessed(state.iterations());
+    if (state.thread_index() == 0) {
+        cache.reset();
+    }
+}
+BENCHMARK(BM_HTTPLRURAMCacheHit)->ArgsProduct({{1, 16}, {0, 1}})->ThreadRange(1, 16)->UseRealTime();
+
+// Hit throughput with a per-worker L1 of state.range(0) entries in front of a single-shard LRU cache
+// (the same lookup path as HttpCacheRCFilter::lookup()), run with 1..N worker threads
+static void BM_L1CacheHit(benchmark::State& state) {
+    static std::unique_ptr<HTTPLRURAMCache> cache;
+    static std::vector<CacheKey> keys;
+    if (state.thread_index() == 0) {
+        cache = std::make_unique<HTTPLRURAMCache>();
+        HTTPLRURAMCacheOptions options;
+        options.capacity_ = BENCHMARK_CACHE_CAPACITY;
+        cache->initCache(options);
+        keys = createKeys(BENCHMARK_HOT_KEYS);
+        for (const auto& key: keys) {
+            cache->insert(key, std::make_shared<CacheEntry>(1));
+        }
+    }
+    ThreadLocalL1Cache l1Cache(static_cast<uint32_t>(state.range(0)));
+    // Zipfian traffic, so the hottest keys stay in the small L1
+    ZipfianGenerator zipfian(BENCHMARK_HOT_KEYS, 0.9, 42 + state.thread_index());
+    bool touchShared = false;
+    for (auto _ : state) {
+        const CacheKey& key = keys[zipfian.next()];
+        CacheEntrySharedPtr entry = l1Cache.at(key, touchShared);
+        if (entry == nullptr || touchShared) {
+            entry = cache->at(key);
+            if (entry != nullptr && !touchShared) {
+                l1Cache.insert(key, entry);
+            }
+        }
+        benchmark::DoNotOptimize(entry);
+    }
+    state.SetItemsProcessed(state.iterations());
+    if (state.thread_index() == 0) {
+        cache.reset();
+    }
+}
+BENCHMARK(BM_L1CacheHit)->Arg(64)->Arg(256)->ThreadRange(1, 16)->UseRealTime();
+
+// Mixed at()/insert() throughput under Zipfian traffic over 4x more keys than the cache holds (misses insert),
+// eviction policy state.range(0) (0 == LRU, 1 == CLOCK), 16 shards, run with 1..N worker threads.
+// Every miss inserts an entry of its own like a fill does: a shared entry would be attached to every shard counter
+// in turn, stay marked evicted and serialize all threads on its footprint lock
+static void BM_HTTPLRURAMCacheZipfian(benchmark::State& state) {
+    constexpr uint32_t keyCount = 4 * BENCHMARK_CACHE_CAPACITY;
+    static std::unique_ptr<HTTPLRURAMCache> cache;
+    static std::vector<CacheKey> keys;
+    if (state.thread_index() == 0) {
+        cache = std::make_unique<HTTPLRURAMCache>();
+        HTTPLRURAMCacheOptions options;
+        options.capacity_ = BENCHMARK_CACHE_CAPACITY;
+        options.shard_count_ = 16;
+        options.eviction_policy_ = state.range(0) == 1 ? EvictionPolicy::CLOCK : EvictionPolicy::LRU;
+        cache->initCache(options);
+        keys = createKeys(keyCount);
+    }
+    ZipfianGenerator zipfian(keyCount, 0.9, 42 + state.thread_index());
+    uint64_t hits = 0;
+    for (auto _ : state) {
+        const CacheKey& key = keys[zipfian.next()];
+        if (cache->at(key) != nullptr) {
+            ++hits;
+        }
+        else {
+            cache->insert(key, std::make_shared<CacheEntry>(1));
+        }
+    }
+    state.SetItemsProcessed(state.iterations());
+    state.counters["hit_ratio"] = benchmark::Counter(static_cast<double>(hits) / static_cast<double>(std::max<int64_t>(state.iterations(), 1)),
+                                                     benchmark::Counter::kAvgThreads);
+    if (state.thread_index() == 0) {
+        cache.reset();
+    }
+}
+BENCHMARK(BM_HTTPLRURAMCacheZipfian)->Arg(0)->Arg(1)->ThreadRange(1, 16)->UseRealTime();
+
+// Hit ratio of the admission policy state.range(0) (0 == NONE, 1 == TINY_LFU) under Zipfian traffic,
+// every 8th request is part of a sequential scan over keys that are never requested again (crawler)
+static void BM_HTTPLRURAMCacheHitRatio(benchmark::State& state) {
+    constexpr uint32_t keyCount = 64 * BENCHMARK_CACHE_CAPACITY;
+    HTTPLRURAMCacheOptions options;
+    options.capacity_ = BENCHMARK_CACHE_CAPACITY;
+    options.admission_policy_ = state.range(0) == 1 ? AdmissionPolicy::TINY_LFU : AdmissionPolicy::NONE;
+    HTTPLRURAMCache cache;
+    cache.initCache(options);
+    std::vector<CacheKey> keys = createKeys(keyCount);
+    ZipfianGenerator zipfian(keyCount, 0.9, 42);
+    uint64_t hits = 0, lookups = 0, scanIndex = 0;
+    for (auto _ : state) {
+        CacheKey key = (lookups % 8 == 7) ? CacheKeyBuilder::fromString("scan/" + std::to_string(scanIndex++))
+                                          : keys[zipfian.next()];
+        if (cache.at(key) != nullptr) {
+            ++hits;
+        }
+        else {
+            cache.insert(key, std::make_shared<CacheEntry>(1));
+        }
+        ++lookups;
+    }
+    state.counters["hit_ratio"] = static_cast<double>(hits) / static_cast<double>(std::max<uint64_t>(lookups, 1));
+}
+BENCHMARK(BM_HTTPLRURAMCacheHitRatio)->Arg(0)->Arg(1);
+
+// Fill and serve of one response with body storage state.range(0) (0 == RING_BUFFER_BLOCKS, 1 == BUFFER_SLICES,
+// 2 == SEGMENTS) and body of state.range(1) bytes, received in 16 KiB frames;
+// counter "footprint_per_body_byte" is the memory of the whole entry divided by the size of the body
+static void BM_CacheEntryBodyStorage(benchmark::State& state) {
+    constexpr uint32_t frameSize = 16 * 1024;
+    const auto bodyStorage = static_cast<BodyStorage>(state.range(0));
+    const auto bodySize = static_cast<uint64_t>(state.range(1));
+    RealTimeSource timeSource;
+    testing::NiceMock<MockStreamDecoderFilterCallbacks> decoderCallbacks;
+    auto headers = ResponseHeaderMapImpl::create();
+    headers->setStatus(200);
+    headers->setContentLength(bodySize);
+    Buffer::OwnedImpl frame(std::string(frameSize, 'x'));
+    uint64_t footprintBytes = 0;
+
+    for (auto _ : state) {
+        CacheEntryProducer producer;
+        producer.initCacheEntry(1024, bodyStorage, DEFAULT_SEGMENT_SIZE_BYTES, timeSource);
+        producer.writeHeaders(*headers, false);
+        producer.headersWriteComplete();
+        for (uint64_t written = 0; written < bodySize; written += frameSize) {
+            producer.writeData(frame, written + frameSize >= bodySize);
+        }
+        producer.writeComplete();
+
+        auto consumer = std::make_shared<CacheEntryConsumer>(&decoderCallbacks);
+        consumer->serveCachedResponse(producer.getCacheEntryPtr());
+        footprintBytes = producer.getCacheEntryPtr()->footprintBytes();
+    }
+    state.SetBytesProcessed(static_cast<int64_t>(state.iterations() * bodySize));
+    state.counters["footprint_per_body_byte"] = static_cast<double>(footprintBytes) / static_cast<double>(bodySize);
+}
+BENCHMARK(BM_CacheEntryBodyStorage)->ArgsProduct({{0, 1, 2}, {64 * 1024, 1024 * 1024}});
+
+// RingBufferQueue::write() of state.range(0) blocks (a new queue per iteration, as a cache entry would allocate it)
+static void BM_RingBufferQueueWrite(benchmark::State& state) {
+    const auto blockCount = static_cast<uint32_t>(state.range(0));
+    uint8_t payload[BLOCK_SIZE_BYTES];
+    memset(payload, 'x', BLOCK_SIZE_BYTES);
+    const WriteCallback writeCb = [&payload](uint8_t* data) { memcpy(data, payload, BLOCK_SIZE_BYTES); };
+    for (auto _ : state) {
+        RingBufferQueue queue(blockCount);
+        for (uint32_t i = 0; i < blockCount; ++i) {
+            queue.write(BLOCK_SIZE_BYTES, writeCb);
+        }
+        benchmark::ClobberMemory();
+    }
+    state.SetItemsProcessed(static_cast<int64_t>(state.iterations() * blockCount));
+    state.SetBytesProcessed(static_cast<int64_t>(state.iterations() * blockCount * BLOCK_SIZE_BYTES));
+}
+BENCHMARK(BM_RingBufferQueueWrite)->Arg(64)->Arg(1024)->Arg(16 * 1024);
+
+// RingBufferQueue::read() of all blocks of a full queue of state.range(0) blocks
+static void BM_RingBufferQueueRead(benchmark::State& state) {
+    const auto blockCount = static_cast<uint32_t>(state.range(0));
+    RingBufferQueue queue(blockCount);
+    for (uint32_t i = 0; i < blockCount; ++i) {
+        queue.write(BLOCK_SIZE_BYTES, [](uint8_t* data) { memset(data, 'x', BLOCK_SIZE_BYTES); });
+    }
+    uint8_t block[BLOCK_SIZE_BYTES];
+    MessageSize size = 0;
+    for (auto _ : state) {
+        for (uint32_t i = 0; i < blockCount; ++i) {
+            queue.read(i, block, size);
+        }
+        benchmark::DoNotOptimize(block);
+    }
+    state.SetItemsProcessed(static_cast<int64_t>(state.iterations() * blockCount));
+    state.SetBytesProcessed(static_cast<int64_t>(state.iterations() * blockCount * BLOCK_SIZE_BYTES));
+}
+BENCHMARK(BM_RingBufferQueueRead)->Arg(64)->Arg(1024)->Arg(16 * 1024);
+
+// CacheEntryProducer writing headers and a body of state.range(1) bytes with body storage state.range(0)
+static void BM_CacheEntryProducerWrite(benchmark::State& state) {
+    const auto bodyStorage = static_cast<BodyStorage>(state.range(0));
+    const auto bodySize = static_cast<uint64_t>(state.range(1));
+    RealTimeSource timeSource;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(fillCacheEntry(bodyStorage, bodySize, timeSource));
+    }
+    state.SetItemsProcessed(state.iterations());
+    state.SetBytesProcessed(static_cast<int64_t>(state.iterations() * bodySize));
+}
+BENCHMARK(BM_CacheEntryProducerWrite)->ArgsProduct({{0, 1, 2}, {1024, 64 * 1024, 1024 * 1024}});
+
+// CacheEntryConsumer replaying a complete cached response (body of state.range(1) bytes, body storage state.range(0))
+// into mock decoder callbacks, per cache hit
+static void BM_CacheEntryConsumerServe(benchmark::State& state) {
+    const auto bodyStorage = static_cast<BodyStorage>(state.range(0));
+    const auto bodySize = static_cast<uint64_t>(state.range(1));
+    RealTimeSource timeSource;
+    testing::NiceMock<MockStreamDecoderFilterCallbacks> decoderCallbacks;
+    drainEncodedData(decoderCallbacks);
+    CacheEntrySharedPtr entry = fillCacheEntry(bodyStorage, bodySize, timeSource);
+    for (auto _ : state) {
+        auto consumer = std::make_shared<CacheEntryConsumer>(&decoderCallbacks);
+        consumer->serveCachedResponse(entry);
+    }
+    state.SetItemsProcessed(state.iterations());
+    state.SetBytesProcessed(static_cast<int64_t>(state.iterations() * bodySize));
+}
+BENCHMARK(BM_CacheEntryConsumerServe)->ArgsProduct({{0, 1, 2}, {1024, 64 * 1024, 1024 * 1024}});
+
+// Cost of serving the headers of a cached response with state.range(0) headers, per cache hit
+static void BM_CacheEntryServeHeaders(benchmark::State& state) {
+    RealTimeSource timeSource;
+    testing::NiceMock<MockStreamDecoderFilterCallbacks> decoderCallbacks;
+    auto headers = ResponseHeaderMapImpl::create();
+    headers->setStatus(200);
+    headers->setContentType("text/html; charset=utf-8");
+    headers->setContentLength(0);
+    for (int64_t i = 3; i < state.range(0); ++i) {
+        headers->addCopy(LowerCaseString("x-origin-header-" + std::to_string(i)),
+                         "value of the origin header number " + std::to_string(i));
+    }
+    CacheEntryProducer producer;
+    producer.initCacheEntry(1024, BodyStorage::RING_BUFFER_BLOCKS, DEFAULT_SEGMENT_SIZE_BYTES, timeSource);
+    producer.writeHeaders(*headers, true);
+    producer.writeComplete();
+    CacheEntrySharedPtr entry = producer.getCacheEntryPtr();
+
+    for (auto _ : state) {
+        auto consumer = std::make_shared<CacheEntryConsumer>(&decoderCallbacks);
+        consumer->serveCachedResponse(entry);
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_CacheEntryServeHeaders)->Arg(8)->Arg(32);
+
+// Cost of computing the cache key of a request, state.range(0) == 0 default spec, 1 == spec with query parameters
+// and cookies
+static void BM_CacheKeyBuild(benchmark::State& state) {
+    CacheKeySpec spec = CacheKeySpec::defaultSpec();
+    if (state.range(0) == 1) {
+        spec.query_parameters_ = {"page", "lang"};
+        spec.cookies_ = {"session"};
+    }
+    CacheKeyBuilder keyBuilder(std::move(spec));
+    auto headers = RequestHeaderMapImpl::create();
+    headers->setHost("www.envoyproxy.io");
+    headers->setPath("/docs/envoy/latest/intro/arch_overview?lang=en&page=2&utm_source=newsletter");
+    headers->setMethod("GET");
+    headers->setScheme("http");
+    headers->setUserAgent("curl/8.5.0");
+    headers->addCopy(LowerCaseString("cookie"), "theme=dark; session=0123456789abcdef; consent=1");
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(keyBuilder.build(*headers));
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_CacheKeyBuild)->Arg(0)->Arg(1);
+
+// Cost of selecting the variant of a response with "Vary: Accept-Encoding, Accept-Language"
+static void BM_CacheKeyVariant(benchmark::State& state) {
+    const CacheKey primaryKey = CacheKeyBuilder::fromString("www.envoyproxy.io/docs/envoy/latest/intro/arch_overview");
+    const std::vector<LowerCaseString> varyHeaders {LowerCaseString("accept-encoding"), LowerCaseString("accept-language")};
+    auto headers = RequestHeaderMapImpl::create();
+    headers->addCopy(LowerCaseString("accept-encoding"), "gzip, deflate, br;q=0.9, zstd;q=0");
+    headers->addCopy(LowerCaseString("accept-language"), "en-US,en;q=0.5");
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(CacheKeyBuilder::variantKey(primaryKey, varyHeaders, *headers));
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_CacheKeyVariant);
+
+} // namespace Envoy::Http
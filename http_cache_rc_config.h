@@ -1,24 +1,242 @@
 #pragma once
 
+#include "envoy/stats/scope.h"
+#include "envoy/stats/stats_macros.h"
+#include "source/common/protobuf/utility.h"
+#include "source/extensions/compression/gzip/compressor/config.h"
+#include "source/extensions/compression/gzip/decompressor/config.h"
+#include "absl/status/status.h"
+#include "absl/strings/ascii.h"
 #include "http_cache_rc.pb.h"
+#include "http_lru_ram_cache.h"
+#include "disk_cache.h"
+#include "cache_key.h"
+#include "body_compression.h"
 
 namespace Envoy::Http {
 
+constexpr std::chrono::milliseconds DEFAULT_FOLLOWER_TIMEOUT {5000};
+
+/**
+ * All stats of the filter (prefix "http_cache_rc."). @see stats_macros.h
+ */
+#define ALL_HTTP_CACHE_RC_STATS(COUNTER, GAUGE, HISTOGRAM)                                                              \
+    COUNTER(hits)                                                                                                      \
+    COUNTER(stale_hits)                                                                                                \
+    COUNTER(misses)                                                                                                    \
+    COUNTER(coalesced)                                                                                                 \
+    COUNTER(follower_timeouts)                                                                                         \
+    COUNTER(evictions)                                                                                                 \
+    COUNTER(refreshes)                                                                                                 \
+    COUNTER(disk_hits)                                                                                                 \
+    COUNTER(snapshot_restores)                                                                                         \
+    COUNTER(oversized)                                                                                                 \
+    COUNTER(errors_cached)                                                                                             \
+    GAUGE(bytes_stored, NeverImport)                                                                                   \
+    GAUGE(entries, NeverImport)                                                                                        \
+    GAUGE(disk_bytes_stored, NeverImport)                                                                              \
+    GAUGE(disk_entries, NeverImport)                                                                                   \
+    HISTOGRAM(lookup_time_us, Microseconds)                                                                            \
+    HISTOGRAM(follower_wait_time_ms, Milliseconds)                                                                     \
+    HISTOGRAM(hit_ttfb_us, Microseconds)
+
+struct HttpCacheRCStats {
+    ALL_HTTP_CACHE_RC_STATS(GENERATE_COUNTER_STRUCT, GENERATE_GAUGE_STRUCT, GENERATE_HISTOGRAM_STRUCT)
+};
+
 /**
  * @brief Config class which is used by the filter factory class.
- * Contains configurable parameter uint32_t for allocating ring buffers.
+ * Contains configurable parameters for allocating ring buffers and the cache.
  */
 class HttpCacheRCConfig {
 public:
-    explicit HttpCacheRCConfig(const envoy::extensions::filters::http::http_cache_rc::Codec &proto_config)
+    HttpCacheRCConfig(const envoy::extensions::filters::http::http_cache_rc::Codec &proto_config, Stats::Scope &scope)
         : ring_buffer_capacity_(proto_config.ring_buffer_capacity()),
-          cache_capacity_(proto_config.cache_capacity()) {}
+          cache_options_(createCacheOptions(proto_config)),
+          follower_timeout_(proto_config.has_follower_timeout()
+                            ? std::chrono::milliseconds(DurationUtil::durationToMilliseconds(proto_config.follower_timeout()))
+                            : DEFAULT_FOLLOWER_TIMEOUT),
+          body_storage_(createBodyStorage(proto_config)),
+          segment_size_(proto_config.segment_size() > 0 ? proto_config.segment_size() : DEFAULT_SEGMENT_SIZE_BYTES),
+          key_builder_(createKeySpec(proto_config)),
+          freshness_options_(createFreshnessOptions(proto_config)),
+          l1_capacity_(proto_config.l1_capacity()),
+          disk_cache_options_(createDiskCacheOptions(proto_config)),
+          snapshot_path_(proto_config.snapshot_path()),
+          compression_options_(createCompressionOptions(proto_config)),
+          compressor_factory_(createCompressorFactory(proto_config)),
+          decompressor_factory_(createDecompressorFactory(scope)),
+          max_object_bytes_(createMaxObjectBytes(cache_options_, proto_config.max_object_bytes())),
+          stats_(generateStats(scope)) {}
+    // Checks the proto validation rules cannot express, called before the config is created
+    static absl::Status validate(const envoy::extensions::filters::http::http_cache_rc::Codec &proto_config) {
+        const CacheKeySpec spec = createKeySpec(proto_config);
+        if (!spec.include_host_ && !spec.include_path_) {
+            // Every URL with the same remaining parts would share one entry
+            return absl::InvalidArgumentError("http_cache_rc: key_spec must include the host or the path");
+        }
+        return absl::OkStatus();
+    }
     const uint32_t &ring_buffer_capacity() const { return ring_buffer_capacity_; }
-    const uint32_t &cache_capacity() const { return cache_capacity_; }
+    const uint32_t &cache_capacity() const { return cache_options_.capacity_; }
+    const uint32_t &cache_shard_count() const { return cache_options_.shard_count_; }
+    const uint64_t &max_bytes() const { return cache_options_.max_bytes_; }
+    const HTTPLRURAMCacheOptions &cache_options() const { return cache_options_; }
+    // Wait of a parked request for the leader before the jitter is added
+    const std::chrono::milliseconds &follower_timeout() const { return follower_timeout_; }
+    const BodyStorage &body_storage() const { return body_storage_; }
+    const uint32_t &segment_size() const { return segment_size_; }
+    const CacheKeyBuilder &key_builder() const { return key_builder_; }
+    const FreshnessOptions &freshness_options() const { return freshness_options_; }
+    const uint32_t &l1_capacity() const { return l1_capacity_; }
+    const std::optional<DiskCacheOptions> &disk_cache_options() const { return disk_cache_options_; }
+    const std::string &snapshot_path() const { return snapshot_path_; }
+    // Compressor of a body stored compressed at rest, nullptr if the response is stored as received
+    Compression::Compressor::CompressorPtr createCompressor(const ResponseHeaderMap &headers) const {
+        if (compressor_factory_ == nullptr || !isCompressibleResponse(headers, compression_options_)) {
+            return nullptr;
+        }
+        return compressor_factory_->createCompressor();
+    }
+    // Created even without compression, entries restored from disk or a snapshot may be compressed
+    Compression::Decompressor::DecompressorFactory &decompressor_factory() const { return *decompressor_factory_; }
+    // Body of this many bytes (as received from the origin) is too large to be cached (max_object_bytes, at most
+    // the budget of one cache shard, a larger entry would flush its shard and still stay over the budget)
+    bool exceedsMaxObjectBytes(uint64_t bytes) const { return max_object_bytes_ > 0 && bytes > max_object_bytes_; }
+    const HttpCacheRCStats &stats() const { return stats_; }
 
 private:
+    static HTTPLRURAMCacheOptions createCacheOptions(const envoy::extensions::filters::http::http_cache_rc::Codec &proto_config) {
+        HTTPLRURAMCacheOptions options;
+        options.capacity_ = proto_config.cache_capacity();
+        options.shard_count_ = std::max<uint32_t>(proto_config.cache_shard_count(), 1);
+        options.max_bytes_ = proto_config.max_bytes();
+        options.admission_policy_ = proto_config.admission_policy() == envoy::extensions::filters::http::http_cache_rc::Codec::TINY_LFU
+                                    ? AdmissionPolicy::TINY_LFU : AdmissionPolicy::NONE;
+        options.eviction_policy_ = proto_config.eviction_policy() == envoy::extensions::filters::http::http_cache_rc::Codec::CLOCK
+                                   ? EvictionPolicy::CLOCK : EvictionPolicy::LRU;
+        return options;
+    }
+
+    static uint64_t createMaxObjectBytes(const HTTPLRURAMCacheOptions &cacheOptions, uint64_t maxObjectBytes) {
+        if (cacheOptions.max_bytes_ == 0) {
+            return maxObjectBytes;
+        }
+        const uint64_t shardMaxBytes = std::max<uint64_t>(cacheOptions.max_bytes_ / cacheOptions.shard_count_, 1);
+        return maxObjectBytes == 0 ? shardMaxBytes : std::min(maxObjectBytes, shardMaxBytes);
+    }
+
+    static BodyStorage createBodyStorage(const envoy::extensions::filters::http::http_cache_rc::Codec &proto_config) {
+        switch (proto_config.body_storage()) {
+        case envoy::extensions::filters::http::http_cache_rc::Codec::BUFFER_SLICES:
+            return BodyStorage::BUFFER_SLICES;
+        case envoy::extensions::filters::http::http_cache_rc::Codec::SEGMENTS:
+            return BodyStorage::SEGMENTS;
+        default:
+            return BodyStorage::RING_BUFFER_BLOCKS;
+        }
+    }
+
+    static CacheKeySpec createKeySpec(const envoy::extensions::filters::http::http_cache_rc::Codec &proto_config) {
+        if (!proto_config.has_key_spec()) {
+            return CacheKeySpec::defaultSpec();
+        }
+        const auto &protoSpec = proto_config.key_spec();
+        // Parts left unset stay in the key, listing query parameters must not drop the host and path
+        CacheKeySpec spec;
+        spec.include_host_ = !protoSpec.has_include_host() || protoSpec.include_host().value();
+        spec.include_path_ = !protoSpec.has_include_path() || protoSpec.include_path().value();
+        spec.include_method_ = !protoSpec.has_include_method() || protoSpec.include_method().value();
+        spec.include_scheme_ = !protoSpec.has_include_scheme() || protoSpec.include_scheme().value();
+        for (const auto &header: protoSpec.headers()) {
+            spec.headers_.emplace_back(header);
+        }
+        spec.query_parameters_.assign(protoSpec.query_parameters().begin(), protoSpec.query_parameters().end());
+        spec.cookies_.assign(protoSpec.cookies().begin(), protoSpec.cookies().end());
+        return spec;
+    }
+
+    static FreshnessOptions createFreshnessOptions(const envoy::extensions::filters::http::http_cache_rc::Codec &proto_config) {
+        FreshnessOptions options;
+        options.default_ttl_ = std::chrono::milliseconds(DurationUtil::durationToMilliseconds(proto_config.default_ttl()));
+        options.stale_while_revalidate_ =
+            std::chrono::milliseconds(DurationUtil::durationToMilliseconds(proto_config.stale_while_revalidate()));
+        const auto &negativeCaching = proto_config.negative_caching();
+        for (const auto &statusTtl: negativeCaching.status_ttls()) {
+            options.error_ttls_[statusTtl.status()] =
+                std::chrono::milliseconds(DurationUtil::durationToMilliseconds(statusTtl.ttl()));
+        }
+        options.server_error_ttl_ =
+            std::chrono::milliseconds(DurationUtil::durationToMilliseconds(negativeCaching.server_error_ttl()));
+        if (negativeCaching.has_max_retry_after()) {
+            options.max_retry_after_ =
+                std::chrono::milliseconds(DurationUtil::durationToMilliseconds(negativeCaching.max_retry_after()));
+        }
+        return options;
+    }
+
+    static std::optional<DiskCacheOptions> createDiskCacheOptions(const envoy::extensions::filters::http::http_cache_rc::Codec &proto_config) {
+        if (!proto_config.has_disk_cache()) {
+            return std::nullopt;
+        }
+        DiskCacheOptions options;
+        options.path_ = proto_config.disk_cache().path();
+        options.max_bytes_ = proto_config.disk_cache().max_bytes();
+        if (proto_config.disk_cache().segment_bytes() > 0) {
+            options.segment_bytes_ = proto_config.disk_cache().segment_bytes();
+        }
+        return options;
+    }
+
+    static CompressionOptions createCompressionOptions(const envoy::extensions::filters::http::http_cache_rc::Codec &proto_config) {
+        CompressionOptions options;
+        if (proto_config.compression().min_bytes() > 0) {
+            options.min_bytes_ = proto_config.compression().min_bytes();
+        }
+        for (const auto &contentType: proto_config.compression().content_types()) {
+            options.content_types_.push_back(absl::AsciiStrToLower(contentType));
+        }
+        return options;
+    }
+
+    static Compression::Compressor::CompressorFactoryPtr createCompressorFactory(const envoy::extensions::filters::http::http_cache_rc::Codec &proto_config) {
+        if (!proto_config.has_compression()) {
+            return nullptr;
+        }
+        // Window of 32 KiB: the compressor lives only while the response is filled, the ratio lasts for the entry
+        envoy::extensions::compression::gzip::compressor::v3::Gzip gzip;
+        gzip.mutable_window_bits()->set_value(15);
+        return std::make_unique<Extensions::Compression::Gzip::Compressor::GzipCompressorFactory>(gzip);
+    }
+
+    static Compression::Decompressor::DecompressorFactoryPtr createDecompressorFactory(Stats::Scope &scope) {
+        // Bodies were compressed by this filter, the inflate ratio of highly repetitive ones is not an attack
+        envoy::extensions::compression::gzip::decompressor::v3::Gzip gzip;
+        gzip.mutable_max_inflate_ratio()->set_value(1032);
+        return std::make_unique<Extensions::Compression::Gzip::Decompressor::GzipDecompressorFactory>(gzip, scope);
+    }
+
+    static HttpCacheRCStats generateStats(Stats::Scope &scope) {
+        const std::string prefix = "http_cache_rc.";
+        return {ALL_HTTP_CACHE_RC_STATS(POOL_COUNTER_PREFIX(scope, prefix), POOL_GAUGE_PREFIX(scope, prefix),
+                                        POOL_HISTOGRAM_PREFIX(scope, prefix))};
+    }
+
     const uint32_t ring_buffer_capacity_;
-    const uint32_t cache_capacity_;
+    const HTTPLRURAMCacheOptions cache_options_;
+    const std::chrono::milliseconds follower_timeout_;
+    const BodyStorage body_storage_;
+    const uint32_t segment_size_;
+    const CacheKeyBuilder key_builder_;
+    const FreshnessOptions freshness_options_;
+    const uint32_t l1_capacity_;
+    const std::optional<DiskCacheOptions> disk_cache_options_;
+    const std::string snapshot_path_;
+    const CompressionOptions compression_options_;
+    const Compression::Compressor::CompressorFactoryPtr compressor_factory_;
+    const Compression::Decompressor::DecompressorFactoryPtr decompressor_factory_;
+    const uint64_t max_object_bytes_;
+    const HttpCacheRCStats stats_;
 };
 
 using HttpCacheRCConfigSharedPtr = std::shared_ptr<HttpCacheRCConfig>;
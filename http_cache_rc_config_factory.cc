@@ -5,7 +5,9 @@
 #include <string>
 
 #include "envoy/registry/registry.h"
+#include "envoy/server/admin.h"
 #include "envoy/server/filter_config.h"
+#include "source/common/http/utility.h"
 
 #include "http_cache_rc.pb.validate.h"
 #include "http_cache_rc_filter.h"
@@ -18,9 +20,13 @@ public:
                                                      const std::string&,
                                                      FactoryContext& context) override {
 
-    return createFilter(Envoy::MessageUtil::downcastAndValidate<const envoy::extensions::filters::http::http_cache_rc::Codec&>(
-                            proto_config, context.messageValidationVisitor()),
-                        context);
+    const auto& codec = Envoy::MessageUtil::downcastAndValidate<const envoy::extensions::filters::http::http_cache_rc::Codec&>(
+        proto_config, context.messageValidationVisitor());
+    absl::Status status = Http::HttpCacheRCConfig::validate(codec);
+    if (!status.ok()) {
+      return status;
+    }
+    return createFilter(codec, context);
   }
 
   /**
@@ -33,16 +39,70 @@ public:
   std::string name() const override { return "envoy.filters.http.http_cache_rc"; }
 
 private:
-  Http::FilterFactoryCb createFilter(const envoy::extensions::filters::http::http_cache_rc::Codec& proto_config, FactoryContext&) {
+  Http::FilterFactoryCb createFilter(const envoy::extensions::filters::http::http_cache_rc::Codec& proto_config, FactoryContext& context) {
     Http::HttpCacheRCConfigSharedPtr config =
-        std::make_shared<Http::HttpCacheRCConfig>(
-            Http::HttpCacheRCConfig(proto_config));
+        std::make_shared<Http::HttpCacheRCConfig>(proto_config, context.scope());
 
-    return [config](Http::FilterChainFactoryCallbacks& callbacks) -> void {
-      auto filter = new Http::HttpCacheRCFilter(config);
+    Upstream::ClusterManager& clusterManager = context.serverFactoryContext().clusterManager();
+
+    // Per-worker L1 in front of the shared cache (optional)
+    Http::L1CacheSlotSharedPtr l1Cache;
+    if (config->l1_capacity() > 0) {
+      l1Cache = Http::L1CacheSlot::makeUnique(context.serverFactoryContext().threadLocal());
+      const uint32_t l1Capacity = config->l1_capacity();
+      l1Cache->set([l1Capacity](Event::Dispatcher&) { return std::make_shared<Http::ThreadLocalL1Cache>(l1Capacity); });
+    }
+
+    // Disk tier of the process-wide cache (optional), entries evicted from RAM are spilled once it is enabled
+    if (config->disk_cache_options().has_value()) {
+      Http::HttpCacheRCFilter::enableDiskCache(*config->disk_cache_options(), context.serverFactoryContext().api());
+    }
+
+    // Warm restarts: the snapshot of the previous process is mapped now and the cache is written on shutdown
+    if (!config->snapshot_path().empty()) {
+      Http::HttpCacheRCFilter::enableSnapshot(config->snapshot_path(), context.serverFactoryContext().api());
+    }
+    // Process-wide, outlives this filter config (LDS updates, listener removal)
+    Http::HttpCacheRCFilter::registerShutdown(context.serverFactoryContext().lifecycleNotifier(),
+                                              context.serverFactoryContext().timeSource());
+
+    // Invalidation endpoint of the process-wide cache, registered by the first filter config only
+    OptRef<Server::Admin> admin = context.serverFactoryContext().admin();
+    if (admin.has_value()) {
+      admin->addHandler("/cache_rc/purge", "purge http_cache_rc entries by key, url, prefix (host + path) or tag (Surrogate-Key)",
+                        purgeHandler, false, true);
+      // Written before a hot restart, the new process starts while this one is still serving
+      admin->addHandler("/cache_rc/snapshot", "write the http_cache_rc snapshot file now", snapshotHandler, false, true);
+    }
+
+    return [config, &clusterManager, l1Cache](Http::FilterChainFactoryCallbacks& callbacks) -> void {
+      auto filter = new Http::HttpCacheRCFilter(config, clusterManager, l1Cache);
       callbacks.addStreamFilter(Http::StreamFilterSharedPtr{filter});
     };
   }
+
+  static Http::Code purgeHandler(Http::ResponseHeaderMap&, Buffer::Instance& response, AdminStream& adminStream) {
+    static const std::pair<absl::string_view, Http::PurgeKind> kinds[] = {
+        {"key", Http::PurgeKind::KEY}, {"url", Http::PurgeKind::URL},
+        {"prefix", Http::PurgeKind::PREFIX}, {"tag", Http::PurgeKind::TAG}};
+    Http::Utility::QueryParamsMulti params =
+        Http::Utility::QueryParamsMulti::parseAndDecodeQueryString(adminStream.getRequestHeaders().getPathValue());
+    for (const auto& [name, kind]: kinds) {
+      absl::optional<std::string> value = params.getFirstValue(name);
+      if (value.has_value() && !value->empty()) {
+        response.add(fmt::format("{{\"purged\": {}}}\n", Http::HttpCacheRCFilter::purge(kind, *value)));
+        return Http::Code::OK;
+      }
+    }
+    response.add("usage: POST /cache_rc/purge?key=<32 hex digits>|url=<host/path>|prefix=<host/path>|tag=<surrogate key>\n");
+    return Http::Code::BadRequest;
+  }
+
+  static Http::Code snapshotHandler(Http::ResponseHeaderMap&, Buffer::Instance& response, AdminStream& adminStream) {
+    TimeSource& timeSource = adminStream.getDecoderFilterCallbacks().dispatcher().timeSource();
+    response.add(fmt::format("{{\"written\": {}}}\n", Http::HttpCacheRCFilter::writeSnapshot(timeSource.systemTime())));
+    return Http::Code::OK;
+  }
 };
 
 /**
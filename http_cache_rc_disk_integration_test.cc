@@ -0,0 +1,87 @@
+/***********************************************************************************************************************
+ * Integration test of the disk tier: an entry evicted from RAM is spilled to disk and read back on a RAM miss.
+ * The disk tier is process-wide and stopped by the shutdown of the first Envoy of the process, so this binary runs
+ * a single test.
+ ***********************************************************************************************************************/
+
+#include "test/integration/http_integration.h"
+#include "absl/strings/str_cat.h"
+
+namespace Envoy {
+
+// Over one disk I/O chunk, so the body is read back in several turns
+constexpr uint64_t RESPONSE_BODY_SIZE = 100 * 1024; // bytes
+constexpr uint32_t CACHE_CAPACITY = 32;             // entries
+
+class HttpCacheRCDiskIntegrationTest : public HttpIntegrationTest, public testing::Test {
+public:
+    HttpCacheRCDiskIntegrationTest()
+        : HttpIntegrationTest(Http::CodecType::HTTP2, TestEnvironment::getIpVersionsForTest().front()) {}
+
+    void SetUp() override {
+        setUpstreamProtocol(Http::CodecType::HTTP2);
+        config_helper_.prependFilter(absl::StrCat(
+            "{ name: envoy.filters.http.http_cache_rc, typed_config: { \"@type\": type.googleapis.com/envoy.extensions.filters.http.http_cache_rc.Codec, ring_buffer_capacity: 512, "
+            "cache_capacity: ", CACHE_CAPACITY, ", disk_cache: { path: \"", TestEnvironment::temporaryPath("http_cache_rc_disk"),
+            "\", max_bytes: 67108864 } } }"));
+        initialize();
+        codec_client_ = makeHttpConnection(lookupPort("http"));
+    }
+
+protected:
+    static Http::TestRequestHeaderMapImpl requestHeaders(const std::string& path) {
+        return {{":method", "GET"}, {":path", path}, {":scheme", "http"}, {":authority", "host"}};
+    }
+
+    uint64_t counterValue(const std::string& name) {
+        Stats::CounterSharedPtr counter = test_server_->counter(name);
+        return counter != nullptr ? counter->value() : 0;
+    }
+
+    uint64_t gaugeValue(const std::string& name) {
+        Stats::GaugeSharedPtr gauge = test_server_->gauge(name);
+        return gauge != nullptr ? gauge->value() : 0;
+    }
+
+    void fillFromOrigin(const std::string& path) {
+        IntegrationStreamDecoderPtr response = codec_client_->makeHeaderOnlyRequest(requestHeaders(path));
+        waitForNextUpstreamRequest();
+        upstream_request_->encodeHeaders(
+            Http::TestResponseHeaderMapImpl {{":status", "200"}, {"content-length", absl::StrCat(RESPONSE_BODY_SIZE)}}, false);
+        upstream_request_->encodeData(RESPONSE_BODY_SIZE, true);
+        ASSERT_TRUE(response->waitForEndStream());
+        EXPECT_EQ("200", response->headers().getStatusValue());
+    }
+
+    // Request of path served without reaching the origin
+    void expectServedFromCache(const std::string& path) {
+        const uint64_t originRequestsBefore = counterValue("cluster.cluster_0.upstream_rq_total");
+        IntegrationStreamDecoderPtr response = codec_client_->makeHeaderOnlyRequest(requestHeaders(path));
+        ASSERT_TRUE(response->waitForEndStream());
+        EXPECT_EQ("200", response->headers().getStatusValue());
+        EXPECT_EQ(std::string(RESPONSE_BODY_SIZE, 'a'), response->body());
+        EXPECT_EQ(originRequestsBefore, counterValue("cluster.cluster_0.upstream_rq_total"));
+    }
+};
+
+TEST_F(HttpCacheRCDiskIntegrationTest, EvictedEntryIsReadBackFromDisk) {
+    const std::string statPrefix = "http.config_test.http_cache_rc.";
+    fillFromOrigin("/disk/evicted");
+    // The first entry is the LRU victim of the fill that exceeds the capacity. It is written by the I/O thread of
+    // the tier, the gauges are updated by every fill, so fill until they show the written record
+    uint32_t fills = 0;
+    while (fills <= CACHE_CAPACITY || gaugeValue(statPrefix + "disk_entries") == 0) {
+        ASSERT_LT(fills, 4 * CACHE_CAPACITY) << "evicted entry was not written to disk";
+        fillFromOrigin(absl::StrCat("/disk/filler_", fills++));
+    }
+    EXPECT_GT(counterValue(statPrefix + "evictions"), 0);
+
+    expectServedFromCache("/disk/evicted");
+    EXPECT_EQ(1, counterValue(statPrefix + "disk_hits"));
+    // Promoted back into RAM
+    expectServedFromCache("/disk/evicted");
+    EXPECT_EQ(1, counterValue(statPrefix + "disk_hits"));
+    EXPECT_EQ(1, counterValue(statPrefix + "hits"));
+}
+
+} // namespace Envoy
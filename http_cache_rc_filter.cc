@@ -1,63 +1,283 @@
 #include "http_cache_rc_filter.h"
+#include "cache_refresher.h"
+#include "absl/strings/ascii.h"
+#include "absl/strings/numbers.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/str_split.h"
+#include <algorithm>
 
 namespace Envoy::Http {
 
 HTTPLRURAMCache HttpCacheRCFilter::cache_ {};
+PurgeIndex HttpCacheRCFilter::purge_index_ {};
+DiskCache HttpCacheRCFilter::disk_cache_ {};
+CacheSnapshot HttpCacheRCFilter::snapshot_ {};
+std::string HttpCacheRCFilter::snapshot_path_ {};
+std::once_flag HttpCacheRCFilter::snapshot_init_flag_ {};
+std::once_flag HttpCacheRCFilter::shutdown_init_flag_ {};
+Server::ServerLifecycleNotifier::Handle* HttpCacheRCFilter::shutdown_handle_ {};
 std::mutex HttpCacheRCFilter::mtx_rc_ {};
 UnordMapResponsesForRC HttpCacheRCFilter::coalesced_requests_ {};
-std::shared_mutex HttpCacheRCFilter::shared_mtx_threads_map_ {};
-UnordMapLeaderThreads HttpCacheRCFilter::leader_threads_for_rc_ {};
+std::unordered_map<CacheKey, MonotonicTime, CacheKeyHash> HttpCacheRCFilter::uncacheable_keys_ {};
+
+HttpCacheRCFilter::HttpCacheRCFilter(HttpCacheRCConfigSharedPtr config, Upstream::ClusterManager& clusterManager,
+                                     L1CacheSlotSharedPtr l1Cache)
+    : config_(std::move(config)), cluster_manager_(clusterManager), l1_cache_(std::move(l1Cache)) {
+    // Installed whether or not the disk tier is enabled yet (a later filter config may enable it after the cache is
+    // initialized), spill() is a no-op while the tier is disabled
+    cache_.initCache(config_->cache_options(), [](const CacheKey& key, const CacheEntrySharedPtr& value) {
+        disk_cache_.spill(key, value);
+    });
+}
+
+void HttpCacheRCFilter::enableDiskCache(const DiskCacheOptions& options, Api::Api& api) {
+    disk_cache_.init(options, api);
+    // Keys of spilled entries stay purgeable while their record exists
+    purge_index_.setRetainPredicate([](const CacheKey& key) { return disk_cache_.isStored(key); });
+}
+
+void HttpCacheRCFilter::enableSnapshot(const std::string& path, Api::Api& api) {
+    std::call_once(snapshot_init_flag_, [&]() {
+        snapshot_path_ = path;
+        snapshot_.load(path, api);
+    });
+}
+
+void HttpCacheRCFilter::registerShutdown(Server::ServerLifecycleNotifier& notifier, TimeSource& timeSource) {
+    std::call_once(shutdown_init_flag_, [&]() {
+        // Never destroyed: filter configs come and go with LDS updates, and the notifier is gone before
+        // static destruction
+        shutdown_handle_ = notifier.registerCallback(Server::ServerLifecycleNotifier::Stage::ShutdownExit,
+                                                     [&timeSource]() { onServerShutdown(timeSource.systemTime()); })
+                               .release();
+    });
+}
+
+void HttpCacheRCFilter::onServerShutdown(SystemTime now) {
+    writeSnapshot(now);
+    snapshot_.stop();
+    // Static destruction runs after the dispatchers are gone, the I/O thread must not post onto them anymore
+    disk_cache_.stop();
+}
 
-HttpCacheRCFilter::HttpCacheRCFilter(HttpCacheRCConfigSharedPtr config) : config_(std::move(config)) {
-    if (cache_.getCacheCapacity() == 0) {
-        cache_.initCacheCapacity(config_->cache_capacity());
+uint64_t HttpCacheRCFilter::writeSnapshot(SystemTime now) {
+    if (snapshot_path_.empty()) {
+        return 0;
+    }
+    return snapshot_.write(snapshot_path_, cache_.collectEntries(), now);
+}
+
+void HttpCacheRCFilter::onDestroy() {
+    destroyed_ = true;
+    follower_timer_.reset();
+    // Cached response may still be served asynchronously, it must not touch this stream anymore
+    if (cache_entry_consumer_ != nullptr) {
+        cache_entry_consumer_->stop();
+    }
+    if (is_leader_ && !encode_complete_) {
+        // Stream reset before the response was complete, followers must not wait for it
+        abandonCurrentRCGroup();
     }
 }
 
 FilterHeadersStatus HttpCacheRCFilter::decodeHeaders(RequestHeaderMap& headers, bool end_stream) {
-    createRequestHeadersStrKey(headers);
-    this_thread_id_ = std::this_thread::get_id();
+    decode_start_ = decoder_callbacks_->dispatcher().timeSource().monotonicTime();
+    primary_key_ = config_->key_builder().build(headers);
+    request_key_ = primary_key_;
+    request_headers_ = &headers;
+    requested_range_ = parseByteRangeRequest(headers);
+    cache_entry_consumer_ = std::make_shared<CacheEntryConsumer>(decoder_callbacks_, requested_range_);
+    cache_entry_consumer_->setContentNegotiation(&config_->decompressor_factory(), acceptsContentCoding(headers, "gzip"));
+    cache_entry_consumer_->onEntryUnavailable([filter = weak_from_this()]() {
+        // Streamed (oversized) response released its body before this request attached to it
+        std::shared_ptr<HttpCacheRCFilter> filterPtr = filter.lock();
+        if (filterPtr != nullptr && !filterPtr->destroyed_) {
+            filterPtr->forwardToOriginWithoutCaching();
+        }
+    });
 
-    ENVOY_STREAM_LOG(trace, "[HttpCacheRCFilter::decodeHeaders] thisThreadID: {}", *decoder_callbacks_, threadIDToStr(this_thread_id_))
     ENVOY_STREAM_LOG(trace, "[HttpCacheRCFilter::decodeHeaders] end_stream: {}", *decoder_callbacks_, end_stream)
     ENVOY_STREAM_LOG(trace, "[HttpCacheRCFilter::decodeHeaders] headers.size(): {}", *decoder_callbacks_, headers.size())
-    ENVOY_STREAM_LOG(trace, "[HttpCacheRCFilter::decodeHeaders] request_headers_str_key_: {}", *decoder_callbacks_, request_headers_str_key_)
-    ENVOY_STREAM_LOG(trace, "[HttpCacheRCFilter::decodeHeaders] cache_.getCacheMap().size(): {}", *decoder_callbacks_, cache_.getCacheMap().size())
-
-    // Process request coalescing and if it is the first request present (initial leader), query the cache or origin
-    ThreadStatus threadStatus = getThreadStatus();
-    // LEADER: Cannot leave this thread waiting on cond_var, save decoder callbacks of this latter request and return
-    // OTHER_GROUP_LEADER: Cannot leave this thread waiting on cond_var, save decoder callbacks of this request and return
-    if (threadStatus == ThreadStatus::LEADER || threadStatus == ThreadStatus::OTHER_GROUP_LEADER) {
-        return FilterHeadersStatus::StopIteration;
+    ENVOY_STREAM_LOG(trace, "[HttpCacheRCFilter::decodeHeaders] request_key_: {:016x}{:016x}", *decoder_callbacks_, request_key_.high_, request_key_.low_)
+    ENVOY_STREAM_LOG(trace, "[HttpCacheRCFilter::decodeHeaders] cache_.size(): {}, cache_.sizeBytes(): {}", *decoder_callbacks_, cache_.size(), cache_.sizeBytes())
+
+    // Query the cache if the response is existing (also entries that are still being written by their leader)
+    CacheEntrySharedPtr responseEntryPtr = lookup(request_key_);
+    if (responseEntryPtr != nullptr && responseEntryPtr->isVaryMarker()) {
+        // Response varies: the values of the request headers listed in Vary select the stored variant
+        request_key_ = CacheKeyBuilder::variantKey(primary_key_, responseEntryPtr->varyHeaders(), headers);
+        ENVOY_STREAM_LOG(trace, "[HttpCacheRCFilter::decodeHeaders] variant request_key_: {:016x}{:016x}",
+                         *decoder_callbacks_, request_key_.high_, request_key_.low_)
+        responseEntryPtr = lookup(request_key_);
+        if (responseEntryPtr != nullptr && !acceptsStoredCoding(*responseEntryPtr, headers)) {
+            // Variant key assumes the coding the origin prefers, it answered the fill with one this request rejects
+            ENVOY_STREAM_LOG(debug, "[HttpCacheRCFilter::decodeHeaders] Stored coding '{}' not accepted -> cache miss",
+                             *decoder_callbacks_, responseEntryPtr->contentCoding())
+            responseEntryPtr = nullptr;
+        }
     }
-    else if (threadStatus == ThreadStatus::WAITING) {
-        // This section enter only threads that have different std::thread::id than the leader thread of the current request group
-        waitForResponseAndServe();
+    config_->stats().lookup_time_us_.recordValue(elapsedSince<std::chrono::microseconds>(decode_start_));
+    if (responseEntryPtr != nullptr) {
+        const SystemTime now = decoder_callbacks_->dispatcher().timeSource().systemTime();
+        if (responseEntryPtr->isFresh(now)) {
+            ENVOY_STREAM_LOG(debug, "[HttpCacheRCFilter::decodeHeaders] *CACHE HIT*", *decoder_callbacks_)
+            config_->stats().hits_.inc();
+            measureTimeToFirstByte();
+            // Serve response to the recipient
+            cache_entry_consumer_->serveCachedResponse(responseEntryPtr);
+            return FilterHeadersStatus::StopIteration;
+        }
+        if (responseEntryPtr->isStaleServable(now)) {
+            ENVOY_STREAM_LOG(debug, "[HttpCacheRCFilter::decodeHeaders] *CACHE HIT (STALE)*", *decoder_callbacks_)
+            config_->stats().stale_hits_.inc();
+            measureTimeToFirstByte();
+            startBackgroundRefresh(headers, responseEntryPtr);
+            cache_entry_consumer_->serveCachedResponse(responseEntryPtr);
+            return FilterHeadersStatus::StopIteration;
+        }
+        // Expired beyond its stale window: revalidated by a conditional request (this request waits for it in
+        // the RC group of the refresh), otherwise the request goes through coalescing as a cache miss
+        ENVOY_STREAM_LOG(debug, "[HttpCacheRCFilter::decodeHeaders] Cached response expired", *decoder_callbacks_)
+        if (responseEntryPtr->hasValidators()) {
+            startBackgroundRefresh(headers, responseEntryPtr);
+        }
+        else {
+            cache_.remove(request_key_, responseEntryPtr);
+            updateCacheGauges(config_->stats());
+        }
+    }
+
+    if (requested_range_.has_value() && isUncacheable(request_key_, decode_start_)) {
+        // Response would not be stored, the origin answers the range itself (entry_cached_ stays true)
+        ENVOY_STREAM_LOG(debug, "[HttpCacheRCFilter::decodeHeaders] Response of the key is not cached; forwarding Range",
+                         *decoder_callbacks_)
+        config_->stats().misses_.inc();
+        return FilterHeadersStatus::Continue;
+    }
+
+    // Process request coalescing, only the first request present (leader) queries the origin
+    switch (joinOrLeadRCGroup()) {
+    case RCGroupRole::FOLLOWER:
+        config_->stats().coalesced_.inc();
         return FilterHeadersStatus::StopIteration;
+    case RCGroupRole::BYPASS:
+        return FilterHeadersStatus::Continue;
+    default:
+        break;
     }
-    // INITIAL_LEADER: Continue iteration, query the cache or origin
 
-    // Query the cache if the response is existing
-    CacheEntrySharedPtr responseEntryPtr = cache_.at(request_headers_str_key_);
-    if (responseEntryPtr != nullptr) {
-        ENVOY_STREAM_LOG(debug, "[HttpCacheRCFilter::decodeHeaders] *CACHE HIT*", *decoder_callbacks_)
-        // Promote update to waiting threads to start reading
-        notifyWaitingCoalescedRequests(responseEntryPtr);
-        // Serve response to the recipient
-        cache_entry_consumer_.serveCachedResponse(responseEntryPtr, decoder_callbacks_);
-        // Detach this RC group from map
-        detachCurrentRCGroup();
-        serveResponseToCurrentRCGroup();
-        attendToOtherRCGroups();
+    // No cached response in RAM
+    if (requested_range_.has_value()) {
+        // The whole response is fetched and cached, the range is cut out of it on the way downstream
+        headers.remove(rangeHeader());
+        headers.remove(ifRangeHeader());
+    }
+    if (readFromDiskCache() || readFromSnapshot()) {
         return FilterHeadersStatus::StopIteration;
     }
+    startOriginFill();
+    return FilterHeadersStatus::Continue;
+}
+
+void HttpCacheRCFilter::bypassCache(ResponseHeaderMap& headers, bool end_stream) {
+    entry_cached_ = true;
+    rememberUncacheable();
+    abandonRCGroup(request_key_, response_wrapper_rc_ptr_);
+    // Range was removed from the upstream request, the client still gets only the part it asked for
+    if (requested_range_.has_value() && !end_stream) {
+        applyLeaderRange(headers);
+    }
+}
 
-    // No cached response
+void HttpCacheRCFilter::streamOversizedFill() {
+    ENVOY_STREAM_LOG(debug, "[HttpCacheRCFilter::streamOversizedFill] Body over max_object_bytes; streaming it without caching",
+                     *encoder_callbacks_)
+    config_->stats().oversized_.inc();
+    oversized_ = true;
+    rememberUncacheable();
+    // Following requests start their own fill, the readers attached so far get the rest of the response
+    cache_.remove(stored_key_, cache_entry_producer_.getCacheEntryPtr());
+    detachCurrentRCGroup();
+    cache_entry_producer_.startStreaming();
+    updateCacheGauges(config_->stats());
+}
+
+void HttpCacheRCFilter::startOriginFill() {
     entry_cached_ = false;
-    cache_entry_producer_.initCacheEntry(config_->ring_buffer_capacity(), encoder_callbacks_);
-    ENVOY_STREAM_LOG(debug, "[HttpCacheRCFilter::decodeHeaders] *CACHE MISS*", *decoder_callbacks_)
-    return FilterHeadersStatus::Continue;
+    fill_epoch_ = purge_index_.epoch();
+    stored_key_ = request_key_;
+    cache_entry_producer_.initCacheEntry(config_->ring_buffer_capacity(), config_->body_storage(),
+                                         config_->segment_size(), decoder_callbacks_->dispatcher().timeSource());
+    ENVOY_STREAM_LOG(debug, "[HttpCacheRCFilter::startOriginFill] *CACHE MISS*", *decoder_callbacks_)
+    config_->stats().misses_.inc();
+}
+
+bool HttpCacheRCFilter::readFromDiskCache() {
+    if (!disk_cache_.contains(request_key_, decoder_callbacks_->dispatcher().timeSource().systemTime())) {
+        return false;
+    }
+    ENVOY_STREAM_LOG(debug, "[HttpCacheRCFilter::readFromDiskCache] Reading evicted response from disk", *decoder_callbacks_)
+    // A purge while the record is read refuses to store it
+    fill_epoch_ = purge_index_.epoch();
+    disk_cache_.read(request_key_, restoredEntryOptions(), decoder_callbacks_->dispatcher(),
+                     [filter = weak_from_this()](const CacheEntrySharedPtr& responseEntryPtr) {
+                         if (std::shared_ptr<HttpCacheRCFilter> filterPtr = filter.lock()) {
+                             filterPtr->onRestoredRead(responseEntryPtr, false);
+                         }
+                     });
+    return true;
+}
+
+bool HttpCacheRCFilter::readFromSnapshot() {
+    if (!snapshot_.contains(request_key_, decoder_callbacks_->dispatcher().timeSource().systemTime())) {
+        return false;
+    }
+    ENVOY_STREAM_LOG(debug, "[HttpCacheRCFilter::readFromSnapshot] Restoring response from the snapshot", *decoder_callbacks_)
+    // Stored like a fill that started with this process (epoch 0), so every purge since the start refuses it
+    fill_epoch_ = 0;
+    snapshot_.restore(request_key_, restoredEntryOptions(), decoder_callbacks_->dispatcher(),
+                      [filter = weak_from_this()](const CacheEntrySharedPtr& responseEntryPtr) {
+                          if (std::shared_ptr<HttpCacheRCFilter> filterPtr = filter.lock()) {
+                              filterPtr->onRestoredRead(responseEntryPtr, true);
+                          }
+                      });
+    return true;
+}
+
+void HttpCacheRCFilter::onRestoredRead(const CacheEntrySharedPtr& responseEntryPtr, bool fromSnapshot) {
+    if (destroyed_) {
+        return;
+    }
+    if (responseEntryPtr == nullptr) {
+        // Record left the disk tier (or was restored by another request) meanwhile, or is damaged
+        startOriginFill();
+        decoder_callbacks_->continueDecoding();
+        return;
+    }
+    if (fromSnapshot) {
+        ENVOY_STREAM_LOG(debug, "[HttpCacheRCFilter::onRestoredRead] *CACHE HIT (SNAPSHOT)*", *decoder_callbacks_)
+        config_->stats().snapshot_restores_.inc();
+    }
+    else {
+        ENVOY_STREAM_LOG(debug, "[HttpCacheRCFilter::onRestoredRead] *CACHE HIT (DISK)*", *decoder_callbacks_)
+        config_->stats().disk_hits_.inc();
+    }
+    // Promoted back into RAM, followers of this leader are served from it as well
+    HeadersTemplateSharedPtr headers = responseEntryPtr->headersTemplate();
+    std::optional<std::vector<LowerCaseString>> varyHeaders = parseVaryHeaders(*headers);
+    stored_key_ = storeResponse(primary_key_, *request_headers_, *headers,
+                                varyHeaders.value_or(std::vector<LowerCaseString>()), responseEntryPtr, true,
+                                fill_epoch_, config_->stats());
+    if (fromSnapshot && responseEntryPtr->isEvicted()) {
+        // Purged since the start of this process
+        startOriginFill();
+        decoder_callbacks_->continueDecoding();
+        return;
+    }
+    publishResponseToRCGroup(response_wrapper_rc_ptr_, responseEntryPtr);
+    detachRCGroup(request_key_, response_wrapper_rc_ptr_);
+    measureTimeToFirstByte();
+    cache_entry_consumer_->serveCachedResponse(responseEntryPtr);
 }
 
 
@@ -74,15 +294,70 @@ FilterHeadersStatus HttpCacheRCFilter::encodeHeaders(ResponseHeaderMap& headers,
                                  *encoder_callbacks_)
                 return FilterHeadersStatus::StopIteration;
             }
-            // Cache only successful [200-299] response status codes
+            std::optional<std::vector<LowerCaseString>> varyHeaders = parseVaryHeaders(headers);
+            if (!varyHeaders.has_value()) {
+                // "Vary: *" response is neither cached nor shared with the coalesced requests
+                ENVOY_STREAM_LOG(debug, "[HttpCacheRCFilter::encodeHeaders] Vary: * -> no caching", *encoder_callbacks_)
+                bypassCache(headers, end_stream);
+                return FilterHeadersStatus::Continue;
+            }
+            uint64_t contentLength = 0;
+            if (absl::SimpleAtoi(headers.getContentLengthValue(), &contentLength) &&
+                config_->exceedsMaxObjectBytes(contentLength)) {
+                // Oversized response is never held in memory: followers query the origin on their own
+                ENVOY_STREAM_LOG(debug, "[HttpCacheRCFilter::encodeHeaders] Content-Length over max_object_bytes -> no caching",
+                                 *encoder_callbacks_)
+                config_->stats().oversized_.inc();
+                bypassCache(headers, end_stream);
+                return FilterHeadersStatus::Continue;
+            }
+            // Cache successful [200-299] response status codes that may be stored (Cache-Control),
+            // error status codes only for the short TTL configured for them (negative caching)
+            bool cacheable = false;
+            const SystemTime now = encoder_callbacks_->dispatcher().timeSource().systemTime();
             if (successful_status_code_) {
-                cache_.insert(request_headers_str_key_, cache_entry_producer_.getCacheEntryPtr());
+                Freshness freshness = computeFreshness(headers, now, config_->freshness_options());
+                if (freshness.cacheable_) {
+                    cache_entry_producer_.getCacheEntryPtr()->setFreshness(freshness);
+                    cacheable = true;
+                }
+                else {
+                    rememberUncacheable();
+                }
+            }
+            else {
+                uint64_t status = 0;
+                Freshness freshness;
+                freshness.cacheable_ = false;
+                if (absl::SimpleAtoi(headers.getStatusValue(), &status)) {
+                    freshness = computeErrorFreshness(headers, status, now, config_->freshness_options());
+                }
+                if (freshness.cacheable_) {
+                    ENVOY_STREAM_LOG(debug, "[HttpCacheRCFilter::encodeHeaders] Status code: '{}' -> negative caching",
+                                     *encoder_callbacks_, status)
+                    cache_entry_producer_.getCacheEntryPtr()->setFreshness(freshness);
+                    cacheable = true;
+                }
             }
-            // Promote update to waiting threads to start reading (even alongside error status codes)
-            notifyWaitingCoalescedRequests(cache_entry_producer_.getCacheEntryPtr());
+            if (cacheable && !end_stream) {
+                // Followers and later hits read the stored (compressed) body, this stream gets the response as received
+                cache_entry_producer_.setCompressor(config_->createCompressor(headers));
+            }
+            stored_key_ = storeResponse(primary_key_, *request_headers_, headers, std::move(*varyHeaders),
+                                        cache_entry_producer_.getCacheEntryPtr(), cacheable, fill_epoch_,
+                                        config_->stats());
+            // Counted only if the fill was not refused (purged meanwhile) or evicted right away
+            if (cacheable && !successful_status_code_ && !cache_entry_producer_.getCacheEntryPtr()->isEvicted()) {
+                config_->stats().errors_cached_.inc();
+            }
+            // Resume followers to start reading (even alongside error status codes)
+            publishResponseToRCGroup(response_wrapper_rc_ptr_, cache_entry_producer_.getCacheEntryPtr());
             is_first_headers_ = false;
         }
         cache_entry_producer_.writeHeaders(headers, end_stream);
+        if (requested_range_.has_value() && !end_stream) {
+            applyLeaderRange(headers);
+        }
     }
     return FilterHeadersStatus::Continue;
 }
@@ -96,8 +371,15 @@ FilterDataStatus HttpCacheRCFilter::encodeData(Buffer::Instance& data, bool end_
             cache_entry_producer_.headersWriteComplete();
             is_first_data_ = false;
         }
+        fill_body_bytes_ += data.length();
+        if (!oversized_ && config_->exceedsMaxObjectBytes(fill_body_bytes_)) {
+            streamOversizedFill();
+        }
         cache_entry_producer_.writeData(data, end_stream);
     }
+    if (trim_to_range_) {
+        trimToLeaderRange(data);
+    }
     return FilterDataStatus::Continue;
 }
 
@@ -105,6 +387,11 @@ FilterTrailersStatus HttpCacheRCFilter::encodeTrailers(ResponseTrailerMap& trail
     ENVOY_STREAM_LOG(trace, "[HttpCacheRCFilter::encodeTrailers] trailers: \n{}\n", *encoder_callbacks_, trailers)
 
     if (!entry_cached_) {
+        if (is_first_data_) {
+            // Response without data, headers end here
+            cache_entry_producer_.headersWriteComplete();
+            is_first_data_ = false;
+        }
         if (is_first_trailers_) {
             cache_entry_producer_.dataWriteComplete();
             is_first_trailers_ = false;
@@ -117,26 +404,17 @@ FilterTrailersStatus HttpCacheRCFilter::encodeTrailers(ResponseTrailerMap& trail
 void HttpCacheRCFilter::encodeComplete() {
     ENVOY_STREAM_LOG(trace, "[HttpCacheRCFilter::encodeComplete] Encoding ended", *encoder_callbacks_)
 
+    encode_complete_ = true;
     if (!entry_cached_) {
         cache_entry_producer_.writeComplete();
-        // Detach this RC group from map
+        // Detach this RC group from map, following requests are cache hits (or new groups for uncached responses)
         detachCurrentRCGroup();
-        // Send response to coalesced requests
-        serveResponseToCurrentRCGroup();
-        attendToOtherRCGroups();
+        // Footprint of the entry is final now
+        updateCacheGauges(config_->stats());
     }
 }
 
 
-void HttpCacheRCFilter::createRequestHeadersStrKey(const RequestHeaderMap& headers) {
-    // A place for improvement - could be made as configurable cache key
-    request_headers_str_key_.append(headers.getHostValue())
-                            .append(headers.getPathValue())
-                            .append(headers.getMethodValue())
-                            .append(headers.getSchemeValue())
-                            .append(headers.getUserAgentValue());
-}
-
 bool HttpCacheRCFilter::checkSuccessfulStatusCode(const ResponseHeaderMap& headers) {
     uint16_t responseStatusCode;
     try { responseStatusCode = std::stoi(std::string(headers.getStatusValue())); }
@@ -154,155 +432,435 @@ bool HttpCacheRCFilter::checkSuccessfulStatusCode(const ResponseHeaderMap& heade
     return true;
 }
 
-// Method used only for logging
-std::string HttpCacheRCFilter::threadIDToStr(const std::thread::id& threadId) {
-    std::ostringstream oss;
-    oss << threadId;
-    return oss.str();
+CacheEntrySharedPtr HttpCacheRCFilter::lookup(const CacheKey& key) {
+    if (l1_cache_ == nullptr) {
+        CacheEntrySharedPtr responseEntryPtr = cache_.at(key);
+        return responseEntryPtr != nullptr ? responseEntryPtr : restoreVaryMarker(key);
+    }
+    bool touchShared = false;
+    CacheEntrySharedPtr responseEntryPtr = (*l1_cache_)->at(key, touchShared);
+    if (responseEntryPtr != nullptr) {
+        if (touchShared) {
+            cache_.at(key);
+        }
+        return responseEntryPtr;
+    }
+    responseEntryPtr = cache_.at(key);
+    if (responseEntryPtr == nullptr) {
+        responseEntryPtr = restoreVaryMarker(key);
+    }
+    if (responseEntryPtr != nullptr) {
+        (*l1_cache_)->insert(key, responseEntryPtr);
+    }
+    return responseEntryPtr;
 }
 
-ThreadStatus HttpCacheRCFilter::getThreadStatus() {
-    {
-        std::unique_lock lockRC(mtx_rc_);
-        response_wrapper_rc_ptr_ = coalesced_requests_[request_headers_str_key_];
-        if (response_wrapper_rc_ptr_ == nullptr) {
-            // Create new request group
-            response_wrapper_rc_ptr_ = coalesced_requests_[request_headers_str_key_] = std::make_shared<ResponseForCoalescedRequests>();
-            // Set leader thread ID
-            response_wrapper_rc_ptr_->leader_thread_id_ = this_thread_id_;
-            lockRC.unlock();
-            std::unique_lock uniqueLockThreads(shared_mtx_threads_map_);
-            leader_threads_for_rc_[this_thread_id_][request_headers_str_key_] = response_wrapper_rc_ptr_;
-            uniqueLockThreads.unlock();
-            ENVOY_STREAM_LOG(trace, "[HttpCacheRCFilter::getThreadStatus] leaderThreadID: {}", *decoder_callbacks_,
-                             threadIDToStr(response_wrapper_rc_ptr_->leader_thread_id_))
-            return ThreadStatus::INITIAL_LEADER;
+CacheEntrySharedPtr HttpCacheRCFilter::restoreVaryMarker(const CacheKey& key) {
+    CacheEntrySharedPtr markerPtr = disk_cache_.takeVaryMarker(key);
+    if (markerPtr != nullptr) {
+        ENVOY_STREAM_LOG(debug, "[HttpCacheRCFilter::restoreVaryMarker] Vary marker restored from the disk tier", *decoder_callbacks_)
+    }
+    else {
+        markerPtr = snapshot_.takeVaryMarker(key, decoder_callbacks_->dispatcher().timeSource().systemTime());
+        if (markerPtr == nullptr) {
+            return nullptr;
         }
+        ENVOY_STREAM_LOG(debug, "[HttpCacheRCFilter::restoreVaryMarker] Vary marker restored from the snapshot", *decoder_callbacks_)
+        config_->stats().snapshot_restores_.inc();
     }
-    ENVOY_STREAM_LOG(trace, "[HttpCacheRCFilter::getThreadStatus] leaderThreadID: {}", *decoder_callbacks_,
-                     threadIDToStr(response_wrapper_rc_ptr_->leader_thread_id_))
-    if (this_thread_id_ == response_wrapper_rc_ptr_->leader_thread_id_) {
-        // This section enters only the leader thread from current coalesced request group
-        ENVOY_STREAM_LOG(debug, "[HttpCacheRCFilter::getThreadStatus] Leader thread already received same request; emplacing decoder callbacks", *decoder_callbacks_)
-        response_wrapper_rc_ptr_->waiting_decoder_callbacks_ptr_->emplace_back(decoder_callbacks_);
-        return ThreadStatus::LEADER;
+    config_->stats().evictions_.add(cache_.insert(key, markerPtr));
+    return markerPtr;
+}
+
+DiskEntryOptions HttpCacheRCFilter::restoredEntryOptions() const {
+    DiskEntryOptions entryOptions;
+    entryOptions.ring_buffer_capacity_ = config_->ring_buffer_capacity();
+    entryOptions.body_storage_ = config_->body_storage();
+    entryOptions.segment_size_ = config_->segment_size();
+    return entryOptions;
+}
+
+RCGroupRole HttpCacheRCFilter::joinOrLeadRCGroup() {
+    CacheEntrySharedPtr responseEntryPtr;
+    {
+        std::lock_guard lockGuard(mtx_rc_);
+        ResponseForCoalescedRequestsSharedPtr& groupPtr = coalesced_requests_[request_key_];
+        if (groupPtr == nullptr) {
+            // Create new request group, this request is its leader
+            groupPtr = std::make_shared<ResponseForCoalescedRequests>();
+            response_wrapper_rc_ptr_ = groupPtr;
+            is_leader_ = true;
+            return RCGroupRole::LEADER;
+        }
+        response_wrapper_rc_ptr_ = groupPtr;
+        responseEntryPtr = groupPtr->shared_response_entry_ptr_;
+        if (responseEntryPtr == nullptr) {
+            // Park this request, the leader resumes it on this worker once the response is published
+            groupPtr->followers_.push_back({&decoder_callbacks_->dispatcher(), weak_from_this()});
+        }
     }
-    if (isLeaderOfOtherRCGroup()) {
-        return ThreadStatus::OTHER_GROUP_LEADER;
+    if (responseEntryPtr != nullptr) {
+        if (!matchesVariant(responseEntryPtr)) {
+            ENVOY_STREAM_LOG(debug, "[HttpCacheRCFilter::joinOrLeadRCGroup] Published response is another variant; bypassing cache",
+                             *decoder_callbacks_)
+            return RCGroupRole::BYPASS;
+        }
+        ENVOY_STREAM_LOG(debug, "[HttpCacheRCFilter::joinOrLeadRCGroup] Response already published; serving coalesced request",
+                         *decoder_callbacks_)
+        cache_entry_consumer_->serveCachedResponse(responseEntryPtr);
+        return RCGroupRole::FOLLOWER;
     }
-    return ThreadStatus::WAITING;
+    ENVOY_STREAM_LOG(debug, "[HttpCacheRCFilter::joinOrLeadRCGroup] Parking coalesced request until the leader publishes the response",
+                     *decoder_callbacks_)
+    is_parked_ = true;
+    parked_at_ = decoder_callbacks_->dispatcher().timeSource().monotonicTime();
+    follower_timer_ = decoder_callbacks_->dispatcher().createTimer([this]() { onFollowerTimeout(); });
+    follower_timer_->enableTimer(followerTimeout());
+    return RCGroupRole::FOLLOWER;
 }
 
-bool HttpCacheRCFilter::isLeaderOfOtherRCGroup() const {
-    // Check if this thread is already leader for other group of RC (if so, it cannot wait on cond_var)
-    std::shared_lock sharedLockThreads(shared_mtx_threads_map_);
-    if (leader_threads_for_rc_.contains(this_thread_id_)) {
-        ENVOY_STREAM_LOG(debug, "[HttpCacheRCFilter::isLeaderOfOtherRCGroup] This thread is already leader of other RC group", *decoder_callbacks_)
-        ENVOY_STREAM_LOG(trace, "[HttpCacheRCFilter::isLeaderOfOtherRCGroup] leader_threads_for_rc_[this_thread_id_].size(): {}", *decoder_callbacks_, leader_threads_for_rc_[this_thread_id_].size())
-        // Assign the callbacks and response helper to random (std::unordered_map::begin()) RC group
-        leader_threads_for_rc_[this_thread_id_].begin()->second->other_rc_groups_ptr_->emplace_back(decoder_callbacks_, response_wrapper_rc_ptr_);
+bool HttpCacheRCFilter::matchesVariant(const CacheEntrySharedPtr& responseEntryPtr) const {
+    if (responseEntryPtr->varyHeaders().empty()) {
         return true;
     }
-    return false;
+    return CacheKeyBuilder::variantKey(primary_key_, responseEntryPtr->varyHeaders(), *request_headers_) ==
+           responseEntryPtr->variantKey() &&
+           acceptsStoredCoding(*responseEntryPtr, *request_headers_);
 }
 
-void HttpCacheRCFilter::waitForResponseAndServe() {
-    waitOnCondVar();
-    CacheEntrySharedPtr responseEntryPtr = response_wrapper_rc_ptr_->shared_response_entry_ptr_;
-    if (responseEntryPtr != nullptr) {
-        ENVOY_STREAM_LOG(debug, "[HttpCacheRCFilter::waitForResponseAndServe] Serving response for coalesced request",
-                         *decoder_callbacks_)
-        cache_entry_consumer_.serveCachedResponse(responseEntryPtr, decoder_callbacks_);
+bool HttpCacheRCFilter::acceptsStoredCoding(const CacheEntry& responseEntry, const RequestHeaderMap& headers) {
+    for (absl::string_view coding: absl::StrSplit(responseEntry.contentCoding(), ',', absl::SkipEmpty())) {
+        if (!acceptsContentCoding(headers, absl::StripAsciiWhitespace(coding))) {
+            return false;
+        }
     }
-    else {
-        ENVOY_STREAM_LOG(critical, "[HttpCacheRCFilter::waitForResponseAndServe] Error: TIMEOUT on conditional variable for coalesced requests; Cannot serve response",
-                         *decoder_callbacks_)
+    return true;
+}
+
+void HttpCacheRCFilter::detachCurrentRCGroup() {
+    ENVOY_STREAM_LOG(debug, "[HttpCacheRCFilter::detachCurrentRCGroup] Release current RC group from map", *encoder_callbacks_)
+    detachRCGroup(request_key_, response_wrapper_rc_ptr_);
+}
+
+void HttpCacheRCFilter::abandonCurrentRCGroup() {
+    if (!entry_cached_) {
+        // Partial response must neither stay in the cache nor keep its readers waiting
+        cache_.remove(stored_key_, cache_entry_producer_.getCacheEntryPtr());
+        cache_entry_producer_.abort();
+        updateCacheGauges(config_->stats());
     }
+    abandonRCGroup(request_key_, response_wrapper_rc_ptr_);
 }
 
-void HttpCacheRCFilter::waitOnCondVar() const {
-    std::unique_lock cvLock(mtx_rc_);
-    ENVOY_STREAM_LOG(debug, "[HttpCacheRCFilter::waitOnCondVar] Waiting on cond_var", *decoder_callbacks_)
-    // Threads will wait here for cond_var.notify_all() callback OR when timeout callback hits -> error scenario
-    response_wrapper_rc_ptr_->cv_ptr_->wait_for(cvLock, std::chrono::seconds(COND_VAR_TIMEOUT), [&]{
-        return (response_wrapper_rc_ptr_->shared_response_entry_ptr_ != nullptr);
-    } );
-    ENVOY_STREAM_LOG(debug, "[HttpCacheRCFilter::waitOnCondVar] Cond_var passed", *decoder_callbacks_)
+bool HttpCacheRCFilter::startBackgroundRefresh(const RequestHeaderMap& headers, const CacheEntrySharedPtr& storedEntry) {
+    ResponseForCoalescedRequestsSharedPtr groupPtr = tryCreateRCGroup(request_key_);
+    if (groupPtr == nullptr) {
+        ENVOY_STREAM_LOG(debug, "[HttpCacheRCFilter::startBackgroundRefresh] Refresh already in flight", *decoder_callbacks_)
+        return false;
+    }
+    Router::RouteConstSharedPtr route = decoder_callbacks_->route();
+    if (route == nullptr || route->routeEntry() == nullptr) {
+        ENVOY_STREAM_LOG(debug, "[HttpCacheRCFilter::startBackgroundRefresh] No route; refresh skipped", *decoder_callbacks_)
+        abandonRCGroup(request_key_, groupPtr);
+        return false;
+    }
+    ENVOY_STREAM_LOG(debug, "[HttpCacheRCFilter::startBackgroundRefresh] Refreshing stale response", *decoder_callbacks_)
+    config_->stats().refreshes_.inc();
+    auto refresher = std::make_shared<CacheRefresher>(primary_key_, request_key_, std::move(groupPtr), storedEntry,
+                                                      config_, decoder_callbacks_->dispatcher());
+    refresher->start(cluster_manager_, route->routeEntry()->clusterName(), route->routeEntry()->timeout(), headers);
+    return true;
 }
 
-void HttpCacheRCFilter::notifyWaitingCoalescedRequests(const CacheEntrySharedPtr& responseEntryPtr) const {
-    // Update shared resource and notify waiting requests
-    {
-        std::lock_guard<std::mutex> lockGuard(mtx_rc_);
-        response_wrapper_rc_ptr_->shared_response_entry_ptr_ = responseEntryPtr;
+ResponseForCoalescedRequestsSharedPtr HttpCacheRCFilter::tryCreateRCGroup(const CacheKey& key) {
+    std::lock_guard lockGuard(mtx_rc_);
+    ResponseForCoalescedRequestsSharedPtr& groupPtr = coalesced_requests_[key];
+    if (groupPtr != nullptr) {
+        return nullptr;
     }
-    ENVOY_STREAM_LOG(debug, "[HttpCacheRCFilter::notifyWaitingCoalescedRequests] Notifying threads waiting on cond_var", *encoder_callbacks_)
-    response_wrapper_rc_ptr_->cv_ptr_->notify_all();
+    groupPtr = std::make_shared<ResponseForCoalescedRequests>();
+    return groupPtr;
 }
 
-void HttpCacheRCFilter::detachCurrentRCGroup() const {
-    ENVOY_STREAM_LOG(debug, "[HttpCacheRCFilter::detachCurrentRCGroup] Release current RC group from map", *encoder_callbacks_)
-    {
-        std::lock_guard lockGuard(mtx_rc_);
-        // Release current RC group from the map
-        coalesced_requests_[request_headers_str_key_] = nullptr;
+CacheKey HttpCacheRCFilter::storeResponse(const CacheKey& primaryKey, const RequestHeaderMap& requestHeaders,
+                                         const ResponseHeaderMap& responseHeaders,
+                                         std::vector<LowerCaseString> varyHeaders,
+                                         const CacheEntrySharedPtr& responseEntryPtr, bool cacheable,
+                                         uint64_t fillEpoch, const HttpCacheRCStats& stats) {
+    CacheKey storedKey = tagVariant(primaryKey, requestHeaders, responseHeaders, varyHeaders, responseEntryPtr);
+    if (cacheable) {
+        insertResponse(primaryKey, storedKey, requestHeaders, responseHeaders, std::move(varyHeaders),
+                       responseEntryPtr, fillEpoch, stats);
     }
+    return storedKey;
 }
 
-void HttpCacheRCFilter::serveResponseToCurrentRCGroup() {
-    // Serve response to all requests processed by this thread from current RC group
-    if (!response_wrapper_rc_ptr_->waiting_decoder_callbacks_ptr_->empty()) {
-        ENVOY_STREAM_LOG(debug, "[HttpCacheRCFilter::serveResponseToCurrentRCGroup] Serving response to coalesced requests (managed by this leader thread)",
-                         *encoder_callbacks_)
-        // No mutex lock here needed (this list of decoder callbacks is produced only by this leader thread)
-        for (const auto &decoderCallbacks: *response_wrapper_rc_ptr_->waiting_decoder_callbacks_ptr_) {
-            cache_entry_consumer_.serveCachedResponse(cache_entry_producer_.getCacheEntryPtr(), decoderCallbacks);
+CacheKey HttpCacheRCFilter::tagVariant(const CacheKey& primaryKey, const RequestHeaderMap& requestHeaders,
+                                       const ResponseHeaderMap& responseHeaders,
+                                       const std::vector<LowerCaseString>& varyHeaders,
+                                       const CacheEntrySharedPtr& responseEntryPtr) {
+    if (varyHeaders.empty()) {
+        return primaryKey;
+    }
+    CacheKey storedKey = CacheKeyBuilder::variantKey(primaryKey, varyHeaders, requestHeaders);
+    // Body compressed by this filter is decompressed for clients that do not accept gzip, it has no origin coding
+    std::string contentCoding;
+    const auto contentEncoding = responseHeaders.get(Http::CustomHeaders::get().ContentEncoding);
+    if (!contentEncoding.empty() && !responseEntryPtr->isCompressedAtRest()) {
+        contentCoding = absl::AsciiStrToLower(contentEncoding[0]->value().getStringView());
+        if (absl::StripAsciiWhitespace(contentCoding) == "identity") {
+            contentCoding.clear();
         }
     }
+    responseEntryPtr->setVariant(varyHeaders, storedKey, std::move(contentCoding));
+    return storedKey;
 }
 
-void HttpCacheRCFilter::attendToOtherRCGroups() {
-    // This thread is no longer leader of its RC group
-    std::shared_lock sharedLockThreads(shared_mtx_threads_map_);
-    leader_threads_for_rc_[this_thread_id_].erase(request_headers_str_key_);
-    sharedLockThreads.unlock();
-
-    if (!response_wrapper_rc_ptr_->other_rc_groups_ptr_->empty()) {
-        OtherRCGroupListSharedPtr otherRCGroupsPtr;
-        sharedLockThreads.lock();
-        if (!leader_threads_for_rc_[this_thread_id_].empty()) {
-            otherRCGroupsPtr = leader_threads_for_rc_[this_thread_id_].begin()->second->other_rc_groups_ptr_;
-            sharedLockThreads.unlock();
-            // Append the callbacks list to random (std::unordered_map::begin()) RC group
-            otherRCGroupsPtr->splice(otherRCGroupsPtr->end(), *response_wrapper_rc_ptr_->other_rc_groups_ptr_);
-            ENVOY_STREAM_LOG(debug, "[HttpCacheRCFilter::attendToOtherRCGroups] This thread is leader of other RC group; Return without waiting on cond_var",
-                             *encoder_callbacks_)
-            return;
+void HttpCacheRCFilter::insertResponse(const CacheKey& primaryKey, const CacheKey& storedKey,
+                                       const RequestHeaderMap& requestHeaders, const ResponseHeaderMap& responseHeaders,
+                                       std::vector<LowerCaseString> varyHeaders,
+                                       const CacheEntrySharedPtr& responseEntryPtr, uint64_t fillEpoch,
+                                       const HttpCacheRCStats& stats) {
+    // Tiers are exclusive: the entry in RAM is the newest response of the key
+    forgetUncacheable(storedKey);
+    disk_cache_.remove(storedKey);
+    snapshot_.remove(storedKey);
+    stats.evictions_.add(cache_.insert(storedKey, responseEntryPtr));
+    if (!varyHeaders.empty()) {
+        // Marker is replaced only when the origin changes the list of Vary headers
+        CacheEntrySharedPtr markerPtr = cache_.at(primaryKey);
+        if (markerPtr == nullptr || !markerPtr->isVaryMarker() || markerPtr->varyHeaders() != varyHeaders) {
+            stats.evictions_.add(cache_.insert(primaryKey, CacheEntry::createVaryMarker(std::move(varyHeaders))));
         }
-        sharedLockThreads.unlock();
-        ENVOY_STREAM_LOG(debug, "[HttpCacheRCFilter::attendToOtherRCGroups] Attend to other groups of coalesced requests",
-                         *encoder_callbacks_)
-        otherRCGroupsPtr = response_wrapper_rc_ptr_->other_rc_groups_ptr_;
-        // This thread can now wait on cond_var and attend to other groups of coalesced requests
-        for (const auto &otherRCGroupPair: *otherRCGroupsPtr) {
-            decoder_callbacks_ = otherRCGroupPair.first;
-            response_wrapper_rc_ptr_ = otherRCGroupPair.second.lock();
-            waitForResponseAndServe();
+    }
+    // Indexed after the insert: a purge racing with this fill is either found in the index or refuses the fill here
+    if (!purge_index_.add(storedKey, responseEntryPtr,
+                          absl::StrCat(requestHeaders.getHostValue(), requestHeaders.getPathValue()),
+                          parseSurrogateKeys(responseHeaders), fillEpoch)) {
+        ENVOY_LOG(debug, "[HttpCacheRCFilter::insertResponse] Response was purged while it was fetched; not cached");
+        cache_.remove(storedKey, responseEntryPtr);
+    }
+    updateCacheGauges(stats);
+}
+
+std::vector<std::string> HttpCacheRCFilter::parseSurrogateKeys(const ResponseHeaderMap& headers) {
+    static const LowerCaseString surrogateKeyHeader {"surrogate-key"};
+    std::vector<std::string> tags;
+    const auto values = headers.get(surrogateKeyHeader);
+    for (size_t i = 0; i < values.size(); ++i) {
+        for (absl::string_view tag: absl::StrSplit(values[i]->value().getStringView(), ' ', absl::SkipEmpty())) {
+            tags.emplace_back(tag);
         }
     }
-    releaseLeaderThreadIfPossible();
+    return tags;
+}
+
+uint64_t HttpCacheRCFilter::purge(PurgeKind kind, absl::string_view value) {
+    uint64_t purgedCount = 0;
+    for (const auto& purged: purge_index_.purge(kind, value)) {
+        bool removed = disk_cache_.remove(purged.key_);
+        snapshot_.remove(purged.key_);
+        if (CacheEntrySharedPtr entry = purged.entry_.lock()) {
+            // Removed only if the key still maps to the purged entry, readers in flight finish serving it
+            cache_.remove(purged.key_, entry);
+            removed = true;
+        }
+        if (removed) {
+            ++purgedCount;
+        }
+    }
+    ENVOY_LOG(info, "[HttpCacheRCFilter::purge] Purged {} entries", purgedCount);
+    return purgedCount;
+}
+
+void HttpCacheRCFilter::updateCacheGauges(const HttpCacheRCStats& stats) {
+    // Both values are kept by the cache in atomics, O(1)
+    stats.evictions_.add(cache_.takeBudgetEvictions());
+    stats.entries_.set(cache_.size());
+    stats.bytes_stored_.set(cache_.sizeBytes());
+    stats.disk_entries_.set(disk_cache_.size());
+    stats.disk_bytes_stored_.set(disk_cache_.sizeBytes());
+}
+
+void HttpCacheRCFilter::measureTimeToFirstByte() {
+    cache_entry_consumer_->onHeadersServed(
+        [config = config_, &timeSource = decoder_callbacks_->dispatcher().timeSource(), start = decode_start_]() {
+            config->stats().hit_ttfb_us_.recordValue(
+                std::chrono::duration_cast<std::chrono::microseconds>(timeSource.monotonicTime() - start).count());
+        });
+}
+
+void HttpCacheRCFilter::publishResponseToRCGroup(const ResponseForCoalescedRequestsSharedPtr& groupPtr,
+                                                 const CacheEntrySharedPtr& responseEntryPtr) {
+    std::vector<CoalescedFollower> followers;
+    {
+        std::lock_guard lockGuard(mtx_rc_);
+        groupPtr->shared_response_entry_ptr_ = responseEntryPtr;
+        followers.swap(groupPtr->followers_);
+    }
+    ENVOY_LOG(debug, "[HttpCacheRCFilter::publishResponseToRCGroup] Resuming {} coalesced requests", followers.size());
+    for (auto& follower: followers) {
+        follower.dispatcher_->post([filter = std::move(follower.filter_), responseEntryPtr]() {
+            if (std::shared_ptr<HttpCacheRCFilter> filterPtr = filter.lock()) {
+                filterPtr->onLeaderResponse(responseEntryPtr);
+            }
+        });
+    }
 }
 
-void HttpCacheRCFilter::releaseLeaderThreadIfPossible() const {
-    std::shared_lock sharedLockThreads(shared_mtx_threads_map_);
-    if (leader_threads_for_rc_[this_thread_id_].empty()) {
-        sharedLockThreads.unlock();
-        ENVOY_STREAM_LOG(debug, "[HttpCacheRCFilter::releaseLeaderThreadIfPossible] Releasing leader thread",
-                         *encoder_callbacks_)
-        std::unique_lock uniqueLockThreads(shared_mtx_threads_map_);
-        // This thread is no longer leader of any RC group
-        leader_threads_for_rc_.erase(this_thread_id_);
+void HttpCacheRCFilter::rememberUncacheable() {
+    const MonotonicTime until = encoder_callbacks_->dispatcher().timeSource().monotonicTime() +
+                                std::chrono::seconds(UNCACHEABLE_KEY_TTL);
+    std::lock_guard lockGuard(mtx_rc_);
+    if (uncacheable_keys_.size() >= MAX_UNCACHEABLE_KEYS) {
+        uncacheable_keys_.clear();
     }
+    uncacheable_keys_[request_key_] = until;
+}
+
+bool HttpCacheRCFilter::isUncacheable(const CacheKey& key, MonotonicTime now) {
+    std::lock_guard lockGuard(mtx_rc_);
+    auto itKey = uncacheable_keys_.find(key);
+    if (itKey == uncacheable_keys_.end()) {
+        return false;
+    }
+    if (now >= itKey->second) {
+        uncacheable_keys_.erase(itKey);
+        return false;
+    }
+    return true;
+}
+
+void HttpCacheRCFilter::forgetUncacheable(const CacheKey& key) {
+    std::lock_guard lockGuard(mtx_rc_);
+    uncacheable_keys_.erase(key);
+}
+
+void HttpCacheRCFilter::detachRCGroup(const CacheKey& key, const ResponseForCoalescedRequestsSharedPtr& groupPtr) {
+    std::lock_guard lockGuard(mtx_rc_);
+    // Release the RC group from the map (only if it was not replaced by a newer group)
+    auto itGroup = coalesced_requests_.find(key);
+    if (itGroup != coalesced_requests_.end() && itGroup->second == groupPtr) {
+        coalesced_requests_.erase(itGroup);
+    }
+}
+
+void HttpCacheRCFilter::abandonRCGroup(const CacheKey& key, const ResponseForCoalescedRequestsSharedPtr& groupPtr) {
+    detachRCGroup(key, groupPtr);
+    std::vector<CoalescedFollower> followers;
+    {
+        std::lock_guard lockGuard(mtx_rc_);
+        followers.swap(groupPtr->followers_);
+    }
+    for (auto& follower: followers) {
+        follower.dispatcher_->post([filter = std::move(follower.filter_)]() {
+            if (std::shared_ptr<HttpCacheRCFilter> filterPtr = filter.lock()) {
+                filterPtr->onLeaderAbandoned();
+            }
+        });
+    }
+}
+
+void HttpCacheRCFilter::onLeaderResponse(const CacheEntrySharedPtr& responseEntryPtr) {
+    if (destroyed_ || !is_parked_) {
+        return;
+    }
+    if (!matchesVariant(responseEntryPtr)) {
+        ENVOY_STREAM_LOG(debug, "[HttpCacheRCFilter::onLeaderResponse] Response of the leader is another variant",
+                         *decoder_callbacks_)
+        forwardToOriginWithoutCaching();
+        return;
+    }
+    is_parked_ = false;
+    follower_timer_.reset();
+    config_->stats().follower_wait_time_ms_.recordValue(elapsedSince<std::chrono::milliseconds>(parked_at_));
+    ENVOY_STREAM_LOG(debug, "[HttpCacheRCFilter::onLeaderResponse] Serving response for coalesced request", *decoder_callbacks_)
+    cache_entry_consumer_->serveCachedResponse(responseEntryPtr);
+}
+
+void HttpCacheRCFilter::onLeaderAbandoned() {
+    if (destroyed_ || !is_parked_) {
+        return;
+    }
+    ENVOY_STREAM_LOG(debug, "[HttpCacheRCFilter::onLeaderAbandoned] Leader stream was reset before publishing the response",
+                     *decoder_callbacks_)
+    forwardToOriginWithoutCaching();
+}
+
+void HttpCacheRCFilter::onFollowerTimeout() {
+    if (destroyed_ || !is_parked_) {
+        return;
+    }
+    if (follower_reparks_ < MAX_FOLLOWER_REPARKS && isLeaderPending()) {
+        // Slow origin: its leader is alive and resumes this request (or releases it on reset), a fallback of all
+        // followers would only send the whole group to the slow origin at once
+        ++follower_reparks_;
+        ENVOY_STREAM_LOG(debug, "[HttpCacheRCFilter::onFollowerTimeout] Leader still waiting for the origin; parked again",
+                         *decoder_callbacks_)
+        follower_timer_->enableTimer(followerTimeout());
+        return;
+    }
+    ENVOY_STREAM_LOG(critical, "[HttpCacheRCFilter::onFollowerTimeout] Error: TIMEOUT while waiting for the leader of coalesced requests",
+                     *decoder_callbacks_)
+    config_->stats().follower_timeouts_.inc();
+    forwardToOriginWithoutCaching();
+}
+
+std::chrono::milliseconds HttpCacheRCFilter::followerTimeout() const {
+    const std::chrono::milliseconds timeout = config_->follower_timeout();
+    // Stream ids are random, up to +50%
+    const uint64_t jitterRange = static_cast<uint64_t>(timeout.count()) / 2 + 1;
+    return timeout + std::chrono::milliseconds(decoder_callbacks_->streamId() % jitterRange);
+}
+
+bool HttpCacheRCFilter::isLeaderPending() const {
+    std::lock_guard lockGuard(mtx_rc_);
+    auto itGroup = coalesced_requests_.find(request_key_);
+    return itGroup != coalesced_requests_.end() && itGroup->second == response_wrapper_rc_ptr_ &&
+           itGroup->second->shared_response_entry_ptr_ == nullptr;
+}
+
+void HttpCacheRCFilter::applyLeaderRange(ResponseHeaderMap& headers) {
+    ByteRange range;
+    switch (applyByteRange(*requested_range_, headers, range)) {
+    case RangeOutcome::PARTIAL:
+        leader_range_ = range;
+        trim_to_range_ = true;
+        break;
+    case RangeOutcome::UNSATISFIABLE:
+        trim_to_range_ = true;
+        break;
+    default:
+        break;
+    }
+    ENVOY_STREAM_LOG(debug, "[HttpCacheRCFilter::applyLeaderRange] Downstream response status: '{}'",
+                     *encoder_callbacks_, headers.getStatusValue())
+}
+
+void HttpCacheRCFilter::trimToLeaderRange(Buffer::Instance& data) {
+    const uint64_t offset = leader_body_offset_;
+    const uint64_t length = data.length();
+    leader_body_offset_ += length;
+    if (!leader_range_.has_value()) {
+        data.drain(length);
+        return;
+    }
+    const uint64_t begin = std::clamp(leader_range_->first_, offset, offset + length) - offset;
+    const uint64_t end = std::clamp(leader_range_->last_ + 1, offset, offset + length) - offset;
+    data.drain(begin);
+    if (end - begin < data.length()) {
+        Buffer::OwnedImpl window;
+        window.move(data, end - begin);
+        data.drain(data.length());
+        data.move(window);
+    }
+}
+
+void HttpCacheRCFilter::forwardToOriginWithoutCaching() {
+    // The parked request queries the origin on its own (entry_cached_ stays true, so nothing is written to the cache)
+    is_parked_ = false;
+    follower_timer_.reset();
+    decoder_callbacks_->continueDecoding();
 }
 
 } // namespace Envoy::Http
@@ -7,61 +7,74 @@
 #pragma once
 
 #include "source/extensions/filters/http/common/pass_through_filter.h"
+#include "envoy/server/lifecycle_notifier.h"
+#include "envoy/upstream/cluster_manager.h"
 #include "http_cache_rc_config.h"
 #include "http_lru_ram_cache.h"
-
-constexpr uint32_t COND_VAR_TIMEOUT = 5; // seconds
+#include "disk_cache.h"
+#include "cache_snapshot.h"
+#include "l1_cache.h"
+#include "purge_index.h"
+
+// Parked request whose leader is still waiting for the origin is parked again this many times before it gives up
+constexpr uint32_t MAX_FOLLOWER_REPARKS = 2;
+// Key whose response was not stored is remembered this long, its range requests are forwarded with their Range
+constexpr uint32_t UNCACHEABLE_KEY_TTL = 60; // seconds
+// Remembered keys are all forgotten when there are this many of them
+constexpr size_t MAX_UNCACHEABLE_KEYS = 16 * 1024;
 
 namespace Envoy::Http {
 
-using CondVarSharedPtr = std::shared_ptr<std::condition_variable>;
-using ListDecoderCallbacksSharedPtr = std::shared_ptr<std::list<Http::StreamDecoderFilterCallbacks*>>;
+class HttpCacheRCFilter;
+using HttpCacheRCFilterWeakPtr = std::weak_ptr<HttpCacheRCFilter>;
 
-struct ResponseForCoalescedRequests;
-using ResponseForCoalescedRequestsSharedPtr = std::shared_ptr<ResponseForCoalescedRequests>;
-// Using std::weak_ptr to solve circular dependency memory leaks
-using ResponseForCoalescedRequestsWeakPtr = std::weak_ptr<ResponseForCoalescedRequests>;
-using OtherRCGroupPair = std::pair<Http::StreamDecoderFilterCallbacks*, ResponseForCoalescedRequestsWeakPtr>;
-using OtherRCGroupListSharedPtr = std::shared_ptr<std::list<OtherRCGroupPair>>;
-using UnordMapResponsesForRC = std::unordered_map<std::string, ResponseForCoalescedRequestsSharedPtr>;
-using UnordMapLeaderThreads = std::unordered_map<std::thread::id, UnordMapResponsesForRC>;
+/**
+ * @brief Request parked (StopIteration) until the leader of its group publishes the response.
+ * It is resumed on its own worker thread through its dispatcher.
+ */
+struct CoalescedFollower {
+    Event::Dispatcher* dispatcher_ {};
+    HttpCacheRCFilterWeakPtr filter_ {};
+};
 
 /**
- * @brief Structure which is used by groups of coalesced requests.
+ * @brief Structure which is used by groups of coalesced requests (guarded by HttpCacheRCFilter::mtx_rc_).
  */
 struct ResponseForCoalescedRequests {
-    std::thread::id leader_thread_id_ {};
-    // List of callbacks attended by the leader thread
-    ListDecoderCallbacksSharedPtr waiting_decoder_callbacks_ptr_ { std::make_shared<std::list<Http::StreamDecoderFilterCallbacks*>>() };
-    // Cond_var to lock other threads
-    CondVarSharedPtr cv_ptr_ { std::make_shared<std::condition_variable>() };
+    // Set by the leader once the first response headers arrive (even alongside error status codes)
     CacheEntrySharedPtr shared_response_entry_ptr_ {};
-    // Additional list which is sometimes used when multiple different groups of requests are coalesced in the same moment
-    OtherRCGroupListSharedPtr other_rc_groups_ptr_ {std::make_shared<std::list<OtherRCGroupPair>>() };
+    // Requests that joined the group before the response was published
+    std::vector<CoalescedFollower> followers_ {};
 };
 
+using ResponseForCoalescedRequestsSharedPtr = std::shared_ptr<ResponseForCoalescedRequests>;
+using UnordMapResponsesForRC = std::unordered_map<CacheKey, ResponseForCoalescedRequestsSharedPtr, CacheKeyHash>;
+
 /**
- * @brief Improves readability of the code.
- * INITIAL_LEADER     == first request of this group which queries the cache or the origin web server
- * LEADER             == this thread already created this group and queried
- * OTHER_GROUP_LEADER == this thread already created other group and queried
- * WAITING            == non-leader thread that can listen for a response from the leader
+ * @brief Part a request plays in the group of coalesced requests of its key.
+ * LEADER   == queries the origin and fills the cache
+ * FOLLOWER == parked or served from the response of the leader
+ * BYPASS   == response of the leader is a different variant (Vary), the request goes to the origin without caching
  */
-enum class ThreadStatus { INITIAL_LEADER, LEADER, OTHER_GROUP_LEADER, WAITING };
+enum class RCGroupRole { LEADER, FOLLOWER, BYPASS };
 
 /**
- * @brief HTTP RAM-only cache decoder/encoder (codec) filter, which supports request coalescing.
- * It caches responses based on key calculated by hash function of a string representation of request headers.
- * Uses request coalescing technique based on std::conditional_variable.
+ * @brief HTTP RAM cache decoder/encoder (codec) filter, which supports request coalescing.
+ * Entries evicted from RAM may be kept in an optional disk tier (see DiskCache) and are promoted back on a hit.
+ * It caches responses based on 128-bit key hashed from configurable parts of the request (see CacheKeyBuilder).
+ * Request coalescing never blocks a worker: followers return StopIteration and are resumed via Dispatcher::post
+ * when the leader publishes the response.
  */
 class HttpCacheRCFilter : public Http::PassThroughFilter,
-                          public Logger::Loggable<Logger::Id::filter> {
+                          public Logger::Loggable<Logger::Id::filter>,
+                          public std::enable_shared_from_this<HttpCacheRCFilter> {
 public:
-    explicit HttpCacheRCFilter(HttpCacheRCConfigSharedPtr config);
+    HttpCacheRCFilter(HttpCacheRCConfigSharedPtr config, Upstream::ClusterManager& clusterManager,
+                      L1CacheSlotSharedPtr l1Cache = nullptr);
     ~HttpCacheRCFilter() override = default;
 
     // Http::StreamFilterBase
-    void onDestroy() override {}
+    void onDestroy() override;
     void onStreamComplete() override {}
 
     // Http::StreamDecoderFilter
@@ -73,48 +86,161 @@ public:
     FilterTrailersStatus encodeTrailers(ResponseTrailerMap& trailers) override;
     void encodeComplete() override;
 
+    // Invalidation (admin endpoint), returns the number of removed entries
+    static uint64_t purge(PurgeKind kind, absl::string_view value);
+    // Disk tier of the process-wide cache, the first filter config with disk_cache set enables it
+    static void enableDiskCache(const DiskCacheOptions& options, Api::Api& api);
+    // Warm restarts: the first filter config with snapshot_path set maps the snapshot of the previous process
+    static void enableSnapshot(const std::string& path, Api::Api& api);
+    // Shutdown of the process-wide cache, registered by the first filter config and kept for the life of the server
+    static void registerShutdown(Server::ServerLifecycleNotifier& notifier, TimeSource& timeSource);
+    // Writes the cache into the snapshot file (shutdown, admin endpoint), returns the number of written records
+    static uint64_t writeSnapshot(SystemTime now);
+
 private:
-    void createRequestHeadersStrKey(const RequestHeaderMap& headers);
+    static void onServerShutdown(SystemTime now);
+    friend class CacheRefresher;
+
     bool checkSuccessfulStatusCode(const ResponseHeaderMap& headers);
-    static std::string threadIDToStr(const std::thread::id& threadId);
-    ThreadStatus getThreadStatus();
-    bool isLeaderOfOtherRCGroup() const;
-    void waitForResponseAndServe();
-    void waitOnCondVar() const;
-    void notifyWaitingCoalescedRequests(const CacheEntrySharedPtr& responseEntryPtr) const;
-    void detachCurrentRCGroup() const;
-    void serveResponseToCurrentRCGroup();
-    void attendToOtherRCGroups();
-    void releaseLeaderThreadIfPossible() const;
-
-    // Provides ring_buffer_capacity and cache_capacity
+    // Per-worker L1 first (if configured), then the shared cache; shared hits are promoted into the L1
+    CacheEntrySharedPtr lookup(const CacheKey& key);
+    // Shared cache miss: the Vary marker kept by the disk tier or stored in the snapshot is restored into the shared cache
+    CacheEntrySharedPtr restoreVaryMarker(const CacheKey& key);
+    // Body storage of entries restored from the disk tier or the snapshot
+    DiskEntryOptions restoredEntryOptions() const;
+    RCGroupRole joinOrLeadRCGroup();
+    // Response of the leader was selected by the same values of the Vary request headers as this request has
+    bool matchesVariant(const CacheEntrySharedPtr& responseEntryPtr) const;
+    // Every coding of the Content-Encoding the origin returned for the variant is accepted by the request
+    static bool acceptsStoredCoding(const CacheEntry& responseEntry, const RequestHeaderMap& headers);
+    void detachCurrentRCGroup();
+    void abandonCurrentRCGroup();
+    // Leader only: the request goes to the origin and its response fills the cache
+    void startOriginFill();
+    // Leader only: returns true if the response is being read from the disk tier (onRestoredRead() resumes it)
+    bool readFromDiskCache();
+    // Leader only: returns true if the response is being restored from the snapshot (onRestoredRead() resumes it)
+    bool readFromSnapshot();
+    void onRestoredRead(const CacheEntrySharedPtr& responseEntryPtr, bool fromSnapshot);
+    // Leader only: response is not cached (Vary: *, Content-Length over max_object_bytes), followers go to the origin
+    void bypassCache(ResponseHeaderMap& headers, bool end_stream);
+    // Leader only: response of the key is not stored, a range miss of the key fetches only its range meanwhile
+    // (the whole response is fetched only to be cached)
+    void rememberUncacheable();
+    static bool isUncacheable(const CacheKey& key, MonotonicTime now);
+    static void forgetUncacheable(const CacheKey& key);
+    // Leader only: body exceeds max_object_bytes, the entry leaves the cache and streams to its attached readers only
+    void streamOversizedFill();
+    // Stale or expired hit: refresh the entry in the background, at most one refresh (or leader) per key
+    // Returns true if the refresh was started by this request
+    bool startBackgroundRefresh(const RequestHeaderMap& headers, const CacheEntrySharedPtr& storedEntry);
+    // RC group operations, shared with the background refresher
+    // Returns the new group or nullptr if the key already has a group (single flight)
+    static ResponseForCoalescedRequestsSharedPtr tryCreateRCGroup(const CacheKey& key);
+    // Tags the entry with its variant key if the response varies and inserts it (next to the Vary marker under
+    // the primary key) if it is cacheable and was not purged since fillEpoch. Returns the key of the entry in the cache
+    static CacheKey storeResponse(const CacheKey& primaryKey, const RequestHeaderMap& requestHeaders,
+                                  const ResponseHeaderMap& responseHeaders, std::vector<LowerCaseString> varyHeaders,
+                                  const CacheEntrySharedPtr& responseEntryPtr, bool cacheable, uint64_t fillEpoch,
+                                  const HttpCacheRCStats& stats);
+    // Both parts of storeResponse(), the refresher inserts its response only once the body is complete
+    static CacheKey tagVariant(const CacheKey& primaryKey, const RequestHeaderMap& requestHeaders,
+                               const ResponseHeaderMap& responseHeaders, const std::vector<LowerCaseString>& varyHeaders,
+                               const CacheEntrySharedPtr& responseEntryPtr);
+    static void insertResponse(const CacheKey& primaryKey, const CacheKey& storedKey,
+                               const RequestHeaderMap& requestHeaders, const ResponseHeaderMap& responseHeaders,
+                               std::vector<LowerCaseString> varyHeaders, const CacheEntrySharedPtr& responseEntryPtr,
+                               uint64_t fillEpoch, const HttpCacheRCStats& stats);
+    // Tags of the response for purging (space separated Surrogate-Key header)
+    static std::vector<std::string> parseSurrogateKeys(const ResponseHeaderMap& headers);
+    // Entry count and footprint of the shared cache
+    static void updateCacheGauges(const HttpCacheRCStats& stats);
+    // Hit only: records the time from decodeHeaders() until the cached headers are encoded
+    void measureTimeToFirstByte();
+    template <class Duration> uint64_t elapsedSince(MonotonicTime start) const {
+        return std::chrono::duration_cast<Duration>(decoder_callbacks_->dispatcher().timeSource().monotonicTime() - start).count();
+    }
+    static void publishResponseToRCGroup(const ResponseForCoalescedRequestsSharedPtr& groupPtr,
+                                         const CacheEntrySharedPtr& responseEntryPtr);
+    static void detachRCGroup(const CacheKey& key, const ResponseForCoalescedRequestsSharedPtr& groupPtr);
+    // Followers of the group query the origin on their own
+    static void abandonRCGroup(const CacheKey& key, const ResponseForCoalescedRequestsSharedPtr& groupPtr);
+    // Follower callbacks, always run on the worker thread of this stream
+    void onLeaderResponse(const CacheEntrySharedPtr& responseEntryPtr);
+    void onLeaderAbandoned();
+    void onFollowerTimeout();
+    // follower_timeout plus a jitter derived from the stream id, so the followers of a group do not expire together
+    std::chrono::milliseconds followerTimeout() const;
+    // Leader of the group is still fetching the response (the group was neither published nor abandoned)
+    bool isLeaderPending() const;
+    void forwardToOriginWithoutCaching();
+    // Leader only: the full response is cached, the downstream receives the requested range of it
+    void applyLeaderRange(ResponseHeaderMap& headers);
+    void trimToLeaderRange(Buffer::Instance& data);
+
+    // Provides ring buffer and cache configuration
     const HttpCacheRCConfigSharedPtr config_ {};
-
-    // String key used for lookup in the cache OR into the map of coalesced requests
-    // String representation of important (not all) request headers which is used for calculating cache key
-    std::string request_headers_str_key_ {};
+    // Background refreshes of stale entries are sent through the async client of the route cluster
+    Upstream::ClusterManager& cluster_manager_;
+    // Per-worker L1 cache (nullptr == disabled)
+    const L1CacheSlotSharedPtr l1_cache_ {};
+
+    // Key built from the request by the key spec, a Vary marker stored under it selects the variant key
+    CacheKey primary_key_ {};
+    // Key used for lookup in the cache OR into the map of coalesced requests (primary or variant key)
+    CacheKey request_key_ {};
+    // Leader only: key the response is stored under (differs from request_key_ once the response varies)
+    CacheKey stored_key_ {};
+    // Valid until the stream is destroyed
+    const RequestHeaderMap* request_headers_ {};
+    // Single byte range requested by the client (served from the cached body)
+    std::optional<ByteRangeRequest> requested_range_ {};
+    // Leader only: window of the upstream body sent downstream (nullopt == 416, nothing is sent), also when the
+    // response bypasses the cache
+    std::optional<ByteRange> leader_range_ {};
+    uint64_t leader_body_offset_ {0};
+    // Leader only: body bytes received from the origin (max_object_bytes)
+    uint64_t fill_body_bytes_ {0};
     // Cache of HTTP responses shared among all instances of the filter class
     static HTTPLRURAMCache cache_;
+    // URL and tag indexes of the cache for purging
+    static PurgeIndex purge_index_;
+    // Evicted entries of the cache (disabled unless configured)
+    static DiskCache disk_cache_;
+    // Snapshot of the previous process (restored lazily) and the file the cache is written into
+    static CacheSnapshot snapshot_;
+    static std::string snapshot_path_;
+    static std::once_flag snapshot_init_flag_;
+    // ShutdownExit callback (snapshot write, I/O threads stopped while the workers are still running)
+    static std::once_flag shutdown_init_flag_;
+    static Server::ServerLifecycleNotifier::Handle* shutdown_handle_;
+    // Leader only: purge epoch when the fill started
+    uint64_t fill_epoch_ {0};
 
     bool entry_cached_ {true}, successful_status_code_ {true},
-         is_first_headers_ {true}, is_first_data_ {true}, is_first_trailers_ {true};
+         is_first_headers_ {true}, is_first_data_ {true}, is_first_trailers_ {true},
+         is_leader_ {false}, is_parked_ {false}, encode_complete_ {false}, destroyed_ {false},
+         trim_to_range_ {false}, oversized_ {false};
 
     // Producer used in case the entry wasn't cached in the past (supports concurrent write and reads)
     CacheEntryProducer cache_entry_producer_ {};
-    // Consumer of cache entry (supports concurrent write and reads)
-    CacheEntryConsumer cache_entry_consumer_ {};
+    // Consumer of cache entry serving this stream (supports concurrent write and reads, never blocks)
+    CacheEntryConsumerSharedPtr cache_entry_consumer_ {};
 
-    // Using regular std::mutex for std::condition_variable
+    // Guards the map of coalesced requests and the groups in it (held only for map/list operations)
     static std::mutex mtx_rc_;
     // Map to keep track of what hosts are being served right now
     static UnordMapResponsesForRC coalesced_requests_;
+    // Keys whose last response was not stored, until when they are remembered (guarded by mtx_rc_)
+    static std::unordered_map<CacheKey, MonotonicTime, CacheKeyHash> uncacheable_keys_;
     // Pointer to an item in the map of coalesced requests
     ResponseForCoalescedRequestsSharedPtr response_wrapper_rc_ptr_ {};
-
-    std::thread::id this_thread_id_ {};
-    static std::shared_mutex shared_mtx_threads_map_;
-    // Map to quickly check for current thread status (OTHER_GROUP_LEADER tag)
-    static UnordMapLeaderThreads leader_threads_for_rc_;
+    // Follower only: fallback to the origin if the leader does not publish the response in time
+    Event::TimerPtr follower_timer_ {};
+    uint32_t follower_reparks_ {0};
+    // Start of decodeHeaders() and of parking (stats)
+    MonotonicTime decode_start_ {};
+    MonotonicTime parked_at_ {};
 };
 
 } // namespace Envoy::Http
@@ -1,52 +1,394 @@
 /***********************************************************************************************************************
- * CREDITS: https://github.com/envoyproxy/envoy-filter-example/tree/main/http-filter-example
- * THIS TEST IS NOT FUNCTIONAL YET
+ * Integration tests of the filter against a fake origin (no network access needed).
+ * Every test starts its own Envoy with the filter config it needs. The cache is process-wide, so every test (and IP
+ * version) uses its own paths.
  ***********************************************************************************************************************/
 
 #include "test/integration/http_integration.h"
+#include "absl/strings/str_cat.h"
 
 namespace Envoy {
 
-class HttpCacheIntegrationTest : public HttpIntegrationTest,
-                                 public testing::TestWithParam<Network::Address::IpVersion> {
+constexpr uint64_t RESPONSE_BODY_SIZE = 1024; // bytes
+
+class HttpCacheRCIntegrationTest : public HttpIntegrationTest,
+                                   public testing::TestWithParam<Network::Address::IpVersion> {
 public:
-    HttpCacheIntegrationTest()
-        : HttpIntegrationTest(Http::CodecClient::Type::HTTP1, GetParam()) {}
-    /**
-     * Initializer for an individual integration test.
-     */
-    void SetUp() override { initialize(); }
-
-    void initialize() override {
-        config_helper_.prependFilter(
+    HttpCacheRCIntegrationTest() : HttpIntegrationTest(Http::CodecType::HTTP2, GetParam()) {}
+
+    void SetUp() override { setUpstreamProtocol(Http::CodecType::HTTP2); }
+
+    // Starts Envoy with the filter, extraConfig is appended to its typed config (e.g. ", follower_timeout: 1s")
+    void initializeFilter(const std::string& extraConfig = "") {
+        config_helper_.prependFilter(absl::StrCat(
             "{ name: envoy.filters.http.http_cache_rc, typed_config: { \"@type\": type.googleapis.com/envoy.extensions.filters.http.http_cache_rc.Codec, ring_buffer_capacity: 512, "
-            "cache_capacity: 1024 } }");
-        HttpIntegrationTest::initialize();
+            "cache_capacity: 1024", extraConfig, " } }"));
+        initialize();
+        codec_client_ = makeHttpConnection(lookupPort("http"));
+    }
+
+protected:
+    static std::string testPath(absl::string_view name) {
+        return absl::StrCat("/", testing::UnitTest::GetInstance()->current_test_info()->name(), "/", name);
+    }
+
+    static Http::TestRequestHeaderMapImpl requestHeaders(const std::string& path) {
+        return {{":method", "GET"}, {":path", path}, {":scheme", "http"}, {":authority", "host"}};
+    }
+
+    static Http::TestResponseHeaderMapImpl responseHeaders(uint64_t bodySize = RESPONSE_BODY_SIZE) {
+        return {{":status", "200"}, {"content-length", absl::StrCat(bodySize)}};
+    }
+
+    static void respond(FakeStream& originRequest, const Http::TestResponseHeaderMapImpl& headers,
+                        uint64_t bodySize = RESPONSE_BODY_SIZE) {
+        originRequest.encodeHeaders(headers, bodySize == 0);
+        if (bodySize > 0) {
+            originRequest.encodeData(bodySize, true);
+        }
+    }
+
+    // First value of the header, empty if it is missing
+    static std::string headerValue(const Http::HeaderMap& headers, const std::string& name) {
+        const auto values = headers.get(Http::LowerCaseString(name));
+        return values.empty() ? "" : std::string(values[0]->value().getStringView());
+    }
+
+    uint64_t counterValue(const std::string& name) {
+        Stats::CounterSharedPtr counter = test_server_->counter(name);
+        return counter != nullptr ? counter->value() : 0;
+    }
+
+    uint64_t originRequests() { return counterValue("cluster.cluster_0.upstream_rq_total"); }
+
+    // Request is decoded by the filter (parked or served) before the worker handles the next event of the origin
+    void waitForActiveRequests(uint64_t count) {
+        test_server_->waitForGaugeEq("http.config_test.downstream_rq_active", count);
+    }
+
+    // Request of path answered by the origin, the response is complete
+    void fillFromOrigin(const std::string& path, const Http::TestResponseHeaderMapImpl& headers,
+                        uint64_t bodySize = RESPONSE_BODY_SIZE) {
+        IntegrationStreamDecoderPtr response = codec_client_->makeHeaderOnlyRequest(requestHeaders(path));
+        waitForNextUpstreamRequest();
+        respond(*upstream_request_, headers, bodySize);
+        ASSERT_TRUE(response->waitForEndStream());
+        EXPECT_EQ(headers.getStatusValue(), response->headers().getStatusValue());
+        EXPECT_EQ(bodySize, response->body().size());
+    }
+
+    // Request of path served without reaching the origin
+    IntegrationStreamDecoderPtr expectServedFromCache(const std::string& path, uint64_t bodySize = RESPONSE_BODY_SIZE) {
+        const uint64_t originRequestsBefore = originRequests();
+        IntegrationStreamDecoderPtr response = codec_client_->makeHeaderOnlyRequest(requestHeaders(path));
+        EXPECT_TRUE(response->waitForEndStream());
+        EXPECT_EQ("200", response->headers().getStatusValue());
+        EXPECT_EQ(bodySize, response->body().size());
+        EXPECT_EQ(originRequestsBefore, originRequests());
+        return response;
+    }
+
+    // Body of the purge admin endpoint, query is e.g. "tag=news"
+    std::string purge(const std::string& query) {
+        BufferingStreamDecoderPtr response = IntegrationUtil::makeSingleRequest(
+            lookupPort("admin"), "POST", absl::StrCat("/cache_rc/purge?", query), "", Http::CodecType::HTTP1, version_);
+        EXPECT_TRUE(response->complete());
+        EXPECT_EQ("200", response->headers().getStatusValue());
+        return response->body();
     }
 };
 
-INSTANTIATE_TEST_SUITE_P(IpVersions, HttpCacheIntegrationTest,
-                         testing::ValuesIn(TestEnvironment::getIpVersionsForTest()));
+INSTANTIATE_TEST_SUITE_P(IpVersions, HttpCacheRCIntegrationTest, testing::ValuesIn(TestEnvironment::getIpVersionsForTest()),
+                         TestUtility::ipTestParamsToString);
+
+// Requests arriving while the leader waits for the origin share its single origin request
+TEST_P(HttpCacheRCIntegrationTest, CoalescedRequestsFetchOnce) {
+    initializeFilter();
+    const std::string path = testPath("a");
+    IntegrationStreamDecoderPtr leader = codec_client_->makeHeaderOnlyRequest(requestHeaders(path));
+    waitForNextUpstreamRequest();
+    IntegrationStreamDecoderPtr follower = codec_client_->makeHeaderOnlyRequest(requestHeaders(path));
+    waitForActiveRequests(2);
+    respond(*upstream_request_, responseHeaders());
+
+    ASSERT_TRUE(leader->waitForEndStream());
+    ASSERT_TRUE(follower->waitForEndStream());
+    EXPECT_EQ("200", follower->headers().getStatusValue());
+    EXPECT_EQ(leader->body(), follower->body());
+    EXPECT_EQ(1, originRequests());
 
-TEST_P(HttpCacheIntegrationTest, Test1) {
-  Http::TestRequestHeaderMapImpl headers{
-      {":method", "GET"}, {":path", "/"}, {":authority", "host"}};
-  Http::TestRequestHeaderMapImpl response_headers{
-      {":status", "200"}};
+    expectServedFromCache(path);
+}
+
+// Follower of a leader the origin never answers stops waiting and queries the origin itself
+TEST_P(HttpCacheRCIntegrationTest, FollowerTimesOutBehindSilentOrigin) {
+    initializeFilter(", follower_timeout: 0.2s");
+    const std::string path = testPath("a");
+    IntegrationStreamDecoderPtr leader = codec_client_->makeHeaderOnlyRequest(requestHeaders(path));
+    waitForNextUpstreamRequest();
+    FakeStreamPtr leaderRequest = std::move(upstream_request_);
+    IntegrationStreamDecoderPtr follower = codec_client_->makeHeaderOnlyRequest(requestHeaders(path));
+
+    // Re-parked twice at most while the leader is waiting, then forwarded
+    waitForNextUpstreamRequest();
+    respond(*upstream_request_, responseHeaders());
+    ASSERT_TRUE(follower->waitForEndStream());
+    EXPECT_EQ("200", follower->headers().getStatusValue());
+    EXPECT_FALSE(leader->complete());
+
+    respond(*leaderRequest, responseHeaders());
+    ASSERT_TRUE(leader->waitForEndStream());
+    EXPECT_EQ("200", leader->headers().getStatusValue());
+    EXPECT_EQ(2, originRequests());
+}
+
+// Reset leader releases its parked followers to the origin right away
+TEST_P(HttpCacheRCIntegrationTest, FollowersGoToOriginWhenLeaderIsReset) {
+    initializeFilter();
+    const std::string path = testPath("a");
+    auto leader = codec_client_->startRequest(requestHeaders(path), true);
+    waitForNextUpstreamRequest();
+    FakeStreamPtr leaderRequest = std::move(upstream_request_);
+    IntegrationStreamDecoderPtr follower = codec_client_->makeHeaderOnlyRequest(requestHeaders(path));
+    waitForActiveRequests(2);
+
+    codec_client_->sendReset(leader.first);
+    ASSERT_TRUE(leaderRequest->waitForReset());
+    waitForNextUpstreamRequest();
+    respond(*upstream_request_, responseHeaders());
+    ASSERT_TRUE(follower->waitForEndStream());
+    EXPECT_EQ("200", follower->headers().getStatusValue());
+    EXPECT_EQ(RESPONSE_BODY_SIZE, follower->body().size());
+    EXPECT_EQ(2, originRequests());
+}
+
+// Expired entry with a validator is revalidated, the 304 refreshes the stored headers and the body is served from cache
+TEST_P(HttpCacheRCIntegrationTest, ExpiredEntryIsRevalidated) {
+    initializeFilter();
+    const std::string path = testPath("a");
+    Http::TestResponseHeaderMapImpl storedHeaders = responseHeaders();
+    storedHeaders.addCopy("cache-control", "max-age=0");
+    storedHeaders.addCopy("etag", "\"v1\"");
+    storedHeaders.addCopy("link", "</stale.css>; rel=preload");
+    fillFromOrigin(path, storedHeaders);
+
+    IntegrationStreamDecoderPtr response = codec_client_->makeHeaderOnlyRequest(requestHeaders(path));
+    waitForNextUpstreamRequest();
+    EXPECT_EQ("\"v1\"", headerValue(upstream_request_->headers(), "if-none-match"));
+    // Repeated fields of the 304 replace the stored field with all of their values
+    Http::TestResponseHeaderMapImpl notModified {{":status", "304"},
+                                                 {"cache-control", "max-age=3600"},
+                                                 {"etag", "\"v1\""},
+                                                 {"link", "</a.css>; rel=preload"},
+                                                 {"link", "</b.js>; rel=preload"}};
+    upstream_request_->encodeHeaders(notModified, true);
+    ASSERT_TRUE(response->waitForEndStream());
+    EXPECT_EQ("200", response->headers().getStatusValue());
+    EXPECT_EQ(RESPONSE_BODY_SIZE, response->body().size());
+    EXPECT_EQ("max-age=3600", headerValue(response->headers(), "cache-control"));
+    const auto links = response->headers().get(Http::LowerCaseString("link"));
+    ASSERT_EQ(2, links.size());
+    EXPECT_EQ("</a.css>; rel=preload", links[0]->value().getStringView());
+    EXPECT_EQ("</b.js>; rel=preload", links[1]->value().getStringView());
+
+    // Fresh again
+    expectServedFromCache(path);
+    EXPECT_EQ(2, originRequests());
+}
+
+// Responses with Vary are stored per variant, a request is served the variant its headers select
+TEST_P(HttpCacheRCIntegrationTest, VariantSelectedByVaryHeaders) {
+    initializeFilter();
+    const std::string path = testPath("a");
+    Http::TestResponseHeaderMapImpl varyHeaders = responseHeaders();
+    varyHeaders.addCopy("vary", "accept-language");
+    const std::vector<std::pair<std::string, uint64_t>> variants {{"en", 100}, {"fr", 200}};
+    for (const auto& [language, bodySize]: variants) {
+        Http::TestRequestHeaderMapImpl headers = requestHeaders(path);
+        headers.addCopy("accept-language", language);
+        IntegrationStreamDecoderPtr response = codec_client_->makeHeaderOnlyRequest(headers);
+        waitForNextUpstreamRequest();
+        varyHeaders.setCopy(Http::LowerCaseString("content-length"), absl::StrCat(bodySize));
+        respond(*upstream_request_, varyHeaders, bodySize);
+        ASSERT_TRUE(response->waitForEndStream());
+    }
+    EXPECT_EQ(2, originRequests());
+
+    for (const auto& [language, bodySize]: {variants[1], variants[0], variants[1]}) {
+        Http::TestRequestHeaderMapImpl headers = requestHeaders(path);
+        headers.addCopy("accept-language", language);
+        IntegrationStreamDecoderPtr response = codec_client_->makeHeaderOnlyRequest(headers);
+        ASSERT_TRUE(response->waitForEndStream());
+        EXPECT_EQ("200", response->headers().getStatusValue());
+        EXPECT_EQ(bodySize, response->body().size()) << language;
+    }
+    EXPECT_EQ(2, originRequests());
+}
+
+// Variant filled with a coding the origin chose is not served to a request that does not accept that coding
+TEST_P(HttpCacheRCIntegrationTest, StoredCodingMustBeAccepted) {
+    initializeFilter();
+    const std::string path = testPath("a");
+    Http::TestRequestHeaderMapImpl gzipOrBr = requestHeaders(path);
+    gzipOrBr.addCopy("accept-encoding", "gzip, br");
+    IntegrationStreamDecoderPtr response = codec_client_->makeHeaderOnlyRequest(gzipOrBr);
+    waitForNextUpstreamRequest();
+    Http::TestResponseHeaderMapImpl gzipHeaders = responseHeaders();
+    gzipHeaders.addCopy("vary", "accept-encoding");
+    gzipHeaders.addCopy("content-encoding", "gzip");
+    respond(*upstream_request_, gzipHeaders);
+    ASSERT_TRUE(response->waitForEndStream());
+
+    // Same variant key (br is preferred), but the stored body is gzip
+    Http::TestRequestHeaderMapImpl brOnly = requestHeaders(path);
+    brOnly.addCopy("accept-encoding", "br");
+    response = codec_client_->makeHeaderOnlyRequest(brOnly);
+    waitForNextUpstreamRequest();
+    Http::TestResponseHeaderMapImpl brHeaders = responseHeaders();
+    brHeaders.addCopy("vary", "accept-encoding");
+    brHeaders.addCopy("content-encoding", "br");
+    respond(*upstream_request_, brHeaders);
+    ASSERT_TRUE(response->waitForEndStream());
+    EXPECT_EQ("br", headerValue(response->headers(), "content-encoding"));
+    EXPECT_EQ(2, originRequests());
+}
+
+// Purged responses are fetched from the origin again, the others stay cached
+TEST_P(HttpCacheRCIntegrationTest, PurgeByUrlPrefixAndTag) {
+    initializeFilter();
+    const std::string tag = absl::StrCat("tag-", TestUtility::ipVersionToString(GetParam()));
+    Http::TestResponseHeaderMapImpl taggedHeaders = responseHeaders();
+    taggedHeaders.addCopy("surrogate-key", absl::StrCat("other ", tag));
+    const std::string single = testPath("single");
+    const std::string dirA = testPath("dir/a");
+    const std::string dirB = testPath("dir/b");
+    const std::string tagged = testPath("tagged");
+    const std::string kept = testPath("kept");
+    fillFromOrigin(single, responseHeaders());
+    fillFromOrigin(dirA, responseHeaders());
+    fillFromOrigin(dirB, responseHeaders());
+    fillFromOrigin(tagged, taggedHeaders);
+    fillFromOrigin(kept, responseHeaders());
+
+    EXPECT_EQ("{\"purged\": 1}\n", purge(absl::StrCat("url=host", single)));
+    EXPECT_EQ("{\"purged\": 2}\n", purge(absl::StrCat("prefix=host", testPath("dir/"))));
+    EXPECT_EQ("{\"purged\": 1}\n", purge(absl::StrCat("tag=", tag)));
+    EXPECT_EQ("{\"purged\": 0}\n", purge(absl::StrCat("url=host", single)));
+
+    expectServedFromCache(kept);
+    for (const std::string& path: {single, dirA, dirB, tagged}) {
+        fillFromOrigin(path, responseHeaders());
+    }
+    EXPECT_EQ(9, originRequests());
+}
+
+// Response of a fill that started before a matching purge is served but not cached
+TEST_P(HttpCacheRCIntegrationTest, PurgeRefusesEarlierFill) {
+    initializeFilter();
+    const std::string path = testPath("a");
+    IntegrationStreamDecoderPtr response = codec_client_->makeHeaderOnlyRequest(requestHeaders(path));
+    waitForNextUpstreamRequest();
+    EXPECT_EQ("{\"purged\": 0}\n", purge(absl::StrCat("url=host", path)));
+    respond(*upstream_request_, responseHeaders());
+    ASSERT_TRUE(response->waitForEndStream());
+    EXPECT_EQ("200", response->headers().getStatusValue());
+
+    fillFromOrigin(path, responseHeaders());
+    EXPECT_EQ(2, originRequests());
+    expectServedFromCache(path);
+}
+
+// Text body is stored gzip-compressed: served as stored to clients accepting gzip, decompressed for the others
+TEST_P(HttpCacheRCIntegrationTest, CompressedAtRestDecompressedOnServe) {
+    initializeFilter(", compression: { algorithm: GZIP }");
+    const std::string path = testPath("a");
+    Http::TestResponseHeaderMapImpl textHeaders = responseHeaders(4 * RESPONSE_BODY_SIZE);
+    textHeaders.addCopy("content-type", "text/plain");
+    fillFromOrigin(path, textHeaders, 4 * RESPONSE_BODY_SIZE);
+
+    Http::TestRequestHeaderMapImpl acceptsGzip = requestHeaders(path);
+    acceptsGzip.addCopy("accept-encoding", "gzip");
+    IntegrationStreamDecoderPtr compressed = codec_client_->makeHeaderOnlyRequest(acceptsGzip);
+    ASSERT_TRUE(compressed->waitForEndStream());
+    EXPECT_EQ("200", compressed->headers().getStatusValue());
+    EXPECT_EQ("gzip", headerValue(compressed->headers(), "content-encoding"));
+    // Body of repeated characters
+    EXPECT_LT(compressed->body().size(), RESPONSE_BODY_SIZE);
+
+    IntegrationStreamDecoderPtr decompressed = expectServedFromCache(path, 4 * RESPONSE_BODY_SIZE);
+    EXPECT_EQ("", headerValue(decompressed->headers(), "content-encoding"));
+    EXPECT_EQ(std::string(4 * RESPONSE_BODY_SIZE, 'a'), decompressed->body());
+    EXPECT_EQ("accept-encoding", headerValue(decompressed->headers(), "vary"));
+    EXPECT_EQ(1, originRequests());
+}
+
+// Response over max_object_bytes reaches the client whole but is not cached
+TEST_P(HttpCacheRCIntegrationTest, OversizedResponseBypassesCache) {
+    initializeFilter(", max_object_bytes: 4096");
+    const std::string path = testPath("a");
+    fillFromOrigin(path, responseHeaders(4 * 4096), 4 * 4096);
+    EXPECT_EQ(1, counterValue("http.config_test.http_cache_rc.oversized"));
+
+    fillFromOrigin(path, responseHeaders(4 * 4096), 4 * 4096);
+    EXPECT_EQ(2, originRequests());
+}
+
+// Growing over max_object_bytes without Content-Length switches the fill to streaming
+TEST_P(HttpCacheRCIntegrationTest, OversizedBodyWithoutContentLengthIsStreamed) {
+    initializeFilter(", max_object_bytes: 4096");
+    const std::string path = testPath("a");
+    IntegrationStreamDecoderPtr response = codec_client_->makeHeaderOnlyRequest(requestHeaders(path));
+    waitForNextUpstreamRequest();
+    upstream_request_->encodeHeaders(Http::TestResponseHeaderMapImpl {{":status", "200"}}, false);
+    for (int i = 0; i < 8; ++i) {
+        upstream_request_->encodeData(2048, i == 7);
+    }
+    ASSERT_TRUE(response->waitForEndStream());
+    EXPECT_EQ(8 * 2048, response->body().size());
+    EXPECT_EQ(1, counterValue("http.config_test.http_cache_rc.oversized"));
+
+    fillFromOrigin(path, responseHeaders());
+    EXPECT_EQ(2, originRequests());
+}
+
+// Range removed from the upstream request is still cut out of a response that is not cached
+TEST_P(HttpCacheRCIntegrationTest, RangeOfOversizedResponse) {
+    initializeFilter(", max_object_bytes: 4096");
+    Http::TestRequestHeaderMapImpl headers = requestHeaders(testPath("a"));
+    headers.addCopy("range", "bytes=100-199");
+    IntegrationStreamDecoderPtr response = codec_client_->makeHeaderOnlyRequest(headers);
+    waitForNextUpstreamRequest();
+    EXPECT_EQ("", headerValue(upstream_request_->headers(), "range"));
+    respond(*upstream_request_, responseHeaders(4 * 4096), 4 * 4096);
+    ASSERT_TRUE(response->waitForEndStream());
+    EXPECT_EQ("206", response->headers().getStatusValue());
+    EXPECT_EQ("bytes 100-199/16384", headerValue(response->headers(), "content-range"));
+    EXPECT_EQ(100, response->body().size());
+}
 
-  IntegrationCodecClientPtr codec_client;
-  FakeHttpConnectionPtr fake_upstream_connection;
-  FakeStreamPtr request_stream;
+// Hit served to a client that stops reading pauses at the high watermark instead of buffering the whole body
+TEST_P(HttpCacheRCIntegrationTest, PausesServingAtHighWatermark) {
+    constexpr uint64_t bodySize = 32 * 1024 * 1024;
+    constexpr uint32_t bufferLimit = 1024 * 1024;
+    config_helper_.setBufferLimits(bufferLimit, bufferLimit);
+    initializeFilter();
+    const std::string path = testPath("a");
+    fillFromOrigin(path, responseHeaders(bodySize), bodySize);
 
-  codec_client = makeHttpConnection(lookupPort("http"));
-  auto response = codec_client->makeHeaderOnlyRequest(headers);
-  ASSERT_TRUE(fake_upstreams_[0]->waitForHttpConnection(*dispatcher_, fake_upstream_connection));
-  ASSERT_TRUE(fake_upstream_connection->waitForNewStream(*dispatcher_, request_stream));
-  ASSERT_TRUE(request_stream->waitForEndStream(*dispatcher_));
-  request_stream->encodeHeaders(response_headers, true);
-  ASSERT_TRUE(response->waitForEndStream());
+    // Response is not read anymore once the socket buffers of the kernel are full, the rest piles up in Envoy
+    codec_client_->connection()->readDisable(true);
+    IntegrationStreamDecoderPtr response = codec_client_->makeHeaderOnlyRequest(requestHeaders(path));
+    test_server_->waitForCounterEq("http.config_test.http_cache_rc.hits", 1, TestUtility::DefaultTimeout, dispatcher_.get());
+    test_server_->waitForGaugeGe("http.config_test.downstream_cx_tx_bytes_buffered", bufferLimit);
+    // A consumer that ignored the watermark would keep copying the rest of the body meanwhile
+    timeSystem().advanceTimeWait(std::chrono::milliseconds(500));
+    EXPECT_LT(test_server_->gauge("http.config_test.downstream_cx_tx_bytes_buffered")->value(), 4 * bufferLimit);
 
-  codec_client->close();
+    codec_client_->connection()->readDisable(false);
+    ASSERT_TRUE(response->waitForEndStream());
+    EXPECT_EQ("200", response->headers().getStatusValue());
+    EXPECT_EQ(bodySize, response->body().size());
+    EXPECT_EQ(1, originRequests());
 }
 
 } // namespace Envoy
@@ -0,0 +1,195 @@
+/***********************************************************************************************************************
+ * Load test of request coalescing against a fake origin (no network access needed).
+ * Thousands of concurrent requests are sent over one HTTP/2 connection, the origin answers only after every request
+ * reached the filter, so each key must be fetched exactly once per fill.
+ * Latency percentiles of leaders and followers are logged and recorded as test properties.
+ ***********************************************************************************************************************/
+
+#include "test/integration/http_integration.h"
+#include "absl/container/flat_hash_set.h"
+#include "absl/strings/str_cat.h"
+
+#include <algorithm>
+#include <map>
+#include <random>
+
+namespace Envoy {
+
+constexpr uint64_t RESPONSE_BODY_SIZE = 4 * 1024; // bytes
+
+class HttpCacheRCLoadTest : public HttpIntegrationTest,
+                            public testing::TestWithParam<Network::Address::IpVersion> {
+public:
+    HttpCacheRCLoadTest() : HttpIntegrationTest(Http::CodecType::HTTP2, GetParam()) {}
+
+    void SetUp() override {
+        setUpstreamProtocol(Http::CodecType::HTTP2);
+        initialize();
+    }
+
+    void initialize() override {
+        config_helper_.prependFilter(
+            "{ name: envoy.filters.http.http_cache_rc, typed_config: { \"@type\": type.googleapis.com/envoy.extensions.filters.http.http_cache_rc.Codec, ring_buffer_capacity: 512, "
+            "cache_capacity: 1024, body_storage: BUFFER_SLICES } }");
+        HttpIntegrationTest::initialize();
+    }
+
+protected:
+    struct SentRequest {
+        IntegrationStreamDecoderPtr response_ {};
+        MonotonicTime sent_at_ {};
+        std::chrono::microseconds latency_ {0};
+        // "leader", "follower" or "hit"
+        std::string role_ {};
+    };
+
+    // Cache of the filter is shared by all tests in this process, every test (and IP version) uses its own paths
+    static std::string keyPath(uint32_t key) {
+        return absl::StrCat("/", testing::UnitTest::GetInstance()->current_test_info()->name(), "/key_", key);
+    }
+
+    static uint64_t counterValue(IntegrationTestServer& server, const std::string& name) {
+        Stats::CounterSharedPtr counter = server.counter(name);
+        return counter != nullptr ? counter->value() : 0;
+    }
+
+    // Sends one request per element of keys; requests are decoded in order on one worker, so the first request of a
+    // key that is not cached leads its RC group
+    std::vector<SentRequest> sendRequests(const std::vector<uint32_t>& keys, bool cached) {
+        std::vector<SentRequest> requests(keys.size());
+        absl::flat_hash_set<uint32_t> ledKeys;
+        for (size_t i = 0; i < keys.size(); ++i) {
+            Http::TestRequestHeaderMapImpl headers {
+                {":method", "GET"}, {":path", keyPath(keys[i])}, {":scheme", "http"}, {":authority", "host"}};
+            requests[i].sent_at_ = timeSystem().monotonicTime();
+            requests[i].response_ = codec_client_->makeHeaderOnlyRequest(headers);
+            requests[i].role_ = cached ? "hit" : ledKeys.insert(keys[i]).second ? "leader" : "follower";
+        }
+        return requests;
+    }
+
+    // Accepts keyCount upstream requests and answers them, every key must be requested once
+    void serveOrigin(uint32_t keyCount) {
+        if (fake_upstream_connection_ == nullptr) {
+            ASSERT_TRUE(fake_upstreams_[0]->waitForHttpConnection(*dispatcher_, fake_upstream_connection_));
+        }
+        std::vector<FakeStreamPtr> upstreamRequests;
+        absl::flat_hash_set<std::string> paths;
+        for (uint32_t i = 0; i < keyCount; ++i) {
+            FakeStreamPtr upstreamRequest;
+            ASSERT_TRUE(fake_upstream_connection_->waitForNewStream(*dispatcher_, upstreamRequest));
+            ASSERT_TRUE(upstreamRequest->waitForEndStream(*dispatcher_));
+            EXPECT_TRUE(paths.insert(std::string(upstreamRequest->headers().getPathValue())).second)
+                << "key requested from the origin twice: " << upstreamRequest->headers().getPathValue();
+            upstreamRequests.push_back(std::move(upstreamRequest));
+        }
+        Http::TestResponseHeaderMapImpl responseHeaders {
+            {":status", "200"}, {"cache-control", "max-age=3600"}, {"content-length", absl::StrCat(RESPONSE_BODY_SIZE)}};
+        for (auto& upstreamRequest: upstreamRequests) {
+            upstreamRequest->encodeHeaders(responseHeaders, false);
+            upstreamRequest->encodeData(RESPONSE_BODY_SIZE, true);
+        }
+    }
+
+    // Runs the client dispatcher until every response is complete; latency of a response is taken when its completion
+    // is observed first, so it is an upper bound with the resolution of one dispatcher iteration
+    void awaitResponses(std::vector<SentRequest>& requests) {
+        const MonotonicTime deadline = timeSystem().monotonicTime() + TestUtility::DefaultTimeout;
+        size_t pending = requests.size();
+        std::vector<bool> observed(requests.size(), false);
+        while (pending > 0) {
+            ASSERT_LT(timeSystem().monotonicTime(), deadline) << pending << " responses did not complete";
+            dispatcher_->run(Event::Dispatcher::RunType::NonBlock);
+            const MonotonicTime now = timeSystem().monotonicTime();
+            for (size_t i = 0; i < requests.size(); ++i) {
+                if (!observed[i] && requests[i].response_->complete()) {
+                    observed[i] = true;
+                    requests[i].latency_ = std::chrono::duration_cast<std::chrono::microseconds>(now - requests[i].sent_at_);
+                    --pending;
+                }
+            }
+        }
+        for (auto& request: requests) {
+            EXPECT_EQ("200", request.response_->headers().getStatusValue());
+            EXPECT_EQ(RESPONSE_BODY_SIZE, request.response_->body().size());
+        }
+    }
+
+    static uint64_t percentile(std::vector<uint64_t> values, double fraction) {
+        if (values.empty()) {
+            return 0;
+        }
+        std::sort(values.begin(), values.end());
+        return values[std::min(values.size() - 1, static_cast<size_t>(fraction * static_cast<double>(values.size())))];
+    }
+
+    void reportLatency(const std::vector<SentRequest>& requests, const std::string& wave) {
+        std::map<std::string, std::vector<uint64_t>> latenciesByRole;
+        for (const auto& request: requests) {
+            latenciesByRole[request.role_].push_back(request.latency_.count());
+        }
+        for (const auto& [role, latencies]: latenciesByRole) {
+            const uint64_t p50 = percentile(latencies, 0.50);
+            const uint64_t p99 = percentile(latencies, 0.99);
+            ENVOY_LOG_MISC(info, "{} wave, {}: {} requests, latency p50: {} us, p99: {} us", wave, role, latencies.size(), p50, p99);
+            RecordProperty(absl::StrCat(wave, "_", role, "_p50_us"), static_cast<int>(p50));
+            RecordProperty(absl::StrCat(wave, "_", role, "_p99_us"), static_cast<int>(p99));
+        }
+    }
+
+    // One fill of keyCount keys by the requests in keys, followed by a wave of the same requests served from the cache
+    void runFillAndHitWaves(const std::vector<uint32_t>& keys, uint32_t keyCount) {
+        const std::string statPrefix = "http.config_test.http_cache_rc.";
+        const uint64_t upstreamRequestsBefore = counterValue(*test_server_, "cluster.cluster_0.upstream_rq_total");
+        const uint64_t coalescedBefore = counterValue(*test_server_, statPrefix + "coalesced");
+        const uint64_t missesBefore = counterValue(*test_server_, statPrefix + "misses");
+        const uint64_t hitsBefore = counterValue(*test_server_, statPrefix + "hits");
+
+        codec_client_ = makeHttpConnection(lookupPort("http"));
+        std::vector<SentRequest> fill = sendRequests(keys, false);
+        // The origin answers only after every request joined or led its RC group
+        test_server_->waitForCounterEq(statPrefix + "coalesced", coalescedBefore + keys.size() - keyCount);
+        test_server_->waitForCounterEq(statPrefix + "misses", missesBefore + keyCount);
+        serveOrigin(keyCount);
+        awaitResponses(fill);
+        reportLatency(fill, "fill");
+        EXPECT_EQ(upstreamRequestsBefore + keyCount, counterValue(*test_server_, "cluster.cluster_0.upstream_rq_total"));
+
+        std::vector<SentRequest> hit = sendRequests(keys, true);
+        awaitResponses(hit);
+        reportLatency(hit, "hit");
+        EXPECT_EQ(hitsBefore + keys.size(), counterValue(*test_server_, statPrefix + "hits"));
+        // Nothing else reached the origin
+        EXPECT_EQ(upstreamRequestsBefore + keyCount, counterValue(*test_server_, "cluster.cluster_0.upstream_rq_total"));
+        FakeStreamPtr unexpectedRequest;
+        EXPECT_FALSE(fake_upstream_connection_->waitForNewStream(*dispatcher_, unexpectedRequest, std::chrono::milliseconds(100)));
+
+        codec_client_->close();
+    }
+};
+
+INSTANTIATE_TEST_SUITE_P(IpVersions, HttpCacheRCLoadTest, testing::ValuesIn(TestEnvironment::getIpVersionsForTest()),
+                         TestUtility::ipTestParamsToString);
+
+// Thousands of identical requests: one leader, everyone else is coalesced into its fetch
+TEST_P(HttpCacheRCLoadTest, IdenticalRequestsFetchOnce) {
+    constexpr uint32_t requestCount = 4000;
+    runFillAndHitWaves(std::vector<uint32_t>(requestCount, 0), 1);
+}
+
+// Requests of many keys interleaved in random order: one origin request per key
+TEST_P(HttpCacheRCLoadTest, MixedKeysFetchOncePerKey) {
+    constexpr uint32_t requestCount = 4000;
+    constexpr uint32_t keyCount = 64;
+    std::mt19937 randomEngine(42);
+    std::uniform_int_distribution<uint32_t> keyDistribution(0, keyCount - 1);
+    std::vector<uint32_t> keys(requestCount);
+    // Every key at least once, so exactly keyCount groups are led
+    for (uint32_t i = 0; i < requestCount; ++i) {
+        keys[i] = i < keyCount ? i : keyDistribution(randomEngine);
+    }
+    std::shuffle(keys.begin(), keys.end(), randomEngine);
+    runFillAndHitWaves(keys, keyCount);
+}
+
+} // namespace Envoy
@@ -0,0 +1,112 @@
+/***********************************************************************************************************************
+ * Integration test of the cache snapshot: the snapshot of a previous process is restored lazily on a RAM miss and
+ * the admin endpoint writes the cache into a new snapshot.
+ * The snapshot is process-wide and stopped by the shutdown of the first Envoy of the process, so this binary runs
+ * a single test.
+ ***********************************************************************************************************************/
+
+#include "cache_key.h"
+#include "cache_snapshot.h"
+#include "test/integration/http_integration.h"
+#include "absl/strings/str_cat.h"
+
+namespace Envoy {
+
+constexpr uint64_t RESPONSE_BODY_SIZE = 100 * 1024; // bytes
+constexpr absl::string_view RESTORED_PATH = "/snapshot/restored";
+constexpr absl::string_view FILLED_PATH = "/snapshot/filled";
+
+class HttpCacheRCSnapshotIntegrationTest : public HttpIntegrationTest, public testing::Test {
+public:
+    HttpCacheRCSnapshotIntegrationTest()
+        : HttpIntegrationTest(Http::CodecType::HTTP2, TestEnvironment::getIpVersionsForTest().front()) {}
+
+    // Snapshot written by the "previous process", holding the response of RESTORED_PATH
+    static void SetUpTestSuite() {
+        Api::ApiPtr api = Api::createApiForTest();
+        const SystemTime now = api->timeSource().systemTime();
+        Http::CacheEntryProducer producer;
+        producer.initCacheEntry(512, Http::BodyStorage::RING_BUFFER_BLOCKS, Http::DEFAULT_SEGMENT_SIZE_BYTES,
+                                api->timeSource());
+        Http::Freshness freshness;
+        freshness.fresh_until_ = now + std::chrono::hours(1);
+        freshness.stale_until_ = freshness.fresh_until_;
+        producer.getCacheEntryPtr()->setFreshness(freshness);
+        producer.writeHeaders(
+            Http::TestResponseHeaderMapImpl {{":status", "200"}, {"content-length", absl::StrCat(RESPONSE_BODY_SIZE)}}, false);
+        producer.headersWriteComplete();
+        Buffer::OwnedImpl body(std::string(RESPONSE_BODY_SIZE, 'r'));
+        producer.writeData(body, true);
+        producer.writeComplete();
+        Http::CacheSnapshot snapshot;
+        ASSERT_EQ(1, snapshot.write(snapshotPath(), {{cacheKey(RESTORED_PATH), producer.getCacheEntryPtr()}}, now));
+    }
+
+    void SetUp() override {
+        setUpstreamProtocol(Http::CodecType::HTTP2);
+        config_helper_.prependFilter(absl::StrCat(
+            "{ name: envoy.filters.http.http_cache_rc, typed_config: { \"@type\": type.googleapis.com/envoy.extensions.filters.http.http_cache_rc.Codec, ring_buffer_capacity: 512, "
+            "cache_capacity: 1024, snapshot_path: \"", snapshotPath(), "\" } }"));
+        initialize();
+        codec_client_ = makeHttpConnection(lookupPort("http"));
+    }
+
+protected:
+    static std::string snapshotPath() { return TestEnvironment::temporaryPath("http_cache_rc.snapshot"); }
+
+    static Http::TestRequestHeaderMapImpl requestHeaders(absl::string_view path) {
+        return {{":method", "GET"}, {":path", std::string(path)}, {":scheme", "http"}, {":authority", "host"}};
+    }
+
+    // Key the filter stores the response of path under (default key spec)
+    static Http::CacheKey cacheKey(absl::string_view path) {
+        return Http::CacheKeyBuilder(Http::CacheKeySpec::defaultSpec()).build(requestHeaders(path));
+    }
+
+    uint64_t counterValue(const std::string& name) {
+        Stats::CounterSharedPtr counter = test_server_->counter(name);
+        return counter != nullptr ? counter->value() : 0;
+    }
+
+    // Request of path served without reaching the origin
+    void expectServedFromCache(absl::string_view path, char bodyCharacter) {
+        const uint64_t originRequestsBefore = counterValue("cluster.cluster_0.upstream_rq_total");
+        IntegrationStreamDecoderPtr response = codec_client_->makeHeaderOnlyRequest(requestHeaders(path));
+        ASSERT_TRUE(response->waitForEndStream());
+        EXPECT_EQ("200", response->headers().getStatusValue());
+        EXPECT_EQ(std::string(RESPONSE_BODY_SIZE, bodyCharacter), response->body());
+        EXPECT_EQ(originRequestsBefore, counterValue("cluster.cluster_0.upstream_rq_total"));
+    }
+};
+
+TEST_F(HttpCacheRCSnapshotIntegrationTest, RestoresPreviousSnapshotAndWritesCache) {
+    const std::string statPrefix = "http.config_test.http_cache_rc.";
+    expectServedFromCache(RESTORED_PATH, 'r');
+    EXPECT_EQ(1, counterValue(statPrefix + "snapshot_restores"));
+    // Restored into RAM, the record is not read again
+    expectServedFromCache(RESTORED_PATH, 'r');
+    EXPECT_EQ(1, counterValue(statPrefix + "snapshot_restores"));
+    EXPECT_EQ(1, counterValue(statPrefix + "hits"));
+
+    IntegrationStreamDecoderPtr response = codec_client_->makeHeaderOnlyRequest(requestHeaders(FILLED_PATH));
+    waitForNextUpstreamRequest();
+    upstream_request_->encodeHeaders(
+        Http::TestResponseHeaderMapImpl {{":status", "200"}, {"content-length", absl::StrCat(RESPONSE_BODY_SIZE)}}, false);
+    upstream_request_->encodeData(RESPONSE_BODY_SIZE, true);
+    ASSERT_TRUE(response->waitForEndStream());
+
+    BufferingStreamDecoderPtr written = IntegrationUtil::makeSingleRequest(
+        lookupPort("admin"), "POST", "/cache_rc/snapshot", "", Http::CodecType::HTTP1, version_);
+    ASSERT_TRUE(written->complete());
+    EXPECT_EQ("{\"written\": 2}\n", written->body());
+
+    // Snapshot for the next process holds both responses
+    Http::CacheSnapshot snapshot;
+    ASSERT_TRUE(snapshot.load(snapshotPath(), *api_));
+    const SystemTime now = api_->timeSource().systemTime();
+    EXPECT_TRUE(snapshot.contains(cacheKey(RESTORED_PATH), now));
+    EXPECT_TRUE(snapshot.contains(cacheKey(FILLED_PATH), now));
+    snapshot.stop();
+}
+
+} // namespace Envoy
@@ -2,74 +2,267 @@
 
 namespace Envoy::Http {
 
-void HTTPLRURAMCache::initCacheCapacity(uint32_t cacheCapacity) {
-    std::unique_lock uniqueLock(shared_mtx_);
-    if (capacity_ != 0) {
-        return;
-    }
-    capacity_ = cacheCapacity;
+void HTTPLRURAMCache::initCache(const HTTPLRURAMCacheOptions& options, EvictionCallback evictionCb) {
+    std::call_once(init_flag_, [&] {
+        options_ = options;
+        eviction_cb_ = std::move(evictionCb);
+        uint32_t shardCount = std::max<uint32_t>(options.shard_count_, 1);
+        options_.shard_count_ = shardCount;
+        // Round up, so the total capacity is never lower than the configured one
+        uint32_t shardCapacity = std::max<uint32_t>((options.capacity_ + shardCount - 1) / shardCount, 1);
+        uint64_t shardMaxBytes = options.max_bytes_ == 0 ? 0 : std::max<uint64_t>(options.max_bytes_ / shardCount, 1);
+        shards_.reserve(shardCount);
+        for (uint32_t i = 0; i < shardCount; ++i) {
+            auto& shard = shards_.emplace_back(std::make_unique<HTTPLRURAMCacheShard>());
+            shard->capacity_ = shardCapacity;
+            shard->max_bytes_ = shardMaxBytes;
+            shard->byte_counter_.parent_ = &byte_counter_;
+            if (shardMaxBytes != 0) {
+                // Entries keep growing after insert() while the producer writes the body
+                shard->byte_counter_.budget_ = shardMaxBytes;
+                shard->byte_counter_.over_budget_cb_ = [this, shardPtr = shard.get()] { evictOverBudget(*shardPtr); };
+            }
+            if (options.admission_policy_ == AdmissionPolicy::TINY_LFU) {
+                // Window takes 1% of the capacity (W-TinyLFU default), the rest is the main LRU list
+                shard->window_capacity_ = std::max<uint32_t>(shardCapacity / 100, 1);
+                shard->frequency_sketch_ = std::make_unique<FrequencySketch>(shardCapacity);
+            }
+        }
+        ENVOY_LOG(debug, "[HTTPLRURAMCache::initCache] capacity: {}, shards: {}, shard capacity: {}, shard max bytes: {}, TinyLFU: {}, CLOCK: {}",
+                  options.capacity_, shardCount, shardCapacity, shardMaxBytes,
+                  options.admission_policy_ == AdmissionPolicy::TINY_LFU,
+                  options.eviction_policy_ == EvictionPolicy::CLOCK);
+    });
 }
 
-CacheEntrySharedPtr HTTPLRURAMCache::at(const std::string& key) {
-    std::shared_lock sharedLock(shared_mtx_);
-    const auto &itCacheMap = cache_map_.find(key);
-    if (itCacheMap == cache_map_.end()) {
+CacheEntrySharedPtr HTTPLRURAMCache::at(const CacheKey& key) {
+    uint64_t keyHash = hashKey(key);
+    HTTPLRURAMCacheShard& shard = getShard(keyHash);
+    // Every lookup (hit or miss) counts into the popularity history of the key
+    if (shard.frequency_sketch_ != nullptr) {
+        shard.frequency_sketch_->increment(keyHash);
+    }
+    std::shared_lock sharedLock(shard.shared_mtx_);
+    auto itCacheMap = shard.cache_map_.find(key);
+    if (itCacheMap == shard.cache_map_.end()) {
         return nullptr;
     }
-    CacheEntrySharedPtr value = itCacheMap->second->second;
+    CacheEntrySharedPtr value = itCacheMap->second->value_;
+    if (options_.eviction_policy_ == EvictionPolicy::CLOCK) {
+        // Read path stays a read path, only the reference bit is set (skip the store if already set)
+        std::atomic<bool>& referenced = itCacheMap->second->referenced_;
+        if (!referenced.load(std::memory_order_relaxed)) {
+            referenced.store(true, std::memory_order_relaxed);
+        }
+        return value;
+    }
     // Check if the position needs to be updated
-    if (key != LRU_list_.front().first) {
+    LRUList& list = itCacheMap->second->in_window_ ? shard.window_list_ : shard.LRU_list_;
+    if (itCacheMap->second != list.begin()) {
         sharedLock.unlock();
-        std::unique_lock uniqueLock(shared_mtx_);
-        // Move the accessed node to the front (most recently used position)
-        LRU_list_.erase(itCacheMap->second);
-        LRU_list_.emplace_front(key, value);
-        // Update the iterator in the map
-        cache_map_[key] = LRU_list_.begin();
+        std::unique_lock uniqueLock(shard.shared_mtx_);
+        // The node could have been evicted, replaced or admitted from the window while the lock was released
+        itCacheMap = shard.cache_map_.find(key);
+        if (itCacheMap != shard.cache_map_.end()) {
+            LRUList& currentList = itCacheMap->second->in_window_ ? shard.window_list_ : shard.LRU_list_;
+            // Move the accessed node to the front (most recently used position), iterators stay valid
+            currentList.splice(currentList.begin(), currentList, itCacheMap->second);
+        }
     }
     return value;
 }
 
-void HTTPLRURAMCache::insert(const std::string& key, const CacheEntrySharedPtr& value) {
-    std::shared_lock sharedLock(shared_mtx_);
-    const auto& itCacheMap = cache_map_.find(key);
+uint32_t HTTPLRURAMCache::insert(const CacheKey& key, const CacheEntrySharedPtr& value) {
+    uint32_t evicted = 0;
+    HTTPLRURAMCacheShard& shard = getShard(hashKey(key));
+    std::unique_lock uniqueLock(shard.shared_mtx_);
+    const auto& itCacheMap = shard.cache_map_.find(key);
     // In case inserting key that already exists
-    if (itCacheMap != cache_map_.end()) {
-        sharedLock.unlock();
+    if (itCacheMap != shard.cache_map_.end()) {
         ENVOY_LOG(debug, "[HTTPLRURAMCache::insert] Overwriting an old element");
-        std::unique_lock uniqueLock(shared_mtx_);
-        // Remove the old node from the list and map
-        LRU_list_.erase(itCacheMap->second);
-        cache_map_.erase(itCacheMap);
+        LRUList& list = itCacheMap->second->in_window_ ? shard.window_list_ : shard.LRU_list_;
+        itCacheMap->second->value_->detachByteCounter();
+        itCacheMap->second->value_->markEvicted();
+        itCacheMap->second->value_ = value;
+        if (options_.eviction_policy_ == EvictionPolicy::CLOCK) {
+            itCacheMap->second->referenced_.store(true, std::memory_order_relaxed);
+        }
+        else {
+            list.splice(list.begin(), list, itCacheMap->second);
+        }
+        value->attachByteCounter(&shard.byte_counter_);
+    }
+    else if (shard.frequency_sketch_ != nullptr) {
+        // New entries always start in the admission window
+        shard.window_list_.emplace_front(key, value, true);
+        shard.cache_map_[key] = shard.window_list_.begin();
+        entry_count_.fetch_add(1, std::memory_order_relaxed);
+        value->attachByteCounter(&shard.byte_counter_);
+        evicted += admitFromWindow(shard);
     }
     else {
-        sharedLock.unlock();
+        // Insert the new node at the front of the list (CLOCK: right behind the clock hand)
+        shard.cache_map_[key] = shard.LRU_list_.emplace(insertPosition(shard), key, value, false);
+        entry_count_.fetch_add(1, std::memory_order_relaxed);
+        value->attachByteCounter(&shard.byte_counter_);
     }
-    std::unique_lock uniqueLock(shared_mtx_);
-    // Insert the new node at the front of the list
-    LRU_list_.emplace_front(key, value);
-    cache_map_[key] = LRU_list_.begin();
-    // If the cache size exceeds the capacity, remove the least recently used item
-    uniqueLock.unlock();
-    sharedLock.lock();
-    if (cache_map_.size() > capacity_) {
-        ENVOY_LOG(debug, "[HTTPLRURAMCache::insert] Cache full, remove least recently used item");
-        const auto& lastNodeKey = LRU_list_.back().first;
-        sharedLock.unlock();
-        uniqueLock.lock();
-        cache_map_.erase(lastNodeKey);
-        LRU_list_.pop_back();
+    evicted += evictIfNeeded(shard);
+    return evicted;
+}
+
+void HTTPLRURAMCache::remove(const CacheKey& key, const CacheEntrySharedPtr& expectedValue) {
+    HTTPLRURAMCacheShard& shard = getShard(hashKey(key));
+    std::unique_lock uniqueLock(shard.shared_mtx_);
+    auto itCacheMap = shard.cache_map_.find(key);
+    if (itCacheMap == shard.cache_map_.end() || itCacheMap->second->value_ != expectedValue) {
+        return;
+    }
+    ENVOY_LOG(debug, "[HTTPLRURAMCache::remove] Removing an element");
+    removeNode(shard, itCacheMap->second->in_window_ ? shard.window_list_ : shard.LRU_list_, itCacheMap->second);
+}
+
+std::vector<std::pair<CacheKey, CacheEntrySharedPtr>> HTTPLRURAMCache::collectEntries() const {
+    std::vector<std::pair<CacheKey, CacheEntrySharedPtr>> entries;
+    entries.reserve(size());
+    for (const auto& shard: shards_) {
+        std::shared_lock sharedLock(shard->shared_mtx_);
+        for (const auto& list: {&shard->window_list_, &shard->LRU_list_}) {
+            for (const auto& node: *list) {
+                entries.emplace_back(node.key_, node.value_);
+            }
+        }
+    }
+    return entries;
+}
+
+uint64_t HTTPLRURAMCache::hashKey(const CacheKey& key) {
+    // Other half than the one used by the shard map, so the shard index does not correlate with bucket index
+    return key.low_;
+}
+
+HTTPLRURAMCacheShard& HTTPLRURAMCache::getShard(uint64_t keyHash) const {
+    if (shards_.size() == 1) {
+        return *shards_.front();
+    }
+    return *shards_[(keyHash >> 32) % shards_.size()];
+}
+
+uint32_t HTTPLRURAMCache::admitFromWindow(HTTPLRURAMCacheShard& shard) {
+    if (shard.window_list_.size() <= shard.window_capacity_) {
+        return 0;
+    }
+    // Window overflows: its least recently used node (candidate) competes with the victim of the main list
+    auto itCandidate = std::prev(shard.window_list_.end());
+    bool mainFull = shard.cache_map_.size() > shard.capacity_ ||
+                    (shard.max_bytes_ != 0 && shard.byte_counter_.bytes() > shard.max_bytes_);
+    if (mainFull && !shard.LRU_list_.empty()) {
+        auto itVictim = findVictim(shard);
+        uint32_t candidateFrequency = shard.frequency_sketch_->frequency(hashKey(itCandidate->key_));
+        uint32_t victimFrequency = shard.frequency_sketch_->frequency(hashKey(itVictim->key_));
+        ENVOY_LOG(debug, "[HTTPLRURAMCache::admitFromWindow] candidate frequency: {}, victim frequency: {}",
+                  candidateFrequency, victimFrequency);
+        if (candidateFrequency <= victimFrequency) {
+            // Rejected, the candidate is evicted and the main list keeps its more popular entry
+            evictNode(shard, shard.window_list_, itCandidate);
+            return 1;
+        }
+        evictNode(shard, shard.LRU_list_, itVictim);
+        itCandidate->in_window_ = false;
+        shard.LRU_list_.splice(insertPosition(shard), shard.window_list_, itCandidate);
+        return 1;
+    }
+    itCandidate->in_window_ = false;
+    shard.LRU_list_.splice(insertPosition(shard), shard.window_list_, itCandidate);
+    return 0;
+}
+
+void HTTPLRURAMCache::evictOverBudget(HTTPLRURAMCacheShard& shard) {
+    std::unique_lock uniqueLock(shard.shared_mtx_);
+    budget_evictions_.fetch_add(evictIfNeeded(shard), std::memory_order_relaxed);
+}
+
+uint32_t HTTPLRURAMCache::evictIfNeeded(HTTPLRURAMCacheShard& shard) {
+    uint32_t evicted = 0;
+    // If the shard exceeds its capacity or byte budget, remove least recently used items (but never the last one,
+    // objects over the shard budget are not cached, see HttpCacheRCConfig::exceedsMaxObjectBytes())
+    while (shard.cache_map_.size() > 1 &&
+           (shard.cache_map_.size() > shard.capacity_ ||
+            (shard.max_bytes_ != 0 && shard.byte_counter_.bytes() > shard.max_bytes_))) {
+        ENVOY_LOG(debug, "[HTTPLRURAMCache::evictIfNeeded] Cache shard full, remove least recently used item; shard bytes: {}",
+                  shard.byte_counter_.bytes());
+        if (shard.LRU_list_.empty()) {
+            evictNode(shard, shard.window_list_, std::prev(shard.window_list_.end()));
+        }
+        else {
+            evictNode(shard, shard.LRU_list_, findVictim(shard));
+        }
+        ++evicted;
+    }
+    return evicted;
+}
+
+LRUList::iterator HTTPLRURAMCache::findVictim(HTTPLRURAMCacheShard& shard) const {
+    if (options_.eviction_policy_ == EvictionPolicy::LRU) {
+        return std::prev(shard.LRU_list_.end());
+    }
+    // Second chance: referenced nodes lose their bit and are skipped, the first unreferenced one is the victim
+    // (terminates after at most one full revolution, because every visited bit gets cleared)
+    while (true) {
+        if (shard.clock_hand_ == shard.LRU_list_.end()) {
+            shard.clock_hand_ = shard.LRU_list_.begin();
+        }
+        if (!shard.clock_hand_->referenced_.exchange(false, std::memory_order_relaxed)) {
+            return shard.clock_hand_;
+        }
+        ++shard.clock_hand_;
+    }
+}
+
+LRUList::iterator HTTPLRURAMCache::insertPosition(HTTPLRURAMCacheShard& shard) const {
+    // CLOCK: the node placed right before the hand is examined last (gets a full revolution)
+    return options_.eviction_policy_ == EvictionPolicy::CLOCK ? shard.clock_hand_ : shard.LRU_list_.begin();
+}
+
+void HTTPLRURAMCache::removeNode(HTTPLRURAMCacheShard& shard, LRUList& list, LRUList::iterator itNode) {
+    if (&list == &shard.LRU_list_ && itNode == shard.clock_hand_) {
+        ++shard.clock_hand_;
+    }
+    itNode->value_->detachByteCounter();
+    itNode->value_->markEvicted();
+    shard.cache_map_.erase(itNode->key_);
+    list.erase(itNode);
+    entry_count_.fetch_sub(1, std::memory_order_relaxed);
+}
+
+void HTTPLRURAMCache::evictNode(HTTPLRURAMCacheShard& shard, LRUList& list, LRUList::iterator itNode) {
+    if (eviction_cb_) {
+        eviction_cb_(itNode->key_, itNode->value_);
     }
+    removeNode(shard, list, itNode);
 }
 
 uint32_t HTTPLRURAMCache::getCacheCapacity() const {
-    std::shared_lock sharedLock(shared_mtx_);
-    return capacity_;
+    return options_.capacity_;
+}
+
+uint32_t HTTPLRURAMCache::getShardCount() const {
+    return static_cast<uint32_t>(shards_.size());
+}
+
+size_t HTTPLRURAMCache::size() const {
+    return entry_count_.load(std::memory_order_relaxed);
+}
+
+uint64_t HTTPLRURAMCache::getMaxBytes() const {
+    return options_.max_bytes_;
+}
+
+uint64_t HTTPLRURAMCache::sizeBytes() const {
+    return byte_counter_.bytes();
 }
 
-std::unordered_map<std::string, LRUList::iterator> HTTPLRURAMCache::getCacheMap() const {
-    std::shared_lock sharedLock(shared_mtx_);
-    return cache_map_;
+uint64_t HTTPLRURAMCache::takeBudgetEvictions() {
+    return budget_evictions_.exchange(0, std::memory_order_relaxed);
 }
 
 } // namespace Envoy::Http
@@ -5,32 +5,130 @@
 #pragma once
 
 #include "cache_entry.h"
+#include "cache_key.h"
+#include "frequency_sketch.h"
+#include <functional>
+#include <list>
+#include <mutex>
 
 namespace Envoy::Http {
 
-using LRUList = std::list<std::pair<std::string, CacheEntrySharedPtr>>;
+/**
+ * @brief Decides whether a new entry may replace the eviction victim.
+ * NONE     == every inserted entry is admitted (plain LRU)
+ * TINY_LFU == W-TinyLFU, new entries go through a small window LRU and enter the main LRU list only if their key
+ *             has been requested more often than the key of the main list victim
+ */
+enum class AdmissionPolicy { NONE, TINY_LFU };
+
+/**
+ * @brief Selects how the victim is found and what a cache hit costs.
+ * LRU   == exact LRU, every hit moves the node to the front of the list (exclusive lock)
+ * CLOCK == approximate LRU (second chance), a hit only sets the reference bit of the node (shared lock),
+ *          the clock hand sweeps the list and clears reference bits only when a victim is needed
+ */
+enum class EvictionPolicy { LRU, CLOCK };
+
+struct HTTPLRURAMCacheOptions {
+    uint32_t capacity_ {0};         // number of entries
+    uint32_t shard_count_ {1};      // number of independent shards
+    uint64_t max_bytes_ {0};        // memory budget (0 == unlimited)
+    AdmissionPolicy admission_policy_ {AdmissionPolicy::NONE};
+    EvictionPolicy eviction_policy_ {EvictionPolicy::LRU};
+};
+
+struct LRUNode {
+    LRUNode(const CacheKey& key, CacheEntrySharedPtr value, bool inWindow)
+        : key_(key), value_(std::move(value)), in_window_(inWindow) {}
+    CacheKey key_;
+    CacheEntrySharedPtr value_;
+    // Node is in the admission window (W-TinyLFU), otherwise in the main LRU list
+    bool in_window_ {false};
+    // CLOCK only: node was accessed since the clock hand passed it (set under shared lock)
+    std::atomic<bool> referenced_ {false};
+};
+
+using LRUList = std::list<LRUNode>;
+
+/**
+ * @brief Independent part of the cache with its own lock, map and LRU list.
+ * Keys are distributed among shards by hash, so workers touching different keys do not contend on one lock.
+ */
+struct HTTPLRURAMCacheShard {
+    mutable std::shared_mutex shared_mtx_ {};
+    uint32_t capacity_ {0};
+    // Memory budget of the shard (0 == unlimited)
+    uint64_t max_bytes_ {0};
+    // Footprint of all entries in the shard, including growth of entries that are still being written
+    ByteCounter byte_counter_ {};
+    // std::unordered_map : Amortized Complexity: Due to rehashing, the amortized complexity
+    // of operations (insertion, search) is O(1) on average
+    std::unordered_map<CacheKey, LRUList::iterator, CacheKeyHash> cache_map_ {};
+    LRUList LRU_list_ {};
+    // CLOCK only: next node of the main list to be examined (LRU_list_.end() == start from the beginning)
+    LRUList::iterator clock_hand_ {LRU_list_.end()};
+    // W-TinyLFU only: admission window and popularity history of keys (including keys that are not cached)
+    uint32_t window_capacity_ {0};
+    LRUList window_list_ {};
+    std::unique_ptr<FrequencySketch> frequency_sketch_ {};
+};
+
+using HTTPLRURAMCacheShardPtr = std::unique_ptr<HTTPLRURAMCacheShard>;
+
+// Called under the shard lock for every entry evicted to make room (not for removed or replaced entries)
+using EvictionCallback = std::function<void(const CacheKey& key, const CacheEntrySharedPtr& value)>;
 
 /**
  * @brief HTTP Least-Recently-Used RAM cache.
  * Uses double linked list from the standard library.
+ * The cache is split into shards (1 shard == single global LRU list), each shard evicts on its own.
  */
 class HTTPLRURAMCache : public Logger::Loggable<Logger::Id::filter> {
 public:
-    void initCacheCapacity(uint32_t cacheCapacity);
+    // Only the first call initializes the cache, following calls are no-op
+    void initCache(const HTTPLRURAMCacheOptions& options, EvictionCallback evictionCb = nullptr);
     // Get the value for a given key
-    CacheEntrySharedPtr at(const std::string& key);
-    // Put a key-value pair into the cache
-    void insert(const std::string& key, const CacheEntrySharedPtr& value);
+    CacheEntrySharedPtr at(const CacheKey& key);
+    // Put a key-value pair into the cache, returns the number of entries evicted to make room for it
+    uint32_t insert(const CacheKey& key, const CacheEntrySharedPtr& value);
+    // Remove the key only if it still maps to the expected value (it could have been replaced meanwhile)
+    void remove(const CacheKey& key, const CacheEntrySharedPtr& expectedValue);
+    // Copy of all key-value pairs (one shard lock at a time, so not an atomic view of the whole cache)
+    std::vector<std::pair<CacheKey, CacheEntrySharedPtr>> collectEntries() const;
     uint32_t getCacheCapacity() const;
-    std::unordered_map<std::string, LRUList::iterator> getCacheMap() const;
+    uint32_t getShardCount() const;
+    // Number of entries of all shards, O(1)
+    size_t size() const;
+    uint64_t getMaxBytes() const;
+    // Memory footprint of all cached entries, O(1)
+    uint64_t sizeBytes() const;
+    // Number of entries evicted because entries grew over the byte budget since the last call
+    uint64_t takeBudgetEvictions();
 
 private:
-    mutable std::shared_mutex shared_mtx_ {};
-    uint32_t capacity_ {0};
-    // std::unordered_map : Amortized Complexity: Due to rehashing, the amortized complexity
-    // of operations (insertion, search) is O(1) on average
-    std::unordered_map<std::string, LRUList::iterator> cache_map_ {};
-    LRUList LRU_list_ {};
+    static uint64_t hashKey(const CacheKey& key);
+    HTTPLRURAMCacheShard& getShard(uint64_t keyHash) const;
+    // Both return the number of evicted entries
+    uint32_t admitFromWindow(HTTPLRURAMCacheShard& shard);
+    uint32_t evictIfNeeded(HTTPLRURAMCacheShard& shard);
+    // Called by the byte counter of the shard when an entry grows over the budget (any thread, no lock held)
+    void evictOverBudget(HTTPLRURAMCacheShard& shard);
+    // Next node of the main list to be evicted (LRU tail or the first unreferenced node under the clock hand)
+    LRUList::iterator findVictim(HTTPLRURAMCacheShard& shard) const;
+    // Position in the main list where new/admitted nodes are placed
+    LRUList::iterator insertPosition(HTTPLRURAMCacheShard& shard) const;
+    void removeNode(HTTPLRURAMCacheShard& shard, LRUList& list, LRUList::iterator itNode);
+    // removeNode() of a victim, the entry is handed to the eviction callback first
+    void evictNode(HTTPLRURAMCacheShard& shard, LRUList& list, LRUList::iterator itNode);
+
+    std::once_flag init_flag_ {};
+    HTTPLRURAMCacheOptions options_ {};
+    EvictionCallback eviction_cb_ {};
+    // Parent of all shard counters
+    ByteCounter byte_counter_ {};
+    std::atomic<uint64_t> entry_count_ {0};
+    std::atomic<uint64_t> budget_evictions_ {0};
+    std::vector<HTTPLRURAMCacheShardPtr> shards_ {};
 };
 
 } // namespace Envoy::Http
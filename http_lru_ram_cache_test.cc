@@ -0,0 +1,135 @@
+/***********************************************************************************************************************
+ * Unit tests of the sharded RAM cache: byte budget, admission and eviction policies
+ ***********************************************************************************************************************/
+
+#include "http_lru_ram_cache.h"
+#include "test/test_common/utility.h"
+#include "gtest/gtest.h"
+#include "absl/strings/str_cat.h"
+
+namespace Envoy::Http {
+namespace {
+
+// Footprint of every entry, as reported by its producer
+constexpr uint64_t ENTRY_BYTES = 1024;
+
+CacheEntrySharedPtr newEntry() {
+    CacheEntrySharedPtr entry = std::make_shared<CacheEntry>(512);
+    entry->addFootprint(ENTRY_BYTES);
+    return entry;
+}
+
+CacheKey key(absl::string_view name) {
+    return CacheKeyBuilder::fromString(name);
+}
+
+TEST(HTTPLRURAMCacheTest, GrowingEntryEvictsLeastRecentlyUsed) {
+    HTTPLRURAMCache cache;
+    HTTPLRURAMCacheOptions options;
+    options.capacity_ = 16;
+    options.max_bytes_ = 4 * ENTRY_BYTES;
+    cache.initCache(options);
+    CacheEntrySharedPtr older = newEntry();
+    CacheEntrySharedPtr newer = newEntry();
+    EXPECT_EQ(0, cache.insert(key("older"), older));
+    EXPECT_EQ(0, cache.insert(key("newer"), newer));
+    EXPECT_EQ(2 * ENTRY_BYTES, cache.sizeBytes());
+
+    // Body written after the insert takes the shard over its budget
+    newer->addFootprint(2 * ENTRY_BYTES + 1);
+    EXPECT_EQ(nullptr, cache.at(key("older")));
+    EXPECT_TRUE(older->isEvicted());
+    EXPECT_EQ(1, cache.takeBudgetEvictions());
+    EXPECT_EQ(0, cache.takeBudgetEvictions());
+
+    // The last entry of the shard is never evicted, however large it grows
+    newer->addFootprint(4 * ENTRY_BYTES);
+    EXPECT_EQ(newer, cache.at(key("newer")));
+    EXPECT_FALSE(newer->isEvicted());
+    EXPECT_EQ(1, cache.size());
+    EXPECT_EQ(newer->footprintBytes(), cache.sizeBytes());
+    EXPECT_EQ(0, cache.takeBudgetEvictions());
+}
+
+TEST(HTTPLRURAMCacheTest, SizeBytesFollowsRemovedEntries) {
+    HTTPLRURAMCache cache;
+    HTTPLRURAMCacheOptions options;
+    options.capacity_ = 16;
+    options.shard_count_ = 4;
+    cache.initCache(options);
+    CacheEntrySharedPtr first = newEntry();
+    CacheEntrySharedPtr second = newEntry();
+    cache.insert(key("first"), first);
+    cache.insert(key("second"), second);
+    second->addFootprint(1000);
+    EXPECT_EQ(first->footprintBytes() + second->footprintBytes(), cache.sizeBytes());
+
+    // Value replaced meanwhile is not removed
+    cache.remove(key("first"), second);
+    EXPECT_EQ(2, cache.size());
+
+    cache.remove(key("first"), first);
+    cache.remove(key("second"), second);
+    EXPECT_EQ(0, cache.size());
+    EXPECT_EQ(0, cache.sizeBytes());
+    // Growth of a removed entry is not reported anymore
+    second->addFootprint(1000);
+    EXPECT_EQ(0, cache.sizeBytes());
+}
+
+// Lookups of the scan count once per key, the hot key requested more often keeps its place in the main list
+uint32_t insertScan(HTTPLRURAMCache& cache, uint32_t keyCount) {
+    uint32_t evicted = 0;
+    for (uint32_t i = 0; i < keyCount; ++i) {
+        const CacheKey scanKey = key(absl::StrCat("scan-", i));
+        EXPECT_EQ(nullptr, cache.at(scanKey));
+        evicted += cache.insert(scanKey, newEntry());
+    }
+    return evicted;
+}
+
+TEST(HTTPLRURAMCacheTest, TinyLfuScanDoesNotDisplaceHotKey) {
+    for (AdmissionPolicy policy: {AdmissionPolicy::TINY_LFU, AdmissionPolicy::NONE}) {
+        HTTPLRURAMCache cache;
+        HTTPLRURAMCacheOptions options;
+        options.capacity_ = 100;
+        options.admission_policy_ = policy;
+        cache.initCache(options);
+        cache.insert(key("hot"), newEntry());
+        for (int i = 0; i < 15; ++i) {
+            EXPECT_NE(nullptr, cache.at(key("hot")));
+        }
+
+        EXPECT_EQ(201, insertScan(cache, 300));
+        EXPECT_EQ(100, cache.size());
+        // Plain LRU lets the scan flush the hot key out
+        EXPECT_EQ(policy == AdmissionPolicy::TINY_LFU, cache.at(key("hot")) != nullptr);
+    }
+}
+
+TEST(HTTPLRURAMCacheTest, ClockReferencedEntrySurvivesOneSweep) {
+    HTTPLRURAMCache cache;
+    HTTPLRURAMCacheOptions options;
+    options.capacity_ = 3;
+    options.eviction_policy_ = EvictionPolicy::CLOCK;
+    std::vector<CacheKey> evicted;
+    cache.initCache(options, [&evicted](const CacheKey& evictedKey, const CacheEntrySharedPtr&) {
+        evicted.push_back(evictedKey);
+    });
+    cache.insert(key("a"), newEntry());
+    cache.insert(key("b"), newEntry());
+    cache.insert(key("c"), newEntry());
+    EXPECT_NE(nullptr, cache.at(key("a")));
+
+    // The hand clears the reference bit of "a" and takes the next unreferenced entry
+    EXPECT_EQ(1, cache.insert(key("d"), newEntry()));
+    EXPECT_EQ(std::vector<CacheKey>({key("b")}), evicted);
+
+    // The sweep goes on from where the hand stopped, "a" is examined last again
+    EXPECT_EQ(1, cache.insert(key("e"), newEntry()));
+    EXPECT_EQ(std::vector<CacheKey>({key("b"), key("c")}), evicted);
+    EXPECT_NE(nullptr, cache.at(key("a")));
+}
+
+} // namespace
+} // namespace Envoy::Http
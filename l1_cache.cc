@@ -0,0 +1,64 @@
+#include "l1_cache.h"
+
+namespace Envoy::Http {
+
+CacheEntrySharedPtr ThreadLocalL1Cache::at(const CacheKey& key, bool& touchShared) {
+    touchShared = false;
+    auto itCacheMap = cache_map_.find(key);
+    if (itCacheMap == cache_map_.end()) {
+        sweepEvicted();
+        return nullptr;
+    }
+    L1List::iterator itNode = itCacheMap->second;
+    if (itNode->value_->isEvicted()) {
+        // Shared cache dropped the entry, this reference must not keep it alive (or served) any longer
+        removeNode(itNode);
+        return nullptr;
+    }
+    LRU_list_.splice(LRU_list_.begin(), LRU_list_, itNode);
+    touchShared = ++itNode->hits_ % L1_SHARED_TOUCH_INTERVAL == 0;
+    CacheEntrySharedPtr value = itNode->value_;
+    if (touchShared) {
+        // Worker serving only hits still sweeps now and then
+        sweepEvicted();
+    }
+    return value;
+}
+
+void ThreadLocalL1Cache::insert(const CacheKey& key, const CacheEntrySharedPtr& value) {
+    auto itCacheMap = cache_map_.find(key);
+    if (itCacheMap != cache_map_.end()) {
+        itCacheMap->second->value_ = value;
+        itCacheMap->second->hits_ = 0;
+        LRU_list_.splice(LRU_list_.begin(), LRU_list_, itCacheMap->second);
+        return;
+    }
+    sweepEvicted();
+    LRU_list_.push_front({key, value, 0});
+    cache_map_[key] = LRU_list_.begin();
+    if (cache_map_.size() > capacity_) {
+        removeNode(std::prev(LRU_list_.end()));
+    }
+}
+
+void ThreadLocalL1Cache::sweepEvicted() {
+    for (uint32_t i = 0; i < L1_SWEEP_BATCH && !LRU_list_.empty(); ++i) {
+        if (sweep_hand_ == LRU_list_.end()) {
+            sweep_hand_ = LRU_list_.begin();
+        }
+        L1List::iterator itNode = sweep_hand_++;
+        if (itNode->value_->isEvicted()) {
+            removeNode(itNode);
+        }
+    }
+}
+
+void ThreadLocalL1Cache::removeNode(L1List::iterator itNode) {
+    if (itNode == sweep_hand_) {
+        ++sweep_hand_;
+    }
+    cache_map_.erase(itNode->key_);
+    LRU_list_.erase(itNode);
+}
+
+} // namespace Envoy::Http
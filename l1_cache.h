@@ -0,0 +1,59 @@
+/***********************************************************************************************************************
+ * Per-worker L1 cache in front of the shared HTTPLRURAMCache
+ ***********************************************************************************************************************/
+
+#pragma once
+
+#include "envoy/thread_local/thread_local.h"
+#include "cache_entry.h"
+#include "cache_key.h"
+#include <list>
+#include <unordered_map>
+
+namespace Envoy::Http {
+
+// Every n-th L1 hit of a key is also reported to the shared cache, so the shared LRU/CLOCK/TinyLFU still sees the key
+// as hot (otherwise the hottest keys would look cold there and get evicted because their hits never reach it)
+constexpr uint32_t L1_SHARED_TOUCH_INTERVAL = 64;
+// Nodes examined per insert or miss by the sweep that drops entries evicted from the shared cache
+constexpr uint32_t L1_SWEEP_BATCH = 8;
+
+/**
+ * @brief Small LRU of the hottest entries of one worker thread, owned by an Envoy ThreadLocal slot.
+ * Accessed only by its own worker, so a hit takes no lock. Entries are references to the entries of the shared cache;
+ * removal or replacement there marks the entry evicted, and the L1 drops it on its next lookup. Entries that are never
+ * looked up again are dropped by a sweep that advances on inserts, misses and touches of the shared cache, so the L1
+ * does not keep evicted entries (memory outside of the max_bytes budget) alive.
+ */
+class ThreadLocalL1Cache : public ThreadLocal::ThreadLocalObject {
+public:
+    explicit ThreadLocalL1Cache(uint32_t capacity) : capacity_(capacity) {}
+    // Returns nullptr on a miss or for an entry evicted from the shared cache meanwhile;
+    // touchShared is set when the hit should also be reported to the shared cache
+    CacheEntrySharedPtr at(const CacheKey& key, bool& touchShared);
+    void insert(const CacheKey& key, const CacheEntrySharedPtr& value);
+    size_t size() const { return cache_map_.size(); }
+
+private:
+    struct L1Node {
+        CacheKey key_;
+        CacheEntrySharedPtr value_;
+        uint32_t hits_ {0};
+    };
+    using L1List = std::list<L1Node>;
+
+    // Examines the next L1_SWEEP_BATCH nodes under the sweep hand
+    void sweepEvicted();
+    void removeNode(L1List::iterator itNode);
+
+    const uint32_t capacity_;
+    L1List LRU_list_ {};
+    // Next node examined by the sweep (LRU_list_.end() == start from the beginning)
+    L1List::iterator sweep_hand_ {LRU_list_.end()};
+    std::unordered_map<CacheKey, L1List::iterator, CacheKeyHash> cache_map_ {};
+};
+
+using L1CacheSlot = ThreadLocal::TypedSlot<ThreadLocalL1Cache>;
+using L1CacheSlotSharedPtr = std::shared_ptr<L1CacheSlot>;
+
+} // namespace Envoy::Http
@@ -0,0 +1,160 @@
+#include "purge_index.h"
+
+#include "absl/strings/match.h"
+#include "absl/strings/numbers.h"
+#include <algorithm>
+
+namespace Envoy::Http {
+
+namespace {
+
+// Purges kept for the check of fills that are still in flight
+constexpr size_t MAX_RECENT_PURGES = 1024;
+// Index is swept at the earliest at this size
+constexpr size_t MIN_SWEEP_SIZE = 1024;
+
+std::optional<CacheKey> parseKey(absl::string_view value) {
+    CacheKey key;
+    if (value.size() != 32 || !absl::SimpleHexAtoi(value.substr(0, 16), &key.high_) ||
+        !absl::SimpleHexAtoi(value.substr(16), &key.low_)) {
+        return std::nullopt;
+    }
+    return key;
+}
+
+} // namespace
+
+bool PurgeIndex::add(const CacheKey& key, const CacheEntrySharedPtr& entry, std::string url,
+                     std::vector<std::string> tags, uint64_t fillEpoch) {
+    std::lock_guard lockGuard(mtx_);
+    if (fillEpoch < dropped_epoch_) {
+        return false;
+    }
+    for (const auto& record: recent_purges_) {
+        if (record.epoch_ > fillEpoch && matches(record, key, url, tags)) {
+            return false;
+        }
+    }
+    eraseLocked(key);
+    urls_[url].insert(key);
+    for (const auto& tag: tags) {
+        tags_[tag].insert(key);
+    }
+    entries_[key] = IndexedEntry {entry, std::move(url), std::move(tags)};
+    if (entries_.size() > std::max(2 * size_after_sweep_, MIN_SWEEP_SIZE)) {
+        sweepLocked();
+    }
+    return true;
+}
+
+std::vector<PurgedEntry> PurgeIndex::purge(PurgeKind kind, absl::string_view value) {
+    std::vector<PurgedEntry> purged;
+    std::lock_guard lockGuard(mtx_);
+    switch (kind) {
+    case PurgeKind::KEY: {
+        std::optional<CacheKey> key = parseKey(value);
+        if (key.has_value()) {
+            collectLocked(KeySet {*key}, purged);
+        }
+        break;
+    }
+    case PurgeKind::URL: {
+        auto itUrl = urls_.find(value);
+        if (itUrl != urls_.end()) {
+            collectLocked(itUrl->second, purged);
+        }
+        break;
+    }
+    case PurgeKind::PREFIX: {
+        for (auto itUrl = urls_.lower_bound(value); itUrl != urls_.end() && absl::StartsWith(itUrl->first, value); ++itUrl) {
+            collectLocked(itUrl->second, purged);
+        }
+        break;
+    }
+    case PurgeKind::TAG: {
+        auto itTag = tags_.find(std::string(value));
+        if (itTag != tags_.end()) {
+            collectLocked(itTag->second, purged);
+        }
+        break;
+    }
+    }
+    for (const auto& entry: purged) {
+        eraseLocked(entry.key_);
+    }
+    const uint64_t epoch = epoch_.fetch_add(1, std::memory_order_acq_rel) + 1;
+    recent_purges_.push_back({epoch, kind, std::string(value)});
+    if (recent_purges_.size() > MAX_RECENT_PURGES) {
+        dropped_epoch_ = recent_purges_.front().epoch_;
+        recent_purges_.pop_front();
+    }
+    return purged;
+}
+
+void PurgeIndex::setRetainPredicate(std::function<bool(const CacheKey&)> isStored) {
+    std::lock_guard lockGuard(mtx_);
+    retain_predicate_ = std::move(isStored);
+}
+
+size_t PurgeIndex::size() const {
+    std::lock_guard lockGuard(mtx_);
+    return entries_.size();
+}
+
+bool PurgeIndex::matches(const PurgeRecord& record, const CacheKey& key, absl::string_view url,
+                         const std::vector<std::string>& tags) {
+    switch (record.kind_) {
+    case PurgeKind::KEY:
+        return parseKey(record.value_) == key;
+    case PurgeKind::URL:
+        return url == record.value_;
+    case PurgeKind::PREFIX:
+        return absl::StartsWith(url, record.value_);
+    case PurgeKind::TAG:
+        return std::find(tags.begin(), tags.end(), record.value_) != tags.end();
+    }
+    return false;
+}
+
+void PurgeIndex::eraseLocked(const CacheKey& key) {
+    auto itEntry = entries_.find(key);
+    if (itEntry == entries_.end()) {
+        return;
+    }
+    auto itUrl = urls_.find(itEntry->second.url_);
+    if (itUrl != urls_.end() && itUrl->second.erase(key) > 0 && itUrl->second.empty()) {
+        urls_.erase(itUrl);
+    }
+    for (const auto& tag: itEntry->second.tags_) {
+        auto itTag = tags_.find(tag);
+        if (itTag != tags_.end() && itTag->second.erase(key) > 0 && itTag->second.empty()) {
+            tags_.erase(itTag);
+        }
+    }
+    entries_.erase(itEntry);
+}
+
+void PurgeIndex::collectLocked(const KeySet& keys, std::vector<PurgedEntry>& purged) {
+    for (const auto& key: keys) {
+        auto itEntry = entries_.find(key);
+        if (itEntry != entries_.end()) {
+            purged.push_back({key, itEntry->second.entry_});
+        }
+    }
+}
+
+void PurgeIndex::sweepLocked() {
+    std::vector<CacheKey> gone;
+    for (const auto& [key, indexed]: entries_) {
+        CacheEntrySharedPtr entry = indexed.entry_.lock();
+        if ((entry == nullptr || entry->isEvicted()) && !(retain_predicate_ && retain_predicate_(key))) {
+            gone.push_back(key);
+        }
+    }
+    for (const auto& key: gone) {
+        eraseLocked(key);
+    }
+    size_after_sweep_ = entries_.size();
+}
+
+} // namespace Envoy::Http
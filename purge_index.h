@@ -0,0 +1,90 @@
+/***********************************************************************************************************************
+ * Invalidation indexes of the cache: by URL (prefix) and by Surrogate-Key tag
+ ***********************************************************************************************************************/
+
+#pragma once
+
+#include "cache_entry.h"
+#include "cache_key.h"
+#include "absl/strings/string_view.h"
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <unordered_map>
+#include <unordered_set>
+
+namespace Envoy::Http {
+
+/**
+ * @brief What a purge matches.
+ * KEY    == exact cache key (32 hex digits, as logged by the filter)
+ * URL    == exact host + path of the request
+ * PREFIX == host + path starting with the value
+ * TAG    == Surrogate-Key tag of the response
+ */
+enum class PurgeKind { KEY, URL, PREFIX, TAG };
+
+using CacheEntryWeakPtr = std::weak_ptr<CacheEntry>;
+
+/**
+ * @brief Cache entry removed from the index by a purge, to be removed from the cache by the caller.
+ */
+struct PurgedEntry {
+    CacheKey key_ {};
+    CacheEntryWeakPtr entry_ {};
+};
+
+/**
+ * @brief Maps URLs (sorted, so a prefix is a range scan) and tags to the keys of cached responses.
+ * Guarded by its own mutex, a purge never scans the cache nor holds a cache shard lock.
+ * Every purge gets an epoch; a fill that started before a purge matching its response is refused by add(),
+ * so a response fetched before an invalidation cannot be cached after it.
+ */
+class PurgeIndex {
+public:
+    // Current purge epoch, taken by a fill before it queries the origin
+    uint64_t epoch() const { return epoch_.load(std::memory_order_acquire); }
+    // Called after the entry was inserted into the cache. Returns false if a purge newer than fillEpoch matches
+    // the response, the caller must remove the entry from the cache again
+    bool add(const CacheKey& key, const CacheEntrySharedPtr& entry, std::string url, std::vector<std::string> tags,
+             uint64_t fillEpoch);
+    // Removes the matching keys from the index and records the purge
+    std::vector<PurgedEntry> purge(PurgeKind kind, absl::string_view value);
+    // Keys of entries that left the RAM cache stay indexed while the predicate holds (e.g. stored in the disk tier)
+    void setRetainPredicate(std::function<bool(const CacheKey&)> isStored);
+    size_t size() const;
+
+private:
+    struct IndexedEntry {
+        CacheEntryWeakPtr entry_ {};
+        std::string url_ {};
+        std::vector<std::string> tags_ {};
+    };
+    struct PurgeRecord {
+        uint64_t epoch_ {0};
+        PurgeKind kind_ {PurgeKind::KEY};
+        std::string value_ {};
+    };
+    using KeySet = std::unordered_set<CacheKey, CacheKeyHash>;
+
+    static bool matches(const PurgeRecord& record, const CacheKey& key, absl::string_view url,
+                        const std::vector<std::string>& tags);
+    void eraseLocked(const CacheKey& key);
+    void collectLocked(const KeySet& keys, std::vector<PurgedEntry>& purged);
+    // Drops keys of entries that left the cache (amortized, runs when the index doubled since the last sweep)
+    void sweepLocked();
+
+    mutable std::mutex mtx_ {};
+    std::unordered_map<CacheKey, IndexedEntry, CacheKeyHash> entries_ {};
+    std::map<std::string, KeySet, std::less<>> urls_ {};
+    std::unordered_map<std::string, KeySet> tags_ {};
+    // Purges a fill may still race with, the oldest are dropped (fills older than them are refused conservatively)
+    std::deque<PurgeRecord> recent_purges_ {};
+    uint64_t dropped_epoch_ {0};
+    size_t size_after_sweep_ {0};
+    std::function<bool(const CacheKey&)> retain_predicate_ {};
+    std::atomic<uint64_t> epoch_ {0};
+};
+
+} // namespace Envoy::Http
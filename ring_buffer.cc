@@ -40,6 +40,10 @@ bool RingBufferQueue::write(MessageSize size, const WriteCallback& writeCb) {
     return true;
 }
 
+size_t RingBufferQueue::footprintBytes(uint32_t ringBufferCapacity) {
+    return sizeof(RingBufferQueue) + static_cast<size_t>(ringBufferCapacity) * sizeof(Block);
+}
+
 bool RingBufferQueue::read(uint32_t blockIndex, uint8_t* data, MessageSize& size) const {
     // Block
     Block& block = blocks_[blockIndex];
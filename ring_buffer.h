@@ -42,6 +42,8 @@ public:
     ~RingBufferQueue();
     bool write(MessageSize size, const WriteCallback& writeCb);
     bool read(uint32_t blockIndex, uint8_t* data, MessageSize& size) const;
+    // Real memory footprint of a queue with given capacity (including Block padding)
+    static size_t footprintBytes(uint32_t ringBufferCapacity);
 
 private:
     const uint32_t ring_buffer_capacity_ {};